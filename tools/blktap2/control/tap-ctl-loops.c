@@ -0,0 +1,106 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "tap-ctl.h"
+
+/*
+ * The event loops of tapdisk id, main loop first.  On success, *loops
+ * is a malloc()ed array of *n entries.
+ */
+int
+tap_ctl_loops(const int id, tap_loop_t **loops, int *n)
+{
+	tapdisk_message_t message;
+	tap_loop_t *list, *loop;
+	int err, sfd, count;
+
+	*loops = NULL;
+	*n     = 0;
+
+	err = tap_ctl_connect_id(id, &sfd);
+	if (err)
+		return err;
+
+	memset(&message, 0, sizeof(message));
+	message.type   = TAPDISK_MESSAGE_LOOPS;
+	message.cookie = -1;
+
+	err = tap_ctl_write_message(sfd, &message, 2);
+	if (err)
+		goto out;
+
+	list  = NULL;
+	count = 0;
+
+	do {
+		err = tap_ctl_read_message(sfd, &message, 2);
+		if (err) {
+			err = -EPROTO;
+			break;
+		}
+
+		if (message.type != TAPDISK_MESSAGE_LOOPS_RSP) {
+			EPRINTF("got unexpected result '%s' from %d\n",
+				tapdisk_message_name(message.type), id);
+			err = -EINVAL;
+			break;
+		}
+
+		if (message.u.loop.count == 0)
+			break;
+
+		loop = realloc(list, (count + 1) * sizeof(*list));
+		if (!loop) {
+			err = -ENOMEM;
+			break;
+		}
+		list = loop;
+
+		loop         = &list[count++];
+		loop->id     = message.u.loop.id;
+		loop->vbds   = message.u.loop.vbds;
+		loop->uptime = message.u.loop.uptime;
+		loop->idle   = message.u.loop.idle;
+		loop->waits  = message.u.loop.waits;
+		loop->events = message.u.loop.events;
+	} while (1);
+
+	if (err) {
+		free(list);
+		goto out;
+	}
+
+	*loops = list;
+	*n     = count;
+
+out:
+	close(sfd);
+	return err;
+}
@@ -633,21 +633,23 @@ usage:
 static void
 tap_cli_open_usage(FILE *stream)
 {
-	fprintf(stream, "usage: open <-p pid> <-m minor> <-a args>\n");
+	fprintf(stream, "usage: open <-p pid> <-m minor> <-a args> "
+		"[-u use io_uring]\n");
 }
 
 static int
 tap_cli_open(int argc, char **argv)
 {
 	const char *args;
-	int c, pid, minor;
+	int c, pid, minor, flags;
 
 	pid   = -1;
 	minor = -1;
 	args  = NULL;
+	flags = 0;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:m:p:h")) != -1) {
+	while ((c = getopt(argc, argv, "a:m:p:uh")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -658,6 +660,9 @@ tap_cli_open(int argc, char **argv)
 		case 'a':
 			args = optarg;
 			break;
+		case 'u':
+			flags |= TAPDISK_MESSAGE_FLAG_URING;
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -669,7 +674,7 @@ tap_cli_open(int argc, char **argv)
 	if (pid == -1 || minor == -1 || !args)
 		goto usage;
 
-	return tap_ctl_open(pid, minor, args);
+	return tap_ctl_open(pid, minor, args, flags);
 
 usage:
 	tap_cli_open_usage(stderr);
@@ -702,6 +707,66 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_loops_usage(FILE *stream)
+{
+	fprintf(stream, "usage: loops <-p pid>\n");
+}
+
+static int
+tap_cli_loops(int argc, char **argv)
+{
+	tap_loop_t *loops, *loop;
+	int c, i, n, pid, err;
+	double util;
+
+	pid = -1;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_loops_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1)
+		goto usage;
+
+	err = tap_ctl_loops(pid, &loops, &n);
+	if (err)
+		return err;
+
+	printf("%4s %5s %6s %12s %12s\n",
+	       "loop", "vbds", "util%", "waits", "events");
+
+	for (i = 0; i < n; i++) {
+		loop = &loops[i];
+
+		util = 0;
+		if (loop->uptime && loop->idle < loop->uptime)
+			util = 100.0 * (loop->uptime - loop->idle) /
+				loop->uptime;
+
+		printf("%4d %5d %6.1f %12"PRIu64" %12"PRIu64"\n",
+		       loop->id, loop->vbds, util,
+		       loop->waits, loop->events);
+	}
+
+	free(loops);
+	return 0;
+
+usage:
+	tap_cli_loops_usage(stderr);
+	return EINVAL;
+}
+
 struct command commands[] = {
 	{ .name = "list",         .func = tap_cli_list          },
 	{ .name = "allocate",     .func = tap_cli_allocate      },
@@ -717,6 +782,7 @@ struct command commands[] = {
 	{ .name = "unpause",      .func = tap_cli_unpause       },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
+	{ .name = "loops",        .func = tap_cli_loops         },
 };
 
 #define print_commands()					\
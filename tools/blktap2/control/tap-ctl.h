@@ -90,7 +90,8 @@ pid_t tap_ctl_get_pid(const int id);
 int tap_ctl_attach(const int id, const int minor);
 int tap_ctl_detach(const int id, const int minor);
 
-int tap_ctl_open(const int id, const int minor, const char *params);
+int tap_ctl_open(const int id, const int minor, const char *params,
+		 const int flags);
 int tap_ctl_close(const int id, const int minor, const int force);
 
 int tap_ctl_pause(const int id, const int minor);
@@ -98,4 +99,16 @@ int tap_ctl_unpause(const int id, const int minor, const char *params);
 
 int tap_ctl_blk_major(void);
 
+/* times in microseconds */
+typedef struct {
+	int         id;
+	int         vbds;
+	uint64_t    uptime;
+	uint64_t    idle;
+	uint64_t    waits;
+	uint64_t    events;
+} tap_loop_t;
+
+int tap_ctl_loops(const int id, tap_loop_t **loops, int *n);
+
 #endif
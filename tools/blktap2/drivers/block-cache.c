@@ -29,13 +29,17 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "block-cache.h"
 
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -58,6 +62,17 @@
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
 #define BLOCK_CACHE_PAGE_IDLETIME       60
 
+#ifndef TEST
+#define BLOCK_CACHE_SHM_NAME            "/tapdisk-block-cache"
+#else
+#define BLOCK_CACHE_SHM_NAME            "/tapdisk-block-cache-test"
+#endif
+#define BLOCK_CACHE_SHM_MAGIC           0x7464626c6b636832ULL /* tdblkch2 */
+#define BLOCK_CACHE_SHM_WAYS            8
+#define BLOCK_CACHE_SHM_BLOCK_SECS      BLOCK_CACHE_NODES_PER_PAGE
+#define BLOCK_CACHE_SHM_BLOCK_SIZE      RADIX_TREE_PAGE_SIZE
+#define BLOCK_CACHE_SHM_ATTACH_TRIES    10
+
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
 typedef struct radix_tree_link          radix_tree_link_t;
@@ -68,6 +83,10 @@ typedef struct block_cache              block_cache_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
 
+typedef struct block_cache_shm          block_cache_shm_t;
+typedef struct block_cache_shm_set      block_cache_shm_set_t;
+typedef struct block_cache_shm_slot     block_cache_shm_slot_t;
+
 struct radix_tree_page {
 	char                           *buf;
 	size_t                          size;
@@ -117,10 +136,50 @@ struct block_cache_stats {
 	uint64_t                        prunes;
 };
 
+/*
+ * The shared cache is a set-associative array of 4K blocks, each set
+ * holding BLOCK_CACHE_SHM_WAYS blocks and evicting its least recently
+ * used one.  A block is keyed by the identity of the image it was read
+ * from and its block number in that image.
+ *
+ * Lookups take no locks: a slot's seq is odd while the slot is being
+ * rewritten, and a reader which sees seq change while copying the block
+ * out takes a miss.  Inserts into a set are serialized by the set's
+ * robust mutex.  If its owner died, the next process to lock it empties
+ * the slots that were left half-written.
+ *
+ * The segment is set up, and checked by later processes, under an
+ * exclusive flock() on it, so one whose creator died before finishing
+ * is set up again.  The last process to detach unlinks it.
+ */
+struct block_cache_shm_slot {
+	volatile uint32_t               seq;
+	volatile uint32_t               atime;
+	volatile uint64_t               id;
+	volatile uint64_t               blk;  /* block number + 1, 0 if empty */
+};
+
+struct block_cache_shm_set {
+	pthread_mutex_t                 lock;
+	block_cache_shm_slot_t          slots[BLOCK_CACHE_SHM_WAYS];
+};
+
+struct block_cache_shm {
+	volatile uint64_t               magic;
+	uint64_t                        size;
+	uint64_t                        sets;
+	uint64_t                        data; /* offset of the first block */
+	volatile uint32_t               clock;
+	uint32_t                        users; /* under the flock */
+};
+
 struct block_cache {
 	int                             ptype;
 	char                           *name;
 
+	block_cache_shm_t              *shm;
+	uint64_t                        id;
+
 	uint64_t                        sectors;
 
 	block_cache_request_t           requests[BLOCK_CACHE_REQUESTS];
@@ -488,6 +547,389 @@ radix_tree_free(radix_tree_t *tree)
 	radix_tree_destroy(tree);
 }
 
+static size_t block_cache_shm_max;
+static block_cache_shm_t *block_cache_shm;
+static int block_cache_shm_users;
+static ino_t block_cache_shm_ino;
+static pthread_mutex_t block_cache_shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+block_cache_set_shared_size(size_t size)
+{
+	block_cache_shm_max = size;
+}
+
+static inline uint64_t
+block_cache_shm_mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static inline block_cache_shm_set_t *
+block_cache_shm_set(block_cache_shm_t *shm, uint64_t id, uint64_t blk)
+{
+	block_cache_shm_set_t *sets;
+
+	sets = (block_cache_shm_set_t *)(shm + 1);
+	return sets + block_cache_shm_mix(id ^ block_cache_shm_mix(blk)) %
+		shm->sets;
+}
+
+static inline char *
+block_cache_shm_block(block_cache_shm_t *shm,
+		      block_cache_shm_set_t *set, int way)
+{
+	block_cache_shm_set_t *sets;
+	uint64_t n;
+
+	sets = (block_cache_shm_set_t *)(shm + 1);
+	n    = (set - sets) * BLOCK_CACHE_SHM_WAYS + way;
+
+	return (char *)shm + shm->data + n * BLOCK_CACHE_SHM_BLOCK_SIZE;
+}
+
+/*
+ * copy @len bytes at @off in block @blk of image @id to @buf.
+ * returns 0 on a hit, -ENOENT on a miss.
+ */
+static int
+block_cache_shm_lookup(block_cache_shm_t *shm, uint64_t id, uint64_t blk,
+		       char *buf, off_t off, size_t len)
+{
+	int i;
+	uint32_t seq;
+	block_cache_shm_set_t *set;
+	block_cache_shm_slot_t *slot;
+
+	set = block_cache_shm_set(shm, id, blk);
+
+	for (i = 0; i < BLOCK_CACHE_SHM_WAYS; i++) {
+		slot = set->slots + i;
+
+		seq = slot->seq;
+		xen_rmb();
+
+		if ((seq & 1) || slot->id != id || slot->blk != blk + 1)
+			continue;
+
+		memcpy(buf, block_cache_shm_block(shm, set, i) + off, len);
+
+		xen_rmb();
+		if (slot->seq != seq)
+			return -ENOENT;
+
+		slot->atime = shm->clock;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static int
+block_cache_shm_lock_set(block_cache_shm_set_t *set)
+{
+	int i, err;
+	block_cache_shm_slot_t *slot;
+
+	err = pthread_mutex_trylock(&set->lock);
+	if (!err)
+		return 0;
+	if (err != EOWNERDEAD)
+		return -EBUSY;
+
+	for (i = 0; i < BLOCK_CACHE_SHM_WAYS; i++) {
+		slot = set->slots + i;
+		if (!(slot->seq & 1))
+			continue;
+
+		slot->blk = 0;
+		xen_wmb();
+		slot->seq++;
+	}
+
+	pthread_mutex_consistent(&set->lock);
+	return 0;
+}
+
+static inline void
+block_cache_shm_unlock_set(block_cache_shm_set_t *set)
+{
+	pthread_mutex_unlock(&set->lock);
+}
+
+/*
+ * best effort: the block is dropped if another process is inserting
+ * into the same set.
+ */
+static void
+block_cache_shm_insert(block_cache_shm_t *shm,
+		       uint64_t id, uint64_t blk, char *buf)
+{
+	int i, way;
+	uint32_t now, age, oldest;
+	block_cache_shm_set_t *set;
+	block_cache_shm_slot_t *slot;
+
+	set = block_cache_shm_set(shm, id, blk);
+	if (block_cache_shm_lock_set(set))
+		return;
+
+	now    = __sync_add_and_fetch(&shm->clock, 1);
+	way    = 0;
+	oldest = 0;
+
+	for (i = 0; i < BLOCK_CACHE_SHM_WAYS; i++) {
+		slot = set->slots + i;
+
+		if (slot->id == id && slot->blk == blk + 1)
+			goto out;
+
+		age = slot->blk ? now - slot->atime : (uint32_t)-1;
+		if (age > oldest) {
+			oldest = age;
+			way    = i;
+		}
+	}
+
+	slot = set->slots + way;
+
+	slot->seq++;
+	xen_wmb();
+
+	slot->id    = id;
+	slot->blk   = blk + 1;
+	slot->atime = now;
+	memcpy(block_cache_shm_block(shm, set, way), buf,
+	       BLOCK_CACHE_SHM_BLOCK_SIZE);
+
+	xen_wmb();
+	slot->seq++;
+
+out:
+	block_cache_shm_unlock_set(set);
+}
+
+/* (re)initialise the segment behind @fd, whose flock we hold. */
+static block_cache_shm_t *
+block_cache_shm_create(int fd, size_t max)
+{
+	int psize;
+	uint64_t i, sets, data;
+	size_t size;
+	block_cache_shm_t *shm;
+	block_cache_shm_set_t *set;
+	pthread_mutexattr_t attr;
+
+	psize = getpagesize();
+	sets  = max / (BLOCK_CACHE_SHM_WAYS * BLOCK_CACHE_SHM_BLOCK_SIZE);
+	if (!sets)
+		sets = 1;
+
+	data  = sizeof(block_cache_shm_t) + sets * sizeof(block_cache_shm_set_t);
+	data  = (data + psize - 1) & ~((uint64_t)psize - 1);
+	size  = data + sets * BLOCK_CACHE_SHM_WAYS * BLOCK_CACHE_SHM_BLOCK_SIZE;
+
+	if (ftruncate(fd, size))
+		return NULL;
+
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	/* whatever a creator which died left here is of no use */
+	shm->magic = 0;
+	xen_wmb();
+	memset((char *)shm + sizeof(shm->magic), 0,
+	       data - sizeof(shm->magic));
+
+	if (pthread_mutexattr_init(&attr))
+		goto fail;
+	if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ||
+	    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) {
+		pthread_mutexattr_destroy(&attr);
+		goto fail;
+	}
+
+	set = (block_cache_shm_set_t *)(shm + 1);
+	for (i = 0; i < sets; i++)
+		if (pthread_mutex_init(&set[i].lock, &attr)) {
+			pthread_mutexattr_destroy(&attr);
+			goto fail;
+		}
+
+	pthread_mutexattr_destroy(&attr);
+
+	shm->size  = size;
+	shm->sets  = sets;
+	shm->data  = data;
+
+	xen_wmb();
+	shm->magic = BLOCK_CACHE_SHM_MAGIC;
+
+	return shm;
+
+fail:
+	munmap(shm, size);
+	return NULL;
+}
+
+/* map the segment behind @fd, whose flock we hold, if it is set up. */
+static block_cache_shm_t *
+block_cache_shm_open(int fd, struct stat *st)
+{
+	block_cache_shm_t *shm;
+
+	if (st->st_size < sizeof(block_cache_shm_t))
+		return NULL;
+
+	shm = mmap(NULL, st->st_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	if (shm->magic == BLOCK_CACHE_SHM_MAGIC && shm->size == st->st_size)
+		return shm;
+
+	munmap(shm, st->st_size);
+	return NULL;
+}
+
+static block_cache_shm_t *
+block_cache_shm_attach(void)
+{
+	int i, fd;
+	struct stat st;
+	block_cache_shm_t *shm;
+
+	pthread_mutex_lock(&block_cache_shm_lock);
+
+	shm = block_cache_shm;
+	if (shm || !block_cache_shm_max)
+		goto out;
+
+	for (i = 0; i < BLOCK_CACHE_SHM_ATTACH_TRIES; i++) {
+		fd = shm_open(BLOCK_CACHE_SHM_NAME, O_RDWR | O_CREAT, 0600);
+		if (fd == -1)
+			break;
+
+		if (flock(fd, LOCK_EX) || fstat(fd, &st)) {
+			close(fd);
+			break;
+		}
+
+		/* the last user unlinked it while we waited: start over */
+		if (!st.st_nlink) {
+			close(fd);
+			continue;
+		}
+
+		shm = block_cache_shm_open(fd, &st);
+		if (!shm) {
+			shm = block_cache_shm_create(fd, block_cache_shm_max);
+			if (!shm)
+				shm_unlink(BLOCK_CACHE_SHM_NAME);
+		}
+		if (shm)
+			shm->users++;
+
+		/* the mapping holds the file open: close alone won't unlock */
+		flock(fd, LOCK_UN);
+		close(fd);
+		break;
+	}
+
+	if (!shm) {
+		EPRINTF("failed to attach shared block cache %s: %d\n",
+			BLOCK_CACHE_SHM_NAME, -errno);
+		goto out;
+	}
+
+	DPRINTF("attached shared block cache %s: %"PRIu64" blocks\n",
+		BLOCK_CACHE_SHM_NAME, shm->sets * BLOCK_CACHE_SHM_WAYS);
+
+	block_cache_shm     = shm;
+	block_cache_shm_ino = st.st_ino;
+
+out:
+	if (shm)
+		block_cache_shm_users++;
+	pthread_mutex_unlock(&block_cache_shm_lock);
+	return shm;
+}
+
+/*
+ * a process which dies attached leaves the segment behind, for the next
+ * one to use.
+ */
+static void
+block_cache_shm_detach(void)
+{
+	int fd;
+	struct stat st;
+	block_cache_shm_t *shm;
+
+	pthread_mutex_lock(&block_cache_shm_lock);
+
+	if (--block_cache_shm_users)
+		goto out;
+
+	shm = block_cache_shm;
+	block_cache_shm = NULL;
+
+	fd = shm_open(BLOCK_CACHE_SHM_NAME, O_RDWR, 0);
+	if (fd != -1 && !flock(fd, LOCK_EX) && !fstat(fd, &st) &&
+	    st.st_ino == block_cache_shm_ino) {
+		if (!--shm->users)
+			shm_unlink(BLOCK_CACHE_SHM_NAME);
+	}
+	if (fd != -1)
+		close(fd);
+
+	munmap(shm, shm->size);
+
+out:
+	pthread_mutex_unlock(&block_cache_shm_lock);
+}
+
+/*
+ * parents are read-only, so a file's device and inode, its size, and
+ * its modification and change times, to the nanosecond, identify its
+ * contents across processes.  A block device is identified by its
+ * device number, its size and the change time of its node, which is
+ * made anew when the device is.
+ */
+static int
+block_cache_image_id(const char *name, uint64_t sectors, uint64_t *id)
+{
+	uint64_t x;
+	struct stat st;
+
+	if (stat(name, &st))
+		return -errno;
+
+	x = block_cache_shm_mix(sectors);
+	x = block_cache_shm_mix(x ^ st.st_ctim.tv_sec);
+	x = block_cache_shm_mix(x ^ st.st_ctim.tv_nsec);
+
+	if (S_ISBLK(st.st_mode))
+		x = block_cache_shm_mix(x ^ st.st_rdev);
+	else {
+		x = block_cache_shm_mix(x ^ st.st_dev);
+		x = block_cache_shm_mix(x ^ st.st_ino);
+		x = block_cache_shm_mix(x ^ st.st_size);
+		x = block_cache_shm_mix(x ^ st.st_mtim.tv_sec);
+		x = block_cache_shm_mix(x ^ st.st_mtim.tv_nsec);
+	}
+
+	*id = x;
+	return 0;
+}
+
 static void
 block_cache_prune_event(event_id_t id, char mode, void *private)
 {
@@ -546,6 +988,9 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
 		cache->request_free_list[i] = cache->requests + i;
 
+	if (!block_cache_image_id(cache->name, cache->sectors, &cache->id))
+		cache->shm = block_cache_shm_attach();
+
 	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
 							  -1, /* dummy fd */
 							  BLOCK_CACHE_PAGE_IDLETIME << 1,
@@ -555,8 +1000,8 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		goto fail;
 
 	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
-		"tree: %p, height: %d\n",
-		cache->name, cache->sectors, tree, tree->height);
+		"tree: %p, height: %d, shared: %d\n",
+		cache->name, cache->sectors, tree, tree->height, !!cache->shm);
 
 	if (mlockall(MCL_CURRENT | MCL_FUTURE))
 		DPRINTF("mlockall failed: %d\n", -errno);
@@ -564,6 +1009,8 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	return 0;
 
 fail:
+	if (cache->shm)
+		block_cache_shm_detach();
 	free(cache->name);
 	radix_tree_free(&cache->tree);
 	return err;
@@ -581,6 +1028,8 @@ block_cache_close(td_driver_t *driver)
 	DPRINTF("closing cache for %s\n", cache->name);
 
 	tapdisk_server_unregister_event(cache->timeout_id);
+	if (cache->shm)
+		block_cache_shm_detach();
 	radix_tree_free(tree);
 	free(cache->name);
 
@@ -706,6 +1155,101 @@ out:
 	td_forward_request(clone);
 }
 
+static void
+block_cache_shm_populate(td_request_t clone, int err)
+{
+	off_t off;
+	uint64_t blk;
+	block_cache_t *cache;
+	block_cache_request_t *breq;
+
+	breq        = (block_cache_request_t *)clone.cb_data;
+	cache       = breq->cache;
+	breq->secs -= clone.secs;
+	breq->err   = (breq->err ? breq->err : err);
+
+	if (breq->secs)
+		return;
+
+	if (!breq->err) {
+		blk = breq->treq.sec / BLOCK_CACHE_SHM_BLOCK_SECS;
+		off = (breq->treq.sec - blk * BLOCK_CACHE_SHM_BLOCK_SECS) <<
+			RADIX_TREE_NODE_SHIFT;
+
+		block_cache_shm_insert(cache->shm, cache->id, blk, breq->buf);
+		memcpy(breq->treq.buf, breq->buf + off,
+		       breq->treq.secs << RADIX_TREE_NODE_SHIFT);
+	}
+
+	free(breq->buf);
+	td_complete_request(breq->treq, breq->err);
+	block_cache_put_request(cache, breq);
+}
+
+/*
+ * read the whole block around @treq, so that later reads of any part
+ * of it hit.
+ */
+static void
+block_cache_shm_miss(block_cache_t *cache, td_request_t treq, uint64_t blk)
+{
+	char *buf;
+	td_request_t clone;
+	block_cache_request_t *breq;
+
+	clone = treq;
+
+	breq = block_cache_get_request(cache);
+	if (!breq)
+		goto out;
+
+	if (posix_memalign((void **)&buf, BLOCK_CACHE_SHM_BLOCK_SIZE,
+			   BLOCK_CACHE_SHM_BLOCK_SIZE)) {
+		block_cache_put_request(cache, breq);
+		goto out;
+	}
+
+	breq->treq    = treq;
+	breq->secs    = BLOCK_CACHE_SHM_BLOCK_SECS;
+	breq->err     = 0;
+	breq->buf     = buf;
+	breq->cache   = cache;
+
+	clone.sec     = blk * BLOCK_CACHE_SHM_BLOCK_SECS;
+	clone.secs    = BLOCK_CACHE_SHM_BLOCK_SECS;
+	clone.buf     = buf;
+	clone.cb      = block_cache_shm_populate;
+	clone.cb_data = breq;
+
+out:
+	td_forward_request(clone);
+}
+
+static void
+block_cache_shm_queue_read(block_cache_t *cache, td_request_t treq)
+{
+	off_t off;
+	uint64_t blk, end;
+
+	blk = treq.sec / BLOCK_CACHE_SHM_BLOCK_SECS;
+	end = (blk + 1) * BLOCK_CACHE_SHM_BLOCK_SECS;
+	off = (treq.sec - blk * BLOCK_CACHE_SHM_BLOCK_SECS) <<
+		RADIX_TREE_NODE_SHIFT;
+
+	/* only whole blocks are cached, so skip reads straddling two */
+	if (treq.sec + treq.secs > end || end > cache->sectors)
+		return td_forward_request(treq);
+
+	if (!block_cache_shm_lookup(cache->shm, cache->id, blk, treq.buf,
+				    off, treq.secs << RADIX_TREE_NODE_SHIFT)) {
+		cache->stats.hits += treq.secs;
+		return td_complete_request(treq, 0);
+	}
+
+	cache->stats.misses += treq.secs;
+	block_cache_shm_miss(cache, treq, blk);
+}
+
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -719,6 +1263,9 @@ block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 
 	cache->stats.reads += treq.secs;
 
+	if (cache->shm)
+		return block_cache_shm_queue_read(cache, treq);
+
 	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
 		return td_forward_request(treq);
 
@@ -771,6 +1318,10 @@ block_cache_debug(td_driver_t *driver)
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
 	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	if (cache->shm)
+		WARN("shared: %s, id: 0x%016"PRIx64", blocks: %"PRIu64"\n",
+		     BLOCK_CACHE_SHM_NAME, cache->id,
+		     cache->shm->sets * BLOCK_CACHE_SHM_WAYS);
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -785,3 +1336,223 @@ struct tap_disk tapdisk_block_cache = {
 	.td_validate_parent         = block_cache_validate_parent,
 	.td_debug                   = block_cache_debug,
 };
+
+#if defined(TEST)
+/*
+ * sanity tests of the shared cache: sharing blocks between processes,
+ * taking over a set whose owner died inserting, setting up a segment
+ * whose creator died again, and telling apart versions of an image.
+ */
+
+#include <stdio.h>
+#include <sys/wait.h>
+
+#define TEST_BLOCKS                     200
+#define TEST_ID                         42
+
+static int failed;
+
+#define CHECK(_p)							\
+	do {								\
+		if (!(_p)) {						\
+			printf("FAILED: %s:%d: %s\n",			\
+			       __FILE__, __LINE__, #_p);		\
+			failed++;					\
+		}							\
+	} while (0)
+
+static void
+test_fill(char *buf, uint64_t blk)
+{
+	memset(buf, (int)(blk & 0xff), BLOCK_CACHE_SHM_BLOCK_SIZE);
+	memcpy(buf, &blk, sizeof(blk));
+}
+
+/* in a child, as another tapdisk would: attach, run @fn, exit. */
+static void
+test_child(void (*fn)(block_cache_shm_t *))
+{
+	pid_t pid;
+	block_cache_shm_t *shm;
+
+	pid = fork();
+	if (pid == -1) {
+		CHECK(pid != -1);
+		return;
+	}
+
+	if (!pid) {
+		block_cache_shm       = NULL;
+		block_cache_shm_users = 0;
+		shm = block_cache_shm_attach();
+		if (!shm)
+			_exit(1);
+		fn(shm);
+		_exit(0);
+	}
+
+	waitpid(pid, NULL, 0);
+}
+
+static void
+test_insert_blocks(block_cache_shm_t *shm)
+{
+	uint64_t blk;
+	char buf[BLOCK_CACHE_SHM_BLOCK_SIZE];
+
+	for (blk = 0; blk < TEST_BLOCKS; blk++) {
+		test_fill(buf, blk);
+		block_cache_shm_insert(shm, TEST_ID, blk, buf);
+	}
+
+	block_cache_shm_detach();
+}
+
+/* die holding the lock of block 0's set, half way through a slot */
+static void
+test_die_inserting(block_cache_shm_t *shm)
+{
+	block_cache_shm_set_t *set;
+
+	set = block_cache_shm_set(shm, TEST_ID, 0);
+	pthread_mutex_lock(&set->lock);
+	set->slots[0].seq |= 1;
+}
+
+static void
+test_shared(void)
+{
+	uint64_t blk, got;
+	int hits, bad;
+	char buf[BLOCK_CACHE_SHM_BLOCK_SIZE];
+	block_cache_shm_t *shm;
+
+	shm = block_cache_shm_attach();
+	CHECK(shm != NULL);
+	if (!shm)
+		return;
+
+	test_child(test_insert_blocks);
+	CHECK(shm->users == 1);
+
+	hits = bad = 0;
+	for (blk = 0; blk < TEST_BLOCKS; blk++) {
+		if (block_cache_shm_lookup(shm, TEST_ID, blk, buf, 0,
+					   BLOCK_CACHE_SHM_BLOCK_SIZE))
+			continue;
+		hits++;
+		memcpy(&got, buf, sizeof(got));
+		if (got != blk || buf[100] != (char)(blk & 0xff))
+			bad++;
+	}
+	printf("shared: %d/%d hits, %"PRIu64" blocks\n", hits, TEST_BLOCKS,
+	       shm->sets * BLOCK_CACHE_SHM_WAYS);
+	CHECK(hits > TEST_BLOCKS / 2);
+	CHECK(!bad);
+
+	block_cache_shm_detach();
+	CHECK(shm_open(BLOCK_CACHE_SHM_NAME, O_RDWR, 0) == -1 &&
+	      errno == ENOENT);
+}
+
+static void
+test_owner_died(void)
+{
+	uint64_t got;
+	char buf[BLOCK_CACHE_SHM_BLOCK_SIZE];
+	block_cache_shm_t *shm;
+
+	shm = block_cache_shm_attach();
+	CHECK(shm != NULL);
+	if (!shm)
+		return;
+
+	test_child(test_die_inserting);
+	test_fill(buf, TEST_BLOCKS);
+	block_cache_shm_insert(shm, TEST_ID, 0, buf);
+	CHECK(!block_cache_shm_lookup(shm, TEST_ID, 0, buf, 0, sizeof(got)));
+	memcpy(&got, buf, sizeof(got));
+	CHECK(got == TEST_BLOCKS);
+
+	/* the dead child is still counted: the segment stays */
+	CHECK(shm->users == 2);
+	block_cache_shm_detach();
+}
+
+static void
+test_half_created(void)
+{
+	int fd;
+	char junk[4096];
+	block_cache_shm_t *shm;
+
+	shm_unlink(BLOCK_CACHE_SHM_NAME);
+	fd = shm_open(BLOCK_CACHE_SHM_NAME, O_RDWR | O_CREAT, 0600);
+	CHECK(fd != -1);
+	if (fd == -1)
+		return;
+	memset(junk, 0xa5, sizeof(junk));
+	CHECK(write(fd, junk, sizeof(junk)) == sizeof(junk));
+	close(fd);
+
+	shm = block_cache_shm_attach();
+	CHECK(shm != NULL);
+	if (!shm)
+		return;
+
+	CHECK(shm->magic == BLOCK_CACHE_SHM_MAGIC);
+	test_fill(junk, 7);
+	block_cache_shm_insert(shm, TEST_ID, 7, junk);
+	CHECK(!block_cache_shm_lookup(shm, TEST_ID, 7, junk, 0, 8));
+	block_cache_shm_detach();
+}
+
+static void
+test_image_id(void)
+{
+	int fd;
+	uint64_t a, b;
+	struct timespec times[2];
+	char name[] = "/tmp/block-cache-test.XXXXXX";
+
+	fd = mkstemp(name);
+	CHECK(fd != -1);
+	if (fd == -1)
+		return;
+
+	CHECK(!block_cache_image_id(name, 8, &a));
+	CHECK(!block_cache_image_id(name, 8, &b));
+	CHECK(a == b);
+
+	/* rewritten within the same second */
+	CHECK(clock_gettime(CLOCK_REALTIME, &times[0]) == 0);
+	times[0].tv_nsec = (times[0].tv_nsec + 1000) % 1000000000;
+	times[1] = times[0];
+	CHECK(!futimens(fd, times));
+	CHECK(!block_cache_image_id(name, 8, &b));
+	CHECK(a != b);
+
+	CHECK(!block_cache_image_id(name, 16, &a));
+	CHECK(a != b);
+
+	close(fd);
+	unlink(name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	shm_unlink(BLOCK_CACHE_SHM_NAME);
+	block_cache_set_shared_size(1 << 20);
+
+	test_shared();
+	test_owner_died();
+	test_half_created();
+	test_image_id();
+
+	shm_unlink(BLOCK_CACHE_SHM_NAME);
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+	return failed ? 1 : 0;
+}
+#endif
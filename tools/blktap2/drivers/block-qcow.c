@@ -77,9 +77,26 @@ struct qcow_request {
 	td_request_t         treq;
 	struct tiocb         tiocb;
 	struct tdqcow_state  *state;
+	struct qcow_request  *next;
 };
 
-static int decompress_cluster(struct tdqcow_state *s, uint64_t cluster_offset);
+/*
+ * Metadata updates -- loading an L2 table, adding one to the L1 table,
+ * allocating a cluster -- go through the same queue as data I/O, so they
+ * never hold up the event loop.  There is one in flight at a time.  Data
+ * requests which depend on it (and any which need another one) wait on
+ * s->waiting_head, and are queued again once it completes.
+ */
+#define QCOW_OP_NONE          0
+#define QCOW_OP_L2_READ       1
+#define QCOW_OP_L2_WRITE      2
+#define QCOW_OP_L1_WRITE      3
+#define QCOW_OP_L2_UPDATE     4
+#define QCOW_OP_CLUSTER_READ  5
+#define QCOW_OP_CLUSTER_WRITE 6
+
+void tdqcow_queue_read(td_driver_t *driver, td_request_t treq);
+void tdqcow_queue_write(td_driver_t *driver, td_request_t treq);
 
 uint32_t gen_cksum(char *ptr, int len)
 {
@@ -96,6 +113,7 @@ static void free_aio_state(struct tdqcow_state* s)
 {
 	free(s->aio_requests);
 	free(s->aio_free_list);
+	free(s->meta_req);
 }
 
 static int init_aio_state(td_driver_t *driver)
@@ -111,7 +129,8 @@ static int init_aio_state(td_driver_t *driver)
 	s->aio_free_count = s->max_aio_reqs;
 
 	if (!(s->aio_requests  = calloc(s->max_aio_reqs, sizeof(struct qcow_request))) || 
-	    !(s->aio_free_list = calloc(s->max_aio_reqs, sizeof(struct qcow_request)))) {
+	    !(s->aio_free_list = calloc(s->max_aio_reqs, sizeof(struct qcow_request))) ||
+	    !(s->meta_req      = calloc(1, sizeof(struct qcow_request)))) {
 	    DPRINTF("Failed to allocate AIO structs (max_aio_reqs = %d)\n",
 		    s->max_aio_reqs);
 	    goto fail;
@@ -120,6 +139,11 @@ static int init_aio_state(td_driver_t *driver)
 	for (i = 0; i < s->max_aio_reqs; i++)
 		s->aio_free_list[i] = &s->aio_requests[i];
 
+	s->meta_req->state = s;
+	s->meta_op         = QCOW_OP_NONE;
+	s->meta_l1_index   = -1;
+	s->waiting_head    = s->waiting_tail = NULL;
+
         DPRINTF("AIO state initialised\n");
 
         return 0;
@@ -364,320 +388,763 @@ int qtruncate(int fd, off_t length, int sparse)
 	return 0;
 }
 
-/* 'allocate' is:
- *
- * 0 to not allocate.
- *
- * 1 to allocate a normal cluster (for sector indexes 'n_start' to
- * 'n_end')
- *
- * 2 to allocate a compressed cluster of size
- * 'compressed_size'. 'compressed_size' must be > 0 and <
- * cluster_size 
- *
- * return 0 if not allocated.
+static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
+                             const uint8_t *buf, int buf_size)
+{
+	z_stream strm1, *strm = &strm1;
+	int ret, out_len;
+	
+	memset(strm, 0, sizeof(*strm));
+	
+	strm->next_in = (uint8_t *)buf;
+	strm->avail_in = buf_size;
+	strm->next_out = out_buf;
+	strm->avail_out = out_buf_size;
+	
+	ret = inflateInit2(strm, -12);
+	if (ret != Z_OK)
+		return -1;
+	ret = inflate(strm, Z_FINISH);
+	out_len = strm->next_out - out_buf;
+	if ( (ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+	    (out_len != out_buf_size) ) {
+		inflateEnd(strm);
+		return -1;
+	}
+	inflateEnd(strm);
+	return 0;
+}
+                              
+#define meta_busy(s) ((s)->meta_op != QCOW_OP_NONE)
+
+static void tdqcow_meta_complete(void *, struct tiocb *, int);
+
+/*
+ * A cached L2 table.  The tables of all images are on one LRU list, so
+ * the budget goes to whichever are in use; l2_cache_get() takes back the
+ * least recently used table once it is spent.  An image is only ever
+ * used from the thread of its event loop, and each loop keeps its own
+ * list, so the lists need no locking.  The budget is for the whole
+ * process, though: what is used of it is counted atomically across the
+ * loops, and a loop over it evicts from its own list.
  */
-static uint64_t get_cluster_offset(struct tdqcow_state *s,
-                                   uint64_t offset, int allocate,
-                                   int compressed_size,
-                                   int n_start, int n_end)
+struct qcow_l2_table {
+	uint64_t                offset;
+	uint64_t               *table;
+	size_t                  size;
+	struct tdqcow_state    *s;
+	struct qcow_l2_table   *hash_next;
+	struct list_head        lru;
+};
+
+static __thread struct list_head l2_cache_lru;
+static size_t l2_cache_used;
+static size_t l2_cache_max = L2_CACHE_DEFAULT;
+
+#define l2_cache_spent()	__sync_add_and_fetch(&l2_cache_used, 0)
+
+void
+qcow_set_l2_cache_size(size_t size)
 {
-	int min_index, i, j, l1_index, l2_index, l2_sector, l1_sector;
-	char *tmp_ptr2, *l2_ptr, *l1_ptr;
-	uint64_t *tmp_ptr;
-	uint64_t l2_offset, *l2_table, cluster_offset, tmp;
-	uint32_t min_count;
-	int new_l2_table;
+	l2_cache_max = size;
+}
 
-	/*Check L1 table for the extent offset*/
-	l1_index = offset >> (s->l2_bits + s->cluster_bits);
-	l2_offset = s->l1_table[l1_index];
-	new_l2_table = 0;
-	if (!l2_offset) {
-		if (!allocate)
-			return 0;
-		/* 
-		 * allocating a new l2 entry + extent 
-		 * at the end of the file, we must also
-		 * update the L1 entry safely.
-		 */
-		l2_offset = s->fd_end;
+static inline struct qcow_l2_table **
+l2_cache_bucket(struct tdqcow_state *s, uint64_t l2_offset)
+{
+	return &s->l2_hash[(l2_offset >> s->cluster_bits) & s->l2_hash_mask];
+}
 
-		/* round to cluster size */
-		l2_offset = (l2_offset + s->cluster_size - 1) 
-			& ~(s->cluster_size - 1);
+static int
+l2_cache_init(struct tdqcow_state *s)
+{
+	int buckets;
 
-		/* update the L1 entry */
-		s->l1_table[l1_index] = l2_offset;
-		
-		/*Truncate file for L2 table 
-		 *(initialised to zero in case we crash)*/
-		if (qtruncate(s->fd, 
-			      l2_offset + (s->l2_size * sizeof(uint64_t)),
-			      s->sparse) != 0) {
-			DPRINTF("ERROR truncating file\n");
-			return 0;
-		}
-		s->fd_end = l2_offset + (s->l2_size * sizeof(uint64_t));
+	if (!l2_cache_lru.next)
+		INIT_LIST_HEAD(&l2_cache_lru);
 
-		/*Update the L1 table entry on disk
-                 * (for O_DIRECT we write 4KByte blocks)*/
-		l1_sector = (l1_index * sizeof(uint64_t)) >> 12;
-		l1_ptr = (char *)s->l1_table + (l1_sector << 12);
+	/* enough for the tables the budget holds, up to one per L1 entry */
+	buckets = 1;
+	while (buckets < s->l1_size && buckets < L2_CACHE_MIN * 1024 &&
+	       (size_t)buckets * s->l2_size * sizeof(uint64_t) < l2_cache_max)
+		buckets <<= 1;
 
-		if (posix_memalign((void **)&tmp_ptr, 4096, 4096) != 0) {
-			DPRINTF("ERROR allocating memory for L1 table\n");
-                        return 0;
-		}
-		memcpy(tmp_ptr, l1_ptr, 4096);
+	s->l2_hash = calloc(buckets, sizeof(struct qcow_l2_table *));
+	if (!s->l2_hash)
+		return -ENOMEM;
+	s->l2_hash_mask = buckets - 1;
 
-		/* Convert block to write to big endian */
-		for(i = 0; i < 4096 / sizeof(uint64_t); i++) {
-			cpu_to_be64s(&tmp_ptr[i]);
+	return 0;
+}
+
+static struct qcow_l2_table *
+l2_cache_lookup(struct tdqcow_state *s, uint64_t l2_offset)
+{
+	struct qcow_l2_table *l2;
+
+	for (l2 = *l2_cache_bucket(s, l2_offset); l2; l2 = l2->hash_next)
+		if (l2->offset == l2_offset) {
+			list_del(&l2->lru);
+			list_add(&l2->lru, &l2_cache_lru);
+			s->l2_cache_hits++;
+			return l2;
 		}
 
-		/*
-		 * Issue non-asynchronous L1 write.
-		 * For safety, we must ensure that
-		 * entry is written before blocks.
-		 */
-		lseek(s->fd, s->l1_table_offset + (l1_sector << 12), SEEK_SET);
-		if (write(s->fd, tmp_ptr, 4096) != 4096) {
-			free(tmp_ptr);
-		 	return 0;
+	return NULL;
+}
+
+static void
+l2_cache_free(struct qcow_l2_table *l2)
+{
+	struct tdqcow_state *s = l2->s;
+	struct qcow_l2_table **pp;
+
+	for (pp = l2_cache_bucket(s, l2->offset); *pp; pp = &(*pp)->hash_next)
+		if (*pp == l2) {
+			*pp = l2->hash_next;
+			break;
 		}
-		free(tmp_ptr);
 
-		new_l2_table = 1;
-		goto cache_miss;
-	} else if (s->min_cluster_alloc == s->l2_size) {
-		/*Fast-track the request*/
-		cluster_offset = l2_offset + (s->l2_size * sizeof(uint64_t));
-		l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-		return cluster_offset + (l2_index * s->cluster_size);
+	list_del(&l2->lru);
+	s->l2_cache_count--;
+	__sync_sub_and_fetch(&l2_cache_used, l2->size);
+	free(l2->table);
+	free(l2);
+}
+
+/*
+ * The least recently used table which can go: not one a metadata update
+ * is using, and not one of an image down to its minimum, unless it is
+ * one of s's own.
+ */
+static struct qcow_l2_table *
+l2_cache_victim(struct tdqcow_state *s)
+{
+	struct list_head *pos;
+	struct qcow_l2_table *l2;
+
+	for (pos = l2_cache_lru.prev; pos != &l2_cache_lru; pos = pos->prev) {
+		l2 = list_entry(pos, struct qcow_l2_table, lru);
+		if (meta_busy(l2->s) && l2->s->meta_l2 == l2)
+			continue;
+		if (l2->s == s || l2->s->l2_cache_count > L2_CACHE_MIN)
+			return l2;
 	}
 
-	/*Check to see if L2 entry is already cached*/
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (l2_offset == s->l2_cache_offsets[i]) {
-			/* increment the hit count */
-			if (++s->l2_cache_counts[i] == 0xffffffff) {
-				for (j = 0; j < L2_CACHE_SIZE; j++) {
-					s->l2_cache_counts[j] >>= 1;
-				}
-			}
-			l2_table = s->l2_cache + (i << s->l2_bits);
-			goto found;
-		}
+	return NULL;
+}
+
+/* Make room for the table at l2_offset, evicting others if need be. */
+static struct qcow_l2_table *
+l2_cache_get(struct tdqcow_state *s, uint64_t l2_offset)
+{
+	struct qcow_l2_table *l2, *victim;
+	size_t size;
+
+	size = s->l2_size * sizeof(uint64_t);
+
+	while (s->l2_cache_count >= L2_CACHE_MIN &&
+	       l2_cache_spent() + size > l2_cache_max) {
+		victim = l2_cache_victim(s);
+		if (!victim)
+			break;
+		victim->s->l2_cache_evictions++;
+		l2_cache_free(victim);
 	}
 
-cache_miss:
-	/* not found: load a new entry in the least used one */
-	min_index = 0;
-	min_count = 0xffffffff;
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (s->l2_cache_counts[i] < min_count) {
-			min_count = s->l2_cache_counts[i];
-			min_index = i;
+	l2 = malloc(sizeof(*l2));
+	if (!l2)
+		return NULL;
+	if (posix_memalign((void **)&l2->table, 4096, size)) {
+		free(l2);
+		return NULL;
+	}
+
+	l2->offset    = l2_offset;
+	l2->size      = size;
+	l2->s         = s;
+	l2->hash_next = *l2_cache_bucket(s, l2_offset);
+	*l2_cache_bucket(s, l2_offset) = l2;
+	list_add(&l2->lru, &l2_cache_lru);
+
+	s->l2_cache_count++;
+	__sync_add_and_fetch(&l2_cache_used, size);
+
+	return l2;
+}
+
+static void
+l2_cache_flush(struct tdqcow_state *s)
+{
+	struct qcow_l2_table *l2, *next;
+	int i;
+
+	if (!s->l2_hash)
+		return;
+
+	for (i = 0; i <= s->l2_hash_mask; i++)
+		for (l2 = s->l2_hash[i]; l2; l2 = next) {
+			next = l2->hash_next;
+			l2_cache_free(l2);
 		}
+}
+
+/*
+ * Grow the file to hold newly allocated space.  Unlike qtruncate(), this
+ * doesn't write zeroes out: the space is allocated up front unless the
+ * image is sparse, and reads as zeroes in any case.
+ */
+static int
+qcow_extend(struct tdqcow_state *s, uint64_t length)
+{
+	struct stat st;
+
+	if (fstat(s->fd, &st))
+		return -errno;
+	if (S_ISBLK(st.st_mode) || st.st_size >= length)
+		return 0;
+
+	if (!s->sparse &&
+	    !fallocate(s->fd, 0, st.st_size, length - st.st_size))
+		return 0;
+
+	if (ftruncate(s->fd, length))
+		return -errno;
+
+	return 0;
+}
+
+/* Reserve count clusters at the end of the file. */
+static int
+qcow_alloc_clusters(struct tdqcow_state *s, int count,
+		    uint64_t *cluster_offset)
+{
+	uint64_t offset, end;
+	int err;
+
+	offset = (s->fd_end + s->cluster_size - 1) & ~(s->cluster_size - 1);
+	end    = offset + (uint64_t)count * s->cluster_size;
+
+	err = qcow_extend(s, end);
+	if (err) {
+		DPRINTF("ERROR extending file: %d\n", err);
+		return err;
 	}
-	l2_table = s->l2_cache + (min_index << s->l2_bits);
-
-	/*If extent pre-allocated, read table from disk, 
-	 *otherwise write new table to disk*/
-	if (new_l2_table) {
-		/*Should we allocate the whole extent? Adjustable parameter.*/
-		if (s->cluster_alloc == s->l2_size) {
-			cluster_offset = l2_offset + 
-				(s->l2_size * sizeof(uint64_t));
-			cluster_offset = (cluster_offset + s->cluster_size - 1)
-				& ~(s->cluster_size - 1);
-			if (qtruncate(s->fd, cluster_offset + 
-				  (s->cluster_size * s->l2_size), 
-				      s->sparse) != 0) {
-				DPRINTF("ERROR truncating file\n");
-				return 0;
-			}
-			s->fd_end = cluster_offset + 
-				(s->cluster_size * s->l2_size);
-			for (i = 0; i < s->l2_size; i++) {
-				l2_table[i] = cpu_to_be64(cluster_offset + 
-							  (i*s->cluster_size));
-			}  
-		} else memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-
-		lseek(s->fd, l2_offset, SEEK_SET);
-		if (write(s->fd, l2_table, s->l2_size * sizeof(uint64_t)) !=
-		   s->l2_size * sizeof(uint64_t))
-			return 0;
-	} else {
-		lseek(s->fd, l2_offset, SEEK_SET);
-		if (read(s->fd, l2_table, s->l2_size * sizeof(uint64_t)) != 
-		    s->l2_size * sizeof(uint64_t))
-			return 0;
+
+	s->fd_end = end;
+	*cluster_offset = offset;
+	return 0;
+}
+
+static void
+qcow_meta_io(struct tdqcow_state *s, int op, int write,
+	     void *buf, size_t size, uint64_t offset)
+{
+	struct tiocb *tiocb = &s->meta_req->tiocb;
+
+	s->meta_op = op;
+	if (write)
+		td_prep_write(tiocb, s->fd, buf, size, offset,
+			      tdqcow_meta_complete, s->meta_req);
+	else
+		td_prep_read(tiocb, s->fd, buf, size, offset,
+			     tdqcow_meta_complete, s->meta_req);
+	td_queue_tiocb(s->driver, tiocb);
+}
+
+/* Queue a request (or what is left of it) behind the metadata update. */
+static int
+qcow_wait(struct tdqcow_state *s, td_request_t treq)
+{
+	struct qcow_request *req;
+
+	ASSERT(meta_busy(s));
+
+	if (s->aio_free_count == 0)
+		return -EBUSY;
+
+	req        = s->aio_free_list[--s->aio_free_count];
+	req->treq  = treq;
+	req->state = s;
+	req->next  = NULL;
+
+	if (s->waiting_tail)
+		s->waiting_tail->next = req;
+	else
+		s->waiting_head = req;
+	s->waiting_tail = req;
+
+	return 0;
+}
+
+/*
+ * The update is done: resubmit the waiting requests, which may have to
+ * wait for another one.  If it failed, so does the request which needed
+ * it: that is the first one, as nothing else waits while none is in
+ * flight.
+ */
+static void
+qcow_meta_done(struct tdqcow_state *s, int err)
+{
+	struct qcow_request *req, *next;
+	td_request_t treq;
+
+	s->meta_op       = QCOW_OP_NONE;
+	s->meta_l1_index = -1;
+
+	req = s->waiting_head;
+	s->waiting_head = s->waiting_tail = NULL;
+
+	for (; req; req = next) {
+		treq = req->treq;
+		next = req->next;
+		s->aio_free_list[s->aio_free_count++] = req;
+
+		if (err)
+			td_complete_request(treq, err);
+		else if (treq.op == TD_OP_WRITE)
+			tdqcow_queue_write(s->driver, treq);
+		else
+			tdqcow_queue_read(s->driver, treq);
+		err = 0;
 	}
-	
-	/*Update the cache entries*/ 
-	s->l2_cache_offsets[min_index] = l2_offset;
-	s->l2_cache_counts[min_index] = 1;
+}
 
-found:
-	/*The extent is split into 's->l2_size' blocks of 
-	 *size 's->cluster_size'*/
-	l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-	cluster_offset = be64_to_cpu(l2_table[l2_index]);
+/*
+ * Read a table which isn't cached.  It is in the cache meanwhile, but
+ * qcow_map() won't look at it until the read is done.
+ */
+static int
+qcow_load_l2(struct tdqcow_state *s, int l1_index)
+{
+	struct qcow_l2_table *l2;
 
-	if (!cluster_offset || 
-	    ((cluster_offset & QCOW_OFLAG_COMPRESSED) && allocate == 1) ) {
-		if (!allocate)
-			return 0;
-		
-		if ((cluster_offset & QCOW_OFLAG_COMPRESSED) &&
-		    (n_end - n_start) < s->cluster_sectors) {
-			/* cluster is already allocated but compressed, we must
-			   decompress it in the case it is not completely
-			   overwritten */
-			if (decompress_cluster(s, cluster_offset) < 0)
-				return 0;
-			cluster_offset = lseek(s->fd, s->fd_end, SEEK_SET);
-			cluster_offset = (cluster_offset + s->cluster_size - 1)
-				& ~(s->cluster_size - 1);
-			/* write the cluster content - not asynchronous */
-			lseek(s->fd, cluster_offset, SEEK_SET);
-			if (write(s->fd, s->cluster_cache, s->cluster_size) != 
-			    s->cluster_size)
-			    return -1;
-		} else {
-			/* allocate a new cluster */
-			cluster_offset = lseek(s->fd, s->fd_end, SEEK_SET);
-			if (allocate == 1) {
-				/* round to cluster size */
-				cluster_offset = 
-					(cluster_offset + s->cluster_size - 1) 
-					& ~(s->cluster_size - 1);
-				if (qtruncate(s->fd, cluster_offset + 
-					      s->cluster_size, s->sparse)!=0) {
-					DPRINTF("ERROR truncating file\n");
-					return 0;
-				}
-				s->fd_end = (cluster_offset + s->cluster_size);
-				/* if encrypted, we must initialize the cluster
-				   content which won't be written */
-				if (s->crypt_method && 
-				    (n_end - n_start) < s->cluster_sectors) {
-					uint64_t start_sect;
-					start_sect = (offset & 
-						      ~(s->cluster_size - 1)) 
-							      >> 9;
-					memset(s->cluster_data + 512, 
-					       0xaa, 512);
-					for (i = 0; i < s->cluster_sectors;i++)
-					{
-						if (i < n_start || i >= n_end) 
-						{
-							encrypt_sectors(s, start_sect + i, 
-									s->cluster_data, 
-									s->cluster_data + 512, 1, 1,
-									&s->aes_encrypt_key);
-							lseek(s->fd, cluster_offset + i * 512, SEEK_SET);
-							if (write(s->fd, s->cluster_data, 512) != 512)
-								return -1;
-						}
-					}
-				}
-			} else {
-				cluster_offset |= QCOW_OFLAG_COMPRESSED | 
-					(uint64_t)compressed_size 
-						<< (63 - s->cluster_bits);
-			}
-		}
-		/* update L2 table */
-		tmp = cpu_to_be64(cluster_offset);
-		l2_table[l2_index] = tmp;
+	if (meta_busy(s))
+		return -EAGAIN;
 
-		/*For IO_DIRECT we write 4KByte blocks*/
-		l2_sector = (l2_index * sizeof(uint64_t)) >> 12;
-		l2_ptr = (char *)l2_table + (l2_sector << 12);
-		
-		if (posix_memalign((void **)&tmp_ptr2, 4096, 4096) != 0) {
-			DPRINTF("ERROR allocating memory for L1 table\n");
-                        return 0;
-		}
-		memcpy(tmp_ptr2, l2_ptr, 4096);
-		lseek(s->fd, l2_offset + (l2_sector << 12), SEEK_SET);
-		if (write(s->fd, tmp_ptr2, 4096) != 4096) {
-			free(tmp_ptr2);
-			return -1;
-		}
-		free(tmp_ptr2);
+	l2 = l2_cache_get(s, s->l1_table[l1_index]);
+	if (!l2)
+		return -ENOMEM;
+	s->l2_cache_misses++;
+
+	s->meta_l1_index = l1_index;
+	s->meta_l2       = l2;
+	qcow_meta_io(s, QCOW_OP_L2_READ, 0, l2->table,
+		     l2->size, l2->offset);
+
+	return -EAGAIN;
+}
+
+static void
+finish_l2_read(struct tdqcow_state *s, int err)
+{
+	if (err)
+		l2_cache_free(s->meta_l2);
+
+	qcow_meta_done(s, err);
+}
+
+/*
+ * Add a new L2 table at the end of the file.  It is written out before
+ * the L1 entry pointing to it, so a crash in between only leaks the space.
+ */
+static int
+qcow_new_l2(struct tdqcow_state *s, int l1_index)
+{
+	int i, err;
+	uint64_t l2_offset, cluster_offset, end, *l2_table;
+	struct qcow_l2_table *l2;
+
+	if (meta_busy(s))
+		return -EAGAIN;
+
+	/* round to cluster size */
+	l2_offset = (s->fd_end + s->cluster_size - 1) & ~(s->cluster_size - 1);
+	end       = l2_offset + (s->l2_size * sizeof(uint64_t));
+
+	/*Should we allocate the whole extent? Adjustable parameter.*/
+	cluster_offset = 0;
+	if (s->cluster_alloc == s->l2_size) {
+		cluster_offset = (end + s->cluster_size - 1)
+			& ~(s->cluster_size - 1);
+		end = cluster_offset + (s->cluster_size * s->l2_size);
+	}
+
+	err = qcow_extend(s, end);
+	if (err) {
+		DPRINTF("ERROR extending file: %d\n", err);
+		return err;
 	}
-	return cluster_offset;
+	s->fd_end = end;
+
+	l2 = l2_cache_get(s, l2_offset);
+	if (!l2)
+		return -ENOMEM;
+	l2_table = l2->table;
+
+	if (cluster_offset) {
+		for (i = 0; i < s->l2_size; i++)
+			l2_table[i] = cpu_to_be64(cluster_offset +
+						  (i * s->cluster_size));
+	} else
+		memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+
+	s->l1_table[l1_index] = l2_offset;
+
+	s->meta_l1_index = l1_index;
+	s->meta_l2       = l2;
+	qcow_meta_io(s, QCOW_OP_L2_WRITE, 1, l2_table,
+		     s->l2_size * sizeof(uint64_t), l2_offset);
+
+	return -EAGAIN;
 }
 
-static int qcow_is_allocated(struct tdqcow_state *s, int64_t sector_num,
-                             int nb_sectors, int *pnum)
+static void
+finish_l2_write(struct tdqcow_state *s, int err)
 {
-	int index_in_cluster, n;
-	uint64_t cluster_offset;
-
-	cluster_offset = get_cluster_offset(s, sector_num << 9, 0, 0, 0, 0);
-	index_in_cluster = sector_num & (s->cluster_sectors - 1);
-	n = s->cluster_sectors - index_in_cluster;
-	if (n > nb_sectors)
-		n = nb_sectors;
-	*pnum = n;
-	return (cluster_offset != 0);
+	int i, l1_sector;
+	uint64_t *buf;
+
+	if (err)
+		goto fail;
+
+	/*Update the L1 table entry on disk
+	 * (for O_DIRECT we write 4KByte blocks)*/
+	l1_sector = (s->meta_l1_index * sizeof(uint64_t)) >> 12;
+	buf       = (uint64_t *)s->meta_buf;
+
+	memcpy(buf, (char *)s->l1_table + (l1_sector << 12), 4096);
+
+	/* Convert block to write to big endian */
+	for (i = 0; i < 4096 / sizeof(uint64_t); i++)
+		cpu_to_be64s(&buf[i]);
+
+	qcow_meta_io(s, QCOW_OP_L1_WRITE, 1, buf, 4096,
+		     s->l1_table_offset + (l1_sector << 12));
+	return;
+
+fail:
+	s->l1_table[s->meta_l1_index] = 0;
+	l2_cache_free(s->meta_l2);
+	qcow_meta_done(s, err);
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
+static void
+finish_l1_write(struct tdqcow_state *s, int err)
 {
-	z_stream strm1, *strm = &strm1;
-	int ret, out_len;
-	
-	memset(strm, 0, sizeof(*strm));
-	
-	strm->next_in = (uint8_t *)buf;
-	strm->avail_in = buf_size;
-	strm->next_out = out_buf;
-	strm->avail_out = out_buf_size;
-	
-	ret = inflateInit2(strm, -12);
-	if (ret != Z_OK)
-		return -1;
-	ret = inflate(strm, Z_FINISH);
-	out_len = strm->next_out - out_buf;
-	if ( (ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-	    (out_len != out_buf_size) ) {
-		inflateEnd(strm);
-		return -1;
+	if (err) {
+		s->l1_table[s->meta_l1_index] = 0;
+		l2_cache_free(s->meta_l2);
 	}
-	inflateEnd(strm);
-	return 0;
+
+	qcow_meta_done(s, err);
 }
-                              
-static int decompress_cluster(struct tdqcow_state *s, uint64_t cluster_offset)
+
+/*
+ * Point the L2 entries at the new clusters, and write the sectors holding
+ * them out.  The table isn't changed meanwhile, so they go from the cache.
+ */
+static void
+qcow_update_l2(struct tdqcow_state *s)
 {
-	int ret, csize;
-	uint64_t coffset;
+	int i, first, last;
+	uint64_t *l2_table;
+
+	l2_table = s->meta_l2->table;
+	for (i = 0; i < s->meta_count; i++)
+		l2_table[s->meta_l2_index + i] =
+			cpu_to_be64(s->meta_cluster + i * s->cluster_size);
+
+	/*For IO_DIRECT we write 4KByte blocks*/
+	first = (s->meta_l2_index * sizeof(uint64_t)) >> 12;
+	last  = ((s->meta_l2_index + s->meta_count - 1) *
+		 sizeof(uint64_t)) >> 12;
+
+	qcow_meta_io(s, QCOW_OP_L2_UPDATE, 1, (char *)l2_table + (first << 12),
+		     (last - first + 1) << 12,
+		     s->l1_table[s->meta_l1_index] + (first << 12));
+}
+
+static void
+finish_l2_update(struct tdqcow_state *s, int err)
+{
+	int i;
+	uint64_t *l2_table;
+
+	if (err) {
+		l2_table = s->meta_l2->table;
+		for (i = 0; i < s->meta_count; i++)
+			l2_table[s->meta_l2_index + i] =
+				cpu_to_be64(s->meta_old);
+	}
+
+	qcow_meta_done(s, err);
+}
+
+/*
+ * Read a compressed cluster, to be decompressed into the cluster cache.
+ * O_DIRECT needs whole sectors, so this reads the ones it spans.
+ */
+static void
+qcow_read_compressed(struct tdqcow_state *s, uint64_t cluster_offset)
+{
+	uint64_t coffset, start, end;
+	int csize;
 
 	coffset = cluster_offset & s->cluster_offset_mask;
-	if (s->cluster_cache_offset != coffset) {
-		csize = cluster_offset >> (63 - s->cluster_bits);
-		csize &= (s->cluster_size - 1);
-		lseek(s->fd, coffset, SEEK_SET);
-		ret = read(s->fd, s->cluster_data, csize);
-		if (ret != csize) 
-			return -1;
-		if (decompress_buffer(s->cluster_cache, s->cluster_size,
-				      s->cluster_data, csize) < 0) {
-			return -1;
+	csize   = cluster_offset >> (63 - s->cluster_bits);
+	csize  &= (s->cluster_size - 1);
+
+	start = coffset & ~511ULL;
+	end   = (coffset + csize + 511) & ~511ULL;
+
+	s->meta_old = cluster_offset;
+	qcow_meta_io(s, QCOW_OP_CLUSTER_READ, 0, s->meta_buf,
+		     end - start, start);
+}
+
+/* Fill the cluster cache for reading a compressed cluster. */
+static int
+qcow_load_compressed(struct tdqcow_state *s, uint64_t cluster_offset)
+{
+	if ((cluster_offset & s->cluster_offset_mask) ==
+	    s->cluster_cache_offset)
+		return 0;
+
+	if (meta_busy(s))
+		return -EAGAIN;
+
+	s->meta_l1_index = -1;
+	qcow_read_compressed(s, cluster_offset);
+	return -EAGAIN;
+}
+
+/* Copy the decompressed cluster to a new one, which replaces it. */
+static void
+qcow_copy_cluster(struct tdqcow_state *s)
+{
+	int err;
+
+	err = qcow_alloc_clusters(s, 1, &s->meta_cluster);
+	if (err) {
+		qcow_meta_done(s, err);
+		return;
+	}
+
+	qcow_meta_io(s, QCOW_OP_CLUSTER_WRITE, 1, s->cluster_cache,
+		     s->cluster_size, s->meta_cluster);
+}
+
+static void
+finish_cluster_read(struct tdqcow_state *s, int err)
+{
+	uint64_t coffset;
+	int csize;
+
+	if (err)
+		goto out;
+
+	coffset = s->meta_old & s->cluster_offset_mask;
+	csize   = s->meta_old >> (63 - s->cluster_bits);
+	csize  &= (s->cluster_size - 1);
+
+	s->cluster_cache_offset = -1;
+	if (decompress_buffer(s->cluster_cache, s->cluster_size,
+			      s->meta_buf + (coffset & 511), csize) < 0) {
+		err = -EIO;
+		goto out;
+	}
+	s->cluster_cache_offset = coffset;
+
+	/* Filled for a write: it goes on to replace the cluster. */
+	if (s->meta_l1_index >= 0) {
+		qcow_copy_cluster(s);
+		return;
+	}
+
+out:
+	qcow_meta_done(s, err);
+}
+
+static void
+finish_cluster_write(struct tdqcow_state *s, int err)
+{
+	if (err) {
+		qcow_meta_done(s, err);
+		return;
+	}
+
+	qcow_update_l2(s);
+}
+
+/*
+ * Allocate a cluster for writing sectors n_start to n_end of it (n_end may
+ * run into the next ones, which are allocated along with it if they have
+ * to be).  If it is compressed and the write doesn't cover it, its content
+ * is copied over first; if encrypted, the sectors which won't be written
+ * are initialised.
+ */
+static int
+qcow_new_cluster(struct tdqcow_state *s, int l1_index,
+		 struct qcow_l2_table *l2, int l2_index, uint64_t offset,
+		 int n_start, int n_end)
+{
+	int i, err, partial, count, max;
+	uint64_t *l2_table, start_sect;
+	uint8_t pattern[512];
+
+	if (meta_busy(s))
+		return -EAGAIN;
+
+	l2_table = l2->table;
+	partial  = (n_start > 0 || n_end < s->cluster_sectors);
+
+	s->meta_l1_index = l1_index;
+	s->meta_l2       = l2;
+	s->meta_l2_index = l2_index;
+	s->meta_old      = be64_to_cpu(l2_table[l2_index]);
+	s->meta_count    = 1;
+
+	if ((s->meta_old & QCOW_OFLAG_COMPRESSED) && partial) {
+		/* cluster is already allocated but compressed, we must
+		   decompress it in the case it is not completely
+		   overwritten */
+		if ((s->meta_old & s->cluster_offset_mask) ==
+		    s->cluster_cache_offset)
+			qcow_copy_cluster(s);
+		else
+			qcow_read_compressed(s, s->meta_old);
+		return -EAGAIN;
+	}
+
+	if (!s->crypt_method) {
+		max = (n_end + s->cluster_sectors - 1) / s->cluster_sectors;
+		if (max > s->l2_size - l2_index)
+			max = s->l2_size - l2_index;
+
+		count = 1;
+		while (count < max && !l2_table[l2_index + count])
+			count++;
+		s->meta_count = count;
+	}
+
+	err = qcow_alloc_clusters(s, s->meta_count, &s->meta_cluster);
+	if (err) {
+		s->meta_l1_index = -1;
+		return err;
+	}
+
+	/* if encrypted, we must initialize the cluster
+	   content which won't be written */
+	if (s->crypt_method && partial) {
+		start_sect = (offset & ~(s->cluster_size - 1)) >> 9;
+		memset(pattern, 0xaa, sizeof(pattern));
+		for (i = 0; i < s->cluster_sectors; i++)
+			encrypt_sectors(s, start_sect + i,
+					s->meta_buf + i * 512, pattern, 1, 1,
+					&s->aes_encrypt_key);
+		qcow_meta_io(s, QCOW_OP_CLUSTER_WRITE, 1, s->meta_buf,
+			     s->cluster_size, s->meta_cluster);
+		return -EAGAIN;
+	}
+
+	qcow_update_l2(s);
+	return -EAGAIN;
+}
+
+/*
+ * Find the cluster holding offset, from the tables in memory.  With
+ * allocate, a cluster is allocated for writing sectors n_start to n_end
+ * of it if needed (see qcow_new_cluster()).  Otherwise, *cluster_offset
+ * is 0 if there is none.
+ *
+ * Returns -EAGAIN if that first takes a metadata update (started now,
+ * or after the one in flight): the request must wait for it.
+ */
+static int
+qcow_map(struct tdqcow_state *s, uint64_t offset, int allocate,
+	 int n_start, int n_end, uint64_t *cluster_offset)
+{
+	int l1_index, l2_index;
+	uint64_t l2_offset, entry;
+	struct qcow_l2_table *l2;
+
+	l1_index = offset >> (s->l2_bits + s->cluster_bits);
+	l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+
+	/* the tables there are changing */
+	if (meta_busy(s) && s->meta_l1_index == l1_index)
+		return -EAGAIN;
+
+	/*Check L1 table for the extent offset*/
+	l2_offset = s->l1_table[l1_index];
+	if (!l2_offset) {
+		if (!allocate) {
+			*cluster_offset = 0;
+			return 0;
 		}
-		s->cluster_cache_offset = coffset;
+		return qcow_new_l2(s, l1_index);
 	}
+
+	if (s->min_cluster_alloc == s->l2_size) {
+		/*Fast-track the request*/
+		*cluster_offset = l2_offset + (s->l2_size * sizeof(uint64_t));
+		*cluster_offset += l2_index * s->cluster_size;
+		return 0;
+	}
+
+	l2 = l2_cache_lookup(s, l2_offset);
+	if (!l2)
+		return qcow_load_l2(s, l1_index);
+
+	entry = be64_to_cpu(l2->table[l2_index]);
+
+	if (!entry || ((entry & QCOW_OFLAG_COMPRESSED) && allocate)) {
+		if (!allocate) {
+			*cluster_offset = 0;
+			return 0;
+		}
+		return qcow_new_cluster(s, l1_index, l2, l2_index,
+					offset, n_start, n_end);
+	}
+
+	*cluster_offset = entry;
 	return 0;
 }
 
+static void
+tdqcow_meta_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct qcow_request *req = (struct qcow_request *)arg;
+	struct tdqcow_state *s = req->state;
+
+	if (err)
+		DPRINTF("qcow: metadata op %d failed: %d\n", s->meta_op, err);
+
+	switch (s->meta_op) {
+	case QCOW_OP_L2_READ:
+		finish_l2_read(s, err);
+		break;
+	case QCOW_OP_L2_WRITE:
+		finish_l2_write(s, err);
+		break;
+	case QCOW_OP_L1_WRITE:
+		finish_l1_write(s, err);
+		break;
+	case QCOW_OP_L2_UPDATE:
+		finish_l2_update(s, err);
+		break;
+	case QCOW_OP_CLUSTER_READ:
+		finish_cluster_read(s, err);
+		break;
+	case QCOW_OP_CLUSTER_WRITE:
+		finish_cluster_write(s, err);
+		break;
+	default:
+		ASSERT(0);
+	}
+}
+
 static int
 tdqcow_read_header(int fd, QCowHeader *header)
 {
@@ -884,6 +1351,7 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 	}
 
 	s->fd = fd;
+	s->driver = driver;
 	s->name = strdup(name);
 	if (!s->name)
 		goto fail;
@@ -930,9 +1398,8 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 		goto fail;
 
 	/* alloc L2 cache */
-	size = s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t);
-	ret = posix_memalign((void **)&s->l2_cache, 4096, size);
-	if(ret != 0) goto fail;
+	if (l2_cache_init(s))
+		goto fail;
 
 	size = s->cluster_size;
 	ret = posix_memalign((void **)&s->cluster_cache, 4096, size);
@@ -942,6 +1409,11 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 	if(ret != 0) goto fail;
 	s->cluster_cache_offset = -1;
 
+	/* room for a compressed cluster, and the sectors around it */
+	size = (s->cluster_size + 512 + 4095) & ~4095;
+	ret = posix_memalign((void **)&s->meta_buf, 4096, size);
+	if(ret != 0) goto fail;
+
 	if (s->backing_file_offset != 0)
 		s->cluster_alloc = 1; /*Cannot use pre-alloc*/
 
@@ -967,6 +1439,8 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 			goto fail;
 	}
 
+	td_register_fd(driver, fd);
+
 	return 0;
 	
 fail:
@@ -974,9 +1448,11 @@ fail:
 
 	free_aio_state(s);
 	free(s->l1_table);
-	free(s->l2_cache);
+	l2_cache_flush(s);
+	free(s->l2_hash);
 	free(s->cluster_cache);
 	free(s->cluster_data);
+	free(s->meta_buf);
 	close(fd);
 	return -1;
 }
@@ -984,79 +1460,92 @@ fail:
 void tdqcow_queue_read(td_driver_t *driver, td_request_t treq)
 {
 	struct tdqcow_state   *s  = (struct tdqcow_state *)driver->data;
-	int ret = 0, index_in_cluster, n, i;
+	int err = 0, index_in_cluster, n;
 	uint64_t cluster_offset, sector, nb_sectors;
-	struct qcow_prv* prv;
 	td_request_t clone = treq;
+	td_request_t forward = treq;
 	char* buf = treq.buf;
 
 	sector     = treq.sec;
 	nb_sectors = treq.secs;
+	forward.secs = 0;
 
 	/*We store a local record of the request*/
 	while (nb_sectors > 0) {
-		cluster_offset = 
-			get_cluster_offset(s, sector << 9, 0, 0, 0, 0);
 		index_in_cluster = sector & (s->cluster_sectors - 1);
 		n = s->cluster_sectors - index_in_cluster;
 		if (n > nb_sectors)
 			n = nb_sectors;
 
-		if (s->aio_free_count == 0) {
-			td_complete_request(treq, -EBUSY);
-			return;
-		}
-		
-		if(!cluster_offset) {
-            int i;
-            /* Forward entire request if possible. */
-            for(i=0; i<nb_sectors; i++)
-                if(get_cluster_offset(s, (sector+i) << 9, 0, 0, 0, 0))
-                    goto coalesce_failed;
-            treq.buf  = buf;
-            treq.sec  = sector;
-            treq.secs = nb_sectors;
-			td_forward_request(treq);
-            return;
-coalesce_failed:            
-			treq.buf  = buf;
-			treq.sec  = sector;
-			treq.secs = n;
-			td_forward_request(treq);
-
-		} else if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
-			if (decompress_cluster(s, cluster_offset) < 0) {
-				td_complete_request(treq, -EIO);
-				goto done;
+		err = qcow_map(s, sector << 9, 0, 0, 0, &cluster_offset);
+		if (err)
+			break;
+
+		if (!cluster_offset) {
+			/* Forward runs of unallocated sectors at once. */
+			if (!forward.secs) {
+				forward.buf = buf;
+				forward.sec = sector;
 			}
+			forward.secs += n;
+			goto next;
+		}
+
+		if (forward.secs) {
+			td_forward_request(forward);
+			forward.secs = 0;
+		}
+
+		if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
+			err = qcow_load_compressed(s, cluster_offset);
+			if (err)
+				break;
+
 			memcpy(buf, s->cluster_cache + index_in_cluster * 512, 
 			       512 * n);
-			
-			treq.buf  = buf;
-			treq.sec  = sector;
-			treq.secs = n;
-			td_complete_request(treq, 0);
+
+			clone.buf  = buf;
+			clone.sec  = sector;
+			clone.secs = n;
+			td_complete_request(clone, 0);
 		} else {
-		  clone.buf  = buf;
-		  clone.sec  = (cluster_offset>>9)+index_in_cluster;
-		  clone.secs = n;
-		  async_read(driver, clone);
+			if (s->aio_free_count == 0) {
+				err = -EBUSY;
+				break;
+			}
+
+			clone.buf  = buf;
+			clone.sec  = (cluster_offset>>9)+index_in_cluster;
+			clone.secs = n;
+			async_read(driver, clone);
 		}
+	next:
 		nb_sectors -= n;
 		sector += n;
 		buf += n * 512;
 	}
-done:
-	return;
+
+	if (forward.secs)
+		td_forward_request(forward);
+
+	if (err) {
+		clone.buf  = buf;
+		clone.sec  = sector;
+		clone.secs = nb_sectors;
+
+		/* Whatever is left waits for the tables it needs. */
+		if (err == -EAGAIN)
+			err = qcow_wait(s, clone);
+		if (err)
+			td_complete_request(clone, err);
+	}
 }
 
 void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 {
 	struct tdqcow_state   *s  = (struct tdqcow_state *)driver->data;
-	int ret = 0, index_in_cluster, n, i;
+	int err = 0, index_in_cluster, n;
 	uint64_t cluster_offset, sector, nb_sectors;
-	td_callback_t cb;
-	struct qcow_prv* prv;
 	char* buf = treq.buf;
 	td_request_t clone=treq;
 
@@ -1071,18 +1560,14 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 			n = nb_sectors;
 
 		if (s->aio_free_count == 0) {
-			td_complete_request(treq, -EBUSY);
-			return;
+			err = -EBUSY;
+			break;
 		}
 
-		cluster_offset = get_cluster_offset(s, sector << 9, 1, 0,
-						    index_in_cluster, 
-						    index_in_cluster+n);
-		if (!cluster_offset) {
-			DPRINTF("Ooops, no write cluster offset!\n");
-			td_complete_request(treq, -EIO);
-			return;
-		}
+		err = qcow_map(s, sector << 9, 1, index_in_cluster,
+			       index_in_cluster + nb_sectors, &cluster_offset);
+		if (err)
+			break;
 
 		if (s->crypt_method) {
 			encrypt_sectors(s, sector, s->cluster_data, 
@@ -1105,9 +1590,18 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 		sector += n;
 		buf += n * 512;
 	}
-	s->cluster_cache_offset = -1; /* disable compressed cache */
 
-	return;
+	if (err) {
+		clone.buf  = buf;
+		clone.sec  = sector;
+		clone.secs = nb_sectors;
+
+		/* Whatever is left waits for the tables it needs. */
+		if (err == -EAGAIN)
+			err = qcow_wait(s, clone);
+		if (err)
+			td_complete_request(clone, err);
+	}
 }
 
 static int
@@ -1169,9 +1663,12 @@ int tdqcow_close(td_driver_t *driver)
 	free_aio_state(s);
 	free(s->name);
 	free(s->l1_table);
-	free(s->l2_cache);
+	l2_cache_flush(s);
+	free(s->l2_hash);
 	free(s->cluster_cache);
 	free(s->cluster_data);
+	free(s->meta_buf);
+	td_unregister_fd(driver, s->fd);
 	close(s->fd);	
 	return 0;
 }
@@ -1332,9 +1829,7 @@ static int qcow_make_empty(struct tdqcow_state *s)
 		return -1;
 	}
 
-	memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
+	l2_cache_flush(s);
 
 	return 0;
 }
@@ -1344,63 +1839,6 @@ static int qcow_get_cluster_size(struct tdqcow_state *s)
 	return s->cluster_size;
 }
 
-/* XXX: put compressed sectors first, then all the cluster aligned
-   tables to avoid losing bytes in alignment */
-static int qcow_compress_cluster(struct tdqcow_state *s, int64_t sector_num, 
-                          const uint8_t *buf)
-{
-	z_stream strm;
-	int ret, out_len;
-	uint8_t *out_buf;
-	uint64_t cluster_offset;
-
-	out_buf = malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-	if (!out_buf)
-		return -1;
-
-	/* best compression, small window, no zlib header */
-	memset(&strm, 0, sizeof(strm));
-	ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-			   Z_DEFLATED, -12, 
-			   9, Z_DEFAULT_STRATEGY);
-	if (ret != 0) {
-		free(out_buf);
-		return -1;
-	}
-
-	strm.avail_in = s->cluster_size;
-	strm.next_in = (uint8_t *)buf;
-	strm.avail_out = s->cluster_size;
-	strm.next_out = out_buf;
-
-	ret = deflate(&strm, Z_FINISH);
-	if (ret != Z_STREAM_END && ret != Z_OK) {
-		free(out_buf);
-		deflateEnd(&strm);
-		return -1;
-	}
-	out_len = strm.next_out - out_buf;
-
-	deflateEnd(&strm);
-
-	if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-		/* could not compress: write normal cluster */
-		//tdqcow_queue_write(bs, sector_num, buf, s->cluster_sectors);
-	} else {
-		cluster_offset = get_cluster_offset(s, sector_num << 9, 2, 
-                                            out_len, 0, 0);
-		cluster_offset &= s->cluster_offset_mask;
-		lseek(s->fd, cluster_offset, SEEK_SET);
-		if (write(s->fd, out_buf, out_len) != out_len) {
-			free(out_buf);
-			return -1;
-		}
-	}
-	
-	free(out_buf);
-	return 0;
-}
-
 static int
 tdqcow_get_image_type(const char *file, int *type)
 {
@@ -1487,6 +1925,21 @@ int tdqcow_validate_parent(td_driver_t *driver,
 	return 0;
 }
 
+static void
+tdqcow_debug(td_driver_t *driver)
+{
+	struct tdqcow_state *s = (struct tdqcow_state *)driver->data;
+
+	tlog_write(TLOG_WARN, "%s: L2 cache: tables: %d, hits: %"PRIu64", "
+		   "misses: %"PRIu64", evictions: %"PRIu64", "
+		   "shared: %zu/%zu bytes\n", s->name, s->l2_cache_count,
+		   s->l2_cache_hits, s->l2_cache_misses,
+		   s->l2_cache_evictions, l2_cache_spent(), l2_cache_max);
+	tlog_write(TLOG_WARN, "%s: metadata op: %d, l1 index: %d, "
+		   "waiting: %p\n", s->name, s->meta_op, s->meta_l1_index,
+		   s->waiting_head);
+}
+
 struct tap_disk tapdisk_qcow = {
 	.disk_type           = "tapdisk_qcow",
 	.flags              = 0,
@@ -1497,5 +1950,5 @@ struct tap_disk tapdisk_qcow = {
 	.td_queue_write      = tdqcow_queue_write,
 	.td_get_parent_id    = tdqcow_get_parent_id,
 	.td_validate_parent  = tdqcow_validate_parent,
-	.td_debug           = NULL,
+	.td_debug            = tdqcow_debug,
 };
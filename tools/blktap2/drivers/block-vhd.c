@@ -59,6 +59,7 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
+#include "block-vhd.h"
 
 unsigned int SPB;
 
@@ -109,7 +110,17 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               32  /* default bitmaps cached */
+#define VHD_CACHE_SIZE_MAX           65536
+
+/*
+ * read-ahead: after VHD_RA_STREAK sequential reads, data past each read
+ * is read into a window of VHD_RA_MIN_SECS, doubling up to
+ * VHD_RA_MAX_SECS as long as the stream keeps using it.
+ */
+#define VHD_RA_STREAK                2
+#define VHD_RA_MIN_SECS              64
+#define VHD_RA_MAX_SECS              1024
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
@@ -121,6 +132,7 @@ unsigned int SPB;
 #define VHD_OP_BITMAP_READ           3
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
+#define VHD_OP_DATA_READAHEAD        6
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -196,6 +208,7 @@ struct vhd_bat_state {
 struct vhd_bitmap {
 	u32                       blk;
 	u64                       seqno;       /* lru sequence number */
+	struct vhd_bitmap        *hnext;       /* bitmap hash chain */
 	vhd_flag_t                status;
 
 	char                     *map;         /* map should only be modified
@@ -215,6 +228,27 @@ struct vhd_bitmap {
 	struct vhd_request        req;
 };
 
+struct vhd_readahead {
+	char                     *buf;
+	uint64_t                  sec;         /* first sector in buf */
+	uint32_t                  secs;        /* sectors in buf */
+	uint32_t                  valid;       /* sectors in buf already read,
+						* the rest are pending */
+	uint32_t                  window;
+	int                       pending;
+	int                       stale;       /* written to while pending */
+
+	uint64_t                  next;        /* where a sequential stream
+						* reads next */
+	int                       streak;      /* sequential reads so far */
+
+	struct vhd_request        req;
+	struct vhd_req_list       waiting;     /* reads of pending sectors */
+
+	uint64_t                  hits;
+	uint64_t                  issued;
+};
+
 struct vhd_state {
 	vhd_flag_t                flags;
 
@@ -229,11 +263,23 @@ struct vhd_state {
 
 	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
+	int                       bm_cache_size;
+	struct vhd_bitmap       **bitmap;
+	struct vhd_bitmap       **bm_hash;
+	u32                       bm_hash_mask;
 
 	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	struct vhd_bitmap       **bitmap_free;
+	struct vhd_bitmap        *bitmap_list;
+
+	uint64_t                  bm_hits;
+	uint64_t                  bm_misses;
+	uint64_t                  bm_prefetches;
+
+	struct vhd_readahead      ra;
+	int                       ireads;      /* bitmap and read-ahead reads
+						* in flight: close waits
+						* for them */
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -259,9 +305,18 @@ struct vhd_state {
 static void vhd_complete(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
 
-static struct vhd_state  *_vhd_master;
-static unsigned long      _vhd_zsize;
-static char              *_vhd_zeros;
+static int vhd_bitmap_cache_size = VHD_CACHE_SIZE;
+
+void
+vhd_set_bitmap_cache_size(int size)
+{
+	vhd_bitmap_cache_size = MAX(1, MIN(size, VHD_CACHE_SIZE_MAX));
+}
+
+/* one per event loop, like the images using them */
+static __thread struct vhd_state  *_vhd_master;
+static __thread unsigned long      _vhd_zsize;
+static __thread char              *_vhd_zeros;
 
 static int
 vhd_initialize(struct vhd_state *s)
@@ -456,29 +511,53 @@ vhd_free_bitmap_cache(struct vhd_state *s)
 	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; s->bitmap_list && i < s->bm_cache_size; i++) {
 		bm = s->bitmap_list + i;
 		free(bm->map);
 		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	free(s->bitmap_list);
+	free(s->bitmap_free);
+	free(s->bitmap);
+	free(s->bm_hash);
+
+	s->bitmap_list   = NULL;
+	s->bitmap_free   = NULL;
+	s->bitmap        = NULL;
+	s->bm_hash       = NULL;
+	s->bm_cache_size = 0;
+	s->bm_free_count = 0;
 }
 
 static int
 vhd_initialize_bitmap_cache(struct vhd_state *s)
 {
 	int i, err, map_size;
+	u32 buckets;
 	struct vhd_bitmap *bm;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	s->bm_cache_size = vhd_bitmap_cache_size;
+
+	buckets = 1;
+	while (buckets < s->bm_cache_size)
+		buckets <<= 1;
+
+	s->bitmap_list = calloc(s->bm_cache_size, sizeof(struct vhd_bitmap));
+	s->bitmap_free = calloc(s->bm_cache_size, sizeof(struct vhd_bitmap *));
+	s->bitmap      = calloc(s->bm_cache_size, sizeof(struct vhd_bitmap *));
+	s->bm_hash     = calloc(buckets, sizeof(struct vhd_bitmap *));
+	if (!s->bitmap_list || !s->bitmap_free || !s->bitmap || !s->bm_hash) {
+		err = -ENOMEM;
+		goto fail;
+	}
 
+	s->bm_hash_mask  = buckets - 1;
 	s->bm_lru        = 0;
 	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	s->bm_free_count = s->bm_cache_size;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; i < s->bm_cache_size; i++) {
 		bm = s->bitmap_list + i;
 
 		err = posix_memalign((void **)&bm->map, 512, map_size);
@@ -646,6 +725,8 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 	for (i = 0; i < VHD_REQS_DATA; i++)
 		s->vreq_free[i] = s->vreq_list + i;
 
+	s->ra.window = VHD_RA_MIN_SECS;
+
 	driver->info.size        = s->vhd.footer.curr_size >> VHD_SECTOR_SHIFT;
 	driver->info.sector_size = VHD_SECTOR_SIZE;
 	driver->info.info        = 0;
@@ -664,11 +745,14 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		s->writes++;
 	}
 
+	td_register_fd(driver, s->vhd.fd);
+
         return 0;
 
  fail:
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
+	free(s->ra.buf);
 	vhd_close(&s->vhd);
 	vhd_free(s);
 	return err;
@@ -721,6 +805,22 @@ vhd_log_close(struct vhd_state *s)
 		s->vhd.file, s->bat.bat.entries, allocated, full, s->next_db);
 }
 
+/*
+ * forget the read-ahead window and the stream, so that nothing read
+ * before a pause is served after it.
+ */
+static void
+readahead_reset(struct vhd_state *s)
+{
+	struct vhd_readahead *ra = &s->ra;
+
+	ASSERT(!ra->pending && !ra->waiting.head);
+
+	free(ra->buf);
+	memset(ra, 0, sizeof(*ra));
+	ra->window = VHD_RA_MIN_SECS;
+}
+
 static int
 _vhd_close(td_driver_t *driver)
 {
@@ -731,6 +831,13 @@ _vhd_close(td_driver_t *driver)
 	DBG(TLOG_WARN, "vhd_close\n");
 	s = (struct vhd_state *)driver->data;
 
+	if (s->ireads) {
+		DBG(TLOG_WARN, "%s: %d reads in flight\n", s->vhd.file, s->ireads);
+		return -EBUSY;
+	}
+
+	readahead_reset(s);
+
 	/* don't write footer if tapdisk is read-only */
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY))
 		goto free;
@@ -760,6 +867,7 @@ _vhd_close(td_driver_t *driver)
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
+	td_unregister_fd(driver, s->vhd.fd);
 	vhd_close(&s->vhd);
 	vhd_free(s);
 
@@ -960,6 +1068,7 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	bm->blk    = 0;
 	bm->seqno  = 0;
 	bm->status = 0;
+	bm->hnext  = NULL;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
 	clear_req_list(&bm->waiting);
@@ -968,21 +1077,38 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	init_vhd_request(s, &bm->req);
 }
 
+static inline struct vhd_bitmap **
+bitmap_bucket(struct vhd_state *s, uint32_t block)
+{
+	return &s->bm_hash[block & s->bm_hash_mask];
+}
+
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	for (bm = *bitmap_bucket(s, block); bm; bm = bm->hnext)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
 
+static inline void
+unhash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pp;
+
+	for (pp = bitmap_bucket(s, bm->blk); *pp; pp = &(*pp)->hnext)
+		if (*pp == bm) {
+			*pp = bm->hnext;
+			break;
+		}
+
+	bm->hnext = NULL;
+}
+
 static inline void
 lock_bitmap(struct vhd_bitmap *bm)
 {
@@ -1019,12 +1145,8 @@ bitmap_in_use(struct vhd_bitmap *bm)
 static inline int
 bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i, n;
-
-	n = s->spb >> 3;
-	for (i = 0; i < n; i++)
-		if (bm->map[i] != (char)0xFF)
-			return 0;
+	if (vhd_bitmap_span(&s->vhd, bm->map, 0, s->spb, 1) != s->spb)
+		return 0;
 
 	DBG(TLOG_DBG, "bitmap 0x%04x full\n", bm->blk);
 	return 1;
@@ -1037,7 +1159,7 @@ remove_lru_bitmap(struct vhd_state *s)
 	u64 seq = s->bm_lru;
 	struct vhd_bitmap *bm, *lru = NULL;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; i < s->bm_cache_size; i++) {
 		bm = s->bitmap[i];
 		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
 			idx = i;
@@ -1048,6 +1170,7 @@ remove_lru_bitmap(struct vhd_state *s)
 
 	if (lru) {
 		s->bitmap[idx] = NULL;
+		unhash_bitmap(s, lru);
 		ASSERT(!bitmap_in_use(lru));
 	}
 
@@ -1084,7 +1207,7 @@ __bitmap_lru_seqno(struct vhd_state *s)
 
 	if (s->bm_lru == 0xffffffff) {
 		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
+		for (i = 0; i < s->bm_cache_size; i++) {
 			bm = s->bitmap[i];
 			if (bm) {
 				bm->seqno >>= 1;
@@ -1107,10 +1230,16 @@ static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	struct vhd_bitmap **bucket;
+
+	for (i = 0; i < s->bm_cache_size; i++) {
 		if (!s->bitmap[i]) {
 			touch_bitmap(s, bm);
 			s->bitmap[i] = bm;
+
+			bucket    = bitmap_bucket(s, bm->blk);
+			bm->hnext = *bucket;
+			*bucket   = bm;
 			return;
 		}
 	}
@@ -1123,15 +1252,16 @@ free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	int i;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
+	for (i = 0; i < s->bm_cache_size; i++)
 		if (s->bitmap[i] == bm)
 			break;
 
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(i < s->bm_cache_size);
 
 	s->bitmap[i] = NULL;
+	unhash_bitmap(s, bm);
 	s->bitmap_free[s->bm_free_count++] = bm;
 }
 
@@ -1168,10 +1298,13 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	bm = get_bitmap(s, blk);
-	if (!bm)
+	if (!bm) {
+		s->bm_misses++;
 		return VHD_BM_NOT_CACHED;
+	}
 
 	/* bump lru count */
+	s->bm_hits++;
 	touch_bitmap(s, bm);
 
 	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
@@ -1185,7 +1318,6 @@ static int
 read_bitmap_cache_span(struct vhd_state *s, 
 		       uint64_t sector, int nr_secs, int value)
 {
-	int ret;
 	u32 blk, sec;
 	struct vhd_bitmap *bm;
 
@@ -1203,11 +1335,8 @@ read_bitmap_cache_span(struct vhd_state *s,
 	
 	ASSERT(bm && bitmap_valid(bm));
 
-	for (ret = 0; sec < s->spb && ret < nr_secs; sec++, ret++)
-		if (vhd_bitmap_test(&s->vhd, bm->map, sec) != value)
-			break;
-
-	return ret;
+	return vhd_bitmap_span(&s->vhd, bm->map, sec,
+			       MIN(s->spb, sec + nr_secs), value);
 }
 
 static inline struct vhd_request *
@@ -1582,6 +1711,7 @@ schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 	req->next      = NULL;
 
 	aio_read(s, req, offset);
+	s->ireads++;
 	lock_bitmap(bm);
 	install_bitmap(s, bm);
 	set_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING);
@@ -1670,8 +1800,203 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 	return 0;
 }
 
+/*
+ * serve @treq from the read-ahead window, now or when the window has
+ * been read.  returns -ENOENT if the window doesn't hold it.
+ */
+static int
+readahead_read(struct vhd_state *s, td_request_t treq)
+{
+	uint64_t off;
+	struct vhd_request *req;
+	struct vhd_readahead *ra = &s->ra;
+
+	if (!ra->secs || ra->stale ||
+	    treq.sec < ra->sec || treq.sec + treq.secs > ra->sec + ra->secs)
+		return -ENOENT;
+
+	off = treq.sec - ra->sec;
+
+	if (off + treq.secs <= ra->valid) {
+		memcpy(treq.buf, ra->buf + vhd_sectors_to_bytes(off),
+		       vhd_sectors_to_bytes(treq.secs));
+		ra->hits += treq.secs;
+		td_complete_request(treq, 0);
+		return 0;
+	}
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq = treq;
+	req->op   = VHD_OP_DATA_READ;
+	req->next = NULL;
+
+	add_to_tail(&ra->waiting, req);
+	ra->hits += treq.secs;
+
+	return 0;
+}
+
+/*
+ * how much of @max sectors from @sector can be read ahead in one go:
+ * allocated in this image and contiguous on disk.
+ */
+static uint32_t
+readahead_span(struct vhd_state *s, uint64_t sector, uint32_t max)
+{
+	u32 blk;
+	struct vhd_bitmap *bm;
+	uint64_t size = s->driver->info.size;
+
+	if (sector >= size)
+		return 0;
+
+	max = MIN(max, size - sector);
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED)
+		return max;
+
+	blk = sector / s->spb;
+	if (blk >= s->bat.bat.entries || bat_entry(s, blk) == DD_BLK_UNUSED)
+		return 0;
+
+	if (!test_batmap(s, blk)) {
+		bm = get_bitmap(s, blk);
+		if (!bm || !bitmap_valid(bm) ||
+		    !vhd_bitmap_test(&s->vhd, bm->map, sector % s->spb))
+			return 0;
+	}
+
+	return read_bitmap_cache_span(s, sector, max, 1);
+}
+
+/*
+ * drop the window if it overlaps a write, when the write is queued and
+ * again when it has reached the disk, in case the window was read in
+ * between.
+ */
 static void
-vhd_queue_read(td_driver_t *driver, td_request_t treq)
+readahead_invalidate(struct vhd_state *s, uint64_t sector, uint32_t secs)
+{
+	struct vhd_readahead *ra = &s->ra;
+
+	if (!ra->secs ||
+	    sector >= ra->sec + ra->secs || sector + secs <= ra->sec)
+		return;
+
+	if (ra->pending)
+		ra->stale = 1;
+	else
+		ra->secs = 0;
+}
+
+/*
+ * called with @sector just past a read of a sequential stream.  once the
+ * stream is past the middle of the window, the window moves up to
+ * @sector: what it still holds is kept, and the rest is read.
+ */
+static void
+vhd_readahead(struct vhd_state *s, uint64_t sector)
+{
+	u64 offset;
+	uint32_t keep, n;
+	uint64_t start;
+	struct vhd_request *req;
+	struct vhd_readahead *ra = &s->ra;
+
+	if (ra->pending || ra->streak < VHD_RA_STREAK)
+		return;
+
+	keep = 0;
+	if (ra->secs && !ra->stale &&
+	    sector >= ra->sec && sector <= ra->sec + ra->secs) {
+		if (sector - ra->sec < ra->secs / 2)
+			return;
+
+		keep       = ra->sec + ra->secs - sector;
+		ra->window = MIN(ra->window << 1, VHD_RA_MAX_SECS);
+		if (keep >= ra->window)
+			return;
+	}
+
+	start = sector + keep;
+	n     = readahead_span(s, start, ra->window - keep);
+	if (!n)
+		return;
+
+	if (!ra->buf &&
+	    posix_memalign((void **)&ra->buf, VHD_SECTOR_SIZE,
+			   vhd_sectors_to_bytes(VHD_RA_MAX_SECS))) {
+		ra->buf = NULL;
+		return;
+	}
+
+	if (keep)
+		memmove(ra->buf,
+			ra->buf + vhd_sectors_to_bytes(sector - ra->sec),
+			vhd_sectors_to_bytes(keep));
+
+	ra->sec     = sector;
+	ra->secs    = keep + n;
+	ra->valid   = keep;
+	ra->stale   = 0;
+	ra->pending = 1;
+	ra->issued += n;
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED)
+		offset = start;
+	else
+		offset = bat_entry(s, start / s->spb) +
+			s->bm_secs + start % s->spb;
+
+	req = &ra->req;
+	init_vhd_request(s, req);
+
+	req->treq.sec  = start;
+	req->treq.secs = n;
+	req->treq.buf  = ra->buf + vhd_sectors_to_bytes(keep);
+	req->treq.cb   = NULL;
+	req->op        = VHD_OP_DATA_READAHEAD;
+	req->next      = NULL;
+
+	aio_read(s, req, vhd_sectors_to_bytes(offset));
+	s->ireads++;
+
+	DBG(TLOG_DBG, "%s: readahead lsec: 0x%08"PRIx64", keep: 0x%04x, "
+	    "nr_secs: 0x%04x\n", s->vhd.file, start, keep, n);
+}
+
+/*
+ * the bitmap of the next block is read while a sequential stream is in
+ * the second half of this one, so the stream doesn't wait for it.
+ */
+static void
+vhd_prefetch_bitmap(struct vhd_state *s, uint64_t sector)
+{
+	u32 blk;
+
+	if (!vhd_type_dynamic(&s->vhd) || !s->bm_cache_size)
+		return;
+
+	if (sector % s->spb < s->spb / 2)
+		return;
+
+	blk = sector / s->spb + 1;
+	if (blk >= s->bat.bat.entries)
+		return;
+
+	if (bat_entry(s, blk) == DD_BLK_UNUSED ||
+	    test_batmap(s, blk) || get_bitmap(s, blk))
+		return;
+
+	if (!schedule_bitmap_read(s, blk))
+		s->bm_prefetches++;
+}
+
+static void
+__vhd_queue_read(td_driver_t *driver, td_request_t treq)
 {
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
@@ -1702,9 +2027,12 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 
 		case VHD_BM_BIT_SET:
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 1);
-			err = schedule_data_read(s, clone, 0);
+			err = readahead_read(s, clone);
+			if (err == -ENOENT)
+				err = schedule_data_read(s, clone, 0);
 			if (err)
 				goto fail;
+			vhd_readahead(s, clone.sec + clone.secs);
 			break;
 
 		case VHD_BM_NOT_CACHED:
@@ -1743,6 +2071,29 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+static void
+vhd_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	struct vhd_readahead *ra = &s->ra;
+
+	if (treq.sec == ra->next) {
+		ra->streak++;
+		/* room for a couple of the stream's reads at least */
+		ra->window = MIN(MAX(ra->window, treq.secs << 1),
+				 VHD_RA_MAX_SECS);
+	} else {
+		ra->streak = 0;
+		ra->window = VHD_RA_MIN_SECS;
+	}
+	ra->next = treq.sec + treq.secs;
+
+	if (ra->streak >= VHD_RA_STREAK)
+		vhd_prefetch_bitmap(s, ra->next);
+
+	__vhd_queue_read(driver, treq);
+}
+
 static void
 vhd_queue_write(td_driver_t *driver, td_request_t treq)
 {
@@ -1751,6 +2102,8 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x, (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
+	readahead_invalidate(s, treq.sec, treq.secs);
+
 	while (treq.secs) {
 		int err;
 		uint8_t flags;
@@ -1860,7 +2213,7 @@ signal_completion(struct vhd_request *list, int error)
 static void
 start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i, error = 0;
+	int error = 0;
 	struct vhd_transaction *tx;
 	struct vhd_request *r, *next;
 
@@ -1886,9 +2239,8 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 			tx->finished++;
 			if (!r->error) {
 				u32 sec = r->treq.sec % s->spb;
-				for (i = 0; i < r->treq.secs; i++)
-					vhd_bitmap_set(&s->vhd,
-						       bm->shadow, sec + i);
+				vhd_bitmap_set_range(&s->vhd, bm->shadow,
+						     sec, r->treq.secs);
 			}
 		}
 		r = next;
@@ -2093,7 +2445,7 @@ finish_bitmap_read(struct vhd_request *req)
 			       tmp.op == VHD_OP_DATA_WRITE);
 
 			if (tmp.op == VHD_OP_DATA_READ)
-				vhd_queue_read(s->driver, tmp.treq);
+				__vhd_queue_read(s->driver, tmp.treq);
 			else if (tmp.op == VHD_OP_DATA_WRITE)
 				vhd_queue_write(s->driver, tmp.treq);
 
@@ -2146,14 +2498,59 @@ finish_data_read(struct vhd_request *req)
 	signal_completion(req, 0);
 }
 
+static void
+finish_readahead(struct vhd_request *req)
+{
+	uint64_t off;
+	struct vhd_request *r, *next;
+	struct vhd_state *s = req->state;
+	struct vhd_readahead *ra = &s->ra;
+
+	DBG(TLOG_DBG, "lsec 0x%08"PRIx64", secs: 0x%04x, err: %d\n",
+	    req->treq.sec, req->treq.secs, req->error);
+
+	r = ra->waiting.head;
+	clear_req_list(&ra->waiting);
+	ra->pending = 0;
+
+	if (req->error) {
+		ra->secs   = 0;
+		ra->streak = 0;
+		ra->window = VHD_RA_MIN_SECS;
+	} else
+		ra->valid  = ra->secs;
+
+	while (r) {
+		struct vhd_request tmp;
+
+		tmp  = *r;
+		next =  r->next;
+		free_vhd_request(s, r);
+
+		if (req->error)
+			__vhd_queue_read(s->driver, tmp.treq);
+		else {
+			off = tmp.treq.sec - ra->sec;
+			memcpy(tmp.treq.buf, ra->buf + vhd_sectors_to_bytes(off),
+			       vhd_sectors_to_bytes(tmp.treq.secs));
+			td_complete_request(tmp.treq, 0);
+		}
+
+		r = next;
+	}
+
+	if (ra->stale)
+		ra->secs = 0;
+}
+
 static void
 finish_data_write(struct vhd_request *req)
 {
-	int i;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = (struct vhd_state *)req->state;
 
 	set_vhd_flag(req->flags, VHD_FLAG_REQ_FINISHED);
+	readahead_invalidate(s, req->treq.sec, req->treq.secs);
 
 	if (tx) {
 		u32 blk, sec;
@@ -2172,8 +2569,8 @@ finish_data_write(struct vhd_request *req)
 		    req->treq.sec / s->spb, tx->started, tx->finished);
 
 		if (!req->error)
-			for (i = 0; i < req->treq.secs; i++)
-				vhd_bitmap_set(&s->vhd, bm->shadow,  sec + i);
+			vhd_bitmap_set_range(&s->vhd, bm->shadow,
+					     sec, req->treq.secs);
 
 		if (transaction_completed(tx))
 			finish_data_transaction(s, bm);
@@ -2210,11 +2607,17 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_data_read(req);
 		break;
 
+	case VHD_OP_DATA_READAHEAD:
+		s->ireads--;
+		finish_readahead(req);
+		break;
+
 	case VHD_OP_DATA_WRITE:
 		finish_data_write(req);
 		break;
 
 	case VHD_OP_BITMAP_READ:
+		s->ireads--;
 		finish_bitmap_read(req);
 		break;
 
@@ -2261,8 +2664,15 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: %d entries, hits: %"PRIu64", misses: "
+	    "%"PRIu64" (%.1f%% hit), prefetches: %"PRIu64"\n",
+	    s->bm_cache_size, s->bm_hits, s->bm_misses,
+	    (s->bm_hits + s->bm_misses ?
+	     100.0 * s->bm_hits / (s->bm_hits + s->bm_misses) : 0.0),
+	    s->bm_prefetches);
+	DBG(TLOG_WARN, "READAHEAD: window: %u, issued: %"PRIu64", hits: "
+	    "%"PRIu64"\n", s->ra.window, s->ra.issued, s->ra.hits);
+	for (i = 0; i < s->bm_cache_size; i++) {
 		int qnum = 0, wnum = 0, rnum = 0;
 		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
@@ -79,9 +79,21 @@ uint32_t gen_cksum(char *ptr, int len);
 int get_filesize(char *filename, uint64_t *size, struct stat *st);
 int qtruncate(int fd, off_t length, int sparse);
 
-#define L2_CACHE_SIZE 16  /*Fixed allocation in Qemu*/
+/*
+ * The L2 tables cached by all the images in a tapdisk process, whatever
+ * event loop they are on, share one budget, which qcow_set_l2_cache_size()
+ * changes.  Each image keeps at least L2_CACHE_MIN tables whatever the
+ * budget.
+ */
+#define L2_CACHE_MIN      16  /*Fixed allocation in Qemu*/
+#define L2_CACHE_DEFAULT  (64 << 20)
+
+struct qcow_request;
+struct qcow_l2_table;
+struct td_driver_handle;
 
 struct tdqcow_state {
+	struct td_driver_handle *driver;
         int fd;                        /*Main Qcow file descriptor */
 	uint64_t fd_end;               /*Store a local record of file length */
 	char *name;                    /*Record of the filename*/
@@ -104,10 +116,12 @@ struct tdqcow_state {
 	uint64_t l1_table_offset;      /*L1 table offset from beginning of 
 					*file*/
 	uint64_t *l1_table;            /*L1 table entries*/
-	uint64_t *l2_cache;            /*We maintain a cache of size 
-					*L2_CACHE_SIZE of most read entries*/
-	uint64_t l2_cache_offsets[L2_CACHE_SIZE];     /*L2 cache entries*/
-	uint32_t l2_cache_counts[L2_CACHE_SIZE];      /*Cache access record*/
+	struct qcow_l2_table **l2_hash; /*Cached L2 tables, by offset*/
+	int l2_hash_mask;
+	int l2_cache_count;            /*Tables this image holds*/
+	uint64_t l2_cache_hits;
+	uint64_t l2_cache_misses;
+	uint64_t l2_cache_evictions;
 	uint8_t *cluster_cache;          
 	uint8_t *cluster_data;
 	uint64_t cluster_cache_offset; /**/
@@ -123,9 +137,24 @@ struct tdqcow_state {
 	struct qcow_request   *aio_requests;
 	struct qcow_request  **aio_free_list;
 
+	/* Metadata update in flight (one at a time), and its state */
+	int                  meta_op;
+	int                  meta_l1_index;  /*L2 table it changes, or -1*/
+	struct qcow_l2_table *meta_l2;       /*Its entry in the L2 cache*/
+	int                  meta_l2_index;
+	int                  meta_count;     /*Entries from there it sets*/
+	uint64_t             meta_cluster;   /*First cluster allocated*/
+	uint64_t             meta_old;       /*L2 entry it replaces*/
+	uint8_t             *meta_buf;
+	struct qcow_request  *meta_req;
+
+	/* Requests waiting for the metadata update to complete */
+	struct qcow_request  *waiting_head;
+	struct qcow_request  *waiting_tail;
 };
 
 int qcow_create(const char *filename, uint64_t total_size,
 		const char *backing_file, int sparse);
+void qcow_set_l2_cache_size(size_t size);
 
 #endif //_QCOW_H_
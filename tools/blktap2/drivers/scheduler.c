@@ -30,6 +30,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 
 #include "scheduler.h"
 #include "tapdisk-log.h"
@@ -49,6 +50,7 @@
 
 typedef struct event {
 	char                         mode;
+	char                         pending;
 	event_id_t                   id;
 
 	int                          fd;
@@ -59,50 +61,183 @@ typedef struct event {
 	void                        *private;
 
 	struct list_head             next;
+	struct list_head             fd_next;
+	struct list_head             timer;
+	struct list_head             ready;
 } event_t;
 
+/*
+ * The events waiting on one file descriptor.  epoll takes each fd once,
+ * so it is registered for the union of their modes.  The generation
+ * tells a stale epoll result, for an fd which was unregistered and
+ * reused meanwhile, from a current one.
+ */
+struct scheduler_fd {
+	struct list_head             events;
+	uint32_t                     mask;
+	uint32_t                     gen;
+};
+
+static uint64_t
+scheduler_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000000ULL + now.tv_usec;
+}
+
+static uint32_t
+scheduler_epoll_mask(struct scheduler_fd *f)
+{
+	event_t *event;
+	uint32_t mask = 0;
+
+	list_for_each_entry(event, &f->events, fd_next) {
+		if (event->mode & SCHEDULER_POLL_READ_FD)
+			mask |= EPOLLIN;
+		if (event->mode & SCHEDULER_POLL_WRITE_FD)
+			mask |= EPOLLOUT;
+		if (event->mode & SCHEDULER_POLL_EXCEPT_FD)
+			mask |= EPOLLPRI;
+	}
+
+	return mask;
+}
+
+static int
+scheduler_update_fd(scheduler_t *s, int fd)
+{
+	struct scheduler_fd *f = s->fds[fd];
+	struct epoll_event ev;
+	uint32_t mask;
+	int op, err;
+
+	mask = scheduler_epoll_mask(f);
+	if (mask == f->mask)
+		return 0;
+
+	if (!mask) {
+		/* fails harmlessly if fd was closed already */
+		epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		f->mask = 0;
+		f->gen++;
+		return 0;
+	}
+
+	op = f->mask ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = mask;
+	ev.data.u64 = ((uint64_t)f->gen << 32) | (uint32_t)fd;
+
+	err = epoll_ctl(s->epoll_fd, op, fd, &ev);
+	if (err && op == EPOLL_CTL_MOD && errno == ENOENT) {
+		/* the fd was closed and reopened under our feet */
+		op  = EPOLL_CTL_ADD;
+		err = epoll_ctl(s->epoll_fd, op, fd, &ev);
+	}
+	if (err)
+		return -errno;
+
+	f->mask = mask;
+	return 0;
+}
+
+static struct scheduler_fd *
+scheduler_get_fd(scheduler_t *s, int fd)
+{
+	struct scheduler_fd **fds, *f;
+	int n;
+
+	if (fd >= s->nr_fds) {
+		n   = MAX(fd + 1, 2 * s->nr_fds);
+		fds = realloc(s->fds, n * sizeof(*fds));
+		if (!fds)
+			return NULL;
+
+		memset(fds + s->nr_fds, 0, (n - s->nr_fds) * sizeof(*fds));
+		s->fds    = fds;
+		s->nr_fds = n;
+	}
+
+	f = s->fds[fd];
+	if (!f) {
+		f = calloc(1, sizeof(*f));
+		if (!f)
+			return NULL;
+
+		INIT_LIST_HEAD(&f->events);
+		s->fds[fd] = f;
+	}
+
+	return f;
+}
+
 static void
 scheduler_prepare_events(scheduler_t *s)
 {
 	int diff;
 	struct timeval now;
-	event_t *event, *tmp;
-
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	event_t *event;
 
-	s->max_fd  = 0;
 	s->timeout = SCHEDULER_MAX_TIMEOUT;
 
 	gettimeofday(&now, NULL);
 
-	scheduler_for_each_event(s, event, tmp) {
-		if (event->mode & SCHEDULER_POLL_READ_FD) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	list_for_each_entry(event, &s->timers, timer) {
+		diff = event->deadline - now.tv_sec;
+		if (diff > 0)
+			s->timeout = MIN(s->timeout, diff);
+		else
+			s->timeout = 0;
+	}
 
-		if (event->mode & SCHEDULER_POLL_WRITE_FD) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	s->timeout = MIN(s->timeout, s->max_timeout);
+}
 
-		if (event->mode & SCHEDULER_POLL_EXCEPT_FD) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+static void
+scheduler_queue_event(scheduler_t *s, event_t *event, char mode)
+{
+	if (event->pending)
+		return;
 
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
-		}
-	}
+	event->pending = mode;
+	list_add_tail(&event->ready, &s->ready);
+}
 
-	s->timeout = MIN(s->timeout, s->max_timeout);
+static void
+scheduler_queue_fd(scheduler_t *s, struct epoll_event *ev)
+{
+	struct scheduler_fd *f;
+	event_t *event;
+	int fd;
+
+	fd = (uint32_t)ev->data.u64;
+	if (fd >= s->nr_fds)
+		return;
+
+	f = s->fds[fd];
+	if (!f || f->gen != (uint32_t)(ev->data.u64 >> 32))
+		return;
+
+	list_for_each_entry(event, &f->events, fd_next) {
+		/* as select() would, report errors to readers and writers */
+		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
+		    (ev->events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+			scheduler_queue_event(s, event,
+					      SCHEDULER_POLL_READ_FD);
+
+		else if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
+			 (ev->events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+			scheduler_queue_event(s, event,
+					      SCHEDULER_POLL_WRITE_FD);
+
+		else if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
+			 (ev->events & EPOLLPRI))
+			scheduler_queue_event(s, event,
+					      SCHEDULER_POLL_EXCEPT_FD);
+	}
 }
 
 static void
@@ -117,46 +252,37 @@ scheduler_event_callback(event_t *event, char mode)
 	event->cb(event->id, mode, event->private);
 }
 
+/*
+ * Callbacks may register and unregister any event, so take one ready
+ * event at a time off the head of the list.
+ */
 static void
-scheduler_run_events(scheduler_t *s)
+scheduler_run_events(scheduler_t *s, struct epoll_event *evs, int n)
 {
 	struct timeval now;
-	event_t *event, *tmp;
+	event_t *event;
+	char mode;
+	int i;
 
 	gettimeofday(&now, NULL);
 
- again:
-	s->restart = 0;
+	for (i = 0; i < n; i++)
+		scheduler_queue_fd(s, &evs[i]);
 
-	scheduler_for_each_event(s, event, tmp) {
-		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_READ_FD);
-			goto next;
-		}
+	list_for_each_entry(event, &s->timers, timer)
+		if (event->deadline <= now.tv_sec)
+			scheduler_queue_event(s, event,
+					      SCHEDULER_POLL_TIMEOUT);
 
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_WRITE_FD);
-			goto next;
-		}
+	while (!list_empty(&s->ready)) {
+		event = list_entry(s->ready.next, event_t, ready);
+		list_del_init(&event->ready);
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_EXCEPT_FD);
-			goto next;
-		}
-
-		if ((event->mode & SCHEDULER_POLL_TIMEOUT) &&
-		    (event->deadline <= now.tv_sec))
-		    scheduler_event_callback(event, SCHEDULER_POLL_TIMEOUT);
+		mode           = event->pending;
+		event->pending = 0;
 
-	next:
-		if (s->restart)
-			goto again;
+		s->dispatched++;
+		scheduler_event_callback(event, mode);
 	}
 }
 
@@ -165,7 +291,9 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 int timeout, event_cb_t cb, void *private)
 {
 	event_t *event;
+	struct scheduler_fd *f;
 	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -173,6 +301,9 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!(mode & SCHEDULER_POLL_TIMEOUT) && !(mode & SCHEDULER_POLL_FD))
 		return -EINVAL;
 
+	if ((mode & SCHEDULER_POLL_FD) && fd < 0)
+		return -EBADF;
+
 	event = calloc(1, sizeof(event_t));
 	if (!event)
 		return -ENOMEM;
@@ -180,6 +311,9 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	gettimeofday(&now, NULL);
 
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->fd_next);
+	INIT_LIST_HEAD(&event->timer);
+	INIT_LIST_HEAD(&event->ready);
 
 	event->mode     = mode;
 	event->fd       = fd;
@@ -187,7 +321,28 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	event->deadline = now.tv_sec + timeout;
 	event->cb       = cb;
 	event->private  = private;
-	event->id       = s->uuid++;
+
+	if (mode & SCHEDULER_POLL_FD) {
+		f = scheduler_get_fd(s, fd);
+		if (!f) {
+			free(event);
+			return -ENOMEM;
+		}
+
+		list_add_tail(&event->fd_next, &f->events);
+
+		err = scheduler_update_fd(s, fd);
+		if (err) {
+			list_del(&event->fd_next);
+			free(event);
+			return err;
+		}
+	}
+
+	if (mode & SCHEDULER_POLL_TIMEOUT)
+		list_add_tail(&event->timer, &s->timers);
+
+	event->id = s->uuid++;
 
 	if (!s->uuid)
 		s->uuid++;
@@ -208,8 +363,15 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 	scheduler_for_each_event(s, event, tmp)
 		if (event->id == id) {
 			list_del(&event->next);
+			list_del(&event->timer);
+			list_del(&event->ready);
+
+			if (event->mode & SCHEDULER_POLL_FD) {
+				list_del(&event->fd_next);
+				scheduler_update_fd(s, event->fd);
+			}
+
 			free(event);
-			s->restart = 1;
 			break;
 		}
 }
@@ -224,42 +386,89 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
+	struct epoll_event evs[SCHEDULER_MAX_EVENTS];
+	uint64_t start;
 	int ret;
-	struct timeval tv;
 
 	scheduler_prepare_events(s);
 
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
-
 	DBG("timeout: %d, max_timeout: %d\n",
 	    s->timeout, s->max_timeout);
 
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
+	start         = scheduler_now();
+	s->wait_start = start;
+
+	ret = epoll_wait(s->epoll_fd, evs, SCHEDULER_MAX_EVENTS,
+			 s->timeout * 1000);
+
+	s->wait_start = 0;
+	s->idle      += scheduler_now() - start;
+	s->waits++;
 
-	s->restart     = 0;
 	s->timeout     = SCHEDULER_MAX_TIMEOUT;
 	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
 	if (ret < 0)
-		return ret;
+		return -errno;
 
-	scheduler_run_events(s);
+	scheduler_run_events(s, evs, ret);
 
 	return ret;
 }
 
-void
+/*
+ * Microseconds spent waiting for events, including a wait in progress.
+ * May be called from another thread.
+ */
+uint64_t
+scheduler_get_idle(scheduler_t *s)
+{
+	uint64_t start = s->wait_start;
+	uint64_t idle  = s->idle;
+
+	if (start)
+		idle += scheduler_now() - start;
+
+	return idle;
+}
+
+int
 scheduler_initialize(scheduler_t *s)
 {
 	memset(s, 0, sizeof(scheduler_t));
 
-	s->uuid = 1;
-
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	s->uuid        = 1;
+	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->timers);
+	INIT_LIST_HEAD(&s->ready);
+
+	s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epoll_fd == -1)
+		return -errno;
+
+	return 0;
+}
+
+void
+scheduler_destroy(scheduler_t *s)
+{
+	event_t *event, *tmp;
+	int i;
+
+	scheduler_for_each_event(s, event, tmp) {
+		list_del(&event->next);
+		free(event);
+	}
+
+	for (i = 0; i < s->nr_fds; i++)
+		free(s->fds[i]);
+	free(s->fds);
+
+	if (s->epoll_fd != -1)
+		close(s->epoll_fd);
+
+	memset(s, 0, sizeof(scheduler_t));
+	s->epoll_fd = -1;
 }
@@ -28,7 +28,7 @@
 #ifndef _SCHEDULER_H_
 #define _SCHEDULER_H_
 
-#include <sys/select.h>
+#include <inttypes.h>
 
 #include "list.h"
 
@@ -37,29 +37,41 @@
 #define SCHEDULER_POLL_EXCEPT_FD     0x4
 #define SCHEDULER_POLL_TIMEOUT       0x8
 
+#define SCHEDULER_MAX_EVENTS         64
+
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+struct scheduler_fd;
+
 typedef struct scheduler {
-	fd_set                       read_fds;
-	fd_set                       write_fds;
-	fd_set                       except_fds;
+	int                          epoll_fd;
 
 	struct list_head             events;
+	struct list_head             timers;
+	struct list_head             ready;
+
+	struct scheduler_fd        **fds;
+	int                          nr_fds;
 
 	int                          uuid;
-	int                          max_fd;
 	int                          timeout;
-	int                          restart;
 	int                          max_timeout;
+
+	uint64_t                     idle;
+	uint64_t                     wait_start;
+	uint64_t                     waits;
+	uint64_t                     dispatched;
 } scheduler_t;
 
-void scheduler_initialize(scheduler_t *);
+int scheduler_initialize(scheduler_t *);
+void scheduler_destroy(scheduler_t *);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    int fd, int timeout,
 				    event_cb_t cb, void *private);
 void scheduler_unregister_event(scheduler_t *,  event_id_t);
 void scheduler_set_max_timeout(scheduler_t *, int);
 int scheduler_wait_for_events(scheduler_t *);
+uint64_t scheduler_get_idle(scheduler_t *);
 
 #endif
@@ -0,0 +1,321 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Random I/O through the tapdisk queue, to compare its I/O drivers:
+ * a fixed number of requests is kept in flight against one file, by
+ * default on tmpfs so that the cost measured is the queue's own.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "tapdisk-server.h"
+#include "tapdisk-queue.h"
+#include "tapdisk-utils.h"
+
+#define BENCH_FILE                      "/dev/shm/tapdisk-bench.img"
+
+struct bench;
+
+struct bench_request {
+	struct tiocb                     tiocb;
+	char                            *buf;
+	struct timeval                   start;
+	struct bench                    *bench;
+};
+
+struct bench {
+	struct tqueue                    queue;
+	int                              fd;
+	uint64_t                         blocks;
+	int                              block_size;
+	int                              read_pct;
+
+	uint64_t                         issued;
+	uint64_t                         completed;
+	uint64_t                         count;
+	uint64_t                         errors;
+	uint64_t                         latency;
+
+	struct bench_request            *reqs;
+};
+
+static const char *program;
+
+static const struct {
+	const char                      *name;
+	int                              drv;
+} drivers[] = {
+	{ "lio",   TIO_DRV_LIO   },
+	{ "rwio",  TIO_DRV_RWIO  },
+	{ "uring", TIO_DRV_URING },
+};
+
+#define NR_DRIVERS (sizeof(drivers) / sizeof(drivers[0]))
+
+static void
+usage(FILE *stream)
+{
+	fprintf(stream, "usage: %s [-d lio|rwio|uring] [-f file] "
+		"[-s size (MB)] [-b block size] [-q depth] [-n count] "
+		"[-r read %%] [-R]\n", program);
+	fprintf(stream, "  without -d, runs each driver in turn; "
+		"-R registers the file and buffers\n");
+}
+
+static uint64_t
+usecs(struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static void bench_issue(struct bench *, struct bench_request *);
+
+static void
+bench_done(void *arg, struct tiocb *tiocb, int err)
+{
+	struct bench_request *req = arg;
+	struct bench *b = req->bench;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	b->latency += usecs(&now) - usecs(&req->start);
+	b->completed++;
+	if (err)
+		b->errors++;
+
+	if (b->issued < b->count)
+		bench_issue(b, req);
+}
+
+static void
+bench_issue(struct bench *b, struct bench_request *req)
+{
+	long long offset;
+	int write;
+
+	offset = (long long)(random() % b->blocks) * b->block_size;
+	write  = (random() % 100) >= b->read_pct;
+
+	tapdisk_prep_tiocb(&req->tiocb, b->fd, write, req->buf,
+			   b->block_size, offset, bench_done, req);
+	gettimeofday(&req->start, NULL);
+	tapdisk_queue_tiocb(&b->queue, &req->tiocb);
+	b->issued++;
+}
+
+static int
+bench_run(struct bench *b, const char *name, int drv,
+	  int depth, int reg)
+{
+	struct rusage ru0, ru1;
+	struct timeval t0, t1;
+	uint64_t elapsed, sys;
+	char *pool;
+	int i, err;
+
+	err = tapdisk_init_queue(&b->queue, depth, drv, NULL);
+	if (err) {
+		fprintf(stderr, "%s: can't set up %s: %d\n",
+			program, name, err);
+		return err;
+	}
+
+	err = posix_memalign((void **)&pool, 4096,
+			     (size_t)depth * b->block_size);
+	if (err) {
+		tapdisk_free_queue(&b->queue);
+		return -err;
+	}
+	memset(pool, 0xa5, (size_t)depth * b->block_size);
+
+	if (reg) {
+		tapdisk_queue_register_fd(&b->queue, b->fd);
+		tapdisk_queue_register_buffer(&b->queue, pool,
+					      (size_t)depth * b->block_size);
+	}
+
+	b->issued = b->completed = b->errors = b->latency = 0;
+	srandom(1);
+
+	getrusage(RUSAGE_SELF, &ru0);
+	gettimeofday(&t0, NULL);
+
+	for (i = 0; i < depth && b->issued < b->count; i++) {
+		b->reqs[i].buf   = pool + (size_t)i * b->block_size;
+		b->reqs[i].bench = b;
+		bench_issue(b, &b->reqs[i]);
+	}
+
+	while (b->completed < b->count) {
+		tapdisk_submit_all_tiocbs(&b->queue);
+		if (b->completed < b->count && b->queue.tiocbs_pending)
+			tapdisk_server_iterate();
+	}
+
+	gettimeofday(&t1, NULL);
+	getrusage(RUSAGE_SELF, &ru1);
+
+	elapsed = usecs(&t1) - usecs(&t0);
+	sys     = usecs(&ru1.ru_stime) - usecs(&ru0.ru_stime);
+
+	printf("%-6s %"PRIu64" ops in %.3fs: %.0f IOPS, %.1f MB/s, "
+	       "latency %.1fus, system %.2fus/op, errors %"PRIu64"\n",
+	       name, b->completed, elapsed / 1e6,
+	       b->completed * 1e6 / elapsed,
+	       (double)b->completed * b->block_size / elapsed,
+	       (double)b->latency / b->completed,
+	       (double)sys / b->completed, b->errors);
+
+	if (reg) {
+		tapdisk_queue_unregister_buffer(&b->queue, pool);
+		tapdisk_queue_unregister_fd(&b->queue, b->fd);
+	}
+
+	tapdisk_free_queue(&b->queue);
+	free(pool);
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file, *drv;
+	int c, i, err, depth, size, reg, ran;
+	struct bench b;
+
+	program = basename(argv[0]);
+
+	memset(&b, 0, sizeof(b));
+	file         = BENCH_FILE;
+	drv          = NULL;
+	size         = 256;
+	depth        = 32;
+	reg          = 0;
+	b.block_size = 4096;
+	b.read_pct   = 50;
+	b.count      = 200000;
+
+	while ((c = getopt(argc, argv, "d:f:s:b:q:n:r:Rh")) != -1) {
+		switch (c) {
+		case 'd':
+			drv = optarg;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'b':
+			b.block_size = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'n':
+			b.count = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			b.read_pct = atoi(optarg);
+			break;
+		case 'R':
+			reg = 1;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			goto fail_usage;
+		}
+	}
+
+	if (optind != argc || size <= 0 || depth <= 0 || !b.count ||
+	    b.block_size < 512 || b.block_size % 512)
+		goto fail_usage;
+
+	b.blocks = ((uint64_t)size << 20) / b.block_size;
+	if (!b.blocks)
+		goto fail_usage;
+
+	b.reqs = calloc(depth, sizeof(struct bench_request));
+	if (!b.reqs)
+		return ENOMEM;
+
+	/* tmpfs doesn't do O_DIRECT */
+	b.fd = open(file, O_RDWR | O_CREAT | O_DIRECT, 0600);
+	if (b.fd == -1 && errno == EINVAL)
+		b.fd = open(file, O_RDWR | O_CREAT, 0600);
+	if (b.fd == -1) {
+		err = errno;
+		fprintf(stderr, "%s: opening %s: %d\n", program, file, err);
+		return err;
+	}
+
+	if (ftruncate(b.fd, (off_t)size << 20)) {
+		err = errno;
+		fprintf(stderr, "%s: sizing %s: %d\n", program, file, err);
+		goto out;
+	}
+
+	err = tapdisk_server_initialize();
+	if (err) {
+		fprintf(stderr, "%s: server setup: %d\n", program, err);
+		goto out;
+	}
+
+	for (i = 0, ran = 0; i < NR_DRIVERS; i++) {
+		if (drv && strcmp(drv, drivers[i].name))
+			continue;
+		bench_run(&b, drivers[i].name, drivers[i].drv, depth, reg);
+		ran++;
+	}
+
+	if (!ran) {
+		fprintf(stderr, "%s: no such driver %s\n", program, drv);
+		err = EINVAL;
+	}
+
+out:
+	close(b.fd);
+	if (!strcmp(file, BENCH_FILE))
+		unlink(file);
+	free(b.reqs);
+	return err;
+
+fail_usage:
+	usage(stderr);
+	return EINVAL;
+}
@@ -214,76 +214,103 @@ tapdisk_control_validate_request(tapdisk_message_t *request)
 	return 0;
 }
 
+static void
+tapdisk_control_list_minor(td_vbd_t *vbd, void *private)
+{
+	tapdisk_message_t *response = private;
+	int i = response->u.minors.count;
+
+	if (i >= TAPDISK_MESSAGE_MAX_MINORS) {
+		response->type = TAPDISK_MESSAGE_ERROR;
+		return;
+	}
+
+	response->u.minors.list[i] = vbd->minor;
+	response->u.minors.count++;
+}
+
 static void
 tapdisk_control_list_minors(struct tapdisk_control_connection *connection,
 			    tapdisk_message_t *request)
 {
-	int i;
-	td_vbd_t *vbd;
-	struct list_head *head;
 	tapdisk_message_t response;
 
-	i = 0;
 	memset(&response, 0, sizeof(response));
 
 	response.type = TAPDISK_MESSAGE_LIST_MINORS_RSP;
 	response.cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
+	tapdisk_server_walk_vbds(tapdisk_control_list_minor, &response);
 
-	list_for_each_entry(vbd, head, next) {
-		response.u.minors.list[i++] = vbd->minor;
-		if (i >= TAPDISK_MESSAGE_MAX_MINORS) {
-			response.type = TAPDISK_MESSAGE_ERROR;
-			response.u.response.error = ERANGE;
-			break;
-		}
-	}
+	if (response.type == TAPDISK_MESSAGE_ERROR)
+		response.u.response.error = ERANGE;
 
-	response.u.minors.count = i;
 	tapdisk_control_write_message(connection->socket, &response, 2);
 	tapdisk_control_close_connection(connection);
 }
 
+static void
+tapdisk_control_count_vbd(td_vbd_t *vbd, void *private)
+{
+	int *count = private;
+
+	(*count)++;
+}
+
+struct tapdisk_control_list {
+	struct tapdisk_control_connection *connection;
+	tapdisk_message_t                 *response;
+};
+
+static void
+tapdisk_control_list_vbd(td_vbd_t *vbd, void *private)
+{
+	struct tapdisk_control_list *list = private;
+	tapdisk_message_t *response = list->response;
+
+	/* count 0 ends the list, so don't let a new VBD get there early */
+	if (response->u.list.count > 1)
+		response->u.list.count--;
+
+	response->u.list.minor   = vbd->minor;
+	response->u.list.state   = vbd->state;
+	response->u.list.path[0] = 0;
+
+	if (!list_empty(&vbd->images)) {
+		td_image_t *image = list_entry(vbd->images.next,
+					       td_image_t, next);
+		snprintf(response->u.list.path,
+			 sizeof(response->u.list.path),
+			 "%s:%s",
+			 tapdisk_disk_types[image->type]->name,
+			 image->name);
+	}
+
+	tapdisk_control_write_message(list->connection->socket, response, 2);
+}
+
 static void
 tapdisk_control_list(struct tapdisk_control_connection *connection,
 		     tapdisk_message_t *request)
 {
-	td_vbd_t *vbd;
-	struct list_head *head;
+	struct tapdisk_control_list list;
 	tapdisk_message_t response;
-	int count, i;
+	int count;
 
 	memset(&response, 0, sizeof(response));
 	response.type = TAPDISK_MESSAGE_LIST_RSP;
 	response.cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
-
 	count = 0;
-	list_for_each_entry(vbd, head, next)
-		count++;
-
-	list_for_each_entry(vbd, head, next) {
-		response.u.list.count   = count--;
-		response.u.list.minor   = vbd->minor;
-		response.u.list.state   = vbd->state;
-		response.u.list.path[0] = 0;
-
-		if (!list_empty(&vbd->images)) {
-			td_image_t *image = list_entry(vbd->images.next,
-						       td_image_t, next);
-			snprintf(response.u.list.path,
-				 sizeof(response.u.list.path),
-				 "%s:%s",
-				 tapdisk_disk_types[image->type]->name,
-				 image->name);
-		}
+	tapdisk_server_walk_vbds(tapdisk_control_count_vbd, &count);
 
-		tapdisk_control_write_message(connection->socket, &response, 2);
-	}
+	list.connection = connection;
+	list.response   = &response;
+
+	response.u.list.count = count + 1;
+	tapdisk_server_walk_vbds(tapdisk_control_list_vbd, &list);
 
-	response.u.list.count   = count;
+	response.u.list.count   = 0;
 	response.u.list.minor   = -1;
 	response.u.list.path[0] = 0;
 
@@ -291,6 +318,42 @@ tapdisk_control_list(struct tapdisk_control_connection *connection,
 	tapdisk_control_close_connection(connection);
 }
 
+static void
+tapdisk_control_loops(struct tapdisk_control_connection *connection,
+		      tapdisk_message_t *request)
+{
+	struct tapdisk_loop_stats stats;
+	tapdisk_message_t response;
+	int i, n;
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_LOOPS_RSP;
+	response.cookie = request->cookie;
+
+	n = tapdisk_server_nr_loops();
+
+	for (i = 0; i < n; i++) {
+		if (tapdisk_server_get_loop_stats(i, &stats))
+			break;
+
+		response.u.loop.count  = n - i;
+		response.u.loop.id     = stats.id;
+		response.u.loop.vbds   = stats.vbds;
+		response.u.loop.uptime = stats.uptime;
+		response.u.loop.idle   = stats.idle;
+		response.u.loop.waits  = stats.waits;
+		response.u.loop.events = stats.events;
+
+		tapdisk_control_write_message(connection->socket, &response, 2);
+	}
+
+	memset(&response.u.loop, 0, sizeof(response.u.loop));
+	response.u.loop.id = -1;
+
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
 static void
 tapdisk_control_get_pid(struct tapdisk_control_connection *connection,
 			tapdisk_message_t *request)
@@ -440,6 +503,8 @@ tapdisk_control_open_image(struct tapdisk_control_connection *connection,
 		flags |= TD_OPEN_VHD_INDEX;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_LOG_DIRTY)
 		flags |= TD_OPEN_LOG_DIRTY;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_URING)
+		flags |= TD_OPEN_URING;
 
 	vbd->name = strndup(request->u.params.path,
 			    sizeof(request->u.params.path));
@@ -518,7 +583,10 @@ tapdisk_control_close_image(struct tapdisk_control_connection *connection,
 		goto out;
 	}
 
-	tapdisk_vbd_close_vdi(vbd);
+	if (tapdisk_vbd_close_vdi(vbd)) {
+		err = -EAGAIN;
+		goto out;
+	}
 
 	/* NB. vbd->name free should probably belong into close_vdi,
 	   but the current blktap1 reopen-stuff likely depends on a
@@ -627,6 +695,46 @@ out:
 	tapdisk_control_close_connection(connection);
 }
 
+typedef void (*tapdisk_control_handler_t)
+	(struct tapdisk_control_connection *, tapdisk_message_t *);
+
+struct tapdisk_control_call {
+	tapdisk_control_handler_t          handler;
+	struct tapdisk_control_connection *connection;
+	tapdisk_message_t                 *message;
+};
+
+static void
+tapdisk_control_run_call(void *private)
+{
+	struct tapdisk_control_call *call = private;
+
+	call->handler(call->connection, call->message);
+}
+
+/*
+ * Requests about a VBD are handled on the event loop it runs on; a new
+ * one goes to the least busy loop.
+ */
+static void
+tapdisk_control_call(struct tapdisk_control_connection *connection,
+		     tapdisk_message_t *message,
+		     tapdisk_control_handler_t handler)
+{
+	struct tapdisk_control_call call = { handler, connection, message };
+	struct tapdisk_loop *loop;
+
+	if (message->type == TAPDISK_MESSAGE_ATTACH)
+		loop = tapdisk_server_pick_loop();
+	else
+		loop = tapdisk_server_get_vbd_loop(message->cookie);
+
+	if (loop)
+		tapdisk_server_call(loop, tapdisk_control_run_call, &call);
+	else
+		handler(connection, message);
+}
+
 static void
 tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 {
@@ -635,6 +743,13 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 	struct tapdisk_control_connection *connection =
 		(struct tapdisk_control_connection *)private;
 
+	/*
+	 * A connection carries one request.  Forget its event now, as the
+	 * request may be handled on another loop.
+	 */
+	tapdisk_server_unregister_event(connection->event_id);
+	connection->event_id = 0;
+
 	if (tapdisk_control_read_message(connection->socket, &message, 2)) {
 		EPRINTF("failed to read message from %d\n", connection->socket);
 		tapdisk_control_close_connection(connection);
@@ -652,18 +767,26 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 		return tapdisk_control_list_minors(connection, &message);
 	case TAPDISK_MESSAGE_LIST:
 		return tapdisk_control_list(connection, &message);
+	case TAPDISK_MESSAGE_LOOPS:
+		return tapdisk_control_loops(connection, &message);
 	case TAPDISK_MESSAGE_ATTACH:
-		return tapdisk_control_attach_vbd(connection, &message);
+		return tapdisk_control_call(connection, &message,
+					    tapdisk_control_attach_vbd);
 	case TAPDISK_MESSAGE_DETACH:
-		return tapdisk_control_detach_vbd(connection, &message);
+		return tapdisk_control_call(connection, &message,
+					    tapdisk_control_detach_vbd);
 	case TAPDISK_MESSAGE_OPEN:
-		return tapdisk_control_open_image(connection, &message);
+		return tapdisk_control_call(connection, &message,
+					    tapdisk_control_open_image);
 	case TAPDISK_MESSAGE_PAUSE:
-		return tapdisk_control_pause_vbd(connection, &message);
+		return tapdisk_control_call(connection, &message,
+					    tapdisk_control_pause_vbd);
 	case TAPDISK_MESSAGE_RESUME:
-		return tapdisk_control_resume_vbd(connection, &message);
+		return tapdisk_control_call(connection, &message,
+					    tapdisk_control_resume_vbd);
 	case TAPDISK_MESSAGE_CLOSE:
-		return tapdisk_control_close_image(connection, &message);
+		return tapdisk_control_call(connection, &message,
+					    tapdisk_control_close_image);
 	default: {
 		tapdisk_message_t response;
 	fail:
@@ -60,6 +60,10 @@ tapdisk_driver_allocate(int type, char *name, td_flag_t flags, int storage)
 	if (td_flag_test(flags, TD_OPEN_RDONLY))
 		td_flag_set(driver->state, TD_DRIVER_RDONLY);
 
+	driver->queue = tapdisk_server_get_queue(
+		td_flag_test(flags, TD_OPEN_URING) ?
+		TIO_DRV_URING : TIO_DRV_LIO);
+
 	return driver;
 
 fail:
@@ -90,7 +94,19 @@ tapdisk_driver_free(td_driver_t *driver)
 void
 tapdisk_driver_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
 {
-	tapdisk_server_queue_tiocb(tiocb);
+	tapdisk_queue_tiocb(driver->queue, tiocb);
+}
+
+int
+tapdisk_driver_register_fd(td_driver_t *driver, int fd)
+{
+	return tapdisk_queue_register_fd(driver->queue, fd);
+}
+
+void
+tapdisk_driver_unregister_fd(td_driver_t *driver, int fd)
+{
+	tapdisk_queue_unregister_fd(driver->queue, fd);
 }
 
 void
@@ -49,6 +49,8 @@ struct td_driver_handle {
 	void                        *data;
 	const struct tap_disk       *ops;
 
+	struct tqueue               *queue;
+
 	struct list_head             next;
 };
 
@@ -56,6 +58,8 @@ td_driver_t *tapdisk_driver_allocate(int, char *, td_flag_t, int);
 void tapdisk_driver_free(td_driver_t *);
 
 void tapdisk_driver_queue_tiocb(td_driver_t *, struct tiocb *);
+int tapdisk_driver_register_fd(td_driver_t *, int);
+void tapdisk_driver_unregister_fd(td_driver_t *, int);
 
 void tapdisk_driver_debug(td_driver_t *);
 
@@ -156,7 +156,7 @@ tapdisk_image_check_ring_request(td_image_t *image, blkif_request_t *req)
 		total += nsects;
 	}
 
-	if (req->sector_number + nsects > info->size)
+	if (req->sector_number + total > info->size)
 		goto fail;
 
 	return 0;
@@ -106,6 +106,7 @@ td_open(td_image_t *image)
 int
 td_close(td_image_t *image)
 {
+	int err;
 	td_driver_t *driver;
 
 	driver = image->driver;
@@ -114,7 +115,12 @@ td_close(td_image_t *image)
 
 	driver->refcnt--;
 	if (!driver->refcnt && td_flag_test(driver->state, TD_DRIVER_OPEN)) {
-		driver->ops->td_close(driver);
+		/* the driver still has I/O of its own in flight */
+		err = driver->ops->td_close(driver);
+		if (err == -EBUSY) {
+			driver->refcnt++;
+			return err;
+		}
 		td_flag_clear(driver->state, TD_DRIVER_OPEN);
 	}
 
@@ -231,6 +237,18 @@ td_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
 	tapdisk_driver_queue_tiocb(driver, tiocb);
 }
 
+int
+td_register_fd(td_driver_t *driver, int fd)
+{
+	return tapdisk_driver_register_fd(driver, fd);
+}
+
+void
+td_unregister_fd(td_driver_t *driver, int fd)
+{
+	tapdisk_driver_unregister_fd(driver, fd);
+}
+
 void
 td_prep_read(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	     long long offset, td_queue_callback_t cb, void *arg)
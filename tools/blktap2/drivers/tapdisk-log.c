@@ -34,6 +34,7 @@
 #include <stdarg.h>
 #include <syslog.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/time.h>
 
 #include "tapdisk-log.h"
@@ -68,6 +69,14 @@ struct tlog {
 static struct ehandle tapdisk_err;
 static struct tlog tapdisk_log;
 
+/*
+ * Taken by whatever reads or writes the log, as the event loops of a
+ * threaded tapdisk share it.  Recursive, since a write may flush and a
+ * flush writes out the errors.
+ */
+static pthread_mutex_t tapdisk_log_lock =
+	PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
 void
 open_tlog(char *file, size_t bytes, int level, int append)
 {
@@ -118,6 +127,8 @@ __tlog_write(int level, const char *func, const char *fmt, ...)
 	if (level > tapdisk_log.level)
 		return;
 
+	pthread_mutex_lock(&tapdisk_log_lock);
+
 	avail = tapdisk_log.size - (tapdisk_log.p - tapdisk_log.buf);
 	if (avail < MAX_ENTRY_LEN) {
 		if (tapdisk_log.append)
@@ -141,6 +152,8 @@ __tlog_write(int level, const char *func, const char *fmt, ...)
 
 	tapdisk_log.cnt++;
 	tapdisk_log.p += len;
+
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
 
 void
@@ -153,17 +166,19 @@ __tlog_error(int err, const char *func, const char *fmt, ...)
 
 	err = (err > 0 ? err : -err);
 
+	pthread_mutex_lock(&tapdisk_log_lock);
+
 	for (i = 0; i < tapdisk_err.cnt; i++) {
 		e = &tapdisk_err.errors[i];
 		if (e->err == err && e->func == func) {
 			e->cnt++;
-			return;
+			goto out;
 		}
 	}
 
 	if (tapdisk_err.cnt >= MAX_ERROR_MESSAGES) {
 		tapdisk_err.dropped++;
-		return;
+		goto out;
 	}
 
 	gettimeofday(&t, NULL);
@@ -184,6 +199,9 @@ __tlog_error(int err, const char *func, const char *fmt, ...)
 	e->err  = err;
 	e->func = (char *)func;
 	tapdisk_err.cnt++;
+
+out:
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
 
 void
@@ -192,6 +210,8 @@ tlog_print_errors(void)
 	int i;
 	struct error *e;
 
+	pthread_mutex_lock(&tapdisk_log_lock);
+
 	for (i = 0; i < tapdisk_err.cnt; i++) {
 		e = &tapdisk_err.errors[i];
 		syslog(LOG_INFO, "TAPDISK ERROR: errno %d at %s (cnt = %d): "
@@ -201,6 +221,8 @@ tlog_print_errors(void)
 	if (tapdisk_err.dropped)
 		syslog(LOG_INFO, "TAPDISK ERROR: %d other error messages "
 		       "dropped\n", tapdisk_err.dropped);
+
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
 
 void
@@ -209,6 +231,8 @@ tlog_flush_errors(void)
 	int i;
 	struct error *e;
 
+	pthread_mutex_lock(&tapdisk_log_lock);
+
 	for (i = 0; i < tapdisk_err.cnt; i++) {
 		e = &tapdisk_err.errors[i];
 		tlog_write(TLOG_WARN, "TAPDISK ERROR: errno %d at %s "
@@ -219,6 +243,8 @@ tlog_flush_errors(void)
 	if (tapdisk_err.dropped)
 		tlog_write(TLOG_WARN, "TAPDISK ERROR: %d other error messages "
 		       "dropped\n", tapdisk_err.dropped);
+
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
 
 void
@@ -230,13 +256,15 @@ tlog_flush(void)
 	if (!tapdisk_log.buf)
 		return;
 
+	pthread_mutex_lock(&tapdisk_log_lock);
+
 	flags = O_CREAT | O_WRONLY | O_DIRECT | O_NONBLOCK;
 	if (!tapdisk_log.append)
 		flags |= O_TRUNC;
 
 	fd = open(tapdisk_log.file, flags, 0644);
 	if (fd == -1)
-		return;
+		goto unlock;
 
 	if (tapdisk_log.append)
 		if (lseek(fd, 0, SEEK_END) == (off_t)-1)
@@ -254,4 +282,6 @@ tlog_flush(void)
 
 out:
 	close(fd);
+unlock:
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
@@ -44,6 +44,12 @@
 #include "libaio-compat.h"
 #include "atomicio.h"
 
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
 #define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
@@ -262,9 +268,9 @@ tapdisk_rwio_submit(struct tqueue *queue)
 
 static const struct tio td_tio_rwio = {
 	.name        = "rwio",
-	.data_size   = 0,
-	.tio_setup   = NULL,
-	.tio_destroy = NULL,
+	.data_size   = sizeof(struct rwio),
+	.tio_setup   = tapdisk_rwio_setup,
+	.tio_destroy = tapdisk_rwio_destroy,
 	.tio_submit  = tapdisk_rwio_submit
 };
 
@@ -547,6 +553,493 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * io_uring
+ *
+ * Requests go on a ring shared with the kernel, and are all handed over
+ * with one io_uring_enter(2).  Completions are read off the other ring
+ * without a system call; an eventfd tells the scheduler there are some.
+ *
+ * Registered fds stay open in the kernel, in the slot of the same number.
+ * Registered buffers stay pinned: requests entirely within one of them
+ * don't have their pages looked up each time.
+ */
+
+#define URING_FILES             1024
+#define URING_BUFFERS           64
+
+struct uring {
+	int                     fd;
+
+	void                   *sq_ring;
+	size_t                  sq_ring_size;
+	unsigned               *sq_head;
+	unsigned               *sq_tail;
+	unsigned               *sq_mask;
+	unsigned               *sq_array;
+	struct io_uring_sqe    *sqes;
+	size_t                  sqes_size;
+
+	void                   *cq_ring;
+	size_t                  cq_ring_size;
+	unsigned               *cq_head;
+	unsigned               *cq_tail;
+	unsigned               *cq_mask;
+	struct io_uring_cqe    *cqes;
+
+	int                     event_fd;
+	int                     event_id;
+	struct io_event        *aio_events;
+
+	/* NULL if the kernel won't register files */
+	int                    *files;
+
+	struct iovec            buffers[URING_BUFFERS];
+	int                     nr_buffers;
+};
+
+static inline int
+__uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+	      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int
+__uring_register(int fd, unsigned op, void *arg, unsigned nr)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (!uring)
+		return;
+
+	if (uring->event_id >= 0) {
+		tapdisk_server_unregister_event(uring->event_id);
+		uring->event_id = -1;
+	}
+
+	if (uring->event_fd >= 0) {
+		close(uring->event_fd);
+		uring->event_fd = -1;
+	}
+
+	if (uring->sqes)
+		munmap(uring->sqes, uring->sqes_size);
+	if (uring->cq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	if (uring->sq_ring)
+		munmap(uring->sq_ring, uring->sq_ring_size);
+	uring->sqes    = NULL;
+	uring->cq_ring = NULL;
+	uring->sq_ring = NULL;
+
+	if (uring->fd >= 0) {
+		close(uring->fd);
+		uring->fd = -1;
+	}
+
+	free(uring->files);
+	uring->files = NULL;
+
+	free(uring->aio_events);
+	uring->aio_events = NULL;
+}
+
+static void
+tapdisk_uring_reap(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_cqe *cqe;
+	struct io_event *ep;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	unsigned head, tail;
+	int i, n, split;
+
+	head = *uring->cq_head;
+	tail = *(volatile unsigned *)uring->cq_tail;
+	xen_rmb();
+
+	if (head == tail)
+		return;
+
+	for (n = 0; head != tail && n < queue->size; head++, n++) {
+		cqe     = &uring->cqes[head & *uring->cq_mask];
+		ep      = uring->aio_events + n;
+		ep->obj = (struct iocb *)(unsigned long)cqe->user_data;
+		ep->res = cqe->res;
+	}
+
+	xen_mb();
+	*(volatile unsigned *)uring->cq_head = head;
+
+	split = io_split(&queue->opioctx, uring->aio_events, n);
+	tapdisk_filter_events(queue->filter, uring->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", n, split);
+
+	queue->iocbs_pending  -= n;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *uring = queue->tio_data;
+	uint64_t val;
+
+	read_exact(uring->event_fd, &val, sizeof(val));
+	tapdisk_uring_reap(queue);
+}
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_params p;
+	int i, err;
+
+	uring->fd       = -1;
+	uring->event_fd = -1;
+	uring->event_id = -1;
+
+	memset(&p, 0, sizeof(p));
+	uring->fd = __uring_setup(qlen, &p);
+	if (uring->fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	/* IORING_OP_READ and IORING_OP_WRITE came with this */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		err = -ENOSYS;
+		goto fail;
+	}
+
+	uring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring->sq_ring = mmap(NULL, uring->sq_ring_size,
+			      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			      uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED) {
+		uring->sq_ring = NULL;
+		err = -errno;
+		goto fail;
+	}
+
+	uring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	uring->cq_ring = mmap(NULL, uring->cq_ring_size,
+			      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			      uring->fd, IORING_OFF_CQ_RING);
+	if (uring->cq_ring == MAP_FAILED) {
+		uring->cq_ring = NULL;
+		err = -errno;
+		goto fail;
+	}
+
+	uring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size,
+			   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			   uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		err = -errno;
+		goto fail;
+	}
+
+	uring->sq_head  = uring->sq_ring + p.sq_off.head;
+	uring->sq_tail  = uring->sq_ring + p.sq_off.tail;
+	uring->sq_mask  = uring->sq_ring + p.sq_off.ring_mask;
+	uring->sq_array = uring->sq_ring + p.sq_off.array;
+	uring->cq_head  = uring->cq_ring + p.cq_off.head;
+	uring->cq_tail  = uring->cq_ring + p.cq_off.tail;
+	uring->cq_mask  = uring->cq_ring + p.cq_off.ring_mask;
+	uring->cqes     = uring->cq_ring + p.cq_off.cqes;
+
+	uring->event_fd = tapdisk_sys_eventfd(0);
+	if (uring->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = __uring_register(uring->fd, IORING_REGISTER_EVENTFD,
+			       &uring->event_fd, 1);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	uring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      uring->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = uring->event_id;
+	if (err < 0)
+		goto fail;
+
+	uring->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!uring->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	/* an empty file table, filled in by tapdisk_uring_register_fd */
+	uring->files = malloc(URING_FILES * sizeof(int));
+	if (uring->files) {
+		for (i = 0; i < URING_FILES; i++)
+			uring->files[i] = -1;
+		if (__uring_register(uring->fd, IORING_REGISTER_FILES,
+				     uring->files, URING_FILES)) {
+			DPRINTF("io_uring: can't register files: %d\n", -errno);
+			free(uring->files);
+			uring->files = NULL;
+		}
+	}
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_uring_find_buffer(struct uring *uring, struct iocb *iocb)
+{
+	char *buf = iocb->u.c.buf;
+	int i;
+
+	for (i = 0; i < uring->nr_buffers; i++) {
+		char *base = uring->buffers[i].iov_base;
+
+		if (buf >= base &&
+		    buf + iocb->u.c.nbytes <= base + uring->buffers[i].iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+tapdisk_uring_prep(struct uring *uring, struct io_uring_sqe *sqe,
+		   struct iocb *iocb)
+{
+	int write = (iocb->aio_lio_opcode == IO_CMD_PWRITE);
+	int fd    = iocb->aio_fildes;
+	int buf;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	sqe->opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd        = fd;
+	sqe->addr      = (unsigned long)iocb->u.c.buf;
+	sqe->len       = iocb->u.c.nbytes;
+	sqe->off       = iocb->u.c.offset;
+	sqe->user_data = (unsigned long)iocb;
+
+	/* registered fds are in the slot of the same number */
+	if (uring->files && fd >= 0 && fd < URING_FILES &&
+	    uring->files[fd] == fd)
+		sqe->flags |= IOSQE_FIXED_FILE;
+
+	buf = tapdisk_uring_find_buffer(uring, iocb);
+	if (buf >= 0) {
+		sqe->opcode    = write ?
+			IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = buf;
+	}
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	unsigned tail, idx;
+	int i, merged, submitted, err = 0;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	tail = *uring->sq_tail;
+	for (i = 0; i < merged; i++) {
+		idx = (tail + i) & *uring->sq_mask;
+		tapdisk_uring_prep(uring, &uring->sqes[idx], queue->iocbs[i]);
+		uring->sq_array[idx] = idx;
+	}
+
+	xen_wmb();
+	*(volatile unsigned *)uring->sq_tail = tail + merged;
+
+	submitted = __uring_enter(uring->fd, merged, 0, 0);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = -errno;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	/* take back the entries the kernel didn't consume */
+	if (submitted < merged)
+		*(volatile unsigned *)uring->sq_tail = tail + submitted;
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	/* requests served from the page cache are done already */
+	tapdisk_uring_reap(queue);
+
+	return submitted;
+}
+
+static int
+tapdisk_uring_update_fd(struct uring *uring, int slot, int fd)
+{
+	struct io_uring_files_update update;
+
+	if (!uring->files)
+		return -EOPNOTSUPP;
+	if (slot < 0 || slot >= URING_FILES)
+		return -EINVAL;
+
+	memset(&update, 0, sizeof(update));
+	update.offset = slot;
+	update.fds    = (unsigned long)&fd;
+
+	if (__uring_register(uring->fd, IORING_REGISTER_FILES_UPDATE,
+			     &update, 1) != 1)
+		return -errno;
+
+	uring->files[slot] = fd;
+	return 0;
+}
+
+static int
+tapdisk_uring_register_fd(struct tqueue *queue, int fd)
+{
+	return tapdisk_uring_update_fd(queue->tio_data, fd, fd);
+}
+
+static void
+tapdisk_uring_unregister_fd(struct tqueue *queue, int fd)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (uring->files && fd >= 0 && fd < URING_FILES &&
+	    uring->files[fd] == fd)
+		tapdisk_uring_update_fd(uring, fd, -1);
+}
+
+/*
+ * The kernel takes the buffers as a set, so changing it means dropping
+ * the old set first.  That waits for requests in flight, but happens
+ * only as disks come and go.
+ */
+static int
+tapdisk_uring_update_buffers(struct uring *uring)
+{
+	__uring_register(uring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+
+	if (!uring->nr_buffers)
+		return 0;
+
+	if (__uring_register(uring->fd, IORING_REGISTER_BUFFERS,
+			     uring->buffers, uring->nr_buffers))
+		return -errno;
+
+	return 0;
+}
+
+static void
+tapdisk_uring_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	struct uring *uring = queue->tio_data;
+	int i;
+
+	for (i = 0; i < uring->nr_buffers; i++)
+		if (uring->buffers[i].iov_base == buf)
+			break;
+
+	if (i == uring->nr_buffers)
+		return;
+
+	uring->buffers[i] = uring->buffers[--uring->nr_buffers];
+
+	if (tapdisk_uring_update_buffers(uring))
+		uring->nr_buffers = 0;
+}
+
+static int
+tapdisk_uring_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	struct uring *uring = queue->tio_data;
+	int err;
+
+	if (uring->nr_buffers == URING_BUFFERS)
+		return -ENOSPC;
+
+	uring->buffers[uring->nr_buffers].iov_base = buf;
+	uring->buffers[uring->nr_buffers].iov_len  = size;
+	uring->nr_buffers++;
+
+	err = tapdisk_uring_update_buffers(uring);
+	if (err) {
+		/* e.g. pages which can't be pinned: keep the others */
+		uring->nr_buffers--;
+		if (tapdisk_uring_update_buffers(uring))
+			uring->nr_buffers = 0;
+	}
+
+	return err;
+}
+
+static const struct tio td_tio_uring = {
+	.name                  = "uring",
+	.data_size             = sizeof(struct uring),
+	.tio_setup             = tapdisk_uring_setup,
+	.tio_destroy           = tapdisk_uring_destroy,
+	.tio_submit            = tapdisk_uring_submit,
+	.tio_register_fd       = tapdisk_uring_register_fd,
+	.tio_unregister_fd     = tapdisk_uring_unregister_fd,
+	.tio_register_buffer   = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer = tapdisk_uring_unregister_buffer,
+};
+#endif /* HAVE_LINUX_IO_URING_H */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -575,6 +1068,11 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#ifdef HAVE_LINUX_IO_URING_H
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -690,6 +1188,38 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 	tiocb->next = NULL;
 }
 
+int
+tapdisk_queue_register_fd(struct tqueue *queue, int fd)
+{
+	if (!queue->tio || !queue->tio->tio_register_fd)
+		return -EOPNOTSUPP;
+
+	return queue->tio->tio_register_fd(queue, fd);
+}
+
+void
+tapdisk_queue_unregister_fd(struct tqueue *queue, int fd)
+{
+	if (queue->tio && queue->tio->tio_unregister_fd)
+		queue->tio->tio_unregister_fd(queue, fd);
+}
+
+int
+tapdisk_queue_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	if (!queue->tio || !queue->tio->tio_register_buffer)
+		return -EOPNOTSUPP;
+
+	return queue->tio->tio_register_buffer(queue, buf, size);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	if (queue->tio && queue->tio->tio_unregister_buffer)
+		queue->tio->tio_unregister_buffer(queue, buf);
+}
+
 void
 tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
@@ -91,11 +91,19 @@ struct tio {
 	int  (*tio_setup)    (struct tqueue *queue, int qlen);
 	void (*tio_destroy)  (struct tqueue *queue);
 	int  (*tio_submit)   (struct tqueue *queue);
+
+	/* optional: let the kernel keep files and buffers set up */
+	int  (*tio_register_fd)       (struct tqueue *queue, int fd);
+	void (*tio_unregister_fd)     (struct tqueue *queue, int fd);
+	int  (*tio_register_buffer)   (struct tqueue *queue,
+				       void *buf, size_t size);
+	void (*tio_unregister_buffer) (struct tqueue *queue, void *buf);
 };
 
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_URING   = 3,
 };
 
 /*
@@ -122,4 +130,14 @@ int tapdisk_cancel_all_tiocbs(struct tqueue *);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
 
+/*
+ * Hints that fd, or the memory at buf, will see a lot of I/O.  Backends
+ * which can't make use of this return -EOPNOTSUPP, and I/O works the
+ * same either way.  Unregister an fd before closing it.
+ */
+int tapdisk_queue_register_fd(struct tqueue *, int fd);
+void tapdisk_queue_unregister_fd(struct tqueue *, int fd);
+int tapdisk_queue_register_buffer(struct tqueue *, void *buf, size_t size);
+void tapdisk_queue_unregister_buffer(struct tqueue *, void *buf);
+
 #endif
@@ -27,8 +27,10 @@
  */
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
 
@@ -42,9 +44,36 @@
 
  tapdisk_server_t server;
 
+/* the loop the calling thread runs */
+static __thread tapdisk_loop_t *td_loop;
+
+struct tapdisk_call {
+	void                       (*fn)(void *);
+	void                        *arg;
+	int                          done;
+	struct list_head             next;
+};
+
+#define tapdisk_loop_for_each_vbd(loop, vbd, tmp)			\
+	list_for_each_entry_safe(vbd, tmp, &(loop)->vbds, next)
+
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
-	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
+	tapdisk_loop_for_each_vbd(td_loop, vbd, tmp)
+
+static tapdisk_loop_t *
+tapdisk_server_loop(int i)
+{
+	return i ? &server.loops[i - 1] : &server.main;
+}
+
+#define tapdisk_server_for_each_loop(loop, i)				\
+	for (i = 0; i <= server.nr_loops &&				\
+		     ((loop) = tapdisk_server_loop(i)); i++)
 
+/*
+ * Images are shared between the VBDs of one loop only, as their state
+ * belongs to that loop's thread.
+ */
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
 {
@@ -63,42 +92,184 @@ tapdisk_server_get_shared_image(td_image_t *image)
 	return NULL;
 }
 
-struct list_head *
-tapdisk_server_get_all_vbds(void)
+static td_vbd_t *
+__tapdisk_server_get_vbd(uint16_t uuid, tapdisk_loop_t **_loop)
 {
-	return &server.vbds;
+	tapdisk_loop_t *loop;
+	td_vbd_t *vbd, *tmp;
+	int i;
+
+	tapdisk_server_for_each_loop(loop, i)
+		tapdisk_loop_for_each_vbd(loop, vbd, tmp)
+			if (vbd->uuid == uuid) {
+				if (_loop)
+					*_loop = loop;
+				return vbd;
+			}
+
+	return NULL;
 }
 
 td_vbd_t *
 tapdisk_server_get_vbd(uint16_t uuid)
 {
-	td_vbd_t *vbd, *tmp;
+	td_vbd_t *vbd;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
-		if (vbd->uuid == uuid)
-			return vbd;
+	pthread_mutex_lock(&server.lock);
+	vbd = __tapdisk_server_get_vbd(uuid, NULL);
+	pthread_mutex_unlock(&server.lock);
 
-	return NULL;
+	return vbd;
+}
+
+tapdisk_loop_t *
+tapdisk_server_get_vbd_loop(uint16_t uuid)
+{
+	tapdisk_loop_t *loop = NULL;
+
+	pthread_mutex_lock(&server.lock);
+	__tapdisk_server_get_vbd(uuid, &loop);
+	pthread_mutex_unlock(&server.lock);
+
+	return loop;
 }
 
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
-	list_add_tail(&vbd->next, &server.vbds);
+	pthread_mutex_lock(&server.lock);
+	list_add_tail(&vbd->next, &td_loop->vbds);
+	td_loop->nr_vbds++;
+	pthread_mutex_unlock(&server.lock);
 }
 
 void
 tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
-	list_del(&vbd->next);
-	INIT_LIST_HEAD(&vbd->next);
+	pthread_mutex_lock(&server.lock);
+	if (!list_empty(&vbd->next)) {
+		list_del(&vbd->next);
+		INIT_LIST_HEAD(&vbd->next);
+		td_loop->nr_vbds--;
+	}
+	pthread_mutex_unlock(&server.lock);
+
 	tapdisk_server_check_state();
 }
 
+/* The loop with the fewest VBDs takes the next one. */
+tapdisk_loop_t *
+tapdisk_server_pick_loop(void)
+{
+	tapdisk_loop_t *loop, *best;
+	int i;
+
+	if (!server.nr_loops)
+		return &server.main;
+
+	pthread_mutex_lock(&server.lock);
+	best = &server.loops[0];
+	for (i = 1; i < server.nr_loops; i++) {
+		loop = &server.loops[i];
+		if (loop->nr_vbds < best->nr_vbds)
+			best = loop;
+	}
+	pthread_mutex_unlock(&server.lock);
+
+	return best;
+}
+
+static void
+tapdisk_loop_wake(tapdisk_loop_t *loop)
+{
+	char c = 0;
+
+	/* called from signal handlers; a full pipe wakes the loop anyway */
+	while (write(loop->wake[1], &c, 1) == -1 && errno == EINTR)
+		;
+}
+
+void
+tapdisk_server_call(tapdisk_loop_t *loop, void (*fn)(void *), void *arg)
+{
+	struct tapdisk_call call;
+
+	if (loop == td_loop) {
+		fn(arg);
+		return;
+	}
+
+	call.fn   = fn;
+	call.arg  = arg;
+	call.done = 0;
+
+	pthread_mutex_lock(&loop->lock);
+	list_add_tail(&call.next, &loop->calls);
+	pthread_mutex_unlock(&loop->lock);
+
+	tapdisk_loop_wake(loop);
+
+	pthread_mutex_lock(&loop->lock);
+	while (!call.done)
+		pthread_cond_wait(&loop->cond, &loop->lock);
+	pthread_mutex_unlock(&loop->lock);
+}
+
+struct tapdisk_walk {
+	void                       (*fn)(td_vbd_t *, void *);
+	void                        *arg;
+};
+
+static void
+tapdisk_server_walk_loop(void *private)
+{
+	struct tapdisk_walk *walk = private;
+	td_vbd_t *vbd, *tmp;
+
+	tapdisk_server_for_each_vbd(vbd, tmp)
+		walk->fn(vbd, walk->arg);
+}
+
+/* Calls fn for each VBD in turn, on the thread of the VBD's loop. */
+void
+tapdisk_server_walk_vbds(void (*fn)(td_vbd_t *, void *), void *arg)
+{
+	struct tapdisk_walk walk = { fn, arg };
+	tapdisk_loop_t *loop;
+	int i;
+
+	tapdisk_server_for_each_loop(loop, i)
+		tapdisk_server_call(loop, tapdisk_server_walk_loop, &walk);
+}
+
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tapdisk_queue_tiocb(&td_loop->aio_queue, tiocb);
+}
+
+/*
+ * The queue for a disk using I/O driver drv.  The io_uring queue is set
+ * up for the first disk asking for it; without it, disks use libaio.
+ */
+struct tqueue *
+tapdisk_server_get_queue(int drv)
+{
+	int err;
+
+	if (drv != TIO_DRV_URING)
+		return &td_loop->aio_queue;
+
+	if (!td_loop->uring_queue.tio) {
+		err = tapdisk_init_queue(&td_loop->uring_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_URING, NULL);
+		if (err) {
+			ERR(err, "io_uring unavailable, using libaio");
+			return &td_loop->aio_queue;
+		}
+	}
+
+	return &td_loop->uring_queue;
 }
 
 void
@@ -106,7 +277,9 @@ tapdisk_server_debug(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_debug_queue(&server.aio_queue);
+	tapdisk_debug_queue(&td_loop->aio_queue);
+	if (td_loop->uring_queue.tio)
+		tapdisk_debug_queue(&td_loop->uring_queue);
 
 	tapdisk_server_for_each_vbd(vbd, tmp)
 		tapdisk_vbd_debug(vbd);
@@ -117,28 +290,72 @@ tapdisk_server_debug(void)
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
+	tapdisk_loop_t *loop;
+	int i, n = 0;
+
+	pthread_mutex_lock(&server.lock);
+	tapdisk_server_for_each_loop(loop, i)
+		n += loop->nr_vbds;
+	pthread_mutex_unlock(&server.lock);
+
+	if (!n) {
 		server.run = 0;
+		if (td_loop != &server.main)
+			tapdisk_loop_wake(&server.main);
+	}
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      int timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
+	return scheduler_register_event(&td_loop->scheduler,
 					mode, fd, timeout, cb, data);
 }
 
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	return scheduler_unregister_event(&td_loop->scheduler, event);
 }
 
 void
 tapdisk_server_set_max_timeout(int seconds)
 {
-	scheduler_set_max_timeout(&server.scheduler, seconds);
+	scheduler_set_max_timeout(&td_loop->scheduler, seconds);
+}
+
+int
+tapdisk_server_nr_loops(void)
+{
+	return server.nr_loops + 1;
+}
+
+/*
+ * Loop 0 is the main thread's.  The counters are read without stopping
+ * the loop, so they are only as consistent as a sample needs to be.
+ */
+int
+tapdisk_server_get_loop_stats(int i, struct tapdisk_loop_stats *stats)
+{
+	tapdisk_loop_t *loop;
+	struct timeval now;
+
+	if (i < 0 || i > server.nr_loops)
+		return -ENOENT;
+
+	loop = tapdisk_server_loop(i);
+	gettimeofday(&now, NULL);
+
+	stats->id     = loop->id;
+	stats->vbds   = loop->nr_vbds;
+	stats->uptime = (now.tv_sec - loop->started.tv_sec) * 1000000ULL +
+		now.tv_usec - loop->started.tv_usec;
+	stats->idle   = scheduler_get_idle(&loop->scheduler);
+	stats->waits  = loop->scheduler.waits;
+	stats->events = loop->scheduler.dispatched;
+
+	return 0;
 }
 
 static void
@@ -174,7 +391,9 @@ tapdisk_server_check_progress(void)
 static void
 tapdisk_server_submit_tiocbs(void)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	tapdisk_submit_all_tiocbs(&td_loop->aio_queue);
+	if (td_loop->uring_queue.tio)
+		tapdisk_submit_all_tiocbs(&td_loop->uring_queue);
 }
 
 static void
@@ -205,23 +424,137 @@ tapdisk_server_stop_vbds(void)
 		tapdisk_vbd_kill_queue(vbd);
 }
 
-static int
-tapdisk_server_init_aio(void)
+static void
+tapdisk_server_handle_signals(int signals)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	td_vbd_t *vbd, *tmp;
+	static int xfsz_error_sent = 0;
+
+	if (signals & ((1 << SIGBUS) | (1 << SIGINT)))
+		tapdisk_server_for_each_vbd(vbd, tmp)
+			tapdisk_vbd_close(vbd);
+
+	if (signals & (1 << SIGXFSZ)) {
+		ERR(EFBIG, "received SIGXFSZ");
+		tapdisk_server_stop_vbds();
+		if (!xfsz_error_sent)
+			xfsz_error_sent = 1;
+	}
+
+	if (signals & (1 << SIGUSR1))
+		tapdisk_server_debug();
 }
 
 static void
-tapdisk_server_close_aio(void)
+tapdisk_loop_wake_event(event_id_t id, char mode, void *private)
 {
-	tapdisk_free_queue(&server.aio_queue);
+	tapdisk_loop_t *loop = private;
+	struct tapdisk_call *call;
+	char buf[64];
+	int signals;
+
+	while (read(loop->wake[0], buf, sizeof(buf)) == sizeof(buf))
+		;
+
+	signals = __sync_fetch_and_and(&loop->signals, 0);
+	if (signals)
+		tapdisk_server_handle_signals(signals);
+
+	pthread_mutex_lock(&loop->lock);
+	while (!list_empty(&loop->calls)) {
+		call = list_entry(loop->calls.next, struct tapdisk_call, next);
+		list_del(&call->next);
+		pthread_mutex_unlock(&loop->lock);
+
+		call->fn(call->arg);
+
+		pthread_mutex_lock(&loop->lock);
+		call->done = 1;
+		pthread_cond_broadcast(&loop->cond);
+	}
+	pthread_mutex_unlock(&loop->lock);
 }
 
 static void
-tapdisk_server_close(void)
+tapdisk_loop_close(tapdisk_loop_t *loop)
+{
+	tapdisk_loop_t *prev = td_loop;
+
+	/* the queues unregister their events from the current loop */
+	td_loop = loop;
+	tapdisk_free_queue(&loop->aio_queue);
+	tapdisk_free_queue(&loop->uring_queue);
+	td_loop = prev;
+
+	scheduler_destroy(&loop->scheduler);
+
+	if (loop->wake[0] != -1) {
+		close(loop->wake[0]);
+		close(loop->wake[1]);
+		loop->wake[0] = loop->wake[1] = -1;
+	}
+
+	pthread_cond_destroy(&loop->cond);
+	pthread_mutex_destroy(&loop->lock);
+}
+
+static int
+tapdisk_loop_init(tapdisk_loop_t *loop, int id)
 {
-	tapdisk_server_close_aio();
+	int err;
+
+	memset(loop, 0, sizeof(*loop));
+
+	loop->id      = id;
+	loop->wake[0] = loop->wake[1] = -1;
+	INIT_LIST_HEAD(&loop->vbds);
+	INIT_LIST_HEAD(&loop->calls);
+	pthread_mutex_init(&loop->lock, NULL);
+	pthread_cond_init(&loop->cond, NULL);
+	gettimeofday(&loop->started, NULL);
+
+	err = scheduler_initialize(&loop->scheduler);
+	if (err)
+		goto fail;
+
+	if (pipe(loop->wake)) {
+		err = -errno;
+		loop->wake[0] = loop->wake[1] = -1;
+		goto fail;
+	}
+
+	fcntl(loop->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(loop->wake[1], F_SETFL, O_NONBLOCK);
+	fcntl(loop->wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(loop->wake[1], F_SETFD, FD_CLOEXEC);
+
+	err = scheduler_register_event(&loop->scheduler,
+				       SCHEDULER_POLL_READ_FD,
+				       loop->wake[0], 0,
+				       tapdisk_loop_wake_event, loop);
+	if (err < 0)
+		goto fail;
+
+	loop->wake_event = err;
+	return 0;
+
+fail:
+	tapdisk_loop_close(loop);
+	return err;
+}
+
+static int
+tapdisk_loop_init_aio(tapdisk_loop_t *loop)
+{
+	tapdisk_loop_t *prev = td_loop;
+	int err;
+
+	td_loop = loop;
+	err = tapdisk_init_queue(&loop->aio_queue, TAPDISK_TIOCBS,
+				 TIO_DRV_LIO, NULL);
+	td_loop = prev;
+
+	return err;
 }
 
 void
@@ -233,7 +566,7 @@ tapdisk_server_iterate(void)
 	tapdisk_server_set_retry_timeout();
 	tapdisk_server_check_progress();
 
-	ret = scheduler_wait_for_events(&server.scheduler);
+	ret = scheduler_wait_for_events(&td_loop->scheduler);
 	if (ret < 0)
 		DBG(TLOG_WARN, "server wait returned %d\n", ret);
 
@@ -242,48 +575,147 @@ tapdisk_server_iterate(void)
 	tapdisk_server_kick_responses();
 }
 
-static void
-__tapdisk_server_run(void)
+static void *
+tapdisk_loop_thread(void *private)
 {
-	while (server.run)
+	tapdisk_loop_t *loop = private;
+
+	td_loop = loop;
+
+	while (loop->run)
 		tapdisk_server_iterate();
+
+	return NULL;
 }
 
 static void
-tapdisk_server_signal_handler(int signal)
+tapdisk_server_stop_loops(void)
 {
-	td_vbd_t *vbd, *tmp;
-	static int xfsz_error_sent = 0;
+	tapdisk_loop_t *loop;
+	int i;
 
-	switch (signal) {
-	case SIGBUS:
-	case SIGINT:
-		tapdisk_server_for_each_vbd(vbd, tmp)
-			tapdisk_vbd_close(vbd);
-		break;
+	for (i = 0; i < server.nr_loops; i++) {
+		loop = &server.loops[i];
 
-	case SIGXFSZ:
-		ERR(EFBIG, "received SIGXFSZ");
-		tapdisk_server_stop_vbds();
-		if (xfsz_error_sent)
+		if (loop->run) {
+			loop->run = 0;
+			tapdisk_loop_wake(loop);
+			pthread_join(loop->thread, NULL);
+		}
+
+		tapdisk_loop_close(loop);
+	}
+
+	free(server.loops);
+	server.loops    = NULL;
+	server.nr_loops = 0;
+}
+
+static int
+tapdisk_server_start_loops(int n)
+{
+	tapdisk_loop_t *loop;
+	sigset_t set, old;
+	int i, err;
+
+	if (!n)
+		return 0;
+
+	server.loops = calloc(n, sizeof(tapdisk_loop_t));
+	if (!server.loops)
+		return -ENOMEM;
+
+	/* signals are for the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 0; i < n; i++) {
+		loop = &server.loops[i];
+
+		err = tapdisk_loop_init(loop, i + 1);
+		if (err)
 			break;
 
-		xfsz_error_sent = 1;
-		break;
+		server.nr_loops++;
 
-	case SIGUSR1:
-		tapdisk_server_debug();
-		break;
+		err = tapdisk_loop_init_aio(loop);
+		if (err)
+			break;
+
+		loop->run = 1;
+		err = pthread_create(&loop->thread, NULL,
+				     tapdisk_loop_thread, loop);
+		if (err) {
+			loop->run = 0;
+			err = -err;
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err) {
+		ERR(err, "failed to start event loop %d", i + 1);
+		tapdisk_server_stop_loops();
 	}
+
+	return err;
+}
+
+static int threads;
+
+int
+tapdisk_server_set_threads(int n)
+{
+	if (n < 0 || n > TAPDISK_MAX_THREADS)
+		return -EINVAL;
+
+	threads = n;
+	return 0;
+}
+
+static void
+tapdisk_server_close(void)
+{
+	tapdisk_server_stop_loops();
+	tapdisk_loop_close(&server.main);
+}
+
+static void
+__tapdisk_server_run(void)
+{
+	while (server.run)
+		tapdisk_server_iterate();
+}
+
+static void
+tapdisk_server_signal_handler(int signal)
+{
+	tapdisk_loop_t *loop;
+	int i, err = errno;
+
+	/* each loop sees to its own VBDs */
+	tapdisk_server_for_each_loop(loop, i) {
+		__sync_fetch_and_or(&loop->signals, 1 << signal);
+		tapdisk_loop_wake(loop);
+	}
+
+	errno = err;
 }
 
 int
 tapdisk_server_init(void)
 {
+	int err;
+
 	memset(&server, 0, sizeof(server));
-	INIT_LIST_HEAD(&server.vbds);
+	pthread_mutex_init(&server.lock, NULL);
 
-	scheduler_initialize(&server.scheduler);
+	err = tapdisk_loop_init(&server.main, 0);
+	if (err)
+		return err;
+
+	td_loop = &server.main;
 
 	return 0;
 }
@@ -293,7 +725,11 @@ tapdisk_server_complete(void)
 {
 	int err;
 
-	err = tapdisk_server_init_aio();
+	err = tapdisk_loop_init_aio(&server.main);
+	if (err)
+		goto fail;
+
+	err = tapdisk_server_start_loops(threads);
 	if (err)
 		goto fail;
 
@@ -302,7 +738,7 @@ tapdisk_server_complete(void)
 	return 0;
 
 fail:
-	tapdisk_server_close_aio();
+	tapdisk_free_queue(&server.main.aio_queue);
 	return err;
 }
 
@@ -311,7 +747,9 @@ tapdisk_server_initialize(void)
 {
 	int err;
 
-	tapdisk_server_init();
+	err = tapdisk_server_init();
+	if (err)
+		return err;
 
 	err = tapdisk_server_complete();
 	if (err)
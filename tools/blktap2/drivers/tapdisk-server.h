@@ -28,20 +28,26 @@
 #ifndef _TAPDISK_SERVER_H_
 #define _TAPDISK_SERVER_H_
 
+#include <pthread.h>
+#include <sys/time.h>
+
 #include "list.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-queue.h"
 
+struct tapdisk_loop;
+
 struct tap_disk *tapdisk_server_find_driver_interface(int);
 
 td_image_t *tapdisk_server_get_shared_image(td_image_t *);
 
-struct list_head *tapdisk_server_get_all_vbds(void);
 td_vbd_t *tapdisk_server_get_vbd(td_uuid_t);
 void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
+void tapdisk_server_walk_vbds(void (*)(td_vbd_t *, void *), void *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
+struct tqueue *tapdisk_server_get_queue(int);
 
 void tapdisk_server_check_state(void);
 
@@ -49,6 +55,30 @@ event_id_t tapdisk_server_register_event(char, int, int, event_cb_t, void *);
 void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_set_max_timeout(int);
 
+/*
+ * With tapdisk_server_set_threads(n), n > 0, VBDs run on n event loops
+ * of their own, each on its own thread, and the main thread only serves
+ * the control socket.  Everything about a VBD happens on its loop: the
+ * control path hands work over with tapdisk_server_call(), which runs
+ * fn(arg) there and waits for it.
+ */
+struct tapdisk_loop *tapdisk_server_get_vbd_loop(td_uuid_t);
+struct tapdisk_loop *tapdisk_server_pick_loop(void);
+void tapdisk_server_call(struct tapdisk_loop *, void (*)(void *), void *);
+int tapdisk_server_set_threads(int);
+
+struct tapdisk_loop_stats {
+	int                          id;
+	int                          vbds;
+	uint64_t                     uptime;
+	uint64_t                     idle;
+	uint64_t                     waits;
+	uint64_t                     events;
+};
+
+int tapdisk_server_nr_loops(void);
+int tapdisk_server_get_loop_stats(int, struct tapdisk_loop_stats *);
+
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(void);
 int tapdisk_server_complete(void);
@@ -56,12 +86,38 @@ int tapdisk_server_run(void);
 void tapdisk_server_iterate(void);
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
+#define TAPDISK_MAX_THREADS          64
 
-typedef struct tapdisk_server {
+typedef struct tapdisk_loop {
+	int                          id;
 	int                          run;
-	struct list_head             vbds;
+	pthread_t                    thread;
+
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
+	struct tqueue                uring_queue;
+
+	struct list_head             vbds;
+	int                          nr_vbds;
+
+	int                          wake[2];
+	event_id_t                   wake_event;
+	int                          signals;
+
+	pthread_mutex_t              lock;
+	pthread_cond_t               cond;
+	struct list_head             calls;
+
+	struct timeval               started;
+} tapdisk_loop_t;
+
+typedef struct tapdisk_server {
+	int                          run;
+	pthread_mutex_t              lock;
+
+	tapdisk_loop_t               main;
+	tapdisk_loop_t              *loops;
+	int                          nr_loops;
 } tapdisk_server_t;
 
 #endif
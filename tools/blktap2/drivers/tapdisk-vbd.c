@@ -179,13 +179,23 @@ tapdisk_vbd_validate_chain(td_vbd_t *vbd)
 	return 0;
 }
 
-void
+/*
+ * returns -EBUSY, with the images not yet closed still on the vbd, if a
+ * driver has I/O of its own in flight.  try again once it completes;
+ * meanwhile the queue stays quiesced, as the chain is incomplete.
+ */
+int
 tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 {
+	int err;
 	td_image_t *image, *tmp;
 
 	tapdisk_vbd_for_each_image(vbd, image, tmp) {
-		td_close(image);
+		err = td_close(image);
+		if (err == -EBUSY) {
+			td_flag_set(vbd->state, TD_VBD_QUIESCED);
+			return err;
+		}
 		tapdisk_image_free(image);
 	}
 
@@ -193,6 +203,7 @@ tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 	td_flag_set(vbd->state, TD_VBD_CLOSED);
 
 	tapdisk_vbd_free_stack(vbd);
+	return 0;
 }
 
 static int
@@ -629,6 +640,16 @@ tapdisk_vbd_map_device(td_vbd_t *vbd, const char *devname)
 	ring->vstart =
 		(unsigned long)ring->mem + (BLKTAP_RING_PAGES * psize);
 
+	/* the data pages are where most I/O goes to and from */
+	if (td_flag_test(vbd->flags, TD_OPEN_URING)) {
+		err = tapdisk_queue_register_buffer(
+			tapdisk_server_get_queue(TIO_DRV_URING),
+			(void *)ring->vstart, MMAP_PAGES * psize);
+		if (err)
+			DPRINTF("%s: data pages not registered: %d\n",
+				devname, err);
+	}
+
 	ioctl(ring->fd, BLKTAP_IOCTL_SETMODE, BLKTAP_MODE_INTERPOSE);
 
 	return 0;
@@ -650,6 +671,11 @@ tapdisk_vbd_unmap_device(td_vbd_t *vbd)
 
 	psize = getpagesize();
 
+	if (vbd->ring.mem > 0 && td_flag_test(vbd->flags, TD_OPEN_URING))
+		tapdisk_queue_unregister_buffer(
+			tapdisk_server_get_queue(TIO_DRV_URING),
+			(void *)vbd->ring.vstart);
+
 	if (vbd->ring.fd != -1)
 		close(vbd->ring.fd);
 	if (vbd->ring.mem > 0)
@@ -753,6 +779,11 @@ tapdisk_vbd_shutdown(td_vbd_t *vbd)
 	if (!list_empty(&vbd->pending_requests))
 		return -EAGAIN;
 
+	if (tapdisk_vbd_close_vdi(vbd)) {
+		td_flag_set(vbd->state, TD_VBD_SHUTDOWN_REQUESTED);
+		return -EAGAIN;
+	}
+
 	tapdisk_vbd_kick(vbd);
 	tapdisk_vbd_queue_count(vbd, &new, &pending, &failed, &completed);
 
@@ -766,7 +797,6 @@ tapdisk_vbd_shutdown(td_vbd_t *vbd)
 		vbd->errors, vbd->retries, vbd->received, vbd->returned,
 		vbd->kicked);
 
-	tapdisk_vbd_close_vdi(vbd);
 	tapdisk_vbd_detach(vbd);
 	tapdisk_server_remove_vbd(vbd);
 	tapdisk_vbd_free(vbd);
@@ -961,7 +991,8 @@ tapdisk_vbd_pause(td_vbd_t *vbd)
 	if (err)
 		return err;
 
-	tapdisk_vbd_close_vdi(vbd);
+	if (tapdisk_vbd_close_vdi(vbd))
+		return -EAGAIN;
 
 	td_flag_clear(vbd->state, TD_VBD_PAUSE_REQUESTED);
 	td_flag_set(vbd->state, TD_VBD_PAUSED);
@@ -1352,6 +1383,28 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 	__tapdisk_vbd_complete_td_request(vbd, vreq, treq, res);
 }
 
+static void
+tapdisk_vbd_queue_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
+			     td_request_t treq)
+{
+	DBG(TLOG_DBG, "%s: req %d seg %d sec 0x%08"PRIx64" secs 0x%04x "
+	    "buf %p op %d\n", treq.image->name, (int)treq.id, treq.sidx,
+	    treq.sec, treq.secs, treq.buf, (int)vreq->req.operation);
+
+	vreq->secs_pending += treq.secs;
+	vbd->secs_pending  += treq.secs;
+
+	switch (treq.op) {
+	case TD_OP_WRITE:
+		td_queue_write(treq.image, treq);
+		break;
+
+	case TD_OP_READ:
+		td_queue_read(treq.image, treq);
+		break;
+	}
+}
+
 static int
 tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
@@ -1361,7 +1414,7 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	td_request_t treq;
 	uint64_t sector_nr;
 	blkif_request_t *req;
-	int i, err, id, nsects;
+	int i, err, id, nsects, merge;
 
 	req       = &vreq->req;
 	id        = req->id;
@@ -1369,6 +1422,16 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	sector_nr = req->sector_number;
 	image     = tapdisk_vbd_first_image(vbd);
 
+	/*
+	 * Segments the ring put back to back go down as one request.  The
+	 * block cache only caches single pages, and memshr shares them.
+	 */
+#ifdef MEMSHR
+	merge     = 0;
+#else
+	merge     = !td_flag_test(vbd->flags, TD_OPEN_ADD_CACHE);
+#endif
+
 	vreq->submitting = 1;
 	gettimeofday(&vbd->ts, NULL);
 	gettimeofday(&vreq->last_try, NULL);
@@ -1384,12 +1447,24 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	if (err)
 		goto fail;
 
+	treq.secs = 0;
+
 	for (i = 0; i < req->nr_segments; i++) {
 		nsects = req->seg[i].last_sect - req->seg[i].first_sect + 1;
 		page   = (char *)MMAP_VADDR(ring->vstart, 
 					   (unsigned long)req->id, i);
 		page  += (req->seg[i].first_sect << SECTOR_SHIFT);
 
+		if (merge && treq.secs &&
+		    treq.buf + (treq.secs << SECTOR_SHIFT) == page) {
+			treq.secs += nsects;
+			sector_nr += nsects;
+			continue;
+		}
+
+		if (treq.secs)
+			tapdisk_vbd_queue_td_request(vbd, vreq, treq);
+
 		treq.id             = id;
 		treq.sidx           = i;
 		treq.blocked        = 0;
@@ -1400,29 +1475,15 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		treq.cb             = tapdisk_vbd_complete_td_request;
 		treq.cb_data        = NULL;
 		treq.private        = vreq;
-
-		DBG(TLOG_DBG, "%s: req %d seg %d sec 0x%08"PRIx64" secs 0x%04x "
-		    "buf %p op %d\n", image->name, id, i, treq.sec, treq.secs,
-		    treq.buf, (int)req->operation);
-
-		vreq->secs_pending += nsects;
-		vbd->secs_pending  += nsects;
-
-		switch (req->operation)	{
-		case BLKIF_OP_WRITE:
-			treq.op = TD_OP_WRITE;
-			td_queue_write(image, treq);
-			break;
-
-		case BLKIF_OP_READ:
-			treq.op = TD_OP_READ;
-			td_queue_read(image, treq);
-			break;
-		}
+		treq.op             = (req->operation == BLKIF_OP_WRITE ?
+				       TD_OP_WRITE : TD_OP_READ);
 
 		sector_nr += nsects;
 	}
 
+	if (treq.secs)
+		tapdisk_vbd_queue_td_request(vbd, vreq, treq);
+
 	err = 0;
 
 out:
@@ -1601,7 +1662,10 @@ tapdisk_vbd_pause_ring(td_vbd_t *vbd)
 		return err;
 	}
 
-	tapdisk_vbd_close_vdi(vbd);
+	if (tapdisk_vbd_close_vdi(vbd)) {
+		EPRINTF("%s: ring pause request on busy images\n", vbd->name);
+		return -EAGAIN;
+	}
 
 	err = ioctl(vbd->ring.fd, BLKTAP2_IOCTL_PAUSE, 0);
 	if (err)
@@ -38,11 +38,17 @@
 #include "tapdisk-utils.h"
 #include "tapdisk-server.h"
 #include "tapdisk-control.h"
+#include "qcow.h"
+#include "block-cache.h"
+#include "block-vhd.h"
 
 static void
 usage(const char *app, int err)
 {
-	fprintf(stderr, "usage: %s [-D] <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "usage: %s [-D] [-q qcow L2 cache MB] "
+		"[-b shared block cache MB] [-m vhd bitmaps cached] "
+		"[-t event loop threads] "
+		"<-u uuid> <-c control socket>\n", app);
 	exit(err);
 }
 
@@ -55,7 +61,7 @@ main(int argc, char *argv[])
 	control  = NULL;
 	nodaemon = 0;
 
-	while ((c = getopt(argc, argv, "s:Dh")) != -1) {
+	while ((c = getopt(argc, argv, "s:q:b:m:t:Dh")) != -1) {
 		switch (c) {
 		case 'D':
 			nodaemon = 1;
@@ -63,6 +69,19 @@ main(int argc, char *argv[])
 		case 'h':
 			usage(argv[0], 0);
 			break;
+		case 'q':
+			qcow_set_l2_cache_size((size_t)atoi(optarg) << 20);
+			break;
+		case 'b':
+			block_cache_set_shared_size((size_t)atoi(optarg) << 20);
+			break;
+		case 'm':
+			vhd_set_bitmap_cache_size(atoi(optarg));
+			break;
+		case 't':
+			if (tapdisk_server_set_threads(atoi(optarg)))
+				usage(argv[0], EINVAL);
+			break;
 		case 's':
 #ifdef MEMSHR
 			memshr_set_domid(atoi(optarg));
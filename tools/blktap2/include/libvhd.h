@@ -101,7 +101,8 @@
 #define FAIL_RESIZE_DATA_MOVED     4
 #define FAIL_RESIZE_METADATA_MOVED 5
 #define FAIL_RESIZE_END            6
-#define NUM_FAIL_TESTS             7
+#define FAIL_COALESCE_CHECKPOINT   7
+#define NUM_FAIL_TESTS             8
 
 #ifdef ENABLE_FAILURE_TESTING
 #define TEST_FAIL_AT(point) \
@@ -289,6 +290,9 @@ int vhd_set_phys_size(vhd_context_t *, off_t);
 int vhd_bitmap_test(vhd_context_t *, char *, uint32_t);
 void vhd_bitmap_set(vhd_context_t *, char *, uint32_t);
 void vhd_bitmap_clear(vhd_context_t *, char *, uint32_t);
+uint32_t vhd_bitmap_span(vhd_context_t *, char *, uint32_t, uint32_t, int);
+uint32_t vhd_bitmap_find(vhd_context_t *, char *, uint32_t, uint32_t, int);
+void vhd_bitmap_set_range(vhd_context_t *, char *, uint32_t, uint32_t);
 
 int vhd_parent_locator_count(vhd_context_t *);
 int vhd_parent_locator_get(vhd_context_t *, char **);
@@ -322,5 +326,6 @@ int vhd_write_block(vhd_context_t *, uint32_t block, char *data);
 
 int vhd_io_read(vhd_context_t *, char *, uint64_t, uint32_t);
 int vhd_io_write(vhd_context_t *, char *, uint64_t, uint32_t);
+int vhd_io_allocate_block(vhd_context_t *, uint32_t);
 
 #endif
@@ -41,6 +41,7 @@
 #define TAPDISK_MESSAGE_FLAG_ADD_CACHE   0x04
 #define TAPDISK_MESSAGE_FLAG_VHD_INDEX   0x08
 #define TAPDISK_MESSAGE_FLAG_LOG_DIRTY   0x10
+#define TAPDISK_MESSAGE_FLAG_URING       0x20
 
 typedef struct tapdisk_message           tapdisk_message_t;
 typedef uint8_t                          tapdisk_message_flag_t;
@@ -50,6 +51,7 @@ typedef struct tapdisk_message_string    tapdisk_message_string_t;
 typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
+typedef struct tapdisk_message_loop      tapdisk_message_loop_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -88,6 +90,17 @@ struct tapdisk_message_list {
 	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
 };
 
+/* times in microseconds, since the loop started */
+struct tapdisk_message_loop {
+	int                              count;
+	int                              id;
+	int                              vbds;
+	uint64_t                         uptime;
+	uint64_t                         idle;
+	uint64_t                         waits;
+	uint64_t                         events;
+};
+
 struct tapdisk_message {
 	uint16_t                         type;
 	uint16_t                         cookie;
@@ -100,6 +113,7 @@ struct tapdisk_message {
 		tapdisk_message_minors_t minors;
 		tapdisk_message_response_t response;
 		tapdisk_message_list_t   list;
+		tapdisk_message_loop_t   loop;
 	} u;
 };
 
@@ -126,6 +140,8 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_LIST_RSP,
 	TAPDISK_MESSAGE_FORCE_SHUTDOWN,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_LOOPS,
+	TAPDISK_MESSAGE_LOOPS_RSP,
 };
 
 static inline char *
@@ -195,6 +211,12 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_LOOPS:
+		return "loops";
+
+	case TAPDISK_MESSAGE_LOOPS_RSP:
+		return "loops response";
+
 	default:
 		return "unknown";
 	}
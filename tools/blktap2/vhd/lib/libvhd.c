@@ -37,6 +37,9 @@
 #include <iconv.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "libvhd.h"
 #include "relative-path.h"
@@ -71,7 +74,8 @@ const char* ENV_VAR_FAIL[NUM_FAIL_TESTS] = {
 	"VHD_UTIL_TEST_FAIL_RESIZE_BEGIN",
 	"VHD_UTIL_TEST_FAIL_RESIZE_DATA_MOVED",
 	"VHD_UTIL_TEST_FAIL_RESIZE_METADATA_MOVED",
-	"VHD_UTIL_TEST_FAIL_RESIZE_END"
+	"VHD_UTIL_TEST_FAIL_RESIZE_END",
+	"VHD_UTIL_TEST_FAIL_COALESCE_CHECKPOINT"
 };
 int TEST_FAIL[NUM_FAIL_TESTS];
 #endif // ENABLE_FAILURE_TESTING
@@ -592,6 +596,152 @@ vhd_bitmap_clear(vhd_context_t *ctx, char *map, uint32_t block)
 	return clear_bit(map, block);
 }
 
+/*
+ * Run scanning.  In VHD bitmaps bit 0 is the top bit of byte 0, so a
+ * big-endian load of 8 bytes holds 64 bits in order and the length of
+ * a run is a count of leading zeros.  Uniform stretches are skipped 16
+ * bytes at a time with SSE2.  Maps are never read past the byte holding
+ * bit end - 1, so they needn't be padded or aligned.
+ *
+ * Old tapdisk bitmaps are host-endian 32-bit words, least significant
+ * bit first, and are scanned a word at a time.
+ */
+static uint32_t
+__bitmap_scan(const char *map, uint32_t i, uint32_t end, int value)
+{
+	uint64_t w, inv;
+	unsigned char b;
+
+	for (; i < end && (i & 7); i++)
+		if (test_bit((char *)map, i) != value)
+			return i;
+
+	inv = value ? ~0ULL : 0;
+
+#ifdef __SSE2__
+	{
+		__m128i pat = _mm_set1_epi8(value ? 0xff : 0);
+
+		for (; i + 128 <= end; i += 128) {
+			__m128i v = _mm_loadu_si128((const __m128i *)
+						    (map + (i >> 3)));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, pat)) != 0xffff)
+				break;
+		}
+	}
+#endif
+
+	for (; i + 64 <= end; i += 64) {
+		memcpy(&w, map + (i >> 3), sizeof(w));
+		BE64_IN(&w);
+		w ^= inv;
+		if (w)
+			return i + __builtin_clzll(w);
+	}
+
+	for (; i + 8 <= end; i += 8) {
+		b = (unsigned char)map[i >> 3] ^ (unsigned char)inv;
+		if (b)
+			return i + __builtin_clz(b) - 24;
+	}
+
+	for (; i < end; i++)
+		if (test_bit((char *)map, i) != value)
+			return i;
+
+	return end;
+}
+
+static uint32_t
+__old_bitmap_scan(const char *map, uint32_t i, uint32_t end, int value)
+{
+	uint32_t w, inv;
+
+	for (; i < end && (i & 31); i++)
+		if (old_test_bit((char *)map, i) != value)
+			return i;
+
+	inv = value ? ~0U : 0;
+
+	for (; i + 32 <= end; i += 32) {
+		w = ((const uint32_t *)map)[i >> 5] ^ inv;
+		if (w)
+			return i + __builtin_ctz(w);
+	}
+
+	for (; i < end; i++)
+		if (old_test_bit((char *)map, i) != value)
+			return i;
+
+	return end;
+}
+
+static inline int
+vhd_bitmap_old(vhd_context_t *ctx)
+{
+	return (ctx && vhd_creator_tapdisk(ctx) &&
+		ctx->footer.crtr_ver == 0x00000001);
+}
+
+/*
+ * returns the number of bits from @start, up to @end, that are @value.
+ */
+uint32_t
+vhd_bitmap_span(vhd_context_t *ctx, char *map,
+		uint32_t start, uint32_t end, int value)
+{
+	if (start >= end)
+		return 0;
+
+	if (vhd_bitmap_old(ctx))
+		return __old_bitmap_scan(map, start, end, !!value) - start;
+
+	return __bitmap_scan(map, start, end, !!value) - start;
+}
+
+/*
+ * returns the first bit from @start, up to @end, that is @value,
+ * or @end if there is none.
+ */
+uint32_t
+vhd_bitmap_find(vhd_context_t *ctx, char *map,
+		uint32_t start, uint32_t end, int value)
+{
+	if (start >= end)
+		return end;
+
+	if (vhd_bitmap_old(ctx))
+		return __old_bitmap_scan(map, start, end, !value);
+
+	return __bitmap_scan(map, start, end, !value);
+}
+
+void
+vhd_bitmap_set_range(vhd_context_t *ctx, char *map,
+		     uint32_t start, uint32_t count)
+{
+	uint32_t i, end;
+
+	end = start + count;
+
+	if (vhd_bitmap_old(ctx)) {
+		for (i = start; i < end; i++)
+			old_set_bit(map, i);
+		return;
+	}
+
+	for (i = start; i < end && (i & 7); i++)
+		set_bit(map, i);
+
+	if (i + 8 <= end) {
+		memset(map + (i >> 3), 0xff, (end - i) >> 3);
+		i += (end - i) & ~7U;
+	}
+
+	for (; i < end; i++)
+		set_bit(map, i);
+}
+
 /*
  * returns absolute offset of the first 
  * byte of the file which is not vhd metadata
@@ -2963,21 +3113,32 @@ __vhd_io_dynamic_copy_data(vhd_context_t *ctx,
 			   char *bitmap, int bitmap_off,
 			   char *dst, char *src, int secs)
 {
-	int i;
+	uint32_t i, n, end;
 
-	for (i = 0; i < secs; i++) {
-		if (test_bit(map, map_off + i))
-			goto next;
+	i   = map_off;
+	end = map_off + secs;
 
-		if (ctx && !vhd_bitmap_test(ctx, bitmap, bitmap_off + i))
-			goto next;
+	/* copy each run still missing from @map and present in @bitmap */
+	while ((i = vhd_bitmap_find(NULL, map, i, end, 0)) < end) {
+		n = vhd_bitmap_span(NULL, map, i, end, 0);
 
-		memcpy(dst, src, VHD_SECTOR_SIZE);
-		set_bit(map, map_off + i);
+		if (ctx) {
+			int off = bitmap_off + (i - map_off);
 
-	next:
-		src += VHD_SECTOR_SIZE;
-		dst += VHD_SECTOR_SIZE;
+			if (!vhd_bitmap_test(ctx, bitmap, off)) {
+				i += vhd_bitmap_span(ctx, bitmap,
+						     off, off + n, 0);
+				continue;
+			}
+
+			n = vhd_bitmap_span(ctx, bitmap, off, off + n, 1);
+		}
+
+		memcpy(dst + vhd_sectors_to_bytes(i - map_off),
+		       src + vhd_sectors_to_bytes(i - map_off),
+		       vhd_sectors_to_bytes(n));
+		vhd_bitmap_set_range(NULL, map, i, n);
+		i += n;
 	}
 }
 
@@ -3088,7 +3249,6 @@ __vhd_io_dynamic_read(vhd_context_t *ctx,
 		      char *buf, uint64_t sec, uint32_t secs)
 {
 	int err;
-	uint32_t i, done;
 	char *map, *next;
 	vhd_context_t parent, *vhd;
 
@@ -3109,11 +3269,7 @@ __vhd_io_dynamic_read(vhd_context_t *ctx,
 		if (err)
 			goto close;
 
-		for (done = 0, i = 0; i < secs; i++)
-			if (test_bit(map, i))
-				done++;
-
-		if (done == secs) {
+		if (vhd_bitmap_span(NULL, map, 0, secs, 1) == secs) {
 			err = 0;
 			goto close;
 		}
@@ -3231,6 +3387,35 @@ out:
 	return err;
 }
 
+/*
+ * allocates @block in a dynamic disk, if it isn't already, for callers
+ * that write block data themselves.  the block's bitmap is left clear.
+ */
+int
+vhd_io_allocate_block(vhd_context_t *ctx, uint32_t block)
+{
+	int err;
+
+	if (!vhd_type_dynamic(ctx))
+		return -EINVAL;
+
+	err = vhd_get_bat(ctx);
+	if (err)
+		return err;
+
+	if (block >= ctx->bat.entries)
+		return -ERANGE;
+
+	if (ctx->bat.bat[block] != DD_BLK_UNUSED)
+		return 0;
+
+	err = __vhd_io_allocate_block(ctx, block);
+	if (err)
+		return err;
+
+	return vhd_write_footer(ctx, &ctx->footer);
+}
+
 static int
 __vhd_io_dynamic_write(vhd_context_t *ctx,
 		       char *buf, uint64_t sector, uint32_t secs)
@@ -3238,7 +3423,7 @@ __vhd_io_dynamic_write(vhd_context_t *ctx,
 	char *map;
 	off_t off;
 	uint32_t blk, sec;
-	int i, err, cnt, ret;
+	int err, cnt, ret;
 
 	if (vhd_sectors_to_bytes(sector + secs) > ctx->footer.curr_size)
 		return -ERANGE;
@@ -3284,19 +3469,18 @@ __vhd_io_dynamic_write(vhd_context_t *ctx,
 		if (err)
 			return err;
 
-		for (i = 0; i < cnt; i++)
-			vhd_bitmap_set(ctx, map, sec + i);
+		vhd_bitmap_set_range(ctx, map, sec, cnt);
 
 		err = vhd_write_bitmap(ctx, blk, map);
 		if (err)
 			goto fail;
 
 		if (vhd_has_batmap(ctx)) {
-			for (i = 0; i < ctx->spb; i++)
-				if (!vhd_bitmap_test(ctx, map, i)) {
-					free(map);
-					goto next;
-				}
+			if (vhd_bitmap_span(ctx, map, 0, ctx->spb, 1) !=
+			    ctx->spb) {
+				free(map);
+				goto next;
+			}
 
 			vhd_batmap_set(ctx, &ctx->batmap, blk);
 			err = vhd_write_batmap(ctx, &ctx->batmap);
@@ -0,0 +1,229 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * Sector bitmap scanning, bit by bit against vhd_bitmap_find/span: every
+ * allocated run of a block's bitmap is enumerated, as coalesce and the
+ * read paths do, for a few typical fill patterns.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include "libvhd.h"
+
+static const char *program;
+
+static void
+usage(FILE *stream)
+{
+	fprintf(stream, "usage: %s [-s sectors per block] [-n iterations] "
+		"[-o] [-h]\n", program);
+	fprintf(stream, "  -o uses the old tapdisk bitmap format\n");
+}
+
+static uint64_t
+usecs(struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static void
+fill_runs(vhd_context_t *ctx, char *map, uint32_t spb, uint32_t avg)
+{
+	uint32_t i, n;
+	int value;
+
+	value = 0;
+	for (i = 0; i < spb; i += n) {
+		n = 1 + random() % (2 * avg);
+		if (n > spb - i)
+			n = spb - i;
+		if (value)
+			vhd_bitmap_set_range(ctx, map, i, n);
+		value = !value;
+	}
+}
+
+static uint64_t
+scan_bitwise(vhd_context_t *ctx, char *map, uint32_t spb, uint64_t *runs)
+{
+	uint64_t secs;
+	uint32_t i, n;
+
+	secs = 0;
+	for (i = 0; i < spb; i++) {
+		if (!vhd_bitmap_test(ctx, map, i))
+			continue;
+
+		for (n = 0; i + n < spb; n++)
+			if (!vhd_bitmap_test(ctx, map, i + n))
+				break;
+
+		secs += n;
+		(*runs)++;
+		i += n;
+	}
+
+	return secs;
+}
+
+static uint64_t
+scan_span(vhd_context_t *ctx, char *map, uint32_t spb, uint64_t *runs)
+{
+	uint64_t secs;
+	uint32_t i, n;
+
+	secs = 0;
+	for (i = 0; i < spb; i += n) {
+		i = vhd_bitmap_find(ctx, map, i, spb, 1);
+		if (i >= spb)
+			break;
+
+		n = vhd_bitmap_span(ctx, map, i, spb, 1);
+		secs += n;
+		(*runs)++;
+	}
+
+	return secs;
+}
+
+static double
+bench_scan(uint64_t (*scan)(vhd_context_t *, char *, uint32_t, uint64_t *),
+	   vhd_context_t *ctx, char *map, uint32_t spb, int count,
+	   uint64_t *secs, uint64_t *runs)
+{
+	struct timeval t0, t1;
+	int i;
+
+	*secs = *runs = 0;
+
+	gettimeofday(&t0, NULL);
+	for (i = 0; i < count; i++)
+		*secs += scan(ctx, map, spb, runs);
+	gettimeofday(&t1, NULL);
+
+	return (double)(usecs(&t1) - usecs(&t0)) * 1000 / count;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		uint32_t    avg;
+		int         fill;
+	} patterns[] = {
+		{ "empty",  0,   0 },
+		{ "full",   0,   1 },
+		{ "runs",   256, 2 },
+		{ "sparse", 4,   2 },
+	};
+	uint64_t secs0, secs1, runs0, runs1;
+	int c, i, count, old, err;
+	double t0, t1;
+	vhd_context_t ctx;
+	uint32_t spb;
+	char *map;
+
+	program = basename(argv[0]);
+
+	spb   = 4096;
+	count = 100000;
+	old   = 0;
+
+	while ((c = getopt(argc, argv, "s:n:oh")) != -1) {
+		switch (c) {
+		case 's':
+			spb = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'o':
+			old = 1;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return EINVAL;
+		}
+	}
+
+	if (!spb || count <= 0 || (old && (spb & 31))) {
+		usage(stderr);
+		return EINVAL;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	if (old) {
+		memcpy(ctx.footer.crtr_app, "tap", 3);
+		ctx.footer.crtr_ver = 0x00000001;
+	}
+
+	map = malloc((spb + 31) / 8);
+	if (!map)
+		return ENOMEM;
+
+	err = 0;
+	srandom(1);
+
+	for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+		memset(map, 0, (spb + 31) / 8);
+		if (patterns[i].fill == 1)
+			vhd_bitmap_set_range(&ctx, map, 0, spb);
+		else if (patterns[i].fill == 2)
+			fill_runs(&ctx, map, spb, patterns[i].avg);
+
+		t0 = bench_scan(scan_bitwise, &ctx, map, spb, count,
+				&secs0, &runs0);
+		t1 = bench_scan(scan_span, &ctx, map, spb, count,
+				&secs1, &runs1);
+
+		if (secs0 != secs1 || runs0 != runs1) {
+			fprintf(stderr, "%s: %s: mismatch: %"PRIu64"/%"PRIu64
+				" sectors, %"PRIu64"/%"PRIu64" runs\n",
+				program, patterns[i].name,
+				secs0, secs1, runs0, runs1);
+			err = EIO;
+		}
+
+		printf("%-6s %"PRIu64" runs/block: bitwise %.1fns, "
+		       "span %.1fns, %.1fx\n", patterns[i].name,
+		       runs0 / count, t0, t1, t0 / t1);
+	}
+
+	free(map);
+	return err;
+}
@@ -0,0 +1,377 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Coalesce, then verify: a child full of random writes over a parent
+ * full of others is coalesced into a dynamic and into a raw parent, and
+ * the parent's contents checked against a model of what was written.
+ * The first run is killed at a checkpoint past half way through, and a
+ * second run resumes from that checkpoint.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/wait.h>
+
+#include "libvhd.h"
+#include "vhd-util.h"
+
+#define TEST_MAX_SECS       4096
+
+TEST_FAIL_EXTERN_VARS;
+
+static const char *program;
+
+struct test {
+	const char      *name;
+	int              raw;
+	uint64_t         secs;
+	char            *model;
+	char            *buf;
+	char             parent[256];
+	char             child[256];
+	char             checkpoint[256];
+};
+
+static void
+usage(FILE *stream)
+{
+	fprintf(stream, "usage: %s [-d directory] [-s size MB] [-h]\n",
+		program);
+}
+
+/* @count writes of random runs, @full of them whole 2MB blocks */
+static int
+scribble(struct test *t, vhd_context_t *ctx, int fd, int count, int full)
+{
+	uint64_t sec;
+	uint32_t n, i;
+	int k, err;
+
+	for (k = 0; k < count; k++) {
+		if (k < full) {
+			sec = (random() % (t->secs / TEST_MAX_SECS)) *
+				TEST_MAX_SECS;
+			n   = TEST_MAX_SECS;
+		} else {
+			sec = random() % t->secs;
+			n   = 1 + random() % (random() % 4 ? 40 : 3000);
+			if (sec + n > t->secs)
+				n = t->secs - sec;
+		}
+
+		for (i = 0; i < vhd_sectors_to_bytes(n); i += sizeof(long))
+			*(long *)(t->buf + i) = random();
+
+		memcpy(t->model + vhd_sectors_to_bytes(sec), t->buf,
+		       vhd_sectors_to_bytes(n));
+
+		if (ctx)
+			err = vhd_io_write(ctx, t->buf, sec, n);
+		else if (pwrite(fd, t->buf, vhd_sectors_to_bytes(n),
+				vhd_sectors_to_bytes(sec)) !=
+			 vhd_sectors_to_bytes(n))
+			err = -errno;
+		else
+			err = 0;
+
+		if (err) {
+			fprintf(stderr, "%s: %s: write %"PRIu64"+%u: %d\n",
+				program, t->name, sec, n, err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static int
+setup(struct test *t)
+{
+	vhd_context_t ctx;
+	int fd, err;
+
+	if (t->raw) {
+		fd = open(t->parent, O_CREAT | O_TRUNC | O_RDWR, 0644);
+		if (fd == -1)
+			return -errno;
+		err = 0;
+		if (ftruncate(fd, vhd_sectors_to_bytes(t->secs)))
+			err = -errno;
+		if (!err)
+			err = scribble(t, NULL, fd, 300, 0);
+		close(fd);
+	} else {
+		err = vhd_create(t->parent, vhd_sectors_to_bytes(t->secs),
+				 HD_TYPE_DYNAMIC, 0);
+		if (err)
+			return err;
+		err = vhd_open(&ctx, t->parent, VHD_OPEN_RDWR);
+		if (err)
+			return err;
+		err = scribble(t, &ctx, -1, 300, 3);
+		vhd_close(&ctx);
+	}
+	if (err)
+		return err;
+
+	err = vhd_snapshot(t->child, vhd_sectors_to_bytes(t->secs),
+			   t->parent, t->raw ? VHD_FLAG_CREAT_PARENT_RAW : 0);
+	if (err)
+		return err;
+
+	err = vhd_open(&ctx, t->child, VHD_OPEN_RDWR);
+	if (err)
+		return err;
+	err = scribble(t, &ctx, -1, 600, 4);
+	vhd_close(&ctx);
+
+	return err;
+}
+
+static int
+coalesce(struct test *t)
+{
+	char *argv[] = { "coalesce", "-n", t->child, "-c", t->checkpoint,
+			 "-i", "0", "-q", "4", NULL };
+
+	return vhd_util_coalesce(sizeof(argv) / sizeof(argv[0]) - 1, argv);
+}
+
+/* the first run dies at a checkpoint past the middle of the child */
+static int
+interrupt(struct test *t)
+{
+	char uuid[37];
+	uint32_t blk, entries;
+	int status, n;
+	FILE *f;
+	pid_t pid;
+
+	fflush(stdout);
+
+	pid = fork();
+	if (pid == -1)
+		return -errno;
+
+	if (!pid) {
+		TEST_FAIL[FAIL_COALESCE_CHECKPOINT] = 1;
+		exit(coalesce(t) ? 1 : 0);
+	}
+
+	if (waitpid(pid, &status, 0) == -1)
+		return -errno;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EINVAL) {
+		fprintf(stderr, "%s: %s: interrupted run exited %#x\n",
+			program, t->name, status);
+		return -EIO;
+	}
+
+	f = fopen(t->checkpoint, "r");
+	if (!f) {
+		fprintf(stderr, "%s: %s: no checkpoint\n", program, t->name);
+		return -ENOENT;
+	}
+	n = fscanf(f, "%36s %u %u", uuid, &blk, &entries);
+	fclose(f);
+
+	if (n != 3 || blk <= entries / 2 || blk >= entries) {
+		fprintf(stderr, "%s: %s: bad checkpoint\n", program, t->name);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int
+verify(struct test *t)
+{
+	vhd_context_t ctx;
+	char *check[] = { "check", "-n", t->parent, NULL };
+	uint64_t sec, bad, first;
+	int fd, err;
+
+	if (t->raw) {
+		fd = open(t->parent, O_RDONLY);
+		if (fd == -1)
+			return -errno;
+		err = 0;
+		if (pread(fd, t->buf, vhd_sectors_to_bytes(t->secs), 0) !=
+		    vhd_sectors_to_bytes(t->secs))
+			err = -EIO;
+		close(fd);
+	} else {
+		err = vhd_util_check(3, check);
+		if (err) {
+			fprintf(stderr, "%s: %s: check failed: %d\n",
+				program, t->name, err);
+			return err;
+		}
+
+		err = vhd_open(&ctx, t->parent, VHD_OPEN_RDONLY);
+		if (err)
+			return err;
+		err = vhd_io_read(&ctx, t->buf, 0, t->secs);
+		vhd_close(&ctx);
+	}
+	if (err)
+		return err;
+
+	bad = first = 0;
+	for (sec = 0; sec < t->secs; sec++)
+		if (memcmp(t->buf + vhd_sectors_to_bytes(sec),
+			   t->model + vhd_sectors_to_bytes(sec),
+			   VHD_SECTOR_SIZE))
+			if (!bad++)
+				first = sec;
+
+	if (bad) {
+		fprintf(stderr, "%s: %s: %"PRIu64" sectors differ, first "
+			"%"PRIu64"\n", program, t->name, bad, first);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int
+run(struct test *t, const char *dir)
+{
+	int err;
+
+	snprintf(t->parent, sizeof(t->parent), "%s/coalesce-test.%d.parent",
+		 dir, getpid());
+	snprintf(t->child, sizeof(t->child), "%s/coalesce-test.%d.child",
+		 dir, getpid());
+	snprintf(t->checkpoint, sizeof(t->checkpoint),
+		 "%s/coalesce-test.%d.checkpoint", dir, getpid());
+
+	memset(t->model, 0, vhd_sectors_to_bytes(t->secs));
+
+	err = setup(t);
+	if (err) {
+		fprintf(stderr, "%s: %s: setup failed: %d\n",
+			program, t->name, err);
+		goto out;
+	}
+
+	err = interrupt(t);
+	if (err)
+		goto out;
+
+	err = coalesce(t);
+	if (err) {
+		fprintf(stderr, "%s: %s: resumed coalesce failed: %d\n",
+			program, t->name, err);
+		goto out;
+	}
+
+	if (!access(t->checkpoint, F_OK)) {
+		fprintf(stderr, "%s: %s: checkpoint left behind\n",
+			program, t->name);
+		err = -EEXIST;
+		goto out;
+	}
+
+	err = verify(t);
+
+out:
+	printf("%s: %s\n", t->name, err ? "FAILED" : "ok");
+	unlink(t->parent);
+	unlink(t->child);
+	unlink(t->checkpoint);
+	return err;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct test tests[] = {
+		{ .name = "dynamic parent", .raw = 0 },
+		{ .name = "raw parent",     .raw = 1 },
+	};
+	const char *dir;
+	uint64_t size;
+	int c, i, err;
+	char *model, *buf;
+
+	program = basename(argv[0]);
+
+	dir  = "/tmp";
+	size = 64;
+
+	while ((c = getopt(argc, argv, "d:s:h")) != -1) {
+		switch (c) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return EINVAL;
+		}
+	}
+
+	/* at least a few 2MB blocks */
+	if (size < 8 || optind != argc) {
+		usage(stderr);
+		return EINVAL;
+	}
+
+	size <<= 20;
+
+	model = malloc(size);
+	err   = posix_memalign((void **)&buf, VHD_SECTOR_SIZE, size);
+	if (!model || err)
+		return ENOMEM;
+
+	srandom(1);
+
+	err = 0;
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		tests[i].secs  = size >> VHD_SECTOR_SHIFT;
+		tests[i].model = model;
+		tests[i].buf   = buf;
+
+		if (run(tests + i, dir))
+			err = EIO;
+	}
+
+	free(model);
+	free(buf);
+	return err;
+}
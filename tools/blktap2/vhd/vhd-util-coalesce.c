@@ -0,0 +1,785 @@
+/* Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libaio.h>
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include "libvhd.h"
+
+TEST_FAIL_EXTERN_VARS;
+
+/*
+ * Child blocks are read whole, bitmap and data in one request, up to
+ * 'depth' at a time.  Their allocated runs are written to the parent
+ * in block order, and a block is retired only once all of its writes
+ * are done.  Retiring a block updates the parent's bitmap in memory;
+ * the bitmaps, and the batmap, are written out together when
+ * VHD_COALESCE_BITMAPS have piled up and at each sync.  With a
+ * checkpoint file, the parent is synced every 'interval' seconds and
+ * the next block to retire is recorded; a later run given the same
+ * file resumes from there.  Writing a block to the parent twice is
+ * harmless.
+ */
+
+#define VHD_COALESCE_DEPTH            8
+#define VHD_COALESCE_MAX_DEPTH        256
+#define VHD_COALESCE_AIO_EVENTS       256
+#define VHD_COALESCE_BITMAPS          1024
+#define VHD_COALESCE_CHECKPOINT_SECS  10
+
+enum {
+	COALESCE_READING = 1,
+	COALESCE_READ,
+	COALESCE_WRITING,
+	COALESCE_WRITTEN,
+};
+
+struct coalesce_slot {
+	uint32_t                   blk;
+	int                        fresh;     /* parent block allocated */
+	int                        state;
+	int                        pending;
+	int                        error;
+	char                      *buf;
+	struct iocb               *iocbs;
+};
+
+struct coalesce {
+	vhd_context_t             *vhd;
+	vhd_context_t             *parent;
+	int                        parent_fd;
+
+	io_context_t               aio;
+	struct io_event           *events;
+	struct iocb              **queue;
+	int                        queued;
+	int                        inflight;
+
+	struct coalesce_slot      *slots;
+	int                        depth;
+	uint64_t                   rd;        /* next slot to read into */
+	uint64_t                   wr;        /* next slot to write out */
+	uint64_t                   rt;        /* next slot to retire */
+	uint32_t                   next;      /* next block to read */
+	uint32_t                   done;      /* blocks before this are in */
+	int                        error;
+
+	/* parent bitmaps not yet written */
+	uint32_t                  *bitmap_blks;
+	char                      *bitmaps;
+	size_t                     bitmap_size;
+	int                        nr_bitmaps;
+	int                        batmap_dirty;
+
+	const char                *checkpoint;
+	int                        interval;
+	struct timeval             synced;
+
+	uint64_t                   blocks;
+	uint64_t                   bytes;
+};
+
+static inline struct coalesce_slot *
+coalesce_slot(struct coalesce *co, uint64_t seq)
+{
+	return co->slots + seq % co->depth;
+}
+
+static inline int
+coalesce_full(vhd_context_t *vhd, uint32_t blk)
+{
+	return vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, blk);
+}
+
+static inline void
+coalesce_queue(struct coalesce *co, struct iocb *iocb)
+{
+	co->queue[co->queued++] = iocb;
+}
+
+static int
+coalesce_submit(struct coalesce *co)
+{
+	int ret;
+
+	while (co->queued) {
+		ret = io_submit(co->aio, co->queued, co->queue);
+		if (ret == -EAGAIN && co->inflight)
+			break;
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			break;
+
+		co->queued   -= ret;
+		co->inflight += ret;
+		memmove(co->queue, co->queue + ret,
+			co->queued * sizeof(struct iocb *));
+	}
+
+	return 0;
+}
+
+static int
+coalesce_reap(struct coalesce *co)
+{
+	struct coalesce_slot *slot;
+	struct iocb *iocb;
+	long res;
+	int i, n;
+
+	n = io_getevents(co->aio, 1, VHD_COALESCE_AIO_EVENTS,
+			 co->events, NULL);
+	if (n == -EINTR)
+		return 0;
+	if (n < 0)
+		return n;
+
+	for (i = 0; i < n; i++) {
+		iocb = co->events[i].obj;
+		slot = iocb->data;
+		res  = co->events[i].res;
+
+		co->inflight--;
+
+		if (res != iocb->u.c.nbytes && !slot->error)
+			slot->error = (res < 0 ? (int)res : -EIO);
+
+		if (--slot->pending)
+			continue;
+
+		if (slot->state == COALESCE_READING)
+			slot->state = COALESCE_READ;
+		else
+			slot->state = COALESCE_WRITTEN;
+	}
+
+	return 0;
+}
+
+static void
+coalesce_read(struct coalesce *co)
+{
+	vhd_context_t *vhd;
+	struct coalesce_slot *slot;
+	struct iocb *iocb;
+	uint32_t blk;
+
+	vhd = co->vhd;
+
+	while (co->rd - co->rt < co->depth && co->next < vhd->bat.entries) {
+		blk = co->next++;
+		if (vhd->bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+
+		slot          = coalesce_slot(co, co->rd++);
+		slot->blk     = blk;
+		slot->state   = COALESCE_READING;
+		slot->pending = 1;
+		slot->error   = 0;
+
+		iocb = slot->iocbs;
+		io_prep_pread(iocb, vhd->fd, slot->buf,
+			      vhd_sectors_to_bytes(vhd->bm_secs + vhd->spb),
+			      vhd_sectors_to_bytes(vhd->bat.bat[blk]));
+		iocb->data = slot;
+		coalesce_queue(co, iocb);
+	}
+}
+
+static int
+coalesce_write(struct coalesce *co, struct coalesce_slot *slot)
+{
+	vhd_context_t *vhd, *parent;
+	struct iocb *iocb;
+	uint32_t i, n, spb;
+	uint64_t sec, off;
+	char *map, *data;
+	int fd, err, full;
+
+	vhd    = co->vhd;
+	parent = co->parent;
+	spb    = vhd->spb;
+	map    = slot->buf;
+	data   = slot->buf + vhd_sectors_to_bytes(vhd->bm_secs);
+	sec    = (uint64_t)slot->blk * spb;
+	full   = coalesce_full(vhd, slot->blk);
+
+	if (!parent->file) {
+		fd  = co->parent_fd;
+		off = sec;
+	} else if (vhd_type_dynamic(parent)) {
+		slot->fresh = (parent->bat.bat[slot->blk] == DD_BLK_UNUSED);
+
+		err = vhd_io_allocate_block(parent, slot->blk);
+		if (err)
+			return err;
+
+		fd  = parent->fd;
+		off = parent->bat.bat[slot->blk] + parent->bm_secs;
+	} else {
+		if (vhd_sectors_to_bytes(sec + spb) > parent->footer.curr_size)
+			return -ERANGE;
+
+		fd  = parent->fd;
+		off = sec;
+	}
+
+	slot->state   = COALESCE_WRITING;
+	slot->pending = 0;
+
+	for (i = 0; i < spb; i += n) {
+		if (full)
+			n = spb;
+		else {
+			i = vhd_bitmap_find(vhd, map, i, spb, 1);
+			if (i >= spb)
+				break;
+			n = vhd_bitmap_span(vhd, map, i, spb, 1);
+		}
+
+		iocb = slot->iocbs + slot->pending++;
+		io_prep_pwrite(iocb, fd, data + vhd_sectors_to_bytes(i),
+			       vhd_sectors_to_bytes(n),
+			       vhd_sectors_to_bytes(off + i));
+		iocb->data = slot;
+		coalesce_queue(co, iocb);
+
+		co->bytes += vhd_sectors_to_bytes(n);
+	}
+
+	if (!slot->pending)
+		slot->state = COALESCE_WRITTEN;
+
+	return 0;
+}
+
+static int
+coalesce_flush(struct coalesce *co)
+{
+	vhd_context_t *parent;
+	int i, err;
+
+	parent = co->parent;
+
+	for (i = 0; i < co->nr_bitmaps; i++) {
+		err = vhd_write_bitmap(parent, co->bitmap_blks[i],
+				       co->bitmaps + i * co->bitmap_size);
+		if (err)
+			return err;
+	}
+
+	co->nr_bitmaps = 0;
+
+	if (co->batmap_dirty) {
+		err = vhd_write_batmap(parent, &parent->batmap);
+		if (err)
+			return err;
+		co->batmap_dirty = 0;
+	}
+
+	return 0;
+}
+
+static int
+coalesce_retire(struct coalesce *co, struct coalesce_slot *slot)
+{
+	vhd_context_t *vhd, *parent;
+	uint32_t i, n;
+	char *map, *old;
+	int err;
+
+	vhd    = co->vhd;
+	parent = co->parent;
+
+	if (slot->error)
+		return slot->error;
+
+	co->blocks++;
+
+	if (!parent->file || !vhd_type_dynamic(parent) ||
+	    coalesce_full(parent, slot->blk))
+		return 0;
+
+	if (co->nr_bitmaps == VHD_COALESCE_BITMAPS) {
+		err = coalesce_flush(co);
+		if (err)
+			return err;
+	}
+
+	map = co->bitmaps + co->nr_bitmaps * co->bitmap_size;
+
+	if (slot->fresh)
+		memset(map, 0, co->bitmap_size);
+	else {
+		err = vhd_read_bitmap(parent, slot->blk, &old);
+		if (err)
+			return err;
+		memcpy(map, old, co->bitmap_size);
+		free(old);
+	}
+
+	if (coalesce_full(vhd, slot->blk))
+		vhd_bitmap_set_range(parent, map, 0, parent->spb);
+	else
+		for (i = 0; i < vhd->spb; i += n) {
+			i = vhd_bitmap_find(vhd, slot->buf, i, vhd->spb, 1);
+			if (i >= vhd->spb)
+				break;
+			n = vhd_bitmap_span(vhd, slot->buf, i, vhd->spb, 1);
+			vhd_bitmap_set_range(parent, map, i, n);
+		}
+
+	co->bitmap_blks[co->nr_bitmaps++] = slot->blk;
+
+	if (vhd_has_batmap(parent) &&
+	    vhd_bitmap_span(parent, map, 0, parent->spb, 1) == parent->spb) {
+		vhd_batmap_set(parent, &parent->batmap, slot->blk);
+		co->batmap_dirty = 1;
+	}
+
+	return 0;
+}
+
+static int
+coalesce_sync(struct coalesce *co)
+{
+	int fd, err;
+
+	err = coalesce_flush(co);
+	if (err)
+		return err;
+
+	fd = (co->parent->file ? co->parent->fd : co->parent_fd);
+	if (fsync(fd))
+		return -errno;
+
+	gettimeofday(&co->synced, NULL);
+	return 0;
+}
+
+static int
+coalesce_checkpoint(struct coalesce *co)
+{
+	char uuid[37], *tmp;
+	FILE *f;
+	int err;
+
+	err = coalesce_sync(co);
+	if (err)
+		return err;
+
+	if (asprintf(&tmp, "%s.tmp", co->checkpoint) == -1)
+		return -ENOMEM;
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		err = -errno;
+		goto out;
+	}
+
+	vhd_uuid_to_string(&co->vhd->footer.uuid, uuid, sizeof(uuid));
+	fprintf(f, "%s %u %u\n", uuid, co->done, co->vhd->bat.entries);
+
+	if (fflush(f) || fsync(fileno(f)))
+		err = -errno;
+	if (fclose(f) && !err)
+		err = -errno;
+	if (!err && rename(tmp, co->checkpoint))
+		err = -errno;
+
+	if (err)
+		unlink(tmp);
+out:
+	if (err)
+		printf("error writing checkpoint %s: %d\n",
+		       co->checkpoint, err);
+	free(tmp);
+
+	if (!err && co->done > co->vhd->bat.entries / 2)
+		TEST_FAIL_AT(FAIL_COALESCE_CHECKPOINT);
+
+	return err;
+}
+
+static void
+coalesce_resume(struct coalesce *co)
+{
+	char uuid[37], want[37];
+	uint32_t blk, entries;
+	FILE *f;
+	int n;
+
+	f = fopen(co->checkpoint, "r");
+	if (!f)
+		return;
+
+	n = fscanf(f, "%36s %u %u", uuid, &blk, &entries);
+	fclose(f);
+
+	vhd_uuid_to_string(&co->vhd->footer.uuid, want, sizeof(want));
+
+	if (n != 3 || strcmp(uuid, want) ||
+	    entries != co->vhd->bat.entries || blk > entries) {
+		printf("checkpoint %s is not for %s, starting over\n",
+		       co->checkpoint, co->vhd->file);
+		return;
+	}
+
+	printf("resuming at block %u of %u\n", blk, entries);
+	co->next = co->done = blk;
+}
+
+static int
+coalesce_run(struct coalesce *co)
+{
+	struct coalesce_slot *slot;
+	struct timeval now;
+	int err;
+
+	for (;;) {
+		if (!co->error) {
+			coalesce_read(co);
+
+			while (co->wr < co->rd) {
+				slot = coalesce_slot(co, co->wr);
+				if (slot->state != COALESCE_READ)
+					break;
+
+				err = slot->error;
+				if (!err)
+					err = coalesce_write(co, slot);
+				if (err) {
+					co->error = err;
+					break;
+				}
+
+				co->wr++;
+			}
+
+			while (!co->error && co->rt < co->wr) {
+				slot = coalesce_slot(co, co->rt);
+				if (slot->state != COALESCE_WRITTEN)
+					break;
+
+				err = coalesce_retire(co, slot);
+				if (err) {
+					co->error = err;
+					break;
+				}
+
+				co->rt++;
+				co->done = slot->blk + 1;
+
+				if (!co->checkpoint)
+					continue;
+
+				gettimeofday(&now, NULL);
+				if (now.tv_sec - co->synced.tv_sec >= co->interval)
+					co->error = coalesce_checkpoint(co);
+			}
+
+			if (!co->error)
+				co->error = coalesce_submit(co);
+		}
+
+		if (!co->inflight) {
+			if (co->error)
+				break;
+			if (co->rt == co->rd &&
+			    co->next >= co->vhd->bat.entries)
+				break;
+			continue;
+		}
+
+		err = coalesce_reap(co);
+		if (err)
+			return err;
+	}
+
+	return co->error;
+}
+
+static int
+coalesce_init(struct coalesce *co, vhd_context_t *vhd,
+	      vhd_context_t *parent, int parent_fd, int depth)
+{
+	int i, err, runs;
+
+	memset(co, 0, sizeof(*co));
+	co->vhd       = vhd;
+	co->parent    = parent;
+	co->parent_fd = parent_fd;
+	co->depth     = depth;
+
+	/* a bitmap holds at most this many runs */
+	runs = vhd->spb / 2 + 1;
+
+	err = io_setup(VHD_COALESCE_AIO_EVENTS, &co->aio);
+	if (err)
+		return err;
+
+	if (parent->file && vhd_type_dynamic(parent)) {
+		co->bitmap_size = vhd_sectors_to_bytes(parent->bm_secs);
+		co->bitmap_blks = calloc(VHD_COALESCE_BITMAPS,
+					 sizeof(uint32_t));
+		err = posix_memalign((void **)&co->bitmaps, VHD_SECTOR_SIZE,
+				     VHD_COALESCE_BITMAPS * co->bitmap_size);
+		if (err) {
+			co->bitmaps = NULL;
+			return -err;
+		}
+		if (!co->bitmap_blks)
+			return -ENOMEM;
+	}
+
+	co->events = calloc(VHD_COALESCE_AIO_EVENTS, sizeof(struct io_event));
+	co->queue  = calloc(depth * runs, sizeof(struct iocb *));
+	co->slots  = calloc(depth, sizeof(struct coalesce_slot));
+	if (!co->events || !co->queue || !co->slots)
+		return -ENOMEM;
+
+	for (i = 0; i < depth; i++) {
+		struct coalesce_slot *slot = co->slots + i;
+
+		err = posix_memalign((void **)&slot->buf, 4096,
+				     vhd_sectors_to_bytes(vhd->bm_secs +
+							  vhd->spb));
+		if (err) {
+			slot->buf = NULL;
+			return -err;
+		}
+
+		slot->iocbs = calloc(runs, sizeof(struct iocb));
+		if (!slot->iocbs)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void
+coalesce_free(struct coalesce *co)
+{
+	int i;
+
+	if (co->aio)
+		io_destroy(co->aio);
+
+	for (i = 0; co->slots && i < co->depth; i++) {
+		free(co->slots[i].buf);
+		free(co->slots[i].iocbs);
+	}
+
+	free(co->slots);
+	free(co->queue);
+	free(co->events);
+	free(co->bitmaps);
+	free(co->bitmap_blks);
+}
+
+static uint64_t
+usecs(struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+int
+vhd_util_coalesce(int argc, char **argv)
+{
+	int err, c, depth, interval;
+	char *name, *pname, *checkpoint;
+	vhd_context_t vhd, parent;
+	struct timeval start, end;
+	struct coalesce co;
+	uint64_t elapsed;
+	int parent_fd = -1;
+
+	name       = NULL;
+	pname      = NULL;
+	checkpoint = NULL;
+	depth      = VHD_COALESCE_DEPTH;
+	interval   = VHD_COALESCE_CHECKPOINT_SECS;
+	parent.file = NULL;
+
+	if (!argc || !argv)
+		goto usage;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:q:c:i:h")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'c':
+			checkpoint = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || optind != argc)
+		goto usage;
+
+	if (depth < 1 || depth > VHD_COALESCE_MAX_DEPTH || interval < 0)
+		goto usage;
+
+	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
+	if (err) {
+		printf("error opening %s: %d\n", name, err);
+		return err;
+	}
+
+	err = vhd_parent_locator_get(&vhd, &pname);
+	if (err) {
+		printf("error finding %s parent: %d\n", name, err);
+		vhd_close(&vhd);
+		return err;
+	}
+
+	if (vhd_parent_raw(&vhd)) {
+		parent_fd = open(pname, O_RDWR | O_DIRECT | O_LARGEFILE, 0644);
+		if (parent_fd == -1) {
+			err = -errno;
+			printf("failed to open parent %s: %d\n", pname, err);
+			vhd_close(&vhd);
+			return err;
+		}
+	} else {
+		err = vhd_open(&parent, pname, VHD_OPEN_RDWR);
+		if (err) {
+			printf("error opening %s: %d\n", pname, err);
+			free(pname);
+			vhd_close(&vhd);
+			return err;
+		}
+	}
+
+	memset(&co, 0, sizeof(co));
+
+	err = vhd_get_bat(&vhd);
+	if (err)
+		goto done;
+
+	if (vhd_has_batmap(&vhd)) {
+		err = vhd_get_batmap(&vhd);
+		if (err)
+			goto done;
+	}
+
+	if (parent.file && vhd_type_dynamic(&parent)) {
+		if (parent.spb != vhd.spb) {
+			printf("%s and %s block sizes differ\n", name, pname);
+			err = -EINVAL;
+			goto done;
+		}
+
+		err = vhd_get_bat(&parent);
+		if (err)
+			goto done;
+
+		if (vhd_has_batmap(&parent)) {
+			err = vhd_get_batmap(&parent);
+			if (err)
+				goto done;
+		}
+	}
+
+	err = coalesce_init(&co, &vhd, &parent, parent_fd, depth);
+	if (err) {
+		printf("error setting up coalesce: %d\n", err);
+		goto done;
+	}
+
+	gettimeofday(&start, NULL);
+	co.synced = start;
+
+	if (checkpoint) {
+		co.checkpoint = checkpoint;
+		co.interval   = interval;
+		coalesce_resume(&co);
+	}
+
+	err = coalesce_run(&co);
+	if (err) {
+		printf("error coalescing %s into %s at block %u: %d\n",
+		       name, pname, co.done, err);
+		if (co.inflight)
+			goto done;
+		if (checkpoint)
+			coalesce_checkpoint(&co);
+		else
+			coalesce_flush(&co);
+		goto done;
+	}
+
+	err = coalesce_sync(&co);
+	if (err)
+		goto done;
+
+	if (checkpoint)
+		unlink(checkpoint);
+
+	gettimeofday(&end, NULL);
+	elapsed = usecs(&end) - usecs(&start);
+
+	printf("coalesced %"PRIu64" blocks, %"PRIu64" MB in %.1fs: "
+	       "%.1f MB/s\n", co.blocks, co.bytes >> 20, elapsed / 1e6,
+	       elapsed ? (double)co.bytes / elapsed : 0.0);
+
+	err = 0;
+
+ done:
+	coalesce_free(&co);
+	free(pname);
+	vhd_close(&vhd);
+	if (parent.file)
+		vhd_close(&parent);
+	else
+		close(parent_fd);
+	return err;
+
+usage:
+	printf("options: <-n name> [-q blocks in flight] "
+	       "[-c checkpoint file] [-i checkpoint interval secs] "
+	       "[-h help]\n");
+	return -EINVAL;
+}
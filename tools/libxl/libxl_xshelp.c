@@ -47,12 +47,41 @@ int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
                            unsigned int num_perms)
 {
     libxl_ctx *ctx = libxl__gc_owner(gc);
+    struct xs_multi_op *ops;
     char *path;
-    int i;
+    int i, n = 0;
 
     if (!kvs)
         return 0;
 
+    /* Batch all the writes into as few round trips as we can... */
+    for (i = 0; kvs[i] != NULL; i += 2)
+        n++;
+    if (!n)
+        return 0;
+    ops = libxl__calloc(gc, n * 2, sizeof(*ops));
+    n = 0;
+    for (i = 0; kvs[i] != NULL; i += 2) {
+        if (!kvs[i + 1])
+            continue;
+        path = GCSPRINTF("%s/%s", dir, kvs[i]);
+        ops[n].type = XS_WRITE;
+        ops[n].path = path;
+        ops[n].data = kvs[i + 1];
+        ops[n].len = strlen(kvs[i + 1]);
+        n++;
+        if (perms) {
+            ops[n].type = XS_SET_PERMS;
+            ops[n].path = path;
+            ops[n].perms = perms;
+            ops[n].num_perms = num_perms;
+            n++;
+        }
+    }
+    if (xs_multi(ctx->xsh, t, ops, n))
+        return 0;
+
+    /* ... falling back to one at a time for daemons without XS_MULTI. */
     for (i = 0; kvs[i] != NULL; i += 2) {
         path = libxl__sprintf(gc, "%s/%s", dir, kvs[i]);
         if (path && kvs[i + 1]) {
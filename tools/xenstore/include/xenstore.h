@@ -156,6 +156,40 @@ bool xs_set_permissions(struct xs_handle *h, xs_transaction_t t,
 			const char *path, struct xs_permissions *perms,
 			unsigned int num_perms);
 
+/* One operation of a batch for xs_multi(). */
+struct xs_multi_op {
+	/* XS_READ, XS_WRITE, XS_MKDIR, XS_RM, XS_DIRECTORY, XS_GET_PERMS
+	 * or XS_SET_PERMS. */
+	enum xsd_sockmsg_type type;
+	const char *path;
+
+	/* The value for XS_WRITE. */
+	const void *data;
+	unsigned int len;
+
+	/* The permissions for XS_SET_PERMS. */
+	struct xs_permissions *perms;
+	unsigned int num_perms;
+
+	/* Set by xs_multi(): 0 or the errno value the operation failed
+	 * with; and for XS_READ, XS_DIRECTORY and XS_GET_PERMS, the raw
+	 * reply, nul terminated and malloced: call free() on it after use.
+	 * Use xs_count_strings() and xs_strings_to_perms() to decode the
+	 * latter two. */
+	int error;
+	void *result;
+	unsigned int result_len;
+};
+
+/* Do a batch of operations in order, with as few round trips as possible.
+ * Each operation succeeds or fails on its own (see error above).
+ * Returns false on failure to talk to the daemon (ENOSYS if it doesn't
+ * know XS_MULTI), in which case some of the operations may have been done
+ * and none have results.
+ */
+bool xs_multi(struct xs_handle *h, xs_transaction_t t,
+	      struct xs_multi_op *ops, unsigned int num_ops);
+
 /* Watch a node for changes (poll on fd to detect, or call read_watch()).
  * When the node (or any child) changes, fd will become readable.
  * Token is returned when watch is read, to allow matching.
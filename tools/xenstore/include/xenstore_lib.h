@@ -42,6 +42,38 @@ struct xs_permissions
 	enum xs_perm_type perms;
 };
 
+/* Header of the node record in the tdb. */
+struct xs_tdb_record_hdr {
+	uint64_t generation;
+	uint32_t num_perms;
+	uint32_t datalen;
+	uint32_t childlen;
+	struct xs_permissions perms[0];
+};
+
+/*
+ * Shared memory a local client may move its socket connection onto (see
+ * LOCAL_RING in docs/misc/xenstore.txt): the rings of a domain, and a
+ * flag for each side which is set while it waits for the other.  Kicks
+ * on the eventfds are only needed then.
+ */
+struct xs_local_ring {
+	struct xenstore_domain_interface intf;
+	uint32_t server_waiting_req;	/* For requests. */
+	uint32_t server_waiting_rsp;	/* For room for replies. */
+	uint32_t client_waiting_rsp;	/* For replies. */
+	uint32_t client_waiting_req;	/* For room for requests. */
+};
+
+/* The fds passed with LOCAL_RING, in this order. */
+enum {
+	XS_LOCAL_RING_SHMEM,	/* Sealed against shrinking. */
+	XS_LOCAL_RING_SERVER,	/* Eventfd kicking the daemon. */
+	XS_LOCAL_RING_RSP,	/* Eventfd kicking the client for replies... */
+	XS_LOCAL_RING_REQ,	/* ... and for room for requests. */
+	XS_LOCAL_RING_NR_FDS
+};
+
 /* Each 10 bits takes ~ 3 digits, plus one, plus one for nul terminator. */
 #define MAX_STRLEN(x) ((sizeof(x) * CHAR_BIT + CHAR_BIT-1) / 10 * 3 + 2)
 
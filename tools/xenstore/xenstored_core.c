@@ -20,6 +20,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <poll.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
 #ifndef NO_SOCKETS
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -29,6 +32,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -50,6 +54,8 @@
 #include "xenstored_watch.h"
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
+#include "xenstored_worker.h"
 #include "xenctrl.h"
 #include "tdb.h"
 
@@ -65,13 +71,26 @@
 #include <systemd/sd-daemon.h>
 #endif
 
+/* Local clients can move onto shared memory rings: see do_local_ring(). */
+#if defined(HAVE_EPOLL) && defined(HAVE_EVENTFD) && !defined(NO_SOCKETS)
+#define LOCAL_RING
+#endif
+
 extern xc_evtchn *xce_handle; /* in xenstored_domain.c */
+#ifdef HAVE_EPOLL
+static int epoll_fd = -1;
+#else
 static int xce_pollfd_idx = -1;
+static int worker_pollfd_idx = -1;
 static struct pollfd *fds;
 static unsigned int current_array_size;
 static unsigned int nr_fds;
 
 #define ROUNDUP(_x, _w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
+#endif
+
+/* Connections with work to do, see conn_ready(). */
+static LIST_HEAD(ready_connections);
 
 static bool verbose = false;
 LIST_HEAD(connections);
@@ -79,11 +98,11 @@ static int tracefd = -1;
 static bool recovery = true;
 static bool remove_local = true;
 static int reopen_log_pipe[2];
+#ifndef HAVE_EPOLL
 static int reopen_log_pipe0_pollfd_idx = -1;
+#endif
 static char *tracefile = NULL;
-static TDB_CONTEXT *tdb_ctx = NULL;
 
-static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
 
 #define log(...)							\
@@ -99,23 +118,48 @@ int quota_nb_entry_per_domain = 1000;
 int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
+int quota_nb_event_per_conn = 4096;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
+/*
+ * Node records live in the store, unless we are inside a transaction, in
+ * which case they go through the transaction's overlay.  trans is NULL
+ * for the global store (e.g. from manual_node at setup).  perms_only says
+ * that the caller only depends on the node's existence and permissions,
+ * which lets a transaction merge concurrent changes to its children.
+ * The data fetched is read-only, and valid for the lifetime of ctx.
+ */
+static TDB_DATA fetch_record(const void *ctx, struct transaction *trans,
+			     const char *name, bool perms_only)
 {
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
+	if (trans)
+		return transaction_fetch(ctx, trans, name, perms_only);
+
+	return store_fetch(ctx, name);
 }
 
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
+static bool store_record(struct transaction *trans, const char *name,
+			 TDB_DATA data)
 {
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
+	if (trans)
+		return transaction_store(trans, name, data);
+
+	((struct xs_tdb_record_hdr *)data.dptr)->generation = ++generation;
+
+	return store_store(name, data);
+}
+
+static bool delete_record(struct transaction *trans, const char *name)
+{
+	if (trans)
+		return transaction_delete(trans, name);
+
+	return store_delete(name);
+}
+
+static struct transaction *conn_transaction(struct connection *conn)
+{
+	/* conn = NULL used in manual_node at setup. */
+	return conn ? conn->transaction : NULL;
 }
 
 static char *sockmsg_string(enum xsd_sockmsg_type type)
@@ -142,6 +186,8 @@ static char *sockmsg_string(enum xsd_sockmsg_type type)
 	case XS_RESUME: return "RESUME";
 	case XS_SET_TARGET: return "SET_TARGET";
 	case XS_RESET_WATCHES: return "RESET_WATCHES";
+	case XS_MULTI: return "MULTI";
+	case XS_LOCAL_RING: return "LOCAL_RING";
 	default:
 		return "**UNKNOWN**";
 	}
@@ -167,12 +213,18 @@ void trace(const char *fmt, ...)
 		return;
 	}
 
-	/* fail back to dynamic allocation */
+	/*
+	 * fail back to dynamic allocation: not from talloc, as workers
+	 * trace too and talloc isn't thread-safe.
+	 */
+	str = malloc(ret + 1);
+	if (!str)
+		return;
 	va_start(arglist, fmt);
-	str = talloc_vasprintf(NULL, fmt, arglist);
+	vsnprintf(str, ret + 1, fmt, arglist);
 	va_end(arglist);
-	dummy = write(tracefd, str, strlen(str));
-	talloc_free(str);
+	dummy = write(tracefd, str, ret);
+	free(str);
 }
 
 static void trace_io(const struct connection *conn,
@@ -242,6 +294,8 @@ static void reopen_log(void)
 	}
 }
 
+static void event_sent(struct connection *conn, struct buffered_data *out);
+
 static bool write_messages(struct connection *conn)
 {
 	int ret;
@@ -270,7 +324,7 @@ static bool write_messages(struct connection *conn)
 		out->used = 0;
 
 		/* Second write might block if non-zero. */
-		if (out->hdr.msg.len && !conn->domain)
+		if (out->hdr.msg.len && !conn->domain && !conn->ring)
 			return true;
 	}
 
@@ -286,17 +340,42 @@ static bool write_messages(struct connection *conn)
 	trace_io(conn, out, 1);
 
 	list_del(&out->list);
+	if (out->hdr.msg.type == XS_WATCH_EVENT)
+		event_sent(conn, out);
 	talloc_free(out);
 
 	return true;
 }
 
+void conn_discard_output(struct connection *conn)
+{
+	struct buffered_data *out;
+
+	while ((out = list_top(&conn->out_list, struct buffered_data, list))) {
+		list_del(&out->list);
+		talloc_free(out);
+	}
+	if (conn->events)
+		hashtable_destroy(conn->events, 0);
+	conn->events = NULL;
+	conn->nr_events = 0;
+}
+
+static void close_passed_fds(struct connection *conn)
+{
+	while (conn->nr_passed_fds)
+		close(conn->passed_fds[--conn->nr_passed_fds]);
+}
+
 static int destroy_conn(void *_conn)
 {
 	struct connection *conn = _conn;
 
+	/* A worker may still be using conn. */
+	worker_cancel(conn);
+
 	/* Flush outgoing if possible, but don't block. */
-	if (!conn->domain) {
+	if (!conn->domain && !conn->ring) {
 		struct pollfd pfd;
 		pfd.fd = conn->fd;
 		pfd.events = POLLOUT;
@@ -305,15 +384,134 @@ static int destroy_conn(void *_conn)
 		       && poll(&pfd, 1, 0) == 1)
 			if (!write_messages(conn))
 				break;
-		close(conn->fd);
 	}
+	if (!conn->domain)
+		close(conn->fd);
+	close_passed_fds(conn);
+	if (conn->events)
+		hashtable_destroy(conn->events, 0);
         if (conn->target)
                 talloc_unlink(conn, conn->target);
 	list_del(&conn->list);
+	list_del(&conn->ready);
 	trace_destroy(conn, "connection");
 	return 0;
 }
 
+/*
+ * Queue a connection for the main loop.  Domain connections are queued
+ * when their event channel fires, socket connections when their fd is
+ * ready, and both when we have output for them.  The main loop only looks
+ * at queued connections, so a wakeup costs O(active connections) rather
+ * than O(connections).
+ */
+void conn_ready(struct connection *conn)
+{
+	if (list_empty(&conn->ready))
+		list_add_tail(&conn->ready, &ready_connections);
+}
+
+/* What the main loop gets back for the fds which are not connections. */
+static char sock_tag, ro_sock_tag, worker_tag;
+
+/* Events to ask for on a socket connection's fd. */
+static short conn_fd_events(struct connection *conn)
+{
+	short events = 0;
+
+	/* Don't read the next request until a worker has answered this one. */
+	if (!conn->request)
+		events |= POLLIN|POLLPRI;
+	if (!list_empty(&conn->out_list))
+		events |= POLLOUT;
+	return events;
+}
+
+static void handle_fd_event(int sock, int ro_sock, void *ptr, short revents);
+
+#ifdef HAVE_EPOLL
+static bool epoll_set(int op, int fd, uint32_t events, void *ptr)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = ptr;
+	return epoll_ctl(epoll_fd, op, fd, &ev) == 0;
+}
+
+/* Listen on fd: ptr is what the main loop gets back when it is ready. */
+static bool add_fd(int fd, void *ptr)
+{
+	return epoll_set(EPOLL_CTL_ADD, fd, EPOLLIN|EPOLLPRI, ptr);
+}
+
+/* Keep the events we listen for on a socket connection up to date. */
+static void update_conn_fd(struct connection *conn)
+{
+	short events = conn_fd_events(conn);
+
+	if (conn->domain || conn->ring || events == conn->fd_events)
+		return;
+	if (!epoll_set(EPOLL_CTL_MOD, conn->fd,
+		       ((events & POLLIN) ? EPOLLIN : 0) |
+		       ((events & POLLPRI) ? EPOLLPRI : 0) |
+		       ((events & POLLOUT) ? EPOLLOUT : 0), conn))
+		barf_perror("epoll_ctl failed on fd %d", conn->fd);
+	conn->fd_events = events;
+}
+
+static void init_fds(int sock, int ro_sock)
+{
+	epoll_fd = epoll_create(64);
+	if (epoll_fd < 0)
+		barf_perror("epoll_create failed");
+
+	if ((sock != -1 && !add_fd(sock, &sock_tag)) ||
+	    (ro_sock != -1 && !add_fd(ro_sock, &ro_sock_tag)) ||
+	    (reopen_log_pipe[0] != -1 &&
+	     !add_fd(reopen_log_pipe[0], &reopen_log_pipe)) ||
+	    (xce_handle != NULL &&
+	     !add_fd(xc_evtchn_fd(xce_handle), &xce_handle)) ||
+	    (worker_fd() != -1 && !add_fd(worker_fd(), &worker_tag)))
+		barf_perror("epoll_ctl failed");
+}
+
+static short poll_events(uint32_t events)
+{
+	return ((events & EPOLLIN) ? POLLIN : 0) |
+		((events & EPOLLPRI) ? POLLPRI : 0) |
+		((events & EPOLLOUT) ? POLLOUT : 0) |
+		((events & EPOLLERR) ? POLLERR : 0) |
+		((events & EPOLLHUP) ? POLLHUP : 0);
+}
+
+static void wait_for_events(int sock, int ro_sock, int timeout)
+{
+	struct epoll_event events[64];
+	int i, nr;
+
+	nr = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), timeout);
+	if (nr < 0) {
+		if (errno == EINTR)
+			return;
+		barf_perror("epoll_wait failed");
+	}
+
+	for (i = 0; i < nr; i++)
+		handle_fd_event(sock, ro_sock, events[i].data.ptr,
+				poll_events(events[i].events));
+}
+#else
+static bool add_fd(int fd, void *ptr)
+{
+	/* initialize_fds() picks up everything on each iteration. */
+	return true;
+}
+
+static void update_conn_fd(struct connection *conn)
+{
+}
+
 /* This function returns index inside the array if succeed, -1 if fail */
 static int set_fd(int fd, short events)
 {
@@ -349,8 +547,7 @@ fail:
 }
 
 static void initialize_fds(int sock, int *p_sock_pollfd_idx,
-			   int ro_sock, int *p_ro_sock_pollfd_idx,
-			   int *ptimeout)
+			   int ro_sock, int *p_ro_sock_pollfd_idx)
 {
 	struct connection *conn;
 
@@ -358,8 +555,6 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
 	nr_fds = 0;
 
-	*ptimeout = -1;
-
 	if (sock != -1)
 		*p_sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
 	if (ro_sock != -1)
@@ -372,21 +567,60 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 		xce_pollfd_idx = set_fd(xc_evtchn_fd(xce_handle),
 					POLLIN|POLLPRI);
 
+	if (worker_fd() != -1)
+		worker_pollfd_idx = set_fd(worker_fd(), POLLIN|POLLPRI);
+
+	/* Domain connections are queued by handle_event() instead. */
 	list_for_each_entry(conn, &connections, list) {
-		if (conn->domain) {
-			if (domain_can_read(conn) ||
-			    (domain_can_write(conn) &&
-			     !list_empty(&conn->out_list)))
-				*ptimeout = 0;
-		} else {
-			short events = POLLIN|POLLPRI;
-			if (!list_empty(&conn->out_list))
-				events |= POLLOUT;
-			conn->pollfd_idx = set_fd(conn->fd, events);
-		}
+		if (!conn->domain)
+			conn->pollfd_idx = set_fd(conn->fd,
+						  conn_fd_events(conn));
 	}
 }
 
+static void init_fds(int sock, int ro_sock)
+{
+}
+
+static void wait_for_events(int sock, int ro_sock, int timeout)
+{
+	int sock_pollfd_idx = -1, ro_sock_pollfd_idx = -1;
+	struct connection *conn;
+
+	initialize_fds(sock, &sock_pollfd_idx, ro_sock, &ro_sock_pollfd_idx);
+
+	if (poll(fds, nr_fds, timeout) < 0) {
+		if (errno == EINTR)
+			return;
+		barf_perror("Poll failed");
+	}
+
+	if (reopen_log_pipe0_pollfd_idx != -1 &&
+	    fds[reopen_log_pipe0_pollfd_idx].revents)
+		handle_fd_event(sock, ro_sock, &reopen_log_pipe,
+				fds[reopen_log_pipe0_pollfd_idx].revents);
+	if (sock_pollfd_idx != -1 && fds[sock_pollfd_idx].revents)
+		handle_fd_event(sock, ro_sock, &sock_tag,
+				fds[sock_pollfd_idx].revents);
+	if (ro_sock_pollfd_idx != -1 && fds[ro_sock_pollfd_idx].revents)
+		handle_fd_event(sock, ro_sock, &ro_sock_tag,
+				fds[ro_sock_pollfd_idx].revents);
+	if (xce_pollfd_idx != -1 && fds[xce_pollfd_idx].revents)
+		handle_fd_event(sock, ro_sock, &xce_handle,
+				fds[xce_pollfd_idx].revents);
+	if (worker_pollfd_idx != -1 && fds[worker_pollfd_idx].revents)
+		handle_fd_event(sock, ro_sock, &worker_tag,
+				fds[worker_pollfd_idx].revents);
+
+	list_for_each_entry(conn, &connections, list) {
+		if (conn->pollfd_idx != -1 && fds[conn->pollfd_idx].revents)
+			handle_fd_event(sock, ro_sock, conn,
+					fds[conn->pollfd_idx].revents);
+		conn->pollfd_idx = -1;
+	}
+}
+#endif
+
 /* Is child a subnode of parent, or equal? */
 bool is_child(const char *child, const char *parent)
 {
@@ -403,42 +637,36 @@ bool is_child(const char *child, const char *parent)
 	return child[len] == '/' || child[len] == '\0';
 }
 
-/* If it fails, returns NULL and sets errno. */
-static struct node *read_node(struct connection *conn, const char *name)
+static struct node *__read_node(struct connection *conn, const char *name,
+				bool perms_only)
 {
-	TDB_DATA key, data;
-	uint32_t *p;
+	TDB_DATA data;
+	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
-
-	key.dptr = (void *)name;
-	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
 
+	node = talloc(name, struct node);
+	data = fetch_record(node, conn_transaction(conn), name, perms_only);
 	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
-			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
-		}
+		int saved_errno = errno;
+
+		talloc_free(node);
+		errno = saved_errno;
 		return NULL;
 	}
 
-	node = talloc(name, struct node);
 	node->name = talloc_strdup(node, name);
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
-	talloc_steal(node, data.dptr);
+	node->trans = conn_transaction(conn);
 
-	/* Datalen, childlen, number of permissions */
-	p = (uint32_t *)data.dptr;
-	node->num_perms = p[0];
-	node->datalen = p[1];
-	node->childlen = p[2];
+	/* Generation, number of permissions, datalen, childlen */
+	hdr = (void *)data.dptr;
+	node->generation = hdr->generation;
+	node->num_perms = hdr->num_perms;
+	node->datalen = hdr->datalen;
+	node->childlen = hdr->childlen;
 
-	/* Permissions are struct xs_permissions. */
-	node->perms = (void *)&p[3];
+	/* Permissions are struct xs_permissions.  All shared: don't modify. */
+	node->perms = hdr->perms;
 	/* Data is binary blob (usually ascii, no nul). */
 	node->data = node->perms + node->num_perms;
 	/* Children is strings, nul separated. */
@@ -447,20 +675,35 @@ static struct node *read_node(struct connection *conn, const char *name)
 	return node;
 }
 
+/* If it fails, returns NULL and sets errno. */
+static struct node *read_node(struct connection *conn, const char *name)
+{
+	return __read_node(conn, name, false);
+}
+
+/*
+ * Read a node whose existence and permissions are all the caller cares
+ * about, e.g. the parent of a node being created or removed.
+ */
+static struct node *read_parent_node(struct connection *conn,
+				     const char *name)
+{
+	return __read_node(conn, name, true);
+}
+
 static bool write_node(struct connection *conn, const struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
+	 * conn_transaction copes with this.
 	 */
 
-	TDB_DATA key, data;
+	TDB_DATA data;
+	struct xs_tdb_record_hdr *hdr;
 	void *p;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	data.dsize = 3*sizeof(uint32_t)
+	/* The padding after childlen isn't stored: perms start before it. */
+	data.dsize = offsetof(struct xs_tdb_record_hdr, perms)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
@@ -468,10 +711,12 @@ static bool write_node(struct connection *conn, const struct node *node)
 		goto error;
 
 	data.dptr = talloc_size(node, data.dsize);
-	((uint32_t *)data.dptr)[0] = node->num_perms;
-	((uint32_t *)data.dptr)[1] = node->datalen;
-	((uint32_t *)data.dptr)[2] = node->childlen;
-	p = data.dptr + 3 * sizeof(uint32_t);
+	hdr = (void *)data.dptr;
+	hdr->generation = node->generation;
+	hdr->num_perms = node->num_perms;
+	hdr->datalen = node->datalen;
+	hdr->childlen = node->childlen;
+	p = hdr->perms;
 
 	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
 	p += node->num_perms*sizeof(node->perms[0]);
@@ -480,8 +725,8 @@ static bool write_node(struct connection *conn, const struct node *node)
 	memcpy(p, node->children, node->childlen);
 
 	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
-		corrupt(conn, "Write of %s failed", key.dptr);
+	if (!store_record(conn_transaction(conn), node->name, data)) {
+		corrupt(conn, "Write of %s failed", node->name);
 		goto error;
 	}
 	return true;
@@ -528,7 +773,7 @@ static enum xs_perm_type ask_parents(struct connection *conn, const char *name)
 
 	do {
 		name = get_parent(name);
-		node = read_node(conn, name);
+		node = read_parent_node(conn, name);
 		if (node)
 			break;
 	} while (!streq(name, "/"));
@@ -635,24 +880,21 @@ unsigned int get_strings(struct buffered_data *data,
 	return i;
 }
 
-void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
-		const void *data, unsigned int len)
+/* Queue a reply to the request with header req (NULL for watch events). */
+static struct buffered_data *queue_reply(struct connection *conn,
+					 const struct xsd_sockmsg *req,
+					 enum xsd_sockmsg_type type,
+					 const void *data, unsigned int len)
 {
 	struct buffered_data *bdata;
 
-	if ( len > XENSTORE_PAYLOAD_MAX ) {
-		send_error(conn, E2BIG);
-		return;
-	}
-
 	/* Message is a child of the connection context for auto-cleanup. */
 	bdata = new_buffer(conn);
 	bdata->buffer = talloc_array(bdata, char, len);
 
 	/* Echo request header in reply unless this is an async watch event. */
-	if (type != XS_WATCH_EVENT) {
-		memcpy(&bdata->hdr.msg, &conn->in->hdr.msg,
-		       sizeof(struct xsd_sockmsg));
+	if (req) {
+		memcpy(&bdata->hdr.msg, req, sizeof(struct xsd_sockmsg));
 	} else {
 		memset(&bdata->hdr.msg, 0, sizeof(struct xsd_sockmsg));
 	}
@@ -664,6 +906,123 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
+	conn_ready(conn);
+
+	return bdata;
+}
+
+/*
+ * Watch events are queued like replies, except that an event identical to
+ * one still queued is dropped: the client will only read the node after
+ * the queued event arrives, so it sees this change as well.  conn->events
+ * finds queued events by their payload, "<path>\0<token>\0".
+ */
+static unsigned int event_hash(void *key)
+{
+	char *path = key;
+
+	return hash_from_key_fn(path) * 31 +
+		hash_from_key_fn(path + strlen(path) + 1);
+}
+
+static int event_equal(void *key1, void *key2)
+{
+	char *path1 = key1, *path2 = key2;
+
+	return streq(path1, path2) &&
+		streq(path1 + strlen(path1) + 1, path2 + strlen(path2) + 1);
+}
+
+static void queue_event(struct connection *conn, const void *data,
+			unsigned int len)
+{
+	struct buffered_data *bdata;
+	void *key;
+
+	if (!conn->events)
+		conn->events = create_hashtable(16, event_hash, event_equal);
+	if (conn->events && hashtable_search(conn->events, (void *)data))
+		return;
+
+	bdata = queue_reply(conn, NULL, XS_WATCH_EVENT, data, len);
+	conn->nr_events++;
+
+	/* Without an entry, this event is just not coalesced with later ones. */
+	key = conn->events ? malloc(len) : NULL;
+	if (key) {
+		memcpy(key, data, len);
+		if (!hashtable_insert(conn->events, key, bdata))
+			free(key);
+	}
+}
+
+static void event_sent(struct connection *conn, struct buffered_data *out)
+{
+	conn->nr_events--;
+	if (conn->events &&
+	    hashtable_search(conn->events, out->buffer) == out)
+		hashtable_remove(conn->events, out->buffer);
+}
+
+/* The replies to the requests of an XS_MULTI being processed. */
+static struct multi_reply
+{
+	struct connection *conn;
+
+	/* Header of the request being processed. */
+	const struct xsd_sockmsg *req;
+
+	char *buffer;
+	unsigned int used;
+	unsigned int nr_replies;
+	bool full;
+} *multi_reply;
+
+/* Append a reply to the XS_MULTI reply: returns false if it isn't part. */
+static bool multi_reply_add(struct connection *conn,
+			    enum xsd_sockmsg_type type, const void *data,
+			    unsigned int len)
+{
+	struct multi_reply *mr = multi_reply;
+	struct xsd_sockmsg hdr;
+
+	if (!mr || mr->conn != conn || type == XS_WATCH_EVENT)
+		return false;
+
+	if (mr->used + sizeof(hdr) + len > XENSTORE_PAYLOAD_MAX) {
+		mr->full = true;
+		return true;
+	}
+
+	hdr = *mr->req;
+	hdr.type = type;
+	hdr.len = len;
+	memcpy(mr->buffer + mr->used, &hdr, sizeof(hdr));
+	memcpy(mr->buffer + mr->used + sizeof(hdr), data, len);
+	mr->used += sizeof(hdr) + len;
+	mr->nr_replies++;
+	return true;
+}
+
+void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
+		const void *data, unsigned int len)
+{
+	if ( len > XENSTORE_PAYLOAD_MAX ) {
+		send_error(conn, E2BIG);
+		return;
+	}
+
+	/* A worker's reply is sent on by the main thread. */
+	if (worker_reply(type, data, len))
+		return;
+
+	if (multi_reply_add(conn, type, data, len))
+		return;
+
+	if (type == XS_WATCH_EVENT)
+		queue_event(conn, data, len);
+	else
+		queue_reply(conn, &conn->in->hdr.msg, type, data, len);
 }
 
 /* Some routines (write, mkdir, etc) just need a non-error return */
@@ -797,12 +1156,7 @@ static void do_read(struct connection *conn, const char *name)
 
 static void delete_node_single(struct connection *conn, struct node *node)
 {
-	TDB_DATA key;
-
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+	if (!delete_record(conn_transaction(conn), node->name)) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -823,7 +1177,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 	char *children, *parentname = get_parent(name);
 
 	/* If parent doesn't exist, create it. */
-	parent = read_node(conn, parentname);
+	parent = read_parent_node(conn, parentname);
 	if (!parent)
 		parent = construct_node(conn, parentname);
 	if (!parent)
@@ -843,7 +1197,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
+	node->trans = conn_transaction(conn);
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -854,6 +1208,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 		node->perms[0].id = conn->id;
 
 	/* No children, no data */
+	node->generation = 0;
 	node->children = node->data = NULL;
 	node->childlen = node->datalen = 0;
 	node->parent = parent;
@@ -864,15 +1219,11 @@ static struct node *construct_node(struct connection *conn, const char *name)
 static int destroy_node(void *_node)
 {
 	struct node *node = _node;
-	TDB_DATA key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(node->tdb, key);
+	delete_record(node->trans, node->name);
 	return 0;
 }
 
@@ -1013,6 +1364,13 @@ static bool remove_child_entry(struct connection *conn, struct node *node,
 			       size_t offset)
 {
 	size_t childlen = strlen(node->children + offset);
+
+	/* The node's children may be shared with the store. */
+	node->children = talloc_memdup(node, node->children, node->childlen);
+	if (!node->children) {
+		errno = ENOMEM;
+		return false;
+	}
 	memdel(node->children, offset, childlen + 1, node->childlen);
 	node->childlen -= childlen + 1;
 	return write_node(conn, node);
@@ -1039,7 +1397,7 @@ static int _rm(struct connection *conn, struct node *node, const char *name)
 	/* Delete from parent first, then if we crash, the worst that can
 	   happen is the child will continue to take up space, but will
 	   otherwise be unreachable. */
-	struct node *parent = read_node(conn, get_parent(name));
+	struct node *parent = read_parent_node(conn, get_parent(name));
 	if (!parent) {
 		send_error(conn, EINVAL);
 		return 0;
@@ -1075,7 +1433,7 @@ static void do_rm(struct connection *conn, const char *name)
 	if (!node) {
 		/* Didn't exist already?  Fine, if parent exists. */
 		if (errno == ENOENT) {
-			node = read_node(conn, get_parent(name));
+			node = read_parent_node(conn, get_parent(name));
 			if (node) {
 				send_ack(conn, XS_RM);
 				return;
@@ -1195,9 +1553,320 @@ static void do_debug(struct connection *conn, struct buffered_data *in)
 	if (streq(in->buffer, "check"))
 		check_store();
 
+	if (streq(in->buffer, "transactions")) {
+		char *stats = transaction_stats(in);
+
+		send_reply(conn, XS_DEBUG, stats, strlen(stats) + 1);
+		return;
+	}
+
 	send_ack(conn, XS_DEBUG);
 }
 
+/*
+ * A local client can move its socket connection onto a shared memory
+ * ring, laid out as a domain's, so that a request costs no syscalls
+ * while either side is busy.  Each side kicks the other through an
+ * eventfd, but only when the other has said it is waiting.  The socket
+ * stays open so we notice when the client goes away.
+ */
+struct local_ring
+{
+	struct xs_local_ring *shared;
+	int fds[XS_LOCAL_RING_NR_FDS];
+};
+
+static void ring_kick(uint32_t *waiting, int fd)
+{
+	uint64_t one = 1;
+
+	xen_mb();
+	if (*(volatile uint32_t *)waiting &&
+	    write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		syslog(LOG_ERR, "Failed to kick local ring: %m");
+}
+
+static int writering(struct connection *conn, const void *data,
+		     unsigned int len)
+{
+	struct xs_local_ring *shared = conn->ring->shared;
+	int ret = interface_write(&shared->intf, data, len);
+
+	if (ret > 0)
+		ring_kick(&shared->client_waiting_rsp,
+			  conn->ring->fds[XS_LOCAL_RING_RSP]);
+	return ret;
+}
+
+static int readring(struct connection *conn, void *data, unsigned int len)
+{
+	struct xs_local_ring *shared = conn->ring->shared;
+	int ret = interface_read(&shared->intf, data, len);
+
+	if (ret > 0)
+		ring_kick(&shared->client_waiting_req,
+			  conn->ring->fds[XS_LOCAL_RING_REQ]);
+	return ret;
+}
+
+/* For connections over rings: is there a request, or room for replies? */
+static bool ring_can_read(struct connection *conn)
+{
+	if (conn->domain)
+		return domain_can_read(conn);
+	return interface_can_read(&conn->ring->shared->intf);
+}
+
+static bool ring_can_write(struct connection *conn)
+{
+	if (conn->domain)
+		return domain_can_write(conn);
+	return interface_can_write(&conn->ring->shared->intf);
+}
+
+static bool ring_has_work(struct connection *conn)
+{
+	return (!conn->request && ring_can_read(conn)) ||
+		(ring_can_write(conn) && !list_empty(&conn->out_list));
+}
+
+/* Leave a local ring until the client kicks us. */
+static void local_ring_wait(struct connection *conn)
+{
+	struct xs_local_ring *shared = conn->ring->shared;
+
+	shared->server_waiting_req = !conn->request;
+	shared->server_waiting_rsp = !list_empty(&conn->out_list);
+	xen_mb();
+	if (ring_has_work(conn)) {
+		shared->server_waiting_req = 0;
+		shared->server_waiting_rsp = 0;
+		conn_ready(conn);
+	}
+}
+
+/* Returns false if the client went away, in which case conn is freed. */
+static bool local_ring_wake(struct connection *conn, short revents)
+{
+	uint64_t count;
+
+	if (revents & ~(POLLIN|POLLPRI|POLLOUT)) {
+		talloc_free(conn);
+		return false;
+	}
+	if ((revents & POLLIN) &&
+	    read(conn->ring->fds[XS_LOCAL_RING_SERVER], &count,
+		 sizeof(count)) < 0 && errno != EAGAIN) {
+		talloc_free(conn);
+		return false;
+	}
+	conn->ring->shared->server_waiting_req = 0;
+	conn->ring->shared->server_waiting_rsp = 0;
+	return true;
+}
+
+#ifdef LOCAL_RING
+static int destroy_local_ring(void *_ring)
+{
+	struct local_ring *ring = _ring;
+	unsigned int i;
+
+	if (ring->shared)
+		local_ring_unmap(ring->shared, sizeof(*ring->shared));
+	for (i = 0; i < XS_LOCAL_RING_NR_FDS; i++)
+		if (ring->fds[i] != -1)
+			close(ring->fds[i]);
+	return 0;
+}
+
+static struct local_ring *map_local_ring(struct connection *conn)
+{
+	struct local_ring *ring;
+	unsigned int i;
+
+	ring = talloc_zero(conn, struct local_ring);
+	if (!ring)
+		return NULL;
+	for (i = 0; i < XS_LOCAL_RING_NR_FDS; i++)
+		ring->fds[i] = conn->passed_fds[i];
+	conn->nr_passed_fds = 0;
+	talloc_set_destructor(ring, destroy_local_ring);
+
+	ring->shared = local_ring_map(ring->fds[XS_LOCAL_RING_SHMEM],
+				      sizeof(*ring->shared));
+	if (!ring->shared)
+		goto fail;
+	close(ring->fds[XS_LOCAL_RING_SHMEM]);
+	ring->fds[XS_LOCAL_RING_SHMEM] = -1;
+
+	/* We only ever look at the eventfds when they are ready. */
+	for (i = XS_LOCAL_RING_SERVER; i < XS_LOCAL_RING_NR_FDS; i++)
+		if (fcntl(ring->fds[i], F_SETFL, O_NONBLOCK) != 0)
+			goto fail;
+
+	return ring;
+
+fail:
+	talloc_free(ring);
+	return NULL;
+}
+
+static void do_local_ring(struct connection *conn, struct buffered_data *in)
+{
+	struct local_ring *ring;
+	int saved_errno;
+
+	if (conn->domain || conn->ring ||
+	    conn->nr_passed_fds != XS_LOCAL_RING_NR_FDS) {
+		send_error(conn, EINVAL);
+		return;
+	}
+	/* Anything already queued would be split between socket and ring. */
+	if (!list_empty(&conn->out_list)) {
+		send_error(conn, EBUSY);
+		return;
+	}
+
+	ring = map_local_ring(conn);
+	if (!ring) {
+		send_error(conn, EINVAL);
+		return;
+	}
+
+	/* From now on the socket only tells us about hangups. */
+	if (!epoll_set(EPOLL_CTL_MOD, conn->fd, 0, conn) ||
+	    !add_fd(ring->fds[XS_LOCAL_RING_SERVER], conn)) {
+		saved_errno = errno;
+		epoll_set(EPOLL_CTL_MOD, conn->fd, EPOLLIN|EPOLLPRI, conn);
+		talloc_free(ring);
+		send_error(conn, saved_errno);
+		return;
+	}
+	conn->fd_events = 0;
+	conn->ring = ring;
+	conn->read = readring;
+	conn->write = writering;
+
+	/* The reply is the first thing on the ring. */
+	send_ack(conn, XS_LOCAL_RING);
+}
+#else
+static void do_local_ring(struct connection *conn, struct buffered_data *in)
+{
+	send_error(conn, ENOSYS);
+}
+#endif
+
+static void process_message(struct connection *conn,
+			    struct buffered_data *in);
+
+/* Operations which may be batched in an XS_MULTI. */
+static bool multi_allowed(enum xsd_sockmsg_type type)
+{
+	switch (type) {
+	case XS_DIRECTORY:
+	case XS_READ:
+	case XS_GET_PERMS:
+	case XS_WRITE:
+	case XS_MKDIR:
+	case XS_RM:
+	case XS_SET_PERMS:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Room kept for the reply to each request: enough for "OK" or any error. */
+#define MULTI_REPLY_MIN	(sizeof(struct xsd_sockmsg) + 16)
+
+/*
+ * The payload is a sequence of requests, each a header and its payload.
+ * They are processed in order, in the transaction of the XS_MULTI, and
+ * their replies sent back the same way in one reply.  We stop early if
+ * the reply fills up: the client sends what is left again.
+ */
+static void do_multi(struct connection *conn, struct buffered_data *in)
+{
+	struct transaction *trans = conn->transaction;
+	struct multi_reply mr;
+	struct buffered_data *sub;
+	struct xsd_sockmsg hdr;
+	unsigned int off;
+
+	/* Check the whole batch before doing any of it. */
+	for (off = 0; off < in->used; off += sizeof(hdr) + hdr.len) {
+		if (in->used - off < sizeof(hdr)) {
+			send_error(conn, EINVAL);
+			return;
+		}
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+		if (hdr.len > in->used - off - sizeof(hdr) ||
+		    !multi_allowed(hdr.type)) {
+			send_error(conn, EINVAL);
+			return;
+		}
+	}
+
+	memset(&mr, 0, sizeof(mr));
+	mr.conn = conn;
+	mr.buffer = talloc_array(in, char, XENSTORE_PAYLOAD_MAX);
+	if (!mr.buffer) {
+		send_error(conn, ENOMEM);
+		return;
+	}
+
+	conn->transaction = NULL;
+	multi_reply = &mr;
+
+	for (off = 0; off < in->used; off += sizeof(hdr) + hdr.len) {
+		if (mr.used + MULTI_REPLY_MIN > XENSTORE_PAYLOAD_MAX)
+			break;
+
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+		hdr.tx_id = in->hdr.msg.tx_id;
+
+		sub = new_buffer(in);
+		if (sub)
+			sub->buffer = talloc_memdup(sub, in->buffer + off +
+						    sizeof(hdr), hdr.len);
+		if (!sub || (!sub->buffer && hdr.len)) {
+			if (!mr.nr_replies) {
+				multi_reply = NULL;
+				conn->transaction = trans;
+				send_error(conn, ENOMEM);
+				return;
+			}
+			break;
+		}
+		sub->hdr.msg = hdr;
+		sub->used = hdr.len;
+		sub->inhdr = false;
+
+		mr.req = &sub->hdr.msg;
+		process_message(conn, sub);
+
+		/*
+		 * Only reads have replies which may not fit: those can be
+		 * repeated, unless one alone is too big.
+		 */
+		if (mr.full) {
+			mr.full = false;
+			if (mr.nr_replies) {
+				talloc_free(sub);
+				break;
+			}
+			send_error(conn, E2BIG);
+		}
+		talloc_free(sub);
+	}
+
+	multi_reply = NULL;
+	conn->transaction = trans;
+
+	send_reply(conn, XS_MULTI, mr.buffer, mr.used);
+}
+
 /* Process "in" for conn: "in" will vanish after this conversation, so
  * we can talloc off it for temporary variables.  May free "conn".
  */
@@ -1291,6 +1960,14 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 		do_reset_watches(conn);
 		break;
 
+	case XS_MULTI:
+		do_multi(conn, in);
+		break;
+
+	case XS_LOCAL_RING:
+		do_local_ring(conn, in);
+		break;
+
 	default:
 		eprintf("Client unknown operation %i", in->hdr.msg.type);
 		send_error(conn, ENOSYS);
@@ -1300,14 +1977,71 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 	conn->transaction = NULL;
 }
 
+/* Can a worker thread serve this request?  See xenstored_worker.c. */
+static bool is_read_message(struct buffered_data *in)
+{
+	if (in->hdr.msg.tx_id != 0)
+		return false;
+
+	switch (in->hdr.msg.type) {
+	case XS_DIRECTORY:
+	case XS_READ:
+	case XS_GET_PERMS:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Runs on a worker thread: this must not change anything but the reply. */
+void process_read_message(struct connection *conn, struct buffered_data *in)
+{
+	switch (in->hdr.msg.type) {
+	case XS_DIRECTORY:
+		send_directory(conn, onearg(in));
+		break;
+
+	case XS_READ:
+		do_read(conn, onearg(in));
+		break;
+
+	case XS_GET_PERMS:
+		do_get_perms(conn, onearg(in));
+		break;
+
+	default:
+		send_error(conn, EINVAL);
+		break;
+	}
+}
+
 static void consider_message(struct connection *conn)
 {
+	bool write = !is_read_message(conn->in);
+
 	if (verbose)
 		xprintf("Got message %s len %i from %p\n",
 			sockmsg_string(conn->in->hdr.msg.type),
 			conn->in->hdr.msg.len, conn);
 
+	if (is_read_message(conn->in) && worker_submit(conn, conn->in)) {
+		/* The request belongs to the worker now. */
+		conn->in = new_buffer(conn);
+		close_passed_fds(conn);
+		return;
+	}
+
+	/*
+	 * Anything but a plain read may change the store: hold the write
+	 * lock for all of it (a whole XS_MULTI, or a transaction commit),
+	 * so workers see either none of its changes or all of them.
+	 */
+	if (write)
+		store_write_lock();
 	process_message(conn, conn->in);
+	if (write)
+		store_write_unlock();
+	close_passed_fds(conn);
 
 	talloc_free(conn->in);
 	conn->in = new_buffer(conn);
@@ -1367,6 +2101,131 @@ static void handle_output(struct connection *conn)
 		talloc_free(conn);
 }
 
+/* Send on the replies of requests the workers have finished. */
+static void handle_worker_done(void)
+{
+	struct worker_request *req;
+	struct connection *conn;
+
+	while ((req = worker_get_done()) != NULL) {
+		conn = req->conn;
+		queue_reply(conn, &req->in->hdr.msg, req->type, req->data,
+			    req->len);
+		talloc_free(req);
+
+		/* Resume reading requests from it. */
+		update_conn_fd(conn);
+		conn_ready(conn);
+	}
+}
+
+static void accept_connection(int sock, bool canwrite);
+
+static void handle_fd_event(int sock, int ro_sock, void *ptr, short revents)
+{
+	struct connection *conn;
+
+	if (ptr == &reopen_log_pipe) {
+		if (revents & ~POLLIN) {
+			close(reopen_log_pipe[0]);
+			close(reopen_log_pipe[1]);
+			init_pipe(reopen_log_pipe);
+			if (!add_fd(reopen_log_pipe[0], &reopen_log_pipe))
+				barf_perror("Failed to listen on log pipe");
+		} else if (revents & POLLIN) {
+			char c;
+			if (read(reopen_log_pipe[0], &c, 1) != 1)
+				barf_perror("read failed");
+			reopen_log();
+		}
+	} else if (ptr == &sock_tag) {
+		if (revents & ~POLLIN)
+			barf_perror("sock poll failed");
+		accept_connection(sock, true);
+	} else if (ptr == &ro_sock_tag) {
+		if (revents & ~POLLIN)
+			barf_perror("ro sock poll failed");
+		accept_connection(ro_sock, false);
+	} else if (ptr == &xce_handle) {
+		if (revents & ~POLLIN)
+			barf_perror("xce_handle poll failed");
+		handle_event();
+	} else if (ptr == &worker_tag) {
+		if (revents & ~POLLIN)
+			barf_perror("worker fd poll failed");
+		handle_worker_done();
+	} else {
+		conn = ptr;
+		conn->poll_events |= revents;
+		conn_ready(conn);
+	}
+}
+
+/*
+ * Service a queued connection.  handle_input/handle_output may free it:
+ * the extra reference makes that take effect at our talloc_free() instead.
+ */
+static void handle_connection(struct connection *conn)
+{
+	short revents = conn->poll_events;
+
+	conn->poll_events = 0;
+
+	/* While a worker serves a request, the next one waits. */
+	if (conn->domain || conn->ring) {
+		if (conn->ring && !local_ring_wake(conn, revents))
+			return;
+
+		talloc_increase_ref_count(conn);
+		if (!conn->request && ring_can_read(conn))
+			handle_input(conn);
+		if (talloc_free(conn) == 0)
+			return;
+
+		talloc_increase_ref_count(conn);
+		if (ring_can_write(conn) && !list_empty(&conn->out_list))
+			handle_output(conn);
+		if (talloc_free(conn) == 0)
+			return;
+
+		/* More requests in the ring, or more output which fits? */
+		if (ring_has_work(conn))
+			conn_ready(conn);
+		else if (conn->ring)
+			local_ring_wait(conn);
+	} else {
+		talloc_increase_ref_count(conn);
+		if (revents & ~(POLLIN|POLLPRI|POLLOUT))
+			talloc_free(conn);
+		else if ((revents & POLLIN) && !conn->request)
+			handle_input(conn);
+		if (talloc_free(conn) == 0)
+			return;
+
+		talloc_increase_ref_count(conn);
+		if ((revents & POLLOUT) && !list_empty(&conn->out_list))
+			handle_output(conn);
+		if (talloc_free(conn) == 0)
+			return;
+
+		update_conn_fd(conn);
+	}
+}
+
+static void handle_ready_connections(void)
+{
+	LIST_HEAD(work);
+	struct connection *conn;
+
+	/* Connections queued while we work wait for the next round. */
+	list_splice_init(&ready_connections, &work);
+	while (!list_empty(&work)) {
+		conn = list_entry(work.next, struct connection, ready);
+		list_del_init(&conn->ready);
+		handle_connection(conn);
+	}
+}
+
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 {
 	struct connection *new;
@@ -1377,6 +2236,8 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 
 	new->fd = -1;
 	new->pollfd_idx = -1;
+	INIT_LIST_HEAD(&new->ready);
+	new->fd_events = POLLIN|POLLPRI;
 	new->write = write;
 	new->read = read;
 	new->can_write = true;
@@ -1418,11 +2279,57 @@ static int writefd(struct connection *conn, const void *data, unsigned int len)
 	return rc;
 }
 
+#ifdef LOCAL_RING
+/* Like read(), but keeps the fds passed with LOCAL_RING requests. */
+static int recv_fds(struct connection *conn, void *data, unsigned int len)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int) * XS_LOCAL_RING_NR_FDS)];
+	} control;
+	struct iovec iov = { .iov_base = data, .iov_len = len };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = &control, .msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	unsigned int i, nr;
+	int rc, *fds;
+
+	/* Unlike read(), recvmsg() waits for data even when len is 0. */
+	if (!len)
+		return 0;
+
+	rc = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (rc < 0)
+		return rc;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		fds = (int *)CMSG_DATA(cmsg);
+		nr = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < nr; i++) {
+			if (conn->nr_passed_fds < XS_LOCAL_RING_NR_FDS)
+				conn->passed_fds[conn->nr_passed_fds++] =
+					fds[i];
+			else
+				close(fds[i]);
+		}
+	}
+
+	return rc;
+}
+#else
+#define recv_fds(conn, data, len) read((conn)->fd, data, len)
+#endif
+
 static int readfd(struct connection *conn, void *data, unsigned int len)
 {
 	int rc;
 
-	while ((rc = read(conn->fd, data, len)) < 0) {
+	while ((rc = recv_fds(conn, data, len)) < 0) {
 		if (errno == EAGAIN) {
 			rc = 0;
 			break;
@@ -1453,6 +2360,8 @@ static void accept_connection(int sock, bool canwrite)
 	if (conn) {
 		conn->fd = fd;
 		conn->can_write = canwrite;
+		if (!add_fd(fd, conn))
+			talloc_free(conn);
 	} else
 		close(fd);
 }
@@ -1484,10 +2393,7 @@ static void setup_structure(void)
 	char *tdbname;
 	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
 
-	if (!(tdb_flags & TDB_INTERNAL))
-		tdb_ctx = tdb_open(tdbname, 0, tdb_flags, O_RDWR, 0);
-
-	if (tdb_ctx) {
+	if (store_init(tdbname, tdb_flags)) {
 		/* XXX When we make xenstored able to restart, this will have
 		   to become cleverer, checking for existing domains and not
 		   removing the corresponding entries, but for now xenstored
@@ -1516,11 +2422,6 @@ static void setup_structure(void)
 		talloc_free(tlocal);
 	}
 	else {
-		tdb_ctx = tdb_open(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT,
-				   0640);
-		if (!tdb_ctx)
-			barf_perror("Could not create tdb file %s", tdbname);
-
 		manual_node("/", "tool");
 		manual_node("/tool", "xenstored");
 		manual_node("/tool/xenstored", NULL);
@@ -1530,7 +2431,7 @@ static void setup_structure(void)
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1543,7 +2444,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -1647,22 +2548,22 @@ static void check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static void clean_store_(const char *name, TDB_DATA val, void *private)
 {
 	struct hashtable *reachable = private;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
+	struct xs_tdb_record_hdr *hdr = (void *)val.dptr;
+
+	/* New writes must get generations beyond any already in the store. */
+	if (val.dsize >= offsetof(struct xs_tdb_record_hdr, perms) &&
+	    hdr->generation > generation)
+		generation = hdr->generation;
 
-	if (!hashtable_search(reachable, name)) {
+	if (!hashtable_search(reachable, (void *)name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			store_delete(name);
 		}
 	}
-
-	talloc_free(name);
-
-	return 0;
 }
 
 
@@ -1672,7 +2573,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	store_traverse(&clean_store_, reachable);
 }
 
 
@@ -1694,12 +2595,19 @@ static void check_store(void)
 
 
 /* Something is horribly wrong: check the store. */
-static void corrupt(struct connection *conn, const char *fmt, ...)
+void corrupt(struct connection *conn, const char *fmt, ...)
 {
 	va_list arglist;
 	char *str;
 	int saved_errno = errno;
 
+	/* Workers can't check the store: the main thread will notice too. */
+	if (in_worker()) {
+		syslog(LOG_ERR, "corruption detected by connection %i",
+		       conn ? (int)conn->id : -1);
+		return;
+	}
+
 	va_start(arglist, fmt);
 	str = talloc_vasprintf(NULL, fmt, arglist);
 	va_end(arglist);
@@ -1861,11 +2769,13 @@ static void usage(void)
 "  --entry-nb <nb>     limit the number of entries per domain,\n"
 "  --entry-size <size> limit the size of entry per domain, and\n"
 "  --watch-nb <nb>     limit the number of watches per domain,\n"
+"  --event-nb <nb>     limit the number of watch events queued per domain,\n"
 "  --transaction <nb>  limit the number of transaction allowed per domain,\n"
 "  --no-recovery       to request that no recovery should be attempted when\n"
 "                      the store is corrupted (debug only),\n"
 "  --internal-db       store database in memory, not on disk\n"
 "  --preserve-local    to request that /local is preserved on start-up,\n"
+"  --threads <nb>      serve reads with <nb> worker threads (default none),\n"
 "  --verbose           to request verbose execution.\n");
 }
 
@@ -1888,6 +2798,8 @@ static struct option options[] = {
 	{ "internal-db", 0, NULL, 'I' },
 	{ "verbose", 0, NULL, 'V' },
 	{ "watch-nb", 1, NULL, 'W' },
+	{ "event-nb", 1, NULL, 'Q' },
+	{ "threads", 1, NULL, 'j' },
 	{ NULL, 0, NULL, 0 } };
 
 extern void dump_conn(struct connection *conn); 
@@ -1898,12 +2810,11 @@ int priv_domid = 0;
 int main(int argc, char *argv[])
 {
 	int opt, *sock, *ro_sock;
-	int sock_pollfd_idx = -1, ro_sock_pollfd_idx = -1;
 	bool dofork = true;
 	bool outputpid = false;
 	bool no_domain_init = false;
 	const char *pidfile = NULL;
-	int timeout;
+	unsigned int nr_worker_threads = 0;
 
 	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLVW:", options,
 				  NULL)) != -1) {
@@ -1950,6 +2861,9 @@ int main(int argc, char *argv[])
 		case 'W':
 			quota_nb_watch_per_domain = strtol(optarg, NULL, 10);
 			break;
+		case 'Q':
+			quota_nb_event_per_conn = strtol(optarg, NULL, 10);
+			break;
 		case 'e':
 			dom0_event = strtol(optarg, NULL, 10);
 			break;
@@ -1959,6 +2873,9 @@ int main(int argc, char *argv[])
 		case 'p':
 			priv_domid = strtol(optarg, NULL, 10);
 			break;
+		case 'j':
+			nr_worker_threads = strtoul(optarg, NULL, 10);
+			break;
 		}
 	}
 	if (optind != argc)
@@ -1987,8 +2904,12 @@ int main(int argc, char *argv[])
 	if (pidfile)
 		write_pidfile(pidfile);
 
-	/* Talloc leak reports go to stderr, which is closed if we fork. */
-	if (!dofork)
+	/*
+	 * Talloc leak reports go to stderr, which is closed if we fork.
+	 * They track every allocation from the NULL context in one list,
+	 * which worker threads would corrupt: not with workers.
+	 */
+	if (!dofork && !nr_worker_threads)
 		talloc_enable_leak_report_full();
 
 	/* Don't kill us with SIGPIPE. */
@@ -2024,9 +2945,11 @@ int main(int argc, char *argv[])
 
 	signal(SIGHUP, trigger_reopen_log);
 
+	/* Threads only once we are done forking. */
+	worker_init(nr_worker_threads);
+
 	/* Get ready to listen to the tools. */
-	initialize_fds(*sock, &sock_pollfd_idx, *ro_sock, &ro_sock_pollfd_idx,
-		       &timeout);
+	init_fds(*sock, *ro_sock);
 
 	/* Tell the kernel we're up and running. */
 	xenbus_notify_running();
@@ -2040,114 +2963,13 @@ int main(int argc, char *argv[])
 
 	/* Main loop. */
 	for (;;) {
-		struct connection *conn, *next;
-
-		if (poll(fds, nr_fds, timeout) < 0) {
-			if (errno == EINTR)
-				continue;
-			barf_perror("Poll failed");
-		}
-
-		if (reopen_log_pipe0_pollfd_idx != -1) {
-			if (fds[reopen_log_pipe0_pollfd_idx].revents
-			    & ~POLLIN) {
-				close(reopen_log_pipe[0]);
-				close(reopen_log_pipe[1]);
-				init_pipe(reopen_log_pipe);
-			} else if (fds[reopen_log_pipe0_pollfd_idx].revents
-				   & POLLIN) {
-				char c;
-				if (read(reopen_log_pipe[0], &c, 1) != 1)
-					barf_perror("read failed");
-				reopen_log();
-			}
-			reopen_log_pipe0_pollfd_idx = -1;
-		}
-
-		if (sock_pollfd_idx != -1) {
-			if (fds[sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("sock poll failed");
-				break;
-			} else if (fds[sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*sock, true);
-				sock_pollfd_idx = -1;
-			}
-		}
-
-		if (ro_sock_pollfd_idx != -1) {
-			if (fds[ro_sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("ro sock poll failed");
-				break;
-			} else if (fds[ro_sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*ro_sock, false);
-				ro_sock_pollfd_idx = -1;
-			}
-		}
-
-		if (xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("xce_handle poll failed");
-				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN) {
-				handle_event();
-				xce_pollfd_idx = -1;
-			}
-		}
-
-		next = list_entry(connections.next, typeof(*conn), list);
-		if (&next->list != &connections)
-			talloc_increase_ref_count(next);
-		while (&next->list != &connections) {
-			conn = next;
-
-			next = list_entry(conn->list.next,
-					  typeof(*conn), list);
-			if (&next->list != &connections)
-				talloc_increase_ref_count(next);
-
-			if (conn->domain) {
-				if (domain_can_read(conn))
-					handle_input(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-				if (domain_can_write(conn) &&
-				    !list_empty(&conn->out_list))
-					handle_output(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-			} else {
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLIN)
-						handle_input(conn);
-				}
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLOUT)
-						handle_output(conn);
-				}
-				if (talloc_free(conn) == 0)
-					continue;
-
-				conn->pollfd_idx = -1;
-			}
-		}
+		/* Write back to the tdb file once we have nothing else to do. */
+		store_flush(list_empty(&ready_connections));
 
-		initialize_fds(*sock, &sock_pollfd_idx, *ro_sock,
-			       &ro_sock_pollfd_idx, &timeout);
+		/* Don't sleep while queued connections have more to do. */
+		wait_for_events(*sock, *ro_sock,
+				list_empty(&ready_connections) ? -1 : 0);
+		handle_ready_connections();
 	}
 }
 
@@ -63,6 +63,25 @@ struct connection
 	/* The index of pollfd in global pollfd array */
 	int pollfd_idx;
 
+	/* Entry in the main loop's list of connections with work to do. */
+	struct list_head ready;
+
+	/* fd events seen since the connection was last serviced. */
+	short poll_events;
+
+	/* Events currently requested for fd. */
+	short fd_events;
+
+	/* Read-only request being served by a worker thread, if any. */
+	struct worker_request *request;
+
+	/* Shared memory ring a socket connection moved onto, if any. */
+	struct local_ring *ring;
+
+	/* fds passed with the request being read. */
+	int passed_fds[XS_LOCAL_RING_NR_FDS];
+	unsigned int nr_passed_fds;
+
 	/* Who am I? 0 for socket connections. */
 	unsigned int id;
 
@@ -75,6 +94,10 @@ struct connection
 	/* Buffered output data */
 	struct list_head out_list;
 
+	/* Watch events in out_list, by payload, and how many there are. */
+	struct hashtable *events;
+	unsigned int nr_events;
+
 	/* Transaction context for current request (NULL if none). */
 	struct transaction *transaction;
 
@@ -101,8 +124,11 @@ extern struct list_head connections;
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Transaction I came from (NULL for the global store) */
+	struct transaction *trans;
+
+	/* Generation count when last written to the global store. */
+	uint64_t generation;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -133,6 +159,9 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 /* Some routines (write, mkdir, etc) just need a non-error return */
 void send_ack(struct connection *conn, enum xsd_sockmsg_type type);
 
+/* Drop everything queued for the connection. */
+void conn_discard_output(struct connection *conn);
+
 /* Send an error: error is usually "errno". */
 void send_error(struct connection *conn, int error);
 
@@ -147,17 +176,21 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
-
-/* Destructor for tdbs: required for transaction code */
-int destroy_tdb(void *_tdb);
+/* Something is horribly wrong: check the store. */
+void corrupt(struct connection *conn, const char *fmt, ...);
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
+/* Hash and compare functions for hashtables keyed by node name. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
+/* Have the main loop service this connection. */
+void conn_ready(struct connection *conn);
+
+/* Serve a read-only request (see xenstored_worker.c). */
+void process_read_message(struct connection *conn, struct buffered_data *in);
+
 
 /* Is this a valid node name? */
 bool is_valid_nodename(const char *node);
@@ -178,6 +211,10 @@ extern int priv_domid;
 void *xenbus_map(void);
 void unmap_xenbus(void *interface);
 
+/* Map the shared memory of a local client's ring (see do_local_ring()). */
+void *local_ring_map(int fd, size_t size);
+void local_ring_unmap(void *addr, size_t size);
+
 static inline int xenbus_master_domid(void) { return dom0_domid; }
 
 /* Return the event channel used by xenbus. */
@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 
 #include "utils.h"
 #include "talloc.h"
@@ -78,6 +79,47 @@ struct domain
 
 static LIST_HEAD(domains);
 
+/* Domains indexed by local event channel port, for handle_event(). */
+static struct domain **port_domains;
+static unsigned int nr_port_domains;
+
+static void set_port_domain(evtchn_port_t port, struct domain *domain)
+{
+	struct domain **new;
+	unsigned int nr;
+
+	if (port >= nr_port_domains) {
+		if (!domain)
+			return;
+		nr = (port + 64) & ~63;
+		new = realloc(port_domains, nr * sizeof(*new));
+		if (!new) {
+			/* find_domain_by_port() falls back to the list. */
+			eprintf("> realloc failed, no map for port %u", port);
+			return;
+		}
+		memset(new + nr_port_domains, 0,
+		       (nr - nr_port_domains) * sizeof(*new));
+		port_domains = new;
+		nr_port_domains = nr;
+	}
+	port_domains[port] = domain;
+}
+
+static struct domain *find_domain_by_port(evtchn_port_t port)
+{
+	struct domain *i;
+
+	if (port < nr_port_domains && port_domains[port])
+		return port_domains[port];
+
+	list_for_each_entry(i, &domains, list) {
+		if (i->port == port)
+			return i;
+	}
+	return NULL;
+}
+
 static bool check_indexes(XENSTORE_RING_IDX cons, XENSTORE_RING_IDX prod)
 {
 	return ((prod - cons) <= XENSTORE_RING_SIZE);
@@ -103,12 +145,11 @@ static const void *get_input_chunk(XENSTORE_RING_IDX cons,
 	return buf + MASK_XENSTORE_IDX(cons);
 }
 
-static int writechn(struct connection *conn,
+int interface_write(struct xenstore_domain_interface *intf,
 		    const void *data, unsigned int len)
 {
 	uint32_t avail;
 	void *dest;
-	struct xenstore_domain_interface *intf = conn->domain->interface;
 	XENSTORE_RING_IDX cons, prod;
 
 	/* Must read indexes once, and before anything else, and verified. */
@@ -129,16 +170,14 @@ static int writechn(struct connection *conn,
 	xen_mb();
 	intf->rsp_prod += len;
 
-	xc_evtchn_notify(xce_handle, conn->domain->port);
-
 	return len;
 }
 
-static int readchn(struct connection *conn, void *data, unsigned int len)
+int interface_read(struct xenstore_domain_interface *intf,
+		   void *data, unsigned int len)
 {
 	uint32_t avail;
 	const void *src;
-	struct xenstore_domain_interface *intf = conn->domain->interface;
 	XENSTORE_RING_IDX cons, prod;
 
 	/* Must read indexes once, and before anything else, and verified. */
@@ -159,11 +198,38 @@ static int readchn(struct connection *conn, void *data, unsigned int len)
 	xen_mb();
 	intf->req_cons += len;
 
-	xc_evtchn_notify(xce_handle, conn->domain->port);
-
 	return len;
 }
 
+bool interface_can_read(struct xenstore_domain_interface *intf)
+{
+	return (intf->req_cons != intf->req_prod);
+}
+
+bool interface_can_write(struct xenstore_domain_interface *intf)
+{
+	return ((intf->rsp_prod - intf->rsp_cons) != XENSTORE_RING_SIZE);
+}
+
+static int writechn(struct connection *conn,
+		    const void *data, unsigned int len)
+{
+	int ret = interface_write(conn->domain->interface, data, len);
+
+	if (ret >= 0)
+		xc_evtchn_notify(xce_handle, conn->domain->port);
+	return ret;
+}
+
+static int readchn(struct connection *conn, void *data, unsigned int len)
+{
+	int ret = interface_read(conn->domain->interface, data, len);
+
+	if (ret >= 0)
+		xc_evtchn_notify(xce_handle, conn->domain->port);
+	return ret;
+}
+
 static void *map_interface(domid_t domid, unsigned long mfn)
 {
 	if (*xcg_handle != NULL) {
@@ -191,6 +257,7 @@ static int destroy_domain(void *_domain)
 	list_del(&domain->list);
 
 	if (domain->port) {
+		set_port_domain(domain->port, NULL);
 		if (xc_evtchn_unbind(xce_handle, domain->port) == -1)
 			eprintf("> Unbinding port %i failed!\n", domain->port);
 	}
@@ -235,16 +302,19 @@ static void domain_cleanup(void)
 		fire_watches(NULL, "@releaseDomain", false);
 }
 
-/* We scan all domains rather than use the information given here. */
 void handle_event(void)
 {
 	evtchn_port_t port;
+	struct domain *domain;
 
 	if ((port = xc_evtchn_pending(xce_handle)) == -1)
 		barf_perror("Failed to read from event fd");
 
 	if (port == virq_port)
 		domain_cleanup();
+	else if ((domain = find_domain_by_port(port)) != NULL &&
+		 domain->interface)
+		conn_ready(domain->conn);
 
 	if (xc_evtchn_unmask(xce_handle, port) == -1)
 		barf_perror("Failed to write to event fd");
@@ -252,8 +322,7 @@ void handle_event(void)
 
 bool domain_can_read(struct connection *conn)
 {
-	struct xenstore_domain_interface *intf = conn->domain->interface;
-	return (intf->req_cons != intf->req_prod);
+	return interface_can_read(conn->domain->interface);
 }
 
 bool domain_is_unprivileged(struct connection *conn)
@@ -263,8 +332,7 @@ bool domain_is_unprivileged(struct connection *conn)
 
 bool domain_can_write(struct connection *conn)
 {
-	struct xenstore_domain_interface *intf = conn->domain->interface;
-	return ((intf->rsp_prod - intf->rsp_cons) != XENSTORE_RING_SIZE);
+	return interface_can_write(conn->domain->interface);
 }
 
 static char *talloc_domain_path(void *context, unsigned int domid)
@@ -292,6 +360,7 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	if (rc == -1)
 	    return NULL;
 	domain->port = rc;
+	set_port_domain(domain->port, domain);
 
 	domain->conn = new_connection(writechn, readchn);
 	domain->conn->domain = domain;
@@ -319,15 +388,10 @@ static struct domain *find_domain_by_domid(unsigned int domid)
 static void domain_conn_reset(struct domain *domain)
 {
 	struct connection *conn = domain->conn;
-	struct buffered_data *out;
 
 	conn_delete_all_watches(conn);
 	conn_delete_all_transactions(conn);
-
-	while ((out = list_top(&conn->out_list, struct buffered_data, list))) {
-		list_del(&out->list);
-		talloc_free(out);
-	}
+	conn_discard_output(conn);
 
 	talloc_free(conn->in->buffer);
 	memset(conn->in, 0, sizeof(*conn->in));
@@ -392,10 +456,14 @@ void do_introduce(struct connection *conn, struct buffered_data *in)
 		fire_watches(NULL, "@introduceDomain", false);
 	} else if ((domain->mfn == mfn) && (domain->conn != conn)) {
 		/* Use XS_INTRODUCE for recreating the xenbus event-channel. */
-		if (domain->port)
+		if (domain->port) {
+			set_port_domain(domain->port, NULL);
 			xc_evtchn_unbind(xce_handle, domain->port);
+		}
 		rc = xc_evtchn_bind_interdomain(xce_handle, domid, port);
 		domain->port = (rc == -1) ? 0 : rc;
+		if (domain->port)
+			set_port_domain(domain->port, domain);
 		domain->remote_port = port;
 	} else {
 		send_error(conn, EINVAL);
@@ -404,6 +472,9 @@ void do_introduce(struct connection *conn, struct buffered_data *in)
 
 	domain_conn_reset(domain);
 
+	/* The guest may have queued requests before we were listening. */
+	conn_ready(domain->conn);
+
 	send_ack(conn, XS_INTRODUCE);
 }
 
@@ -614,6 +685,7 @@ static int dom0_init(void)
 		return -1;
 
 	talloc_steal(dom0->conn, dom0); 
+	conn_ready(dom0->conn);
 
 	xc_evtchn_notify(xce_handle, dom0->port); 
 
@@ -57,6 +57,19 @@ bool domain_can_write(struct connection *conn);
 
 bool domain_is_unprivileged(struct connection *conn);
 
+/*
+ * The server side of a xenstore_domain_interface ring: copy out requests
+ * and copy in replies, as much as fits.  Returns the number of bytes, or
+ * -1 with errno set if the indexes are corrupt.  Also used for the shared
+ * memory rings of local clients.
+ */
+int interface_write(struct xenstore_domain_interface *intf,
+		    const void *data, unsigned int len);
+int interface_read(struct xenstore_domain_interface *intf,
+		   void *data, unsigned int len);
+bool interface_can_read(struct xenstore_domain_interface *intf);
+bool interface_can_write(struct xenstore_domain_interface *intf);
+
 /* Quota manipulation */
 void domain_entry_inc(struct connection *conn, struct node *);
 void domain_entry_dec(struct connection *conn, struct node *);
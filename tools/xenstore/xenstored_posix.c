@@ -17,10 +17,13 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 
@@ -101,6 +104,34 @@ void unmap_xenbus(void *interface)
 	munmap(interface, getpagesize());
 }
 
+void *local_ring_map(int fd, size_t size)
+{
+#ifdef F_SEAL_SHRINK
+	struct stat st;
+	void *addr;
+	int seals;
+
+	/* The client must not be able to pull the memory from under us. */
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK) ||
+	    fstat(fd, &st) != 0 || st.st_size < size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	return addr == MAP_FAILED ? NULL : addr;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+void local_ring_unmap(void *addr, size_t size)
+{
+	munmap(addr, size);
+}
+
 #ifndef __sun__
 evtchn_port_t xenbus_evtchn(void)
 {
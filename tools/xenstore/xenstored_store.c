@@ -0,0 +1,409 @@
+/*
+    In-memory node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "utils.h"
+#include "talloc.h"
+#include "list.h"
+#include "hashtable.h"
+#include "xenstored_core.h"
+#include "xenstored_store.h"
+
+/*
+ * The node records are kept in memory, indexed by name, so reading a node
+ * costs a hash lookup and no copy.  A record is immutable once stored:
+ * writes replace it, and readers hold a reference to the version they
+ * looked up, so they never see it change under them.
+ *
+ * The tdb file, if any, is only written to.  Changed names are queued and
+ * written back when the daemon is idle (or when enough of them pile up),
+ * so the file lags the store by at most a batch while we are busy.
+ */
+struct store_record
+{
+	unsigned int refs;
+	TDB_DATA data;
+};
+
+struct store_entry
+{
+	/* List of all entries, for store_traverse(). */
+	struct list_head list;
+
+	/* Entries not yet written to the tdb file. */
+	struct list_head dirty;
+
+	/* Also the hashtable's key. */
+	char *name;
+
+	/* NULL for a deleted entry kept until the deletion is flushed. */
+	struct store_record *rec;
+};
+
+/* Flush even while busy once this many changes are pending. */
+#define STORE_FLUSH_BATCH 1024
+
+static struct hashtable *entries;
+static LIST_HEAD(entry_list);
+static LIST_HEAD(dirty_list);
+static unsigned int nr_dirty;
+
+static TDB_CONTEXT *tdb_ctx;
+
+#ifdef USE_PTHREAD
+static pthread_rwlock_t store_lock;
+
+void store_read_lock(void)
+{
+	pthread_rwlock_rdlock(&store_lock);
+}
+
+void store_read_unlock(void)
+{
+	pthread_rwlock_unlock(&store_lock);
+}
+
+void store_write_lock(void)
+{
+	pthread_rwlock_wrlock(&store_lock);
+}
+
+void store_write_unlock(void)
+{
+	pthread_rwlock_unlock(&store_lock);
+}
+
+/* Readers on several threads may take references to the same record. */
+#define get_ref(rec)	__sync_add_and_fetch(&(rec)->refs, 1)
+#define put_ref(rec)	__sync_sub_and_fetch(&(rec)->refs, 1)
+#else
+#define get_ref(rec)	(++(rec)->refs)
+#define put_ref(rec)	(--(rec)->refs)
+#endif
+
+static struct store_record *new_record(TDB_DATA data)
+{
+	struct store_record *rec;
+
+	rec = malloc(sizeof(*rec) + data.dsize);
+	if (!rec)
+		return NULL;
+	rec->refs = 1;
+	rec->data.dptr = (void *)(rec + 1);
+	rec->data.dsize = data.dsize;
+	memcpy(rec->data.dptr, data.dptr, data.dsize);
+	return rec;
+}
+
+static void put_record(struct store_record *rec)
+{
+	if (rec && put_ref(rec) == 0)
+		free(rec);
+}
+
+/* Ties a reference to a record to the lifetime of a talloc context. */
+static int destroy_record_ref(void *_ref)
+{
+	struct store_record **ref = _ref;
+
+	put_record(*ref);
+	return 0;
+}
+
+static struct store_entry *find_entry(const char *name)
+{
+	return hashtable_search(entries, (void *)name);
+}
+
+static void free_entry(struct store_entry *entry)
+{
+	/* Frees entry->name. */
+	hashtable_remove(entries, entry->name);
+	list_del(&entry->list);
+	put_record(entry->rec);
+	free(entry);
+}
+
+static void mark_dirty(struct store_entry *entry, struct list_head *deleted)
+{
+	if (!tdb_ctx) {
+		/* Nothing to write back: deleted entries go once published. */
+		if (!entry->rec && list_empty(&entry->dirty))
+			list_add_tail(&entry->dirty, deleted);
+		return;
+	}
+	if (list_empty(&entry->dirty)) {
+		list_add_tail(&entry->dirty, &dirty_list);
+		nr_dirty++;
+	}
+}
+
+static struct store_entry *new_entry(const char *name)
+{
+	struct store_entry *entry;
+
+	entry = malloc(sizeof(*entry));
+	if (!entry)
+		return NULL;
+	entry->name = strdup(name);
+	entry->rec = NULL;
+	INIT_LIST_HEAD(&entry->dirty);
+	if (!entry->name ||
+	    !hashtable_insert(entries, entry->name, entry)) {
+		free(entry->name);
+		free(entry);
+		return NULL;
+	}
+	list_add_tail(&entry->list, &entry_list);
+	return entry;
+}
+
+TDB_DATA store_fetch(const void *ctx, const char *name)
+{
+	TDB_DATA data = { .dptr = NULL, .dsize = 0 };
+	struct store_entry *entry = find_entry(name);
+	struct store_record **ref;
+
+	if (!entry || !entry->rec) {
+		errno = ENOENT;
+		return data;
+	}
+
+	ref = talloc(ctx, struct store_record *);
+	if (!ref) {
+		errno = ENOMEM;
+		return data;
+	}
+	*ref = entry->rec;
+	get_ref(*ref);
+	talloc_set_destructor(ref, destroy_record_ref);
+
+	return entry->rec->data;
+}
+
+bool store_commit(const struct store_change *changes, unsigned int nr)
+{
+	struct staged {
+		struct store_entry *entry;
+		struct store_record *rec;
+		bool created;
+	} *staged;
+	struct store_entry *entry, *next;
+	LIST_HEAD(deleted);
+	unsigned int i;
+	int saved_errno;
+
+	staged = calloc(nr ? nr : 1, sizeof(*staged));
+	if (!staged) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	/*
+	 * Allocate everything first.  Entries created here have no record
+	 * yet, so they look absent until they are published.
+	 */
+	for (i = 0; i < nr; i++) {
+		struct staged *s = &staged[i];
+
+		s->entry = find_entry(changes[i].name);
+		if (!changes[i].data.dptr) {
+			if (!s->entry || !s->entry->rec) {
+				errno = ENOENT;
+				goto fail;
+			}
+			continue;
+		}
+
+		s->rec = new_record(changes[i].data);
+		if (!s->rec) {
+			errno = ENOMEM;
+			goto fail;
+		}
+		if (!s->entry) {
+			s->entry = new_entry(changes[i].name);
+			if (!s->entry) {
+				errno = ENOMEM;
+				goto fail;
+			}
+			s->created = true;
+		}
+	}
+
+	/* Then publish: nothing below can fail. */
+	for (i = 0; i < nr; i++) {
+		put_record(staged[i].entry->rec);
+		staged[i].entry->rec = staged[i].rec;
+		mark_dirty(staged[i].entry, &deleted);
+	}
+
+	/*
+	 * Later changes in the batch may still name a deleted entry, and may
+	 * even have brought it back.
+	 */
+	list_for_each_entry_safe(entry, next, &deleted, dirty) {
+		list_del_init(&entry->dirty);
+		if (!entry->rec)
+			free_entry(entry);
+	}
+
+	free(staged);
+	return true;
+
+ fail:
+	saved_errno = errno;
+	for (nr = i + 1, i = 0; i < nr; i++) {
+		put_record(staged[i].rec);
+		if (staged[i].created)
+			free_entry(staged[i].entry);
+	}
+	free(staged);
+	errno = saved_errno;
+	return false;
+}
+
+bool store_store(const char *name, TDB_DATA data)
+{
+	struct store_change change = { .name = name, .data = data };
+
+	return store_commit(&change, 1);
+}
+
+bool store_delete(const char *name)
+{
+	struct store_change change = { .name = name };
+
+	return store_commit(&change, 1);
+}
+
+void store_traverse(void (*fn)(const char *name, TDB_DATA data, void *priv),
+		    void *priv)
+{
+	struct store_entry *entry, *next;
+
+	list_for_each_entry_safe(entry, next, &entry_list, list) {
+		/* fn may delete entry, but nothing else. */
+		if (entry->rec)
+			fn(entry->name, entry->rec->data, priv);
+	}
+}
+
+void store_flush(bool force)
+{
+	struct store_entry *entry, *next;
+	LIST_HEAD(deleted);
+	TDB_DATA key;
+	int ret;
+
+	if (!nr_dirty || (!force && nr_dirty < STORE_FLUSH_BATCH))
+		return;
+
+	/* Only the main thread changes the list, so no lock to write back. */
+	while (!list_empty(&dirty_list)) {
+		entry = list_entry(dirty_list.next, struct store_entry, dirty);
+		list_del_init(&entry->dirty);
+		nr_dirty--;
+
+		key.dptr = (void *)entry->name;
+		key.dsize = strlen(entry->name);
+		if (entry->rec)
+			ret = tdb_store(tdb_ctx, key, entry->rec->data,
+					TDB_REPLACE);
+		else {
+			ret = tdb_delete(tdb_ctx, key);
+			if (ret != 0 && tdb_error(tdb_ctx) == TDB_ERR_NOEXIST)
+				ret = 0;
+			list_add_tail(&entry->dirty, &deleted);
+		}
+		if (ret != 0)
+			syslog(LOG_ERR, "TDB error on write back: %s",
+			       tdb_errorstr(tdb_ctx));
+	}
+
+	/* Dropping the deleted entries changes the hashtable, though. */
+	if (list_empty(&deleted))
+		return;
+	store_write_lock();
+	list_for_each_entry_safe(entry, next, &deleted, dirty)
+		free_entry(entry);
+	store_write_unlock();
+}
+
+static int load_record(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
+		       void *private)
+{
+	char *name = talloc_strndup(NULL, (char *)key.dptr, key.dsize);
+	struct store_entry *entry;
+
+	entry = name ? new_entry(name) : NULL;
+	if (!entry || !(entry->rec = new_record(val)))
+		barf("Out of memory loading the store");
+
+	talloc_free(name);
+	return 0;
+}
+
+bool store_init(const char *tdbname, int tdb_flags)
+{
+	bool loaded = false;
+#ifdef USE_PTHREAD
+	pthread_rwlockattr_t attr;
+
+	/* Don't let a stream of reads hold up writes indefinitely. */
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	pthread_rwlockattr_setkind_np(&attr,
+		PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	if (pthread_rwlock_init(&store_lock, &attr) != 0)
+		barf("Could not initialise the store lock");
+	pthread_rwlockattr_destroy(&attr);
+#endif
+
+	entries = create_hashtable(7919, hash_from_key_fn, keys_equal_fn);
+	if (!entries)
+		barf_perror("Could not create the store");
+
+	/* An internal database has nothing to persist. */
+	if (tdb_flags & TDB_INTERNAL)
+		return false;
+
+	tdb_ctx = tdb_open(tdbname, 0, tdb_flags, O_RDWR, 0);
+	if (tdb_ctx) {
+		if (tdb_traverse(tdb_ctx, load_record, NULL) < 0)
+			barf("Could not load the store from %s", tdbname);
+		loaded = true;
+	} else {
+		tdb_ctx = tdb_open(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT,
+				   0640);
+		if (!tdb_ctx)
+			barf_perror("Could not create tdb file %s", tdbname);
+	}
+
+	return loaded;
+}
@@ -0,0 +1,81 @@
+/*
+    In-memory node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _XENSTORED_STORE_H
+#define _XENSTORED_STORE_H
+
+#include <stdbool.h>
+#include "tdb.h"
+
+/*
+ * Open the store.  Without TDB_INTERNAL in tdb_flags, tdbname is used to
+ * persist it.  Returns true if the store was loaded from an existing file.
+ */
+bool store_init(const char *tdbname, int tdb_flags);
+
+/*
+ * Look up a record.  The returned data is immutable and stays valid until
+ * ctx is freed, even if the record is replaced or deleted meanwhile.
+ * dptr is NULL and errno is ENOENT if there is no such record.
+ */
+TDB_DATA store_fetch(const void *ctx, const char *name);
+
+/* One change in a store_commit(): a NULL data.dptr deletes the record. */
+struct store_change
+{
+	const char *name;
+	TDB_DATA data;
+};
+
+/*
+ * Apply several changes at once.  Either all of them are made, or, if
+ * one fails (ENOENT for a missing record to delete, or ENOMEM), none is.
+ */
+bool store_commit(const struct store_change *changes, unsigned int nr);
+
+/* Replace (or create) a record with a copy of data. */
+bool store_store(const char *name, TDB_DATA data);
+
+/* Delete a record: fails with ENOENT if there is none. */
+bool store_delete(const char *name);
+
+/* Call fn on each record, which may delete the record it is given. */
+void store_traverse(void (*fn)(const char *name, TDB_DATA data, void *priv),
+		    void *priv);
+
+/* Write back changes to the tdb file, if any.  force ignores batching. */
+void store_flush(bool force);
+
+/*
+ * Only the main thread changes the store.  Worker threads reading it
+ * hold the read lock, which keeps the store as it is meanwhile.  The
+ * main thread holds the write lock for the whole of a request which may
+ * change the store, so readers see all of its changes or none.  Store
+ * functions changing the store must be called with it held.
+ */
+#ifdef USE_PTHREAD
+void store_read_lock(void);
+void store_read_unlock(void);
+void store_write_lock(void);
+void store_write_unlock(void);
+#else
+static inline void store_write_lock(void) { }
+static inline void store_write_unlock(void) { }
+#endif
+
+#endif /* _XENSTORED_STORE_H */
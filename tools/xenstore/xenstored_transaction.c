@@ -30,9 +30,11 @@
 #include <unistd.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 
@@ -48,6 +50,43 @@ struct changed_node
 	bool recurse;
 };
 
+/*
+ * A transaction does not copy the store.  Instead every node it touches is
+ * pulled into a per-transaction overlay on first access, together with the
+ * record as it was in the store at that time.  Reads and writes inside the
+ * transaction only ever see the overlay, so the transaction works on a
+ * consistent view of everything it looked at.
+ *
+ * Every record carries the generation count of its last write.  At commit
+ * time each overlay entry is checked against the store: an entry whose
+ * generation is unchanged is fine.  If it did change, the commit fails
+ * with EAGAIN, unless the transaction only depended on the node's
+ * permissions (the parent of a node it created or removed).  In that case
+ * the children the transaction added or removed are merged into the
+ * current record, so that e.g. concurrent domain creations do not
+ * conflict on /local/domain.
+ */
+struct accessed_node
+{
+	/* List of all nodes accessed in the context of this transaction. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *node;
+
+	/* Record in the store when first accessed (dptr NULL if absent). */
+	TDB_DATA orig;
+
+	/* Record as seen by the transaction (dptr NULL if absent). */
+	TDB_DATA data;
+
+	/* Read set: did the transaction depend on more than permissions? */
+	bool read;
+
+	/* Write set: has the transaction written or deleted the node? */
+	bool modified;
+};
+
 struct changed_domain
 {
 	/* List of all changed domains in the context of this transaction. */
@@ -68,12 +107,9 @@ struct transaction
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
-	/* Generation when transaction started. */
-	unsigned int generation;
-
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* Nodes accessed by this transaction, indexed by name. */
+	struct hashtable *accessed_hash;
+	struct list_head accessed;
 
 	/* List of changed nodes. */
 	struct list_head changes;
@@ -83,12 +119,315 @@ struct transaction
 };
 
 extern int quota_max_transaction;
-static unsigned int generation;
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+/* Generation count of the last write to the global store. */
+uint64_t generation;
+
+/* Transaction statistics, reported by "xenstore-control transactions". */
+static struct {
+	unsigned long started;
+	unsigned long committed;
+	unsigned long aborted;
+	unsigned long conflicts;
+	unsigned long merged;
+} stats;
+
+static TDB_DATA copy_data(const void *ctx, TDB_DATA data)
+{
+	TDB_DATA copy = { .dptr = NULL, .dsize = 0 };
+
+	if (data.dptr) {
+		copy.dptr = talloc_memdup(ctx, data.dptr, data.dsize);
+		copy.dsize = data.dsize;
+	}
+	return copy;
+}
+
+static struct xs_tdb_record_hdr *record_hdr(TDB_DATA data)
+{
+	return (struct xs_tdb_record_hdr *)data.dptr;
+}
+
+static char *record_children(TDB_DATA data)
+{
+	struct xs_tdb_record_hdr *hdr = record_hdr(data);
+
+	return (char *)&hdr->perms[hdr->num_perms] + hdr->datalen;
+}
+
+/* Length of the permissions and data, which precede the children. */
+static size_t record_body_len(TDB_DATA data)
+{
+	return record_children(data) - (char *)record_hdr(data)->perms;
+}
+
+static bool same_generation(TDB_DATA a, TDB_DATA b)
+{
+	if (!a.dptr || !b.dptr)
+		return a.dptr == b.dptr;
+	return record_hdr(a)->generation == record_hdr(b)->generation;
+}
+
+static bool same_perms(TDB_DATA a, TDB_DATA b)
+{
+	struct xs_tdb_record_hdr *ha = record_hdr(a), *hb = record_hdr(b);
+
+	return ha->num_perms == hb->num_perms &&
+		memcmp(ha->perms, hb->perms,
+		       ha->num_perms * sizeof(ha->perms[0])) == 0;
+}
+
+/* Do the records differ in anything but their children? */
+static bool same_head(TDB_DATA a, TDB_DATA b)
+{
+	struct xs_tdb_record_hdr *ha = record_hdr(a), *hb = record_hdr(b);
+	size_t len = record_body_len(a);
+
+	return ha->num_perms == hb->num_perms && len == record_body_len(b) &&
+		memcmp(ha->perms, hb->perms, len) == 0;
+}
+
+static bool has_child(const char *children, unsigned int childlen,
+		      const char *name)
 {
-	return trans->tdb;
+	unsigned int i;
+
+	for (i = 0; i < childlen; i += strlen(children + i) + 1)
+		if (streq(children + i, name))
+			return true;
+	return false;
+}
+
+/*
+ * Apply the children the transaction added to or removed from its copy of
+ * a node (ours, compared to orig) to the current record in the store.
+ * Returns a NULL record if the changes do not apply any more.
+ */
+static TDB_DATA merge_children(const void *ctx, TDB_DATA orig, TDB_DATA ours,
+			       TDB_DATA cur)
+{
+	TDB_DATA merged = { .dptr = NULL, .dsize = 0 };
+	const char *oc = record_children(orig), *uc = record_children(ours);
+	unsigned int olen = record_hdr(orig)->childlen;
+	unsigned int ulen = record_hdr(ours)->childlen;
+	unsigned int clen = record_hdr(cur)->childlen;
+	unsigned int i, len, skip = 0;
+	char *mc;
+
+	/* Children are usually only appended or removed: skip the prefix. */
+	while (skip < olen && skip < ulen && streq(oc + skip, uc + skip))
+		skip += strlen(oc + skip) + 1;
+
+	/* Worst case all of ours get added to the current children. */
+	merged.dptr = talloc_size(ctx, cur.dsize + ulen);
+	memcpy(merged.dptr, cur.dptr, cur.dsize - clen);
+	mc = record_children(merged);
+	len = 0;
+
+	/* Keep current children, minus those the transaction removed. */
+	for (i = 0; i < clen; i += strlen(record_children(cur) + i) + 1) {
+		const char *name = record_children(cur) + i;
+
+		if (has_child(oc + skip, olen - skip, name) &&
+		    !has_child(uc + skip, ulen - skip, name))
+			continue;
+		strcpy(mc + len, name);
+		len += strlen(name) + 1;
+	}
+
+	/* Removed children must still have been there. */
+	for (i = skip; i < olen; i += strlen(oc + i) + 1)
+		if (!has_child(uc + skip, ulen - skip, oc + i) &&
+		    !has_child(record_children(cur), clen, oc + i))
+			goto fail;
+
+	/* Added children must not have been created concurrently. */
+	for (i = skip; i < ulen; i += strlen(uc + i) + 1) {
+		if (has_child(oc + skip, olen - skip, uc + i))
+			continue;
+		if (has_child(record_children(cur), clen, uc + i))
+			goto fail;
+		strcpy(mc + len, uc + i);
+		len += strlen(uc + i) + 1;
+	}
+
+	record_hdr(merged)->childlen = len;
+	merged.dsize = cur.dsize - clen + len;
+	return merged;
+
+ fail:
+	talloc_free(merged.dptr);
+	merged.dptr = NULL;
+	return merged;
+}
+
+/* Find a node in the overlay, pulling it in from the store if needed. */
+static struct accessed_node *access_node(struct transaction *trans,
+					 const char *name, bool perms_only)
+{
+	struct accessed_node *i;
+	char *hkey;
+
+	i = hashtable_search(trans->accessed_hash, (void *)name);
+	if (i) {
+		i->read |= !perms_only;
+		return i;
+	}
+
+	i = talloc(trans, struct accessed_node);
+	i->node = talloc_strdup(i, name);
+	/* A reference to the store's record, not a copy. */
+	i->orig = store_fetch(i, name);
+	if (!i->orig.dptr && errno != ENOENT) {
+		talloc_free(i);
+		return NULL;
+	}
+	i->data = i->orig;
+	i->read = !perms_only;
+	i->modified = false;
+
+	/* The hashtable frees its keys with free(). */
+	hkey = strdup(name);
+	if (!hkey || !hashtable_insert(trans->accessed_hash, hkey, i)) {
+		free(hkey);
+		talloc_free(i);
+		errno = ENOMEM;
+		return NULL;
+	}
+	list_add_tail(&i->list, &trans->accessed);
+
+	return i;
+}
+
+TDB_DATA transaction_fetch(const void *ctx, struct transaction *trans,
+			   const char *name, bool perms_only)
+{
+	struct accessed_node *i;
+	TDB_DATA data = { .dptr = NULL, .dsize = 0 };
+
+	i = access_node(trans, name, perms_only);
+	if (!i)
+		return data;
+
+	if (!i->data.dptr) {
+		errno = ENOENT;
+		return data;
+	}
+	return copy_data(ctx, i->data);
+}
+
+bool transaction_store(struct transaction *trans, const char *name,
+		       TDB_DATA data)
+{
+	struct accessed_node *i;
+
+	i = access_node(trans, name, true);
+	if (!i)
+		return false;
+
+	if (i->data.dptr != i->orig.dptr)
+		talloc_free(i->data.dptr);
+	i->data = copy_data(i, data);
+	i->modified = true;
+	return true;
+}
+
+bool transaction_delete(struct transaction *trans, const char *name)
+{
+	struct accessed_node *i;
+
+	i = access_node(trans, name, true);
+	if (!i)
+		return false;
+
+	if (!i->data.dptr) {
+		errno = ENOENT;
+		return false;
+	}
+
+	if (i->data.dptr != i->orig.dptr)
+		talloc_free(i->data.dptr);
+	i->data.dptr = NULL;
+	i->data.dsize = 0;
+	i->modified = true;
+	return true;
+}
+
+/*
+ * Check the transaction against the store.  Returns false if it conflicts
+ * with a change committed since it started; otherwise each entry's data is
+ * left holding the record to write back.
+ */
+static bool transaction_validate(struct transaction *trans)
+{
+	struct accessed_node *i;
+	TDB_DATA cur, merged;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		cur = store_fetch(i, i->node);
+		if (!cur.dptr && errno != ENOENT)
+			return false;
+
+		if (same_generation(i->orig, cur))
+			continue;
+
+		/* Only the permissions mattered: are they unchanged? */
+		if (i->read || !i->orig.dptr || !cur.dptr ||
+		    !same_perms(i->orig, cur))
+			return false;
+		if (!i->modified)
+			continue;
+
+		/* Deleted, or changed more than its children? */
+		if (!i->data.dptr || !same_head(i->orig, i->data))
+			return false;
+		merged = merge_children(i, i->orig, i->data, cur);
+		if (!merged.dptr)
+			return false;
+		if (i->data.dptr != i->orig.dptr)
+			talloc_free(i->data.dptr);
+		i->data = merged;
+		stats.merged++;
+	}
+	return true;
+}
+
+/*
+ * Write the transaction's modifications back to the store, all or nothing:
+ * on failure the store is left as it was and errno says why.
+ */
+static bool transaction_apply(struct transaction *trans)
+{
+	struct accessed_node *i;
+	struct store_change *changes;
+	unsigned int nr = 0;
+	bool ret;
+
+	list_for_each_entry(i, &trans->accessed, list)
+		if (i->modified && (i->orig.dptr || i->data.dptr))
+			nr++;
+
+	changes = talloc_array(trans, struct store_change, nr ? nr : 1);
+	if (!changes) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	nr = 0;
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->modified || (!i->orig.dptr && !i->data.dptr))
+			continue;
+
+		if (i->data.dptr)
+			record_hdr(i->data)->generation = ++generation;
+		changes[nr].name = i->node;
+		changes[nr].data = i->data;
+		nr++;
+	}
+
+	ret = store_commit(changes, nr);
+	talloc_free(changes);
+	return ret;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -97,11 +436,8 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 {
 	struct changed_node *i;
 
-	if (!trans) {
-		/* They're changing the global database. */
-		generation++;
+	if (!trans)
 		return;
-	}
 
 	list_for_each_entry(i, &trans->changes, list)
 		if (streq(i->node, node))
@@ -118,9 +454,8 @@ static int destroy_transaction(void *_transaction)
 	struct transaction *trans = _transaction;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+	/* Keys were strdup()ed, the values are talloc children of trans. */
+	hashtable_destroy(trans->accessed_hash, 0);
 	return 0;
 }
 
@@ -156,18 +491,15 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 
 	/* Attach transaction to input for autofree until it's complete */
 	trans = talloc(in, struct transaction);
+	INIT_LIST_HEAD(&trans->accessed);
 	INIT_LIST_HEAD(&trans->changes);
 	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
+	trans->accessed_hash = create_hashtable(16, hash_from_key_fn,
+						keys_equal_fn);
+	if (!trans->accessed_hash) {
+		send_error(conn, ENOMEM);
 		return;
 	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -180,6 +512,7 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	talloc_steal(conn, trans);
 	talloc_set_destructor(trans, destroy_transaction);
 	conn->transaction_started++;
+	stats.started++;
 
 	snprintf(id_str, sizeof(id_str), "%u", trans->id);
 	send_reply(conn, XS_TRANSACTION_START, id_str, strlen(id_str)+1);
@@ -209,17 +542,16 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	talloc_steal(arg, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
+		if (!transaction_validate(trans)) {
+			stats.conflicts++;
 			send_error(conn, EAGAIN);
 			return;
 		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
+		/* A failed apply changes nothing: the client may retry. */
+		if (!transaction_apply(trans)) {
 			send_error(conn, errno);
 			return;
 		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
 
 		/* fix domain entry for each changed domain */
 		list_for_each_entry(d, &trans->changed_domains, list)
@@ -228,11 +560,24 @@ void do_transaction_end(struct connection *conn, const char *arg)
 		/* Fire off the watches for everything that changed. */
 		list_for_each_entry(i, &trans->changes, list)
 			fire_watches(conn, i->node, i->recurse);
-		generation++;
-	}
+		stats.committed++;
+	} else
+		stats.aborted++;
 	send_ack(conn, XS_TRANSACTION_END);
 }
 
+char *transaction_stats(const void *ctx)
+{
+	unsigned long ended = stats.committed + stats.conflicts;
+
+	return talloc_asprintf(ctx,
+		"started %lu committed %lu aborted %lu conflicts %lu "
+		"merged %lu retry-rate %lu%%\n",
+		stats.started, stats.committed, stats.aborted,
+		stats.conflicts, stats.merged,
+		ended ? stats.conflicts * 100 / ended : 0);
+}
+
 void transaction_entry_inc(struct transaction *trans, unsigned int domid)
 {
 	struct changed_domain *d;
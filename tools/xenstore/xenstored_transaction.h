@@ -35,9 +35,20 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct transaction *trans, const char *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/* Generation count of the last write to the global store. */
+extern uint64_t generation;
+
+/* Node record access through the transaction's overlay: these fail
+ * (NULL dptr or false) and set errno. */
+TDB_DATA transaction_fetch(const void *ctx, struct transaction *trans,
+			   const char *name, bool perms_only);
+bool transaction_store(struct transaction *trans, const char *name,
+		       TDB_DATA data);
+bool transaction_delete(struct transaction *trans, const char *name);
 
 void conn_delete_all_transactions(struct connection *conn);
 
+/* Summary of transaction commits and conflicts, for XS_DEBUG. */
+char *transaction_stats(const void *ctx);
+
 #endif /* _XENSTORED_TRANSACTION_H */
@@ -26,18 +26,47 @@
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 #include "xenstored_domain.h"
 
 extern int quota_nb_watch_per_domain;
+extern int quota_nb_event_per_conn;
+
+/*
+ * Watches are indexed by path in a trie, so that a write only visits the
+ * watches on the written node, its ancestors and (for rm) its descendants
+ * rather than every watch of every connection.  Each trie node is also
+ * entered in a hashtable by its full path, which makes walking down to a
+ * node O(depth) lookups instead of a search through each level.  Special
+ * "@" events live in trie nodes of their own without a parent.
+ */
+struct watch_node
+{
+	/* Full path of this node, also the hashtable key. */
+	char *path;
+
+	/* Parent, NULL for "/" and "@" events. */
+	struct watch_node *parent;
+
+	/* Children, and our entry in the parent's list. */
+	struct list_head children;
+	struct list_head child;
+
+	/* Watches registered on exactly this path. */
+	struct list_head watches;
+};
 
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path */
+	struct list_head node_list;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -46,8 +75,50 @@ struct watch
 
 	char *token;
 	char *node;
+
+	/* The connection which registered the watch. */
+	struct connection *conn;
+
+	/* Where the watch lives in the trie. */
+	struct watch_node *trie;
 };
 
+/* Trie nodes by path. */
+static struct hashtable *watch_nodes;
+
+static struct watch_node *find_watch_node(const char *path)
+{
+	if (!watch_nodes)
+		return NULL;
+	return hashtable_search(watch_nodes, (void *)path);
+}
+
+static char *parent_path(const void *ctx, const char *path)
+{
+	char *slash = strrchr(path, '/');
+
+	if (path[0] != '/' || streq(path, "/"))
+		return NULL;
+	if (slash == path)
+		return talloc_strdup(ctx, "/");
+	return talloc_strndup(ctx, path, slash - path);
+}
+
+/* Drop trie nodes which no longer lead to any watch. */
+static void put_watch_node(struct watch_node *node)
+{
+	struct watch_node *parent;
+
+	while (node && list_empty(&node->watches) &&
+	       list_empty(&node->children)) {
+		parent = node->parent;
+		list_del(&node->child);
+		hashtable_remove(watch_nodes, node->path);
+		talloc_free(node);
+		node = parent;
+	}
+}
+
 static void add_event(struct connection *conn,
 		      struct watch *watch,
 		      const char *name)
@@ -72,6 +143,16 @@ static void add_event(struct connection *conn,
 			return;
 	}
 
+	/*
+	 * A domain which doesn't read its events only gets so many queued.
+	 * Past that, its watches fire on their own paths instead: events
+	 * coalesce to one per watch, and each tells the domain to look at
+	 * everything under the watch.
+	 */
+	if (conn->nr_events >= quota_nb_event_per_conn &&
+	    domain_is_unprivileged(conn))
+		name = watch->node;
+
 	if (watch->relative_path) {
 		name += strlen(watch->relative_path);
 		if (*name == '/') /* Could be "" */
@@ -86,29 +167,131 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
-void fire_watches(struct connection *conn, const char *name, bool recurse)
+/* Find the trie node for a path, creating it and its ancestors. */
+static struct watch_node *get_watch_node(const char *path)
+{
+	struct watch_node *node, *parent = NULL;
+	char *ppath, *key;
+
+	node = find_watch_node(path);
+	if (node)
+		return node;
+
+	if (!watch_nodes) {
+		watch_nodes = create_hashtable(64, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!watch_nodes)
+			return NULL;
+	}
+
+	ppath = parent_path(NULL, path);
+	if (ppath) {
+		parent = get_watch_node(ppath);
+		talloc_free(ppath);
+		if (!parent)
+			return NULL;
+	}
+
+	/*
+	 * Not off the autofree context: watches are freed with their
+	 * connections at exit, and they must find the trie intact.
+	 */
+	node = talloc(NULL, struct watch_node);
+	/* The hashtable frees its keys with free(). */
+	key = strdup(path);
+	if (!node || !key || !hashtable_insert(watch_nodes, key, node)) {
+		free(key);
+		talloc_free(node);
+		put_watch_node(parent);
+		return NULL;
+	}
+	node->path = talloc_strdup(node, path);
+	node->parent = parent;
+	INIT_LIST_HEAD(&node->children);
+	INIT_LIST_HEAD(&node->watches);
+	if (parent)
+		list_add_tail(&node->child, &parent->children);
+	else
+		INIT_LIST_HEAD(&node->child);
+
+	return node;
+}
+
+static void fire_node_watches(struct watch_node *node, const char *name)
 {
-	struct connection *i;
 	struct watch *watch;
 
+	list_for_each_entry(watch, &node->watches, node_list)
+		add_event(watch->conn, watch, name ? name : watch->node);
+}
+
+/* A subtree went away: tell everyone watching inside it. */
+static void fire_subtree_watches(struct watch_node *node)
+{
+	struct watch_node *child;
+
+	list_for_each_entry(child, &node->children, child) {
+		fire_node_watches(child, NULL);
+		fire_subtree_watches(child);
+	}
+}
+
+void fire_watches(struct connection *conn, const char *name, bool recurse)
+{
+	struct watch_node *node = NULL;
+	char *path;
+	unsigned int i;
+
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, watch, watch->node);
-		}
+	if (!watch_nodes)
+		return;
+
+	/* Watches on "/" see everything, including special events. */
+	if (name[0] != '/') {
+		node = find_watch_node("/");
+		if (node)
+			fire_node_watches(node, name);
+		node = find_watch_node(name);
+		if (node)
+			fire_node_watches(node, name);
+		return;
+	}
+
+	/* Walk down from the root, firing the watches on each ancestor. */
+	node = find_watch_node("/");
+	if (!node)
+		return;
+	fire_node_watches(node, name);
+
+	path = talloc_strdup(NULL, name);
+	for (i = 1; node && !streq(name, "/") && path[i - 1] != '\0'; i++) {
+		char c = path[i];
+
+		if (c != '/' && c != '\0')
+			continue;
+		path[i] = '\0';
+		node = find_watch_node(path);
+		path[i] = c;
+		if (node)
+			fire_node_watches(node, name);
 	}
+	talloc_free(path);
+
+	/* node is now the trie node for name itself, if there is one. */
+	if (node && recurse)
+		fire_subtree_watches(node);
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
 	trace_destroy(_watch, "watch");
+	list_del(&watch->node_list);
+	put_watch_node(watch->trie);
 	return 0;
 }
 
@@ -160,11 +343,19 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 		watch->relative_path = get_implicit_path(conn);
 	else
 		watch->relative_path = NULL;
+	watch->conn = conn;
+	watch->trie = get_watch_node(watch->node);
+	if (!watch->trie) {
+		talloc_free(watch);
+		send_error(conn, ENOMEM);
+		return;
+	}
 
 	INIT_LIST_HEAD(&watch->events);
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->node_list, &watch->trie->watches);
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
@@ -0,0 +1,229 @@
+/*
+    Worker threads for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * Read-only requests (outside transactions) can be served by a pool of
+ * worker threads, so that a guest reading a large directory doesn't hold
+ * up everybody else.  Everything else stays on the main thread, which
+ * owns the store: workers hold the store's read lock while they run a
+ * request, so each sees the store as of one point in time, and writes
+ * wait until no request is in progress.
+ *
+ * A connection has at most one request with the workers, and the main
+ * loop stops reading from it meanwhile, so replies go out in order.  The
+ * worker's reply is handed back to the main thread, which queues it.
+ *
+ * talloc isn't thread-safe.  A worker only allocates within its request,
+ * which the main thread leaves alone from queueing it until it is handed
+ * back; and leak tracking, which links every allocation from the NULL
+ * context together, is off when there are workers.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "talloc.h"
+#include "list.h"
+#include "xenstored_core.h"
+#include "xenstored_store.h"
+#include "xenstored_worker.h"
+
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static LIST_HEAD(queued);
+static LIST_HEAD(done);
+
+/* Written to when done becomes non-empty. */
+static int done_pipe[2] = { -1, -1 };
+
+static unsigned int nr_workers;
+
+static __thread struct worker_request *current_request;
+
+bool in_worker(void)
+{
+	return current_request != NULL;
+}
+
+bool worker_reply(enum xsd_sockmsg_type type, const void *data,
+		  unsigned int len)
+{
+	struct worker_request *req = current_request;
+
+	if (!req)
+		return false;
+
+	/* The request is ours alone until we hand it back. */
+	req->data = talloc_memdup(req, data, len);
+	if (!req->data && len) {
+		type = XS_ERROR;
+		data = "ENOMEM";
+		len = strlen("ENOMEM") + 1;
+		req->data = (void *)data;
+	}
+	req->type = type;
+	req->len = len;
+	return true;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker_request *req;
+	bool wake;
+	char c = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&worker_lock);
+		while (list_empty(&queued))
+			pthread_cond_wait(&queued_cond, &worker_lock);
+		pthread_mutex_unlock(&worker_lock);
+
+		/*
+		 * Take the read lock before claiming a request: the main
+		 * thread may cancel requests while it holds the write lock,
+		 * and waits for running ones to finish.
+		 */
+		store_read_lock();
+		pthread_mutex_lock(&worker_lock);
+		if (list_empty(&queued)) {
+			pthread_mutex_unlock(&worker_lock);
+			store_read_unlock();
+			continue;
+		}
+		req = list_entry(queued.next, struct worker_request, list);
+		list_del(&req->list);
+		req->state = REQUEST_RUNNING;
+		pthread_mutex_unlock(&worker_lock);
+
+		current_request = req;
+		process_read_message(req->conn, req->in);
+		current_request = NULL;
+		store_read_unlock();
+
+		pthread_mutex_lock(&worker_lock);
+		wake = list_empty(&done);
+		list_add_tail(&req->list, &done);
+		req->state = REQUEST_DONE;
+		pthread_cond_broadcast(&done_cond);
+		pthread_mutex_unlock(&worker_lock);
+
+		if (wake && write(done_pipe[1], &c, 1) != 1 && errno != EAGAIN)
+			barf_perror("worker: write failed");
+	}
+
+	return NULL;
+}
+
+void worker_init(unsigned int nr)
+{
+	pthread_t thread;
+	unsigned int i;
+
+	if (!nr)
+		return;
+
+	if (pipe(done_pipe) != 0 ||
+	    fcntl(done_pipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+	    fcntl(done_pipe[1], F_SETFL, O_NONBLOCK) != 0 ||
+	    fcntl(done_pipe[0], F_SETFD, FD_CLOEXEC) != 0 ||
+	    fcntl(done_pipe[1], F_SETFD, FD_CLOEXEC) != 0)
+		barf_perror("Failed to create worker pipe");
+
+	for (i = 0; i < nr; i++) {
+		if (pthread_create(&thread, NULL, worker_thread, NULL) != 0)
+			barf("Failed to create worker thread");
+		pthread_detach(thread);
+	}
+	nr_workers = nr;
+}
+
+int worker_fd(void)
+{
+	return done_pipe[0];
+}
+
+bool worker_submit(struct connection *conn, struct buffered_data *in)
+{
+	struct worker_request *req;
+
+	if (!nr_workers)
+		return false;
+
+	req = talloc_zero(NULL, struct worker_request);
+	if (!req)
+		return false;
+	req->conn = conn;
+	req->in = talloc_steal(req, in);
+	req->state = REQUEST_QUEUED;
+	conn->request = req;
+
+	pthread_mutex_lock(&worker_lock);
+	list_add_tail(&req->list, &queued);
+	pthread_cond_signal(&queued_cond);
+	pthread_mutex_unlock(&worker_lock);
+
+	return true;
+}
+
+struct worker_request *worker_get_done(void)
+{
+	struct worker_request *req = NULL;
+	char buf[64];
+
+	pthread_mutex_lock(&worker_lock);
+	if (list_empty(&done)) {
+		/* Drained: the next completion writes to the pipe again. */
+		while (read(done_pipe[0], buf, sizeof(buf)) > 0)
+			;
+	} else {
+		req = list_entry(done.next, struct worker_request, list);
+		list_del(&req->list);
+	}
+	pthread_mutex_unlock(&worker_lock);
+
+	if (req)
+		req->conn->request = NULL;
+	return req;
+}
+
+void worker_cancel(struct connection *conn)
+{
+	struct worker_request *req = conn->request;
+
+	if (!req)
+		return;
+
+	/* A running request uses conn: wait for it to finish. */
+	pthread_mutex_lock(&worker_lock);
+	while (req->state == REQUEST_RUNNING)
+		pthread_cond_wait(&done_cond, &worker_lock);
+	list_del(&req->list);
+	pthread_mutex_unlock(&worker_lock);
+
+	conn->request = NULL;
+	talloc_free(req);
+}
@@ -0,0 +1,85 @@
+/*
+    Worker threads for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _XENSTORED_WORKER_H
+#define _XENSTORED_WORKER_H
+
+#include "xenstored_core.h"
+
+/* A request handed to the worker threads. */
+struct worker_request
+{
+	struct list_head list;
+
+	struct connection *conn;
+
+	/* The request, and the reply the worker sent to it. */
+	struct buffered_data *in;
+	enum xsd_sockmsg_type type;
+	void *data;
+	unsigned int len;
+
+	enum { REQUEST_QUEUED, REQUEST_RUNNING, REQUEST_DONE } state;
+};
+
+#ifdef USE_PTHREAD
+
+/* Start nr worker threads.  Without any, requests are never queued. */
+void worker_init(unsigned int nr);
+
+/* Readable when worker_get_done() has requests to hand back; or -1. */
+int worker_fd(void);
+
+/*
+ * Queue a read-only request.  The request takes over in, and the worker
+ * calls process_read_message() for it.  Returns false if there are no
+ * worker threads.
+ */
+bool worker_submit(struct connection *conn, struct buffered_data *in);
+
+/* Next completed request, or NULL.  The caller must talloc_free() it. */
+struct worker_request *worker_get_done(void);
+
+/* Drop the request of a connection which is going away. */
+void worker_cancel(struct connection *conn);
+
+/* Called by send_reply(): returns true if the reply was for a worker. */
+bool worker_reply(enum xsd_sockmsg_type type, const void *data,
+		  unsigned int len);
+
+/* Is the calling thread a worker? */
+bool in_worker(void);
+
+#else /* !USE_PTHREAD */
+
+static inline void worker_init(unsigned int nr) { }
+static inline int worker_fd(void) { return -1; }
+static inline bool worker_submit(struct connection *conn,
+				 struct buffered_data *in) { return false; }
+static inline struct worker_request *worker_get_done(void) { return NULL; }
+static inline void worker_cancel(struct connection *conn) { }
+static inline bool worker_reply(enum xsd_sockmsg_type type,
+				const void *data, unsigned int len)
+{
+	return false;
+}
+static inline bool in_worker(void) { return false; }
+
+#endif /* USE_PTHREAD */
+
+#endif /* _XENSTORED_WORKER_H */
@@ -17,6 +17,8 @@
     Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -36,6 +38,14 @@
 #include "list.h"
 #include "utils.h"
 
+/* Socket connections move onto a shared memory ring where we can. */
+#if defined(USE_PTHREAD) && defined(HAVE_EVENTFD) && defined(F_SEAL_SHRINK)
+#define USE_LOCAL_RING
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#endif
+
 struct xs_stored_msg {
 	struct list_head list;
 	struct xsd_sockmsg hdr;
@@ -50,6 +60,13 @@ struct xs_handle {
 	/* Communications channel to xenstore daemon. */
 	int fd;
 
+#ifdef USE_LOCAL_RING
+	/* Shared memory ring to the daemon, if we moved onto one: the
+	 * socket then only tells us if the daemon goes away. */
+	struct xs_local_ring *ring;
+	int ring_fds[XS_LOCAL_RING_NR_FDS];
+#endif
+
 	/*
          * A read thread which pulls messages off the comms channel and
          * signals waiters.
@@ -145,6 +162,10 @@ struct xs_handle {
 #endif
 
 static int read_message(struct xs_handle *h, int nonblocking);
+#ifdef USE_LOCAL_RING
+static void local_ring_connect(struct xs_handle *h);
+static void close_local_ring(struct xs_handle *h);
+#endif
 
 static bool setnonblock(int fd, int nonblock) {
 	int flags = fcntl(fd, F_GETFL);
@@ -267,6 +288,11 @@ static struct xs_handle *get_handle(const char *connect_to)
 	pthread_mutex_init(&h->request_mutex, NULL);
 #endif
 
+#ifdef USE_LOCAL_RING
+	if (S_ISSOCK(buf.st_mode))
+		local_ring_connect(h);
+#endif
+
 	return h;
 }
 
@@ -323,6 +349,11 @@ static void close_fds_free(struct xs_handle *h) {
 		close(h->watch_pipe[1]);
 	}
 
+#ifdef USE_LOCAL_RING
+	if (h->ring)
+		close_local_ring(h);
+#endif
+
         close(h->fd);
         
 	free(h);
@@ -409,6 +440,272 @@ out_false:
 #define xs_write_all write_all_choice
 #endif
 
+#ifdef USE_LOCAL_RING
+/*
+ * The client side of a local ring: the mirror image of the daemon's (see
+ * do_local_ring() in xenstored_core.c).  We only kick the daemon when it
+ * says it is waiting, and it only kicks us when we do.
+ */
+static void ring_kick(struct xs_handle *h, uint32_t *waiting)
+{
+	uint64_t one = 1;
+
+	__sync_synchronize();
+	if (*(volatile uint32_t *)waiting)
+		while (write(h->ring_fds[XS_LOCAL_RING_SERVER], &one,
+			     sizeof(one)) < 0 && errno == EINTR)
+			continue;
+}
+
+static bool ring_can_read(struct xs_handle *h)
+{
+	struct xenstore_domain_interface *intf = &h->ring->intf;
+
+	return intf->rsp_cons != intf->rsp_prod;
+}
+
+static bool ring_can_write(struct xs_handle *h)
+{
+	struct xenstore_domain_interface *intf = &h->ring->intf;
+
+	return intf->req_prod - intf->req_cons != XENSTORE_RING_SIZE;
+}
+
+/* Wait for ready(h), kicked on fd.  Fails with EBADF if the daemon
+ * has gone away, or has replied on the socket instead. */
+static bool ring_wait(struct xs_handle *h, uint32_t *waiting, int fd,
+		      bool (*ready)(struct xs_handle *h))
+{
+	struct pollfd pfd[2];
+	uint64_t count;
+	bool ok = true;
+
+	if (h->fd == -1) {
+		errno = EBADF;
+		return false;
+	}
+
+	*(volatile uint32_t *)waiting = 1;
+	__sync_synchronize();
+	if (!ready(h)) {
+		pfd[0].fd = fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = h->fd;
+		pfd[1].events = POLLIN;
+		while (poll(pfd, 2, -1) < 0) { /* Cancellation point */
+			if (errno != EINTR) {
+				ok = false;
+				break;
+			}
+		}
+		if (ok && pfd[1].revents) {
+			errno = EBADF;
+			ok = false;
+		}
+		/* Reset the eventfd: it is non-blocking. */
+		if (ok && read(fd, &count, sizeof(count)) < 0 &&
+		    errno != EAGAIN)
+			ok = false;
+	}
+	*(volatile uint32_t *)waiting = 0;
+
+	return ok;
+}
+
+static bool ring_write_all(struct xs_handle *h, const void *data,
+			   unsigned int len)
+{
+	struct xenstore_domain_interface *intf = &h->ring->intf;
+	XENSTORE_RING_IDX cons, prod;
+	unsigned int avail;
+
+	while (len) {
+		/* Must read indexes once, and before anything else. */
+		cons = intf->req_cons;
+		prod = intf->req_prod;
+		__sync_synchronize();
+		if (prod - cons > XENSTORE_RING_SIZE) {
+			errno = EIO;
+			return false;
+		}
+
+		avail = XENSTORE_RING_SIZE - (prod - cons);
+		if (!avail) {
+			if (!ring_wait(h, &h->ring->client_waiting_req,
+				       h->ring_fds[XS_LOCAL_RING_REQ],
+				       ring_can_write))
+				return false;
+			continue;
+		}
+		if (avail > XENSTORE_RING_SIZE - MASK_XENSTORE_IDX(prod))
+			avail = XENSTORE_RING_SIZE - MASK_XENSTORE_IDX(prod);
+		if (avail > len)
+			avail = len;
+
+		memcpy(intf->req + MASK_XENSTORE_IDX(prod), data, avail);
+		__sync_synchronize();
+		intf->req_prod = prod + avail;
+		data += avail;
+		len -= avail;
+
+		ring_kick(h, &h->ring->server_waiting_req);
+	}
+
+	return true;
+}
+
+static bool ring_read_all(struct xs_handle *h, void *data, unsigned int len,
+			  int nonblocking)
+{
+	struct xenstore_domain_interface *intf = &h->ring->intf;
+	XENSTORE_RING_IDX cons, prod;
+	unsigned int avail;
+
+	if (nonblocking && len && !ring_can_read(h)) {
+		errno = EAGAIN;
+		return false;
+	}
+
+	while (len) {
+		/* Must read indexes once, and before anything else. */
+		cons = intf->rsp_cons;
+		prod = intf->rsp_prod;
+		__sync_synchronize();
+		if (prod - cons > XENSTORE_RING_SIZE) {
+			errno = EIO;
+			return false;
+		}
+
+		avail = prod - cons;
+		if (!avail) {
+			if (!ring_wait(h, &h->ring->client_waiting_rsp,
+				       h->ring_fds[XS_LOCAL_RING_RSP],
+				       ring_can_read))
+				return false;
+			continue;
+		}
+		if (avail > XENSTORE_RING_SIZE - MASK_XENSTORE_IDX(cons))
+			avail = XENSTORE_RING_SIZE - MASK_XENSTORE_IDX(cons);
+		if (avail > len)
+			avail = len;
+
+		memcpy(data, intf->rsp + MASK_XENSTORE_IDX(cons), avail);
+		__sync_synchronize();
+		intf->rsp_cons = cons + avail;
+		data += avail;
+		len -= avail;
+
+		ring_kick(h, &h->ring->server_waiting_rsp);
+	}
+
+	return true;
+}
+
+static void close_local_ring(struct xs_handle *h)
+{
+	unsigned int i;
+
+	munmap(h->ring, sizeof(*h->ring));
+	h->ring = NULL;
+	for (i = 0; i < XS_LOCAL_RING_NR_FDS; i++)
+		if (h->ring_fds[i] != -1)
+			close(h->ring_fds[i]);
+}
+
+/*
+ * Ask the daemon to move our socket connection onto shared memory.  It
+ * replies on the ring if it did, and on the socket if it can't (older
+ * daemons and oxenstored don't know LOCAL_RING).
+ */
+static void local_ring_connect(struct xs_handle *h)
+{
+	struct xsd_sockmsg msg = { .type = XS_LOCAL_RING };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int) * XS_LOCAL_RING_NR_FDS)];
+	} control;
+	struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+	struct msghdr mh = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = &control, .msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	char body[XENSTORE_PAYLOAD_MAX];
+	unsigned int i;
+	void *shared;
+	int fd;
+
+	if (getenv("XENSTORE_NO_LOCAL_RING"))
+		return;
+
+	fd = memfd_create("xenstore", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return;
+	if (ftruncate(fd, sizeof(*h->ring)) != 0 ||
+	    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_SEAL) != 0 ||
+	    (shared = mmap(NULL, sizeof(*h->ring), PROT_READ|PROT_WRITE,
+			   MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+
+	memset(shared, 0, sizeof(*h->ring));
+	h->ring = shared;
+	h->ring_fds[XS_LOCAL_RING_SHMEM] = fd;
+	for (i = XS_LOCAL_RING_SERVER; i < XS_LOCAL_RING_NR_FDS; i++)
+		h->ring_fds[i] = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	for (i = 0; i < XS_LOCAL_RING_NR_FDS; i++)
+		if (h->ring_fds[i] == -1)
+			goto fail;
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(h->ring_fds));
+	memcpy(CMSG_DATA(cmsg), h->ring_fds, sizeof(h->ring_fds));
+	if (sendmsg(h->fd, &mh, MSG_NOSIGNAL) != sizeof(msg))
+		goto fail;
+
+	if (ring_read_all(h, &msg, sizeof(msg), 0)) {
+		/* We're on the ring now, whatever the reply says. */
+		if (msg.len <= sizeof(body))
+			ring_read_all(h, body, msg.len, 0);
+		close(h->ring_fds[XS_LOCAL_RING_SHMEM]);
+		h->ring_fds[XS_LOCAL_RING_SHMEM] = -1;
+		return;
+	}
+
+	/* An error on the socket: carry on there. */
+	if (errno == EBADF && read_all(h->fd, &msg, sizeof(msg), 0) &&
+	    msg.len <= sizeof(body))
+		read_all(h->fd, body, msg.len, 0);
+
+fail:
+	close_local_ring(h);
+}
+#endif
+
+/* Read from, or write to, the daemon: over the socket or the ring. */
+static bool read_chan(struct xs_handle *h, void *data, unsigned int len,
+		      int nonblocking)
+{
+#ifdef USE_LOCAL_RING
+	if (h->ring)
+		return ring_read_all(h, data, len, nonblocking);
+#endif
+	return read_all(h->fd, data, len, nonblocking);
+}
+
+static bool write_chan(struct xs_handle *h, const void *data,
+		       unsigned int len)
+{
+#ifdef USE_LOCAL_RING
+	if (h->ring)
+		return ring_write_all(h, data, len);
+#endif
+	return xs_write_all(h->fd, data, len);
+}
+
 static int get_error(const char *errorstring)
 {
 	unsigned int i;
@@ -490,11 +787,11 @@ static void *xs_talkv(struct xs_handle *h, xs_transaction_t t,
 
 	mutex_lock(&h->request_mutex);
 
-	if (!xs_write_all(h->fd, &msg, sizeof(msg)))
+	if (!write_chan(h, &msg, sizeof(msg)))
 		goto fail;
 
 	for (i = 0; i < num_vecs; i++)
-		if (!xs_write_all(h->fd, iovec[i].iov_base, iovec[i].iov_len))
+		if (!write_chan(h, iovec[i].iov_base, iovec[i].iov_len))
 			goto fail;
 
 	ret = read_reply(h, &msg.type, len);
@@ -706,6 +1003,183 @@ unwind:
 	return false;
 }
 
+/* Append to an XS_MULTI payload being built: false if it won't fit. */
+static bool multi_append(char *buf, unsigned int *used,
+			 const void *data, unsigned int len)
+{
+	if (len > XENSTORE_PAYLOAD_MAX - *used)
+		return false;
+	memcpy(buf + *used, data, len);
+	*used += len;
+	return true;
+}
+
+/* Append op, as request number idx: false if it won't fit. */
+static bool multi_add_op(char *buf, unsigned int *used,
+			 const struct xs_multi_op *op, unsigned int idx)
+{
+	char perm[MAX_STRLEN(unsigned int)+1];
+	struct xsd_sockmsg msg;
+	unsigned int start = *used, i;
+	bool ok;
+
+	if (sizeof(msg) > XENSTORE_PAYLOAD_MAX - start)
+		return false;
+	*used += sizeof(msg);
+
+	ok = multi_append(buf, used, op->path, strlen(op->path) + 1);
+	if (op->type == XS_WRITE)
+		ok = ok && multi_append(buf, used, op->data, op->len);
+	if (op->type == XS_SET_PERMS) {
+		/* Checked by xs_multi(). */
+		for (i = 0; ok && i < op->num_perms; i++) {
+			xs_perm_to_string(&op->perms[i], perm, sizeof(perm));
+			ok = multi_append(buf, used, perm, strlen(perm) + 1);
+		}
+	}
+	if (!ok) {
+		*used = start;
+		return false;
+	}
+
+	msg.type = op->type;
+	msg.req_id = idx;
+	msg.tx_id = 0;
+	msg.len = *used - start - sizeof(msg);
+	memcpy(buf + start, &msg, sizeof(msg));
+	return true;
+}
+
+/* Fill in the ops from first to last from an XS_MULTI reply: returns the
+ * number of ops done, or 0 with errno set if the reply is garbled. */
+static unsigned int multi_parse_reply(struct xs_multi_op *ops,
+				      unsigned int first, unsigned int last,
+				      const char *reply, unsigned int len)
+{
+	struct xs_multi_op *op;
+	struct xsd_sockmsg msg;
+	unsigned int off, next = first;
+	const char *body;
+
+	errno = EBADF;
+	for (off = 0; off < len; off += sizeof(msg) + msg.len) {
+		if (next == last) {
+			/* More replies than ops sent. */
+			errno = EPROTO;
+			return 0;
+		}
+		if (len - off < sizeof(msg))
+			return 0;
+		memcpy(&msg, reply + off, sizeof(msg));
+		body = reply + off + sizeof(msg);
+		if (msg.len > len - off - sizeof(msg) || msg.req_id != next)
+			return 0;
+		op = &ops[next++];
+
+		if (msg.type == XS_ERROR) {
+			if (!msg.len || body[msg.len - 1] != '\0')
+				return 0;
+			op->error = get_error(body);
+			continue;
+		}
+		if (msg.type != op->type)
+			return 0;
+		if (op->type != XS_READ && op->type != XS_DIRECTORY &&
+		    op->type != XS_GET_PERMS)
+			continue;
+
+		/* Nul terminated, like xs_read(). */
+		op->result = malloc(msg.len + 1);
+		if (!op->result) {
+			op->error = ENOMEM;
+			continue;
+		}
+		memcpy(op->result, body, msg.len);
+		((char *)op->result)[msg.len] = '\0';
+		op->result_len = msg.len;
+	}
+
+	return next - first;
+}
+
+bool xs_multi(struct xs_handle *h, xs_transaction_t t,
+	      struct xs_multi_op *ops, unsigned int num_ops)
+{
+	char perm[MAX_STRLEN(unsigned int)+1];
+	struct iovec iovec;
+	unsigned int i, j, first, used, len, done;
+	char *buf, *reply;
+	int saved_errno;
+
+	for (i = 0; i < num_ops; i++) {
+		switch (ops[i].type) {
+		case XS_DIRECTORY:
+		case XS_READ:
+		case XS_GET_PERMS:
+		case XS_WRITE:
+		case XS_MKDIR:
+		case XS_RM:
+		case XS_SET_PERMS:
+			break;
+		default:
+			errno = EINVAL;
+			return false;
+		}
+		for (j = 0; ops[i].type == XS_SET_PERMS &&
+			    j < ops[i].num_perms; j++)
+			if (!xs_perm_to_string(&ops[i].perms[j], perm,
+					       sizeof(perm)))
+				return false;
+		ops[i].error = 0;
+		ops[i].result = NULL;
+		ops[i].result_len = 0;
+	}
+
+	buf = malloc(XENSTORE_PAYLOAD_MAX);
+	if (!buf)
+		return false;
+
+	/* As many ops as fit in each message, until the daemon did all. */
+	for (first = 0; first < num_ops; first += done) {
+		used = 0;
+		for (i = first; i < num_ops; i++)
+			if (!multi_add_op(buf, &used, &ops[i], i))
+				break;
+		if (i == first) {
+			/* Too big to send even on its own. */
+			ops[first].error = E2BIG;
+			done = 1;
+			continue;
+		}
+
+		iovec.iov_base = buf;
+		iovec.iov_len = used;
+		reply = xs_talkv(h, t, XS_MULTI, &iovec, 1, &len);
+		if (!reply)
+			goto fail;
+		done = multi_parse_reply(ops, first, i, reply, len);
+		saved_errno = errno;
+		free(reply);
+		if (!done) {
+			errno = saved_errno;
+			goto fail;
+		}
+	}
+
+	free(buf);
+	return true;
+
+fail:
+	saved_errno = errno;
+	for (i = 0; i < num_ops; i++) {
+		free(ops[i].result);
+		ops[i].result = NULL;
+	}
+	free(buf);
+	errno = saved_errno;
+	return false;
+}
+
 bool xs_restrict(struct xs_handle *h, unsigned domid)
 {
 	char buf[16];
@@ -1147,7 +1621,7 @@ static int read_message(struct xs_handle *h, int nonblocking)
 	if (msg == NULL)
 		goto error;
 	cleanup_push_heap(msg);
-	if (!read_all(h->fd, &msg->hdr, sizeof(msg->hdr), nonblocking)) { /* Cancellation point */
+	if (!read_chan(h, &msg->hdr, sizeof(msg->hdr), nonblocking)) { /* Cancellation point */
 		saved_errno = errno;
 		goto error_freemsg;
 	}
@@ -1163,7 +1637,7 @@ static int read_message(struct xs_handle *h, int nonblocking)
 	if (body == NULL)
 		goto error_freemsg;
 	cleanup_push_heap(body);
-	if (!read_all(h->fd, body, msg->hdr.len, 0)) { /* Cancellation point */
+	if (!read_chan(h, body, msg->hdr.len, 0)) { /* Cancellation point */
 		saved_errno = errno;
 		goto error_freebody;
 	}
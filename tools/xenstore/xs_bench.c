@@ -0,0 +1,205 @@
+/*
+    Simple benchmark for the Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * Populates the store with a device tree per fake domain, then measures
+ * how many small transactions (a couple of reads and a write, the shape
+ * of a hotplug script) the daemon commits per second.  Running it with
+ * increasing -d shows how transaction cost scales with the store size.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "xenstore.h"
+
+#define BENCH_ROOT "/bench"
+
+static const char *vif_keys[] = {
+	"backend-id", "state", "handle", "mac", "bridge", "script",
+	"frontend", "frontend-id", "online", "hotplug-status",
+};
+
+static const char *vbd_keys[] = {
+	"backend-id", "state", "virtual-device", "device-type", "params",
+	"mode", "frontend", "frontend-id", "online", "hotplug-status",
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"Usage: %s [options]\n"
+"\n"
+"  -d, --domains <nr>       number of fake domains to populate (default 100)\n"
+"  -n, --transactions <nr>  number of transactions to run (default 10000)\n"
+"  -k, --keep               leave the populated tree in the store\n"
+"  -h, --help               output this message\n",
+		name);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void write_key(struct xs_handle *xsh, xs_transaction_t t,
+		      const char *path, const char *value)
+{
+	if (!xs_write(xsh, t, path, value, strlen(value))) {
+		perror(path);
+		exit(1);
+	}
+}
+
+static unsigned int populate_device(struct xs_handle *xsh, unsigned int dom,
+				    const char *type, unsigned int devid,
+				    const char **keys, unsigned int nr_keys)
+{
+	char path[128];
+	unsigned int i;
+
+	for (i = 0; i < nr_keys; i++) {
+		snprintf(path, sizeof(path), BENCH_ROOT "/%u/device/%s/%u/%s",
+			 dom, type, devid, keys[i]);
+		write_key(xsh, XBT_NULL, path, "1");
+	}
+	return nr_keys;
+}
+
+static unsigned int populate(struct xs_handle *xsh, unsigned int domains)
+{
+	unsigned int dom, nodes = 0;
+
+	for (dom = 0; dom < domains; dom++) {
+		nodes += populate_device(xsh, dom, "vif", 0, vif_keys,
+					 sizeof(vif_keys) / sizeof(vif_keys[0]));
+		nodes += populate_device(xsh, dom, "vbd", 51712, vbd_keys,
+					 sizeof(vbd_keys) / sizeof(vbd_keys[0]));
+	}
+	return nodes;
+}
+
+/* One hotplug-like transaction: returns false if it had to be retried. */
+static bool run_transaction(struct xs_handle *xsh, unsigned int dom)
+{
+	char path[128];
+	xs_transaction_t t;
+	unsigned int len;
+	void *val;
+
+	t = xs_transaction_start(xsh);
+	if (t == XBT_NULL) {
+		perror("xs_transaction_start");
+		exit(1);
+	}
+
+	snprintf(path, sizeof(path), BENCH_ROOT "/%u/device/vif/0/state", dom);
+	val = xs_read(xsh, t, path, &len);
+	free(val);
+	snprintf(path, sizeof(path), BENCH_ROOT "/%u/device/vif/0/online", dom);
+	val = xs_read(xsh, t, path, &len);
+	free(val);
+	snprintf(path, sizeof(path),
+		 BENCH_ROOT "/%u/device/vif/0/hotplug-status", dom);
+	write_key(xsh, t, path, "connected");
+
+	if (!xs_transaction_end(xsh, t, false)) {
+		if (errno == EAGAIN)
+			return false;
+		perror("xs_transaction_end");
+		exit(1);
+	}
+	return true;
+}
+
+static struct option options[] = {
+	{ "domains", 1, NULL, 'd' },
+	{ "transactions", 1, NULL, 'n' },
+	{ "keep", 0, NULL, 'k' },
+	{ "help", 0, NULL, 'h' },
+	{ NULL, 0, NULL, 0 } };
+
+int main(int argc, char *argv[])
+{
+	struct xs_handle *xsh;
+	unsigned int domains = 100, transactions = 10000;
+	unsigned int i, nodes, retries = 0;
+	bool keep = false;
+	double start, elapsed;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "d:n:kh", options,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			domains = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			transactions = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			keep = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (optind != argc || domains == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	xsh = xs_open(0);
+	if (xsh == NULL) {
+		fprintf(stderr, "Failed to contact Xenstored.\n");
+		return 1;
+	}
+
+	start = now();
+	nodes = populate(xsh, domains);
+	elapsed = now() - start;
+	printf("populated %u domains, %u nodes in %.2fs\n",
+	       domains, nodes, elapsed);
+
+	start = now();
+	for (i = 0; i < transactions; i++)
+		if (!run_transaction(xsh, i % domains))
+			retries++;
+	elapsed = now() - start;
+	printf("%u transactions in %.2fs: %.0f transactions/s, %u retries\n",
+	       transactions, elapsed, transactions / elapsed, retries);
+
+	if (!keep)
+		xs_rm(xsh, XBT_NULL, BENCH_ROOT);
+
+	xs_close(xsh);
+
+	return 0;
+}
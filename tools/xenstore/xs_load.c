@@ -0,0 +1,597 @@
+/*
+    Load generator for the Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * Populates the store with device trees for a number of fake domains,
+ * then runs a mix of operations on them from several concurrent clients,
+ * each a process with its own connection, for a fixed time.  Reports
+ * throughput and latency percentiles per operation.
+ *
+ * Only the client library is used, so this runs against either daemon
+ * (oxenstored as well as xenstored), without a hypervisor: start one with
+ * its socket somewhere convenient and point XENSTORED_PATH at it.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "xenstore.h"
+
+#define LOAD_ROOT "/load"
+
+static const char *vif_keys[] = {
+	"backend-id", "state", "handle", "mac", "bridge", "script",
+	"frontend", "frontend-id", "online", "hotplug-status",
+};
+
+static const char *vbd_keys[] = {
+	"backend-id", "state", "virtual-device", "device-type", "params",
+	"mode", "frontend", "frontend-id", "online", "hotplug-status",
+};
+
+#define NR_KEYS(keys) (sizeof(keys) / sizeof(keys[0]))
+
+enum op { OP_READ, OP_WRITE, OP_DIRECTORY, OP_WATCH, OP_TRANSACTION,
+	  NR_OPS };
+
+static const char *op_names[NR_OPS] = {
+	"read", "write", "directory", "watch", "transaction",
+};
+
+/* What each client measured, sent back to the parent. */
+struct op_stats {
+	unsigned int count, errors, retries;
+	unsigned int size;
+	uint64_t *ns;
+};
+
+static unsigned int domains = 1000;
+static unsigned int hold_ms;
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"Usage: %s [options]\n"
+"\n"
+"  -c, --clients <nr>       number of concurrent clients (default 8)\n"
+"  -d, --domains <nr>       number of fake domains to populate (default 1000)\n"
+"  -t, --time <seconds>     how long to run for (default 10)\n"
+"  -m, --mix <op=weight,..> relative weights of the operations: read, write,\n"
+"                           directory, watch and transaction (default\n"
+"                           read=60,write=20,directory=10,watch=5,transaction=5)\n"
+"  -l, --hold <ms>          keep each transaction open for this long\n"
+"  -k, --keep               leave the populated tree in the store\n"
+"  -h, --help               output this message\n"
+"\n"
+"The daemon is found as for any client: set XENSTORED_PATH to use\n"
+"a socket other than the default one.\n",
+		name);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool parse_mix(const char *arg, unsigned int *weights)
+{
+	char *str = strdup(arg), *tok, *save, *eq;
+	unsigned int op, total = 0;
+
+	if (!str)
+		return false;
+	memset(weights, 0, NR_OPS * sizeof(*weights));
+
+	for (tok = strtok_r(str, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		eq = strchr(tok, '=');
+		if (!eq)
+			goto bad;
+		*eq = '\0';
+		for (op = 0; op < NR_OPS; op++)
+			if (!strcmp(tok, op_names[op]))
+				break;
+		if (op == NR_OPS)
+			goto bad;
+		weights[op] = strtoul(eq + 1, NULL, 10);
+		total += weights[op];
+	}
+
+	free(str);
+	return total != 0;
+
+bad:
+	free(str);
+	return false;
+}
+
+/* Populate all the domains, a device at a time. */
+static void populate(struct xs_handle *xsh)
+{
+	struct xs_multi_op ops[NR_KEYS(vif_keys) + NR_KEYS(vbd_keys)];
+	char paths[NR_KEYS(ops)][128];
+	unsigned int dom, i, n;
+	bool multi = true;
+
+	memset(ops, 0, sizeof(ops));
+	for (dom = 0; dom < domains; dom++) {
+		n = 0;
+		for (i = 0; i < NR_KEYS(vif_keys); i++, n++)
+			snprintf(paths[n], sizeof(paths[n]),
+				 LOAD_ROOT "/%u/device/vif/0/%s",
+				 dom, vif_keys[i]);
+		for (i = 0; i < NR_KEYS(vbd_keys); i++, n++)
+			snprintf(paths[n], sizeof(paths[n]),
+				 LOAD_ROOT "/%u/device/vbd/51712/%s",
+				 dom, vbd_keys[i]);
+		for (i = 0; i < n; i++) {
+			ops[i].type = XS_WRITE;
+			ops[i].path = paths[i];
+			ops[i].data = "1";
+			ops[i].len = 1;
+		}
+
+		/* oxenstored has no XS_MULTI: write one key at a time. */
+		if (multi && !xs_multi(xsh, XBT_NULL, ops, n)) {
+			if (errno != ENOSYS && errno != EINVAL) {
+				perror("xs_multi");
+				exit(1);
+			}
+			multi = false;
+		}
+		/* xs_multi() only fails as a whole: check each write too. */
+		for (i = 0; multi && i < n; i++) {
+			if (ops[i].error) {
+				errno = ops[i].error;
+				perror(paths[i]);
+				exit(1);
+			}
+		}
+		for (i = 0; !multi && i < n; i++) {
+			if (!xs_write(xsh, XBT_NULL, paths[i], "1", 1)) {
+				perror(paths[i]);
+				exit(1);
+			}
+		}
+	}
+}
+
+static void random_key(char *path, size_t size, unsigned int *seed)
+{
+	unsigned int dom = rand_r(seed) % domains;
+
+	if (rand_r(seed) & 1)
+		snprintf(path, size, LOAD_ROOT "/%u/device/vif/0/%s", dom,
+			 vif_keys[rand_r(seed) % NR_KEYS(vif_keys)]);
+	else
+		snprintf(path, size, LOAD_ROOT "/%u/device/vbd/51712/%s", dom,
+			 vbd_keys[rand_r(seed) % NR_KEYS(vbd_keys)]);
+}
+
+/* Set up a watch, wait for the event it fires straight away, remove it. */
+static bool do_watch(struct xs_handle *xsh, const char *path,
+		     unsigned int *token_nr)
+{
+	char token[16], **event;
+	bool found = false;
+	unsigned int num;
+
+	snprintf(token, sizeof(token), "%u", ++*token_nr);
+	if (!xs_watch(xsh, path, token))
+		return false;
+
+	/* Events for earlier watches may still be queued: skip them. */
+	while (!found) {
+		event = xs_read_watch(xsh, &num);
+		if (!event)
+			return false;
+		found = !strcmp(event[XS_WATCH_TOKEN], token);
+		free(event);
+	}
+
+	return xs_unwatch(xsh, path, token);
+}
+
+/*
+ * A hotplug-like transaction, touching a frontend and its backend in dom0:
+ * returns false on error, retrying conflicts.
+ */
+static bool do_transaction(struct xs_handle *xsh, unsigned int dom,
+			   unsigned int *retries)
+{
+	struct timespec hold = {
+		.tv_sec = hold_ms / 1000,
+		.tv_nsec = (hold_ms % 1000) * 1000000,
+	};
+	char path[128];
+	xs_transaction_t t;
+	void *val;
+
+	for (;;) {
+		t = xs_transaction_start(xsh);
+		if (t == XBT_NULL)
+			return false;
+
+		snprintf(path, sizeof(path),
+			 LOAD_ROOT "/%u/device/vif/0/state", dom);
+		val = xs_read(xsh, t, path, NULL);
+		free(val);
+		snprintf(path, sizeof(path),
+			 LOAD_ROOT "/%u/device/vif/0/online", dom);
+		val = xs_read(xsh, t, path, NULL);
+		free(val);
+		if (hold_ms)
+			nanosleep(&hold, NULL);
+
+		snprintf(path, sizeof(path),
+			 LOAD_ROOT "/%u/device/vif/0/hotplug-status", dom);
+		if (!xs_write(xsh, t, path, "connected", strlen("connected"))) {
+			xs_transaction_end(xsh, t, true);
+			return false;
+		}
+		snprintf(path, sizeof(path),
+			 LOAD_ROOT "/0/backend/vif/%u/0/hotplug-status", dom);
+		if (!xs_write(xsh, t, path, "connected", strlen("connected"))) {
+			xs_transaction_end(xsh, t, true);
+			return false;
+		}
+
+		if (xs_transaction_end(xsh, t, false))
+			return true;
+		if (errno != EAGAIN)
+			return false;
+		(*retries)++;
+	}
+}
+
+static bool record(struct op_stats *stats, uint64_t ns)
+{
+	uint64_t *bigger;
+
+	if (stats->count == stats->size) {
+		stats->size = stats->size ? stats->size * 2 : 4096;
+		bigger = realloc(stats->ns, stats->size * sizeof(*stats->ns));
+		if (!bigger)
+			return false;
+		stats->ns = bigger;
+	}
+	stats->ns[stats->count++] = ns;
+	return true;
+}
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+	ssize_t done;
+
+	while (len) {
+		done = write(fd, data, len);
+		if (done < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data = (const char *)data + done;
+		len -= done;
+	}
+	return true;
+}
+
+static bool read_all(int fd, void *data, size_t len)
+{
+	ssize_t done;
+
+	while (len) {
+		done = read(fd, data, len);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			return false;
+		data = (char *)data + done;
+		len -= done;
+	}
+	return true;
+}
+
+/* Runs in a child: waits for start_fd to close, then for seconds. */
+static void client(unsigned int id, const unsigned int *weights,
+		   unsigned int seconds, int start_fd, int result_fd)
+{
+	struct op_stats stats[NR_OPS];
+	struct xs_handle *xsh;
+	unsigned int seed = id * 7919 + getpid(), token_nr = 0;
+	unsigned int total = 0, op, pick, len;
+	uint64_t start, end, deadline;
+	char path[128], c, **dir;
+	bool ok;
+	void *val;
+
+	memset(stats, 0, sizeof(stats));
+	for (op = 0; op < NR_OPS; op++)
+		total += weights[op];
+
+	xsh = xs_open(XS_OPEN_SOCKETONLY);
+	if (!xsh) {
+		perror("xs_open");
+		exit(1);
+	}
+
+	/* Everybody starts at once. */
+	if (read(start_fd, &c, 1) < 0)
+		exit(1);
+
+	deadline = now_ns() + seconds * 1000000000ULL;
+	do {
+		pick = rand_r(&seed) % total;
+		for (op = 0; pick >= weights[op]; op++)
+			pick -= weights[op];
+
+		random_key(path, sizeof(path), &seed);
+		start = now_ns();
+		switch (op) {
+		case OP_READ:
+			val = xs_read(xsh, XBT_NULL, path, &len);
+			ok = val != NULL;
+			free(val);
+			break;
+		case OP_WRITE:
+			ok = xs_write(xsh, XBT_NULL, path, "2", 1);
+			break;
+		case OP_DIRECTORY:
+			*strrchr(path, '/') = '\0';
+			dir = xs_directory(xsh, XBT_NULL, path, &len);
+			ok = dir != NULL;
+			free(dir);
+			break;
+		case OP_WATCH:
+			*strrchr(path, '/') = '\0';
+			ok = do_watch(xsh, path, &token_nr);
+			break;
+		case OP_TRANSACTION:
+		default:
+			ok = do_transaction(xsh, rand_r(&seed) % domains,
+					    &stats[op].retries);
+			break;
+		}
+		end = now_ns();
+
+		if (!ok)
+			stats[op].errors++;
+		else if (!record(&stats[op], end - start)) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	} while (end < deadline);
+
+	xs_close(xsh);
+
+	for (op = 0; op < NR_OPS; op++) {
+		if (!write_all(result_fd, &stats[op], sizeof(stats[op])) ||
+		    !write_all(result_fd, stats[op].ns,
+			       stats[op].count * sizeof(*stats[op].ns)))
+			exit(1);
+	}
+	exit(0);
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct op_stats *stats, unsigned int pct)
+{
+	unsigned int i;
+
+	if (!stats->count)
+		return 0;
+	i = (uint64_t)stats->count * pct / 100;
+	if (i >= stats->count)
+		i = stats->count - 1;
+	return stats->ns[i] / 1000.0;
+}
+
+static void report(const char *name, struct op_stats *stats,
+		   unsigned int seconds)
+{
+	qsort(stats->ns, stats->count, sizeof(*stats->ns), cmp_ns);
+	printf("%-12s %10u %10.0f %10.1f %10.1f %8u %8u\n", name,
+	       stats->count, (double)stats->count / seconds,
+	       percentile_us(stats, 50), percentile_us(stats, 99),
+	       stats->errors, stats->retries);
+}
+
+static struct option options[] = {
+	{ "clients", 1, NULL, 'c' },
+	{ "domains", 1, NULL, 'd' },
+	{ "time", 1, NULL, 't' },
+	{ "mix", 1, NULL, 'm' },
+	{ "hold", 1, NULL, 'l' },
+	{ "keep", 0, NULL, 'k' },
+	{ "help", 0, NULL, 'h' },
+	{ NULL, 0, NULL, 0 } };
+
+int main(int argc, char *argv[])
+{
+	unsigned int weights[NR_OPS] = { 60, 20, 10, 5, 5 };
+	unsigned int clients = 8, seconds = 10, i, op;
+	struct op_stats stats[NR_OPS], all, got;
+	int start_pipe[2], result_pipe[2], opt, status;
+	struct xs_handle *xsh;
+	bool keep = false, failed = false;
+	int *result_fds;
+	pid_t pid;
+	uint64_t *bigger;
+
+	while ((opt = getopt_long(argc, argv, "c:d:t:m:l:kh", options,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			clients = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			domains = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			seconds = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			if (!parse_mix(optarg, weights)) {
+				fprintf(stderr, "Bad operation mix: %s\n",
+					optarg);
+				return 2;
+			}
+			break;
+		case 'l':
+			hold_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			keep = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (optind != argc || !clients || !domains || !seconds) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	xsh = xs_open(XS_OPEN_SOCKETONLY);
+	if (xsh == NULL) {
+		fprintf(stderr, "Failed to contact Xenstored.\n");
+		return 1;
+	}
+
+	populate(xsh);
+
+	result_fds = calloc(clients, sizeof(*result_fds));
+	if (!result_fds || pipe(start_pipe) != 0) {
+		perror("Failed to set up clients");
+		return 1;
+	}
+
+	/* Each client sends its results down its own pipe, read in turn. */
+	for (i = 0; i < clients; i++) {
+		if (pipe(result_pipe) != 0) {
+			perror("pipe");
+			return 1;
+		}
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0) {
+			close(start_pipe[1]);
+			close(result_pipe[0]);
+			client(i, weights, seconds, start_pipe[0],
+			       result_pipe[1]);
+		}
+		close(result_pipe[1]);
+		result_fds[i] = result_pipe[0];
+	}
+	close(start_pipe[0]);
+	close(start_pipe[1]);
+
+	memset(stats, 0, sizeof(stats));
+	for (i = 0; i < clients; i++) {
+		for (op = 0; op < NR_OPS; op++) {
+			if (!read_all(result_fds[i], &got, sizeof(got))) {
+				failed = true;
+				break;
+			}
+			if (got.count) {
+				bigger = realloc(stats[op].ns,
+						 (stats[op].count + got.count) *
+						 sizeof(*bigger));
+				if (!bigger ||
+				    !read_all(result_fds[i],
+					      bigger + stats[op].count,
+					      got.count * sizeof(*bigger))) {
+					failed = true;
+					break;
+				}
+				stats[op].ns = bigger;
+				stats[op].count += got.count;
+			}
+			stats[op].errors += got.errors;
+			stats[op].retries += got.retries;
+		}
+		close(result_fds[i]);
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = true;
+	if (failed) {
+		fprintf(stderr, "A client failed\n");
+		return 1;
+	}
+
+	printf("%u clients, %u domains, %u seconds\n",
+	       clients, domains, seconds);
+	printf("%-12s %10s %10s %10s %10s %8s %8s\n", "operation", "count",
+	       "ops/s", "p50 (us)", "p99 (us)", "errors", "retries");
+
+	memset(&all, 0, sizeof(all));
+	for (op = 0; op < NR_OPS; op++) {
+		if (!weights[op])
+			continue;
+		report(op_names[op], &stats[op], seconds);
+
+		if (stats[op].count) {
+			bigger = realloc(all.ns, (all.count + stats[op].count) *
+					 sizeof(*bigger));
+			if (!bigger) {
+				perror("realloc");
+				return 1;
+			}
+			all.ns = bigger;
+			memcpy(all.ns + all.count, stats[op].ns,
+			       stats[op].count * sizeof(*bigger));
+			all.count += stats[op].count;
+		}
+		all.errors += stats[op].errors;
+		all.retries += stats[op].retries;
+	}
+	report("all", &all, seconds);
+
+	if (!keep)
+		xs_rm(xsh, XBT_NULL, LOAD_ROOT);
+
+	xs_close(xsh);
+
+	return 0;
+}
@@ -1,4 +1,5 @@
 /* Simple program to dump out all records of TDB */
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -11,16 +12,10 @@
 #include "talloc.h"
 #include "utils.h"
 
-struct record_hdr {
-	uint32_t num_perms;
-	uint32_t datalen;
-	uint32_t childlen;
-	struct xs_permissions perms[0];
-};
-
-static uint32_t total_size(struct record_hdr *hdr)
+static uint32_t total_size(struct xs_tdb_record_hdr *hdr)
 {
-	return sizeof(*hdr) + hdr->num_perms * sizeof(struct xs_permissions) 
+	return offsetof(struct xs_tdb_record_hdr, perms)
+		+ hdr->num_perms * sizeof(struct xs_permissions) 
 		+ hdr->datalen + hdr->childlen;
 }
 
@@ -48,11 +43,11 @@ int main(int argc, char *argv[])
 	key = tdb_firstkey(tdb);
 	while (key.dptr) {
 		TDB_DATA data;
-		struct record_hdr *hdr;
+		struct xs_tdb_record_hdr *hdr;
 
 		data = tdb_fetch(tdb, key);
 		hdr = (void *)data.dptr;
-		if (data.dsize < sizeof(*hdr))
+		if (data.dsize < offsetof(struct xs_tdb_record_hdr, perms))
 			fprintf(stderr, "%.*s: BAD truncated\n",
 				(int)key.dsize, key.dptr);
 		else if (data.dsize != total_size(hdr))
@@ -64,7 +59,8 @@ int main(int argc, char *argv[])
 			unsigned int i;
 			char *p;
 
-			printf("%.*s: ", (int)key.dsize, key.dptr);
+			printf("%.*s: gen %llu ", (int)key.dsize, key.dptr,
+			       (unsigned long long)hdr->generation);
 			for (i = 0; i < hdr->num_perms; i++)
 				printf("%s%c%i",
 				       i == 0 ? "" : ",",
@@ -406,6 +406,8 @@ static void __devinit amd_get_topology(struct cpuinfo_x86 *c)
         c->cpu_core_id = c->phys_proc_id & ((1<<bits)-1);
         /* Convert local APIC ID into the socket ID */
         c->phys_proc_id >>= bits;
+        /* The last level cache is shared by all cores of a processor */
+        c->cpu_llc_id = c->phys_proc_id;
         /* Collect compute unit ID if available */
         if (cpu_has(c, X86_FEATURE_TOPOEXT)) {
                 u32 eax, ebx, ecx, edx;
@@ -244,10 +244,12 @@ unsigned int __cpuinit init_intel_cacheinfo(struct cpuinfo_x86 *c)
 
 	if (new_l2) {
 		l2 = new_l2;
+		c->cpu_llc_id = l2_id;
 	}
 
 	if (new_l3) {
 		l3 = new_l3;
+		c->cpu_llc_id = l3_id;
 	}
 
 	if (opt_cpu_info) {
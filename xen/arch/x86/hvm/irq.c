@@ -25,6 +25,7 @@
 #include <xen/sched.h>
 #include <xen/irq.h>
 #include <xen/keyhandler.h>
+#include <asm/apic.h>
 #include <asm/hvm/domain.h>
 #include <asm/hvm/support.h>
 #include <asm/msi.h>
@@ -212,6 +213,27 @@ void hvm_maybe_deassert_evtchn_irq(void)
 
 void hvm_assert_evtchn_irq(struct vcpu *v)
 {
+    uint8_t vector = v->arch.hvm_vcpu.evtchn_upcall_vector;
+
+    if ( vector != 0 )
+    {
+        struct hvm_irq *hvm_irq = &v->domain->arch.hvm_domain.irq;
+
+        /*
+         * The per-vCPU upcall vector goes through the local APIC, which is
+         * safe from any context. With posted interrupts the vector is set
+         * in the target's PIR and a vCPU running on another pCPU receives
+         * it through the notification vector, without a VM exit.
+         */
+        atomic_inc(&hvm_irq->evtchn_upcalls);
+        if ( hvm_funcs.deliver_posted_intr && v->is_running &&
+             (v != current) )
+            atomic_inc(&hvm_irq->evtchn_upcalls_posted);
+
+        vlapic_set_irq(vcpu_vlapic(v), vector, 0);
+        return;
+    }
+
     if ( unlikely(in_irq() || !local_irq_is_enabled()) )
     {
         tasklet_schedule(&v->arch.hvm_vcpu.assert_evtchn_irq_tasklet);
@@ -224,6 +246,27 @@ void hvm_assert_evtchn_irq(struct vcpu *v)
         hvm_set_callback_irq_level(v);
 }
 
+/*
+ * Called when @v has moved to a new pCPU.  An upcall posted while it was
+ * moving may have had its notification sent to the old pCPU, so pull the
+ * PIR into the IRR and raise the upcall vector again on the new one if
+ * events are still pending and it isn't already requested.
+ */
+void hvm_migrate_evtchn_upcall(struct vcpu *v)
+{
+    uint8_t vector = v->arch.hvm_vcpu.evtchn_upcall_vector;
+    struct vlapic *vlapic = vcpu_vlapic(v);
+
+    if ( vector == 0 || !vcpu_info(v, evtchn_upcall_pending) )
+        return;
+
+    if ( hvm_funcs.sync_pir_to_irr )
+        hvm_funcs.sync_pir_to_irr(v);
+
+    if ( !vlapic_test_vector(vector, &vlapic->regs->data[APIC_IRR]) )
+        vlapic_set_irq(vlapic, vector, 0);
+}
+
 void hvm_set_pci_link_route(struct domain *d, u8 link, u8 isa_irq)
 {
     struct hvm_irq *hvm_irq = &d->arch.hvm_domain.irq;
@@ -505,6 +548,9 @@ static void irq_dump(struct domain *d)
     printk("Callback via %i:%#"PRIx32",%s asserted\n",
            hvm_irq->callback_via_type, hvm_irq->callback_via.gsi, 
            hvm_irq->callback_via_asserted ? "" : " not");
+    printk("Upcall vector deliveries %u, posted without VM exit %u\n",
+           atomic_read(&hvm_irq->evtchn_upcalls),
+           atomic_read(&hvm_irq->evtchn_upcalls_posted));
 }
 
 static void dump_irq_info(unsigned char key)
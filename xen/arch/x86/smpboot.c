@@ -768,10 +768,29 @@ void __init smp_prepare_cpus(unsigned int max_cpus)
     setup_boot_APIC_clock();
 }
 
+/* Until it is identified, a cpu has no place in the topology. */
+static void clear_cpu_topology(unsigned int cpu)
+{
+    cpu_data[cpu].phys_proc_id = BAD_APICID;
+    cpu_data[cpu].cpu_core_id = BAD_APICID;
+    cpu_data[cpu].compute_unit_id = BAD_APICID;
+    cpu_data[cpu].cpu_llc_id = BAD_APICID;
+}
+
 void __init smp_prepare_boot_cpu(void)
 {
+    unsigned int cpu;
+
     cpumask_set_cpu(smp_processor_id(), &cpu_online_map);
     cpumask_set_cpu(smp_processor_id(), &cpu_present_map);
+
+    /*
+     * cpu_data[] starts out zeroed, which would read as package 0, core
+     * 0: schedulers placing a cpu before it is up must be able to tell.
+     */
+    for ( cpu = 0; cpu < NR_CPUS; cpu++ )
+        if ( cpu != smp_processor_id() )
+            clear_cpu_topology(cpu);
 }
 
 static void
@@ -792,9 +811,7 @@ remove_siblinginfo(int cpu)
         cpumask_clear_cpu(cpu, per_cpu(cpu_sibling_mask, sibling));
     cpumask_clear(per_cpu(cpu_sibling_mask, cpu));
     cpumask_clear(per_cpu(cpu_core_mask, cpu));
-    c[cpu].phys_proc_id = BAD_APICID;
-    c[cpu].cpu_core_id = BAD_APICID;
-    c[cpu].compute_unit_id = BAD_APICID;
+    clear_cpu_topology(cpu);
     cpumask_clear_cpu(cpu, &cpu_sibling_setup_map);
 }
 
@@ -655,6 +655,57 @@ out:
     return ret;
 }
 
+static long evtchn_send_batch(XEN_GUEST_HANDLE_PARAM(void) arg)
+{
+    struct evtchn_send_batch batch;
+    XEN_GUEST_HANDLE_PARAM(evtchn_port_t) ports;
+    evtchn_port_t port;
+    unsigned int i;
+    long rc = 0;
+
+    if ( copy_from_guest(&batch, arg, 1) != 0 )
+        return -EFAULT;
+
+    /* Fairly arbitrary limit. */
+    if ( batch.nr_ports > 256 )
+        return -EINVAL;
+
+    ports = guest_handle_cast(arg, evtchn_port_t);
+    guest_handle_add_offset(ports, offsetof(struct evtchn_send_batch, port) /
+                                   sizeof(port));
+    if ( !guest_handle_okay(ports, batch.nr_ports) )
+        return -EFAULT;
+
+    /*
+     * Kicking a remote vCPU raises VCPU_KICK_SOFTIRQ (and possibly
+     * SCHEDULE_SOFTIRQ) on the pCPU it runs on. Batch these so that the
+     * pCPUs to be notified are accumulated over the whole port list and
+     * signalled with a single multicast IPI at the end. Repeated
+     * notifications of the same vCPU are already filtered out by
+     * vcpu_mark_events_pending() while its upcall remains pending.
+     */
+    cpu_raise_softirq_batch_begin();
+
+    for ( i = 0; i < batch.nr_ports; i++ )
+    {
+        rc = -EFAULT;
+        if ( __copy_from_guest_offset(&port, ports, i, 1) )
+            break;
+
+        rc = evtchn_send(current->domain, port);
+        if ( rc )
+            break;
+    }
+
+    cpu_raise_softirq_batch_finish();
+
+    batch.nr_sent = i;
+    if ( __copy_to_guest(arg, &batch, 1) )
+        rc = -EFAULT;
+
+    return rc;
+}
+
 static void evtchn_set_pending(struct vcpu *v, int port)
 {
     evtchn_port_set_pending(v, evtchn_from_port(v->domain, port));
@@ -1074,6 +1125,10 @@ long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case EVTCHNOP_send_batch:
+        rc = evtchn_send_batch(arg);
+        break;
+
     case EVTCHNOP_status: {
         struct evtchn_status status;
         if ( copy_from_guest(&status, arg, 1) != 0 )
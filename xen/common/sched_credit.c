@@ -131,11 +131,27 @@
 #define CSCHED_BALANCE_SOFT_AFFINITY    0
 #define CSCHED_BALANCE_HARD_AFFINITY    1
 
+/*
+ * Work stealing: when looking for work to steal, the peer PCPUs are visited
+ * from the closest to the farthest, i.e., first our SMT siblings, then the
+ * PCPUs sharing our last level cache, then the rest of our NUMA node and,
+ * finally, the other nodes, nearest first. This keeps vcpus -- and their
+ * cache footprint and memory -- as close as possible to where they were.
+ */
+#define CSCHED_STEAL_SMT                0
+#define CSCHED_STEAL_LLC                1
+#define CSCHED_STEAL_NODE               2
+#define CSCHED_STEAL_REMOTE             3
+#define CSCHED_STEAL_NR                 4
+
 /*
  * Boot parameters
  */
 static int __read_mostly sched_credit_tslice_ms = CSCHED_DEFAULT_TSLICE_MS;
 integer_param("sched_credit_tslice_ms", sched_credit_tslice_ms);
+/* Max number of peer runqueues to look at in each balancing (0: no limit) */
+static unsigned int __read_mostly sched_credit_steal_budget;
+integer_param("sched_credit_steal_budget", sched_credit_steal_budget);
 
 /*
  * Physical CPU
@@ -148,6 +164,14 @@ struct csched_pcpu {
     unsigned int idle_bias;
     /* Store this here to avoid having too many cpumask_var_t-s on stack */
     cpumask_var_t balance_mask;
+    cpumask_var_t steal_visited;
+    /* Work stealing statistics, per CSCHED_STEAL_* level */
+    struct {
+        uint32_t attempts[CSCHED_STEAL_NR];
+        uint32_t stolen[CSCHED_STEAL_NR];
+        uint32_t trylock_failed;
+        uint32_t budget_exhausted;
+    } steal;
 };
 
 /*
@@ -486,6 +510,7 @@ csched_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
     spin_unlock_irqrestore(&prv->lock, flags);
 
     free_cpumask_var(spc->balance_mask);
+    free_cpumask_var(spc->steal_visited);
     xfree(spc);
 }
 
@@ -506,6 +531,12 @@ csched_alloc_pdata(const struct scheduler *ops, int cpu)
         xfree(spc);
         return NULL;
     }
+    if ( !alloc_cpumask_var(&spc->steal_visited) )
+    {
+        free_cpumask_var(spc->balance_mask);
+        xfree(spc);
+        return NULL;
+    }
 
     spin_lock_irqsave(&prv->lock, flags);
 
@@ -1490,15 +1521,128 @@ csched_runq_steal(int peer_cpu, int cpu, int pri, int balance_step)
     return NULL;
 }
 
+/*
+ * Put in mask the PCPUs that are at the given CSCHED_STEAL_* distance
+ * from cpu (or closer).
+ */
+static void
+csched_steal_level_mask(unsigned int cpu, int level, cpumask_t *mask)
+{
+    unsigned int peer;
+
+    switch ( level )
+    {
+    case CSCHED_STEAL_SMT:
+        cpumask_copy(mask, per_cpu(cpu_sibling_mask, cpu));
+        break;
+    case CSCHED_STEAL_LLC:
+        cpumask_clear(mask);
+        for_each_cpu ( peer, per_cpu(cpu_core_mask, cpu) )
+            if ( cpu_to_llc(peer) == cpu_to_llc(cpu) )
+                cpumask_set_cpu(peer, mask);
+        break;
+    case CSCHED_STEAL_NODE:
+        cpumask_copy(mask, &node_to_cpumask(cpu_to_node(cpu)));
+        break;
+    default:
+        BUG();
+    }
+}
+
+/*
+ * The online nodes other than node, sorted by distance from it (and then
+ * by id): return the one that follows prev, or node if prev is the last
+ * one. prev == node means "return the first one".
+ */
+static int
+csched_next_node(int node, int prev)
+{
+    int n, next = node;
+    int d, next_d = INT_MAX, prev_d = __node_distance(node, prev);
+
+    for_each_online_node ( n )
+    {
+        if ( n == node )
+            continue;
+        d = __node_distance(node, n);
+        if ( prev != node && (d < prev_d || (d == prev_d && n <= prev)) )
+            continue;
+        if ( d < next_d )
+        {
+            next = n;
+            next_d = d;
+        }
+    }
+
+    return next;
+}
+
+/*
+ * Look for work to steal on the runqueues of the PCPUs in workers, which
+ * are all at distance level from us. Each runqueue looked at consumes one
+ * unit of *budget; we give up when it reaches 0.
+ */
+static struct csched_vcpu *
+csched_steal_from(struct csched_pcpu *spc, const cpumask_t *workers,
+                  int cpu, int pri, int bstep, int level, unsigned int *budget)
+{
+    const cpumask_t *online = cpupool_scheduler_cpumask(per_cpu(cpupool, cpu));
+    struct csched_vcpu *speer;
+    int peer_cpu;
+
+    for_each_cpu ( peer_cpu, workers )
+    {
+        spinlock_t *lock;
+
+        if ( *budget == 0 )
+        {
+            spc->steal.budget_exhausted++;
+            return NULL;
+        }
+        (*budget)--;
+
+        /*
+         * Get ahold of the scheduler lock for this peer CPU.
+         *
+         * Note: We don't spin on this lock but simply try it. Spinning
+         * could cause a deadlock if the peer CPU is also load
+         * balancing and trying to lock this CPU.
+         */
+        lock = pcpu_schedule_trylock(peer_cpu);
+        if ( !lock )
+        {
+            SCHED_STAT_CRANK(steal_trylock_failed);
+            spc->steal.trylock_failed++;
+            continue;
+        }
+
+        /* Any work over there to steal? */
+        spc->steal.attempts[level]++;
+        speer = cpumask_test_cpu(peer_cpu, online) ?
+            csched_runq_steal(peer_cpu, cpu, pri, bstep) : NULL;
+        pcpu_schedule_unlock(lock, peer_cpu);
+
+        if ( speer != NULL )
+        {
+            spc->steal.stolen[level]++;
+            return speer;
+        }
+    }
+
+    return NULL;
+}
+
 static struct csched_vcpu *
 csched_load_balance(struct csched_private *prv, int cpu,
     struct csched_vcpu *snext, bool_t *stolen)
 {
+    struct csched_pcpu * const spc = CSCHED_PCPU(cpu);
     struct csched_vcpu *speer;
     cpumask_t workers;
     cpumask_t *online;
-    int peer_cpu, peer_node, bstep;
+    int peer_node, bstep, level;
     int node = cpu_to_node(cpu);
+    unsigned int budget = sched_credit_steal_budget ?: UINT_MAX;
 
     BUG_ON( cpu != snext->vcpu->processor );
     online = cpupool_scheduler_cpumask(per_cpu(cpupool, cpu));
@@ -1523,67 +1667,58 @@ csched_load_balance(struct csched_private *prv, int cpu,
      */
     for_each_csched_balance_step( bstep )
     {
+        cpumask_copy(spc->steal_visited, cpumask_of(cpu));
+
         /*
-         * We peek at the non-idling CPUs in a node-wise fashion. In fact,
-         * it is more likely that we find some affine work on our same
-         * node, not to mention that migrating vcpus within the same node
-         * could well expected to be cheaper than across-nodes (memory
-         * stays local, there might be some node-wide cache[s], etc.).
+         * We peek at the non-idling CPUs in order of distance: SMT
+         * siblings, then LLC, then node. It is more likely that we find
+         * some affine work close to us, not to mention that migrating
+         * vcpus there is cheaper (caches are shared, memory stays local).
          */
+        for ( level = CSCHED_STEAL_SMT; level < CSCHED_STEAL_REMOTE; level++ )
+        {
+            csched_steal_level_mask(cpu, level, &workers);
+            cpumask_andnot(&workers, &workers, spc->steal_visited);
+            cpumask_or(spc->steal_visited, spc->steal_visited, &workers);
+
+            /* Find out what the !idle are at this distance */
+            cpumask_and(&workers, &workers, online);
+            cpumask_andnot(&workers, &workers, prv->idlers);
+
+            speer = csched_steal_from(spc, &workers, cpu, snext->pri,
+                                      bstep, level, &budget);
+            /* As soon as one vcpu is found, balancing ends */
+            if ( speer != NULL )
+                goto stolen;
+            if ( budget == 0 )
+                goto out;
+        }
+
+        /* Then the other nodes, nearest first. */
         peer_node = node;
-        do
+        while ( (peer_node = csched_next_node(node, peer_node)) != node )
         {
-            /* Find out what the !idle are in this node */
             cpumask_andnot(&workers, online, prv->idlers);
             cpumask_and(&workers, &workers, &node_to_cpumask(peer_node));
-            cpumask_clear_cpu(cpu, &workers);
-
-            peer_cpu = cpumask_first(&workers);
-            if ( peer_cpu >= nr_cpu_ids )
-                goto next_node;
-            do
-            {
-                /*
-                 * Get ahold of the scheduler lock for this peer CPU.
-                 *
-                 * Note: We don't spin on this lock but simply try it. Spinning
-                 * could cause a deadlock if the peer CPU is also load
-                 * balancing and trying to lock this CPU.
-                 */
-                spinlock_t *lock = pcpu_schedule_trylock(peer_cpu);
-
-                if ( !lock )
-                {
-                    SCHED_STAT_CRANK(steal_trylock_failed);
-                    peer_cpu = cpumask_cycle(peer_cpu, &workers);
-                    continue;
-                }
+            cpumask_andnot(&workers, &workers, spc->steal_visited);
 
-                /* Any work over there to steal? */
-                speer = cpumask_test_cpu(peer_cpu, online) ?
-                    csched_runq_steal(peer_cpu, cpu, snext->pri, bstep) : NULL;
-                pcpu_schedule_unlock(lock, peer_cpu);
-
-                /* As soon as one vcpu is found, balancing ends */
-                if ( speer != NULL )
-                {
-                    *stolen = 1;
-                    return speer;
-                }
-
-                peer_cpu = cpumask_cycle(peer_cpu, &workers);
-
-            } while( peer_cpu != cpumask_first(&workers) );
-
- next_node:
-            peer_node = cycle_node(peer_node, node_online_map);
-        } while( peer_node != node );
+            speer = csched_steal_from(spc, &workers, cpu, snext->pri,
+                                      bstep, CSCHED_STEAL_REMOTE, &budget);
+            if ( speer != NULL )
+                goto stolen;
+            if ( budget == 0 )
+                goto out;
+        }
     }
 
  out:
     /* Failed to find more important work elsewhere... */
     __runq_remove(snext);
     return snext;
+
+ stolen:
+    *stolen = 1;
+    return speer;
 }
 
 /*
@@ -1764,6 +1899,19 @@ csched_dump_pcpu(const struct scheduler *ops, int cpu)
     cpumask_scnprintf(cpustr, sizeof(cpustr), per_cpu(cpu_core_mask, cpu));
     printk("core=%s\n", cpustr);
 
+    /* work stealing, as stolen/looked at, per distance */
+    printk("\tsteal: smt=%u/%u llc=%u/%u node=%u/%u remote=%u/%u"
+           " trylock_failed=%u budget_exhausted=%u\n",
+           spc->steal.stolen[CSCHED_STEAL_SMT],
+           spc->steal.attempts[CSCHED_STEAL_SMT],
+           spc->steal.stolen[CSCHED_STEAL_LLC],
+           spc->steal.attempts[CSCHED_STEAL_LLC],
+           spc->steal.stolen[CSCHED_STEAL_NODE],
+           spc->steal.attempts[CSCHED_STEAL_NODE],
+           spc->steal.stolen[CSCHED_STEAL_REMOTE],
+           spc->steal.attempts[CSCHED_STEAL_REMOTE],
+           spc->steal.trylock_failed, spc->steal.budget_exhausted);
+
     /* current VCPU */
     svc = CSCHED_VCPU(curr_on_cpu(cpu));
     if ( svc )
@@ -54,10 +54,7 @@
  * + Immediate bug-fixes
  *  - Do per-runqueue, grab proper lock for dump debugkey
  * + Multiple sockets
- *  - Detect cpu layout and make runqueue map, one per L2 (make_runq_map())
- *  - Simple load balancer / runqueue assignment
- *  - Runqueue load measurement
- *  - Load-based load balancer
+ *  - Soft affinity
  * + Hyperthreading
  *  - Look for non-busy core if possible
  *  - "Discount" time run on a thread with busy siblings
@@ -84,9 +81,11 @@
  * or equal to zero.  At that point, everyone's credits are "clipped"
  * to a small value, and a fixed credit is added to everyone.
  *
- * The plan is for all cores that share an L2 will share the same
- * runqueue.  At the moment, there is one global runqueue for all
- * cores.
+ * Runqueues are built from the cpu topology: by default all cpus which
+ * share a last-level cache share a runqueue (see credit2_runqueue= for
+ * the alternatives).  Load is balanced between runqueues by
+ * balance_load(), which is called on credit reset and, rate-limited,
+ * whenever a cpu is about to go idle.
  */
 
 /*
@@ -128,6 +127,9 @@
 #define CSCHED2_CREDIT_RESET         0
 /* Max timer: Maximum time a guest can be run for. */
 #define CSCHED2_MAX_TIMER            MILLISECS(2)
+/* Idle balance: Minimum interval between two idle-triggered load
+ * balancing attempts on the same runqueue. */
+#define CSCHED2_IDLE_BALANCE_INTERVAL MICROSECS(1000)
 
 
 #define CSCHED2_IDLE_CREDIT                 (-(1<<30))
@@ -194,6 +196,55 @@ integer_param("credit2_balance_under", opt_underload_balance_tolerance);
 int opt_overload_balance_tolerance=-3;
 integer_param("credit2_balance_over", opt_overload_balance_tolerance);
 
+/*
+ * Runqueue organization.
+ *
+ * The various cpus are to be assigned each one to a runqueue, and we
+ * want that to happen basing on topology.  At the moment, it is possible
+ * to choose to arrange runqueues to be:
+ * - per-core: meaning that there will be one runqueue per each physical
+ *             core of the host.  This makes sense if the host has
+ *             hyperthreading enabled;
+ * - per-llc: meaning that there will be one runqueue per each last level
+ *            cache (usually the L3, or the L2 on older parts);
+ * - per-socket: meaning that there will be one runqueue per each physical
+ *               socket (AKA package, which often, but not always, also
+ *               matches a NUMA node) of the host;
+ * - per-node: meaning that there will be one runqueue per each physical
+ *             NUMA node of the host;
+ * - global: meaning that there will be only one runqueue for all the cpus.
+ */
+#define OPT_RUNQUEUE_CORE   0
+#define OPT_RUNQUEUE_LLC    1
+#define OPT_RUNQUEUE_SOCKET 2
+#define OPT_RUNQUEUE_NODE   3
+#define OPT_RUNQUEUE_ALL    4
+static const char *const opt_runqueue_str[] = {
+    [OPT_RUNQUEUE_CORE] = "core",
+    [OPT_RUNQUEUE_LLC] = "llc",
+    [OPT_RUNQUEUE_SOCKET] = "socket",
+    [OPT_RUNQUEUE_NODE] = "node",
+    [OPT_RUNQUEUE_ALL] = "all"
+};
+static int __read_mostly opt_runqueue = OPT_RUNQUEUE_LLC;
+
+static void __init parse_credit2_runqueue(const char *s)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(opt_runqueue_str); i++ )
+    {
+        if ( !strcmp(s, opt_runqueue_str[i]) )
+        {
+            opt_runqueue = i;
+            return;
+        }
+    }
+
+    printk("WARNING, unrecognized value of credit2_runqueue option!\n");
+}
+custom_param("credit2_runqueue", parse_credit2_runqueue);
+
 /*
  * Per-runqueue data
  */
@@ -213,6 +264,7 @@ struct csched2_runqueue_data {
     s_time_t load_last_update;  /* Last time average was updated */
     s_time_t avgload;           /* Decaying queue load */
     s_time_t b_avgload;         /* Decaying queue load modified by balancing */
+    s_time_t last_balance;      /* Last idle-triggered balance_load() */
 };
 
 /*
@@ -502,8 +554,9 @@ runq_tickle(const struct scheduler *ops, unsigned int cpu, struct csched2_vcpu *
         goto tickle;
     }
     
-    /* Get a mask of idle, but not tickled */
+    /* Get a mask of idle, but not tickled, that new is allowed to run on */
     cpumask_andnot(&mask, &rqd->idle, &rqd->tickled);
+    cpumask_and(&mask, &mask, new->vcpu->cpu_hard_affinity);
     
     /* If it's not empty, choose one */
     i = cpumask_cycle(cpu, &mask);
@@ -517,6 +570,7 @@ runq_tickle(const struct scheduler *ops, unsigned int cpu, struct csched2_vcpu *
      * skipping cpus which have been tickled but not scheduled yet */
     cpumask_andnot(&mask, &rqd->active, &rqd->idle);
     cpumask_andnot(&mask, &mask, &rqd->tickled);
+    cpumask_and(&mask, &mask, new->vcpu->cpu_hard_affinity);
 
     for_each_cpu(i, &mask)
     {
@@ -1031,6 +1085,35 @@ csched2_context_saved(const struct scheduler *ops, struct vcpu *vc)
     vcpu_schedule_unlock_irq(lock, vc);
 }
 
+/*
+ * Where to put a vcpu when we can't (or don't want to) look at the other
+ * runqueues: stay on the current processor if affinity allows it, or on
+ * the current runqueue if any of its cpus is allowed; otherwise go to
+ * any allowed cpu at all.
+ */
+static int get_fallback_cpu(struct csched2_vcpu *svc)
+{
+    struct vcpu *v = svc->vcpu;
+    int cpu;
+
+    if ( likely(cpumask_test_cpu(v->processor, v->cpu_hard_affinity)) )
+        return v->processor;
+
+    if ( svc->rqd != NULL )
+    {
+        cpumask_t mask;
+
+        cpumask_and(&mask, v->cpu_hard_affinity, &svc->rqd->active);
+        cpu = cpumask_any(&mask);
+        if ( cpu < nr_cpu_ids )
+            return cpu;
+    }
+
+    cpu = cpumask_any(v->cpu_hard_affinity);
+    BUG_ON(cpu >= nr_cpu_ids);
+    return cpu;
+}
+
 #define MAX_LOAD (1ULL<<60);
 static int
 choose_cpu(const struct scheduler *ops, struct vcpu *vc)
@@ -1039,6 +1122,7 @@ choose_cpu(const struct scheduler *ops, struct vcpu *vc)
     int i, min_rqi = -1, new_cpu;
     struct csched2_vcpu *svc = CSCHED2_VCPU(vc);
     s_time_t min_avgload;
+    cpumask_t mask;
 
     BUG_ON(cpumask_empty(&prv->active_queues));
 
@@ -1059,14 +1143,13 @@ choose_cpu(const struct scheduler *ops, struct vcpu *vc)
 
     if ( !spin_trylock(&prv->lock) )
     {
+        SCHED_STAT_CRANK(pick_trylock_failed);
         if ( test_and_clear_bit(__CSFLAG_runq_migrate_request, &svc->flags) )
         {
             d2printk("%pv -\n", svc->vcpu);
             clear_bit(__CSFLAG_runq_migrate_request, &svc->flags);
         }
-        /* Leave it where it is for now.  When we actually pay attention
-         * to affinity we'll have to figure something out... */
-        return vc->processor;
+        return get_fallback_cpu(svc);
     }
 
     /* First check to see if we're here because someone else suggested a place
@@ -1081,17 +1164,22 @@ choose_cpu(const struct scheduler *ops, struct vcpu *vc)
         }
         else
         {
-            d2printk("%pv +\n", svc->vcpu);
-            new_cpu = cpumask_cycle(vc->processor, &svc->migrate_rqd->active);
-            goto out_up;
+            cpumask_and(&mask, vc->cpu_hard_affinity,
+                        &svc->migrate_rqd->active);
+            new_cpu = cpumask_cycle(vc->processor, &mask);
+            if ( new_cpu < nr_cpu_ids )
+            {
+                d2printk("%pv +\n", svc->vcpu);
+                goto out_up;
+            }
+            /* Affinity changed since the request was made; fall through */
         }
     }
 
-    /* FIXME: Pay attention to cpu affinity */                                                                                      
-
     min_avgload = MAX_LOAD;
 
-    /* Find the runqueue with the lowest instantaneous load */
+    /* Find the runqueue with the lowest instantaneous load, among the
+     * ones containing at least one cpu we are allowed to run on */
     for_each_cpu(i, &prv->active_queues)
     {
         struct csched2_runqueue_data *rqd;
@@ -1099,6 +1187,9 @@ choose_cpu(const struct scheduler *ops, struct vcpu *vc)
 
         rqd = prv->rqd + i;
 
+        if ( !cpumask_intersects(vc->cpu_hard_affinity, &rqd->active) )
+            continue;
+
         /* If checking a different runqueue, grab the lock,
          * read the avg, and then release the lock.
          *
@@ -1124,12 +1215,13 @@ choose_cpu(const struct scheduler *ops, struct vcpu *vc)
         }
     }
 
-    /* We didn't find anyone (most likely because of spinlock contention); leave it where it is */
+    /* We didn't find anyone (most likely because of spinlock contention) */
     if ( min_rqi == -1 )
-        new_cpu = vc->processor;
+        new_cpu = get_fallback_cpu(svc);
     else
     {
-        new_cpu = cpumask_cycle(vc->processor, &prv->rqd[min_rqi].active);
+        cpumask_and(&mask, vc->cpu_hard_affinity, &prv->rqd[min_rqi].active);
+        new_cpu = cpumask_cycle(vc->processor, &mask);
         BUG_ON(new_cpu >= nr_cpu_ids);
     }
 
@@ -1192,6 +1284,7 @@ static void migrate(const struct scheduler *ops,
     {
         d2printk("%pv %d-%d a\n", svc->vcpu, svc->rqd->id, trqd->id);
         /* It's running; mark it to migrate. */
+        SCHED_STAT_CRANK(migrate_requested);
         svc->migrate_rqd = trqd;
         set_bit(_VPF_migrating, &svc->vcpu->pause_flags);
         set_bit(__CSFLAG_runq_migrate_request, &svc->flags);
@@ -1199,8 +1292,10 @@ static void migrate(const struct scheduler *ops,
     else
     {
         int on_runq=0;
+        cpumask_t mask;
         /* It's not running; just move it */
         d2printk("%pv %d-%d i\n", svc->vcpu, svc->rqd->id, trqd->id);
+        SCHED_STAT_CRANK(migrate_on_runq);
         if ( __vcpu_on_runq(svc) )
         {
             __runq_remove(svc);
@@ -1208,7 +1303,9 @@ static void migrate(const struct scheduler *ops,
             on_runq=1;
         }
         __runq_deassign(svc);
-        svc->vcpu->processor = cpumask_any(&trqd->active);
+        cpumask_and(&mask, svc->vcpu->cpu_hard_affinity, &trqd->active);
+        svc->vcpu->processor = cpumask_any(&mask);
+        BUG_ON(svc->vcpu->processor >= nr_cpu_ids);
         __runq_assign(svc, trqd);
         if ( on_runq )
         {
@@ -1240,11 +1337,16 @@ static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
      */
     st.lrqd = RQD(ops, cpu);
 
+    SCHED_STAT_CRANK(balance_load);
+
     __update_runq_load(ops, st.lrqd, 0, now);
 
 retry:
     if ( !spin_trylock(&prv->lock) )
+    {
+        SCHED_STAT_CRANK(balance_trylock_failed);
         return;
+    }
 
     st.load_delta = 0;
 
@@ -1310,7 +1412,10 @@ retry:
      * give up and return. */
     st.orqd = prv->rqd + max_delta_rqi;
     if ( !spin_trylock(&st.orqd->lock) )
+    {
+        SCHED_STAT_CRANK(balance_trylock_failed);
         goto retry;
+    }
 
     /* Make sure the runqueue hasn't been deactivated since we released prv->lock */
     if ( unlikely(st.orqd->id < 0) )
@@ -1327,8 +1432,11 @@ retry:
 
         __update_svc_load(ops, push_svc, 0, now);
 
-        /* Skip this one if it's already been flagged to migrate */
-        if ( test_bit(__CSFLAG_runq_migrate_request, &push_svc->flags) )
+        /* Skip this one if it's already been flagged to migrate, or if
+         * its affinity doesn't allow it to run on the other runqueue */
+        if ( test_bit(__CSFLAG_runq_migrate_request, &push_svc->flags)
+             || !cpumask_intersects(push_svc->vcpu->cpu_hard_affinity,
+                                    &st.orqd->active) )
             continue;
 
         list_for_each( pull_iter, &st.orqd->svc )
@@ -1341,7 +1449,9 @@ retry:
             }
         
             /* Skip this one if it's already been flagged to migrate */
-            if ( test_bit(__CSFLAG_runq_migrate_request, &pull_svc->flags) )
+            if ( test_bit(__CSFLAG_runq_migrate_request, &pull_svc->flags)
+                 || !cpumask_intersects(pull_svc->vcpu->cpu_hard_affinity,
+                                        &st.lrqd->active) )
                 continue;
 
             consider(&st, push_svc, pull_svc);
@@ -1358,7 +1468,9 @@ retry:
         struct csched2_vcpu * pull_svc = list_entry(pull_iter, struct csched2_vcpu, rqd_elem);
         
         /* Skip this one if it's already been flagged to migrate */
-        if ( test_bit(__CSFLAG_runq_migrate_request, &pull_svc->flags) )
+        if ( test_bit(__CSFLAG_runq_migrate_request, &pull_svc->flags)
+             || !cpumask_intersects(pull_svc->vcpu->cpu_hard_affinity,
+                                    &st.lrqd->active) )
             continue;
 
         /* Consider pull only */
@@ -1367,9 +1479,15 @@ retry:
 
     /* OK, now we have some candidates; do the moving */
     if ( st.best_push_svc )
+    {
+        SCHED_STAT_CRANK(balance_push);
         migrate(ops, st.best_push_svc, st.orqd, now);
+    }
     if ( st.best_pull_svc )
+    {
+        SCHED_STAT_CRANK(balance_pull);
         migrate(ops, st.best_pull_svc, st.lrqd, now);
+    }
 
 out_up:
     spin_unlock(&st.orqd->lock);
@@ -1611,6 +1729,10 @@ runq_candidate(struct csched2_runqueue_data *rqd,
     {
         struct csched2_vcpu * svc = list_entry(iter, struct csched2_vcpu, runq_elem);
 
+        /* Only consider vcpus that are allowed to run on this processor. */
+        if ( !cpumask_test_cpu(cpu, svc->vcpu->cpu_hard_affinity) )
+            continue;
+
         /* If this is on a different processor, don't pull it unless
          * its credit is at least CSCHED2_MIGRATE_RESIST higher. */
         if ( svc->vcpu->processor != cpu
@@ -1771,6 +1893,21 @@ csched2_schedule(
         /* Make sure avgload gets updated periodically even
          * if there's no activity */
         update_load(ops, rqd, NULL, 0, now);
+
+        /* Nothing to do here; see if some other runqueue has work we can
+         * pull.  Rate-limited per runqueue, as several cpus of the same
+         * runqueue going idle at once would otherwise all try. */
+        if ( !tasklet_work_scheduled && list_empty(&rqd->runq) )
+        {
+            if ( now - rqd->last_balance >= CSCHED2_IDLE_BALANCE_INTERVAL )
+            {
+                SCHED_STAT_CRANK(balance_load_idle);
+                rqd->last_balance = now;
+                balance_load(ops, cpu, now);
+            }
+            else
+                SCHED_STAT_CRANK(balance_load_ratelimit);
+        }
     }
 
     /*
@@ -1842,22 +1979,28 @@ csched2_dump(const struct scheduler *ops)
     int i, loop;
 
     printk("Active queues: %d\n"
-           "\tdefault-weight     = %d\n",
+           "\tdefault-weight     = %d\n"
+           "\trunqueues          = %s\n",
            cpumask_weight(&prv->active_queues),
-           CSCHED2_DEFAULT_WEIGHT);
+           CSCHED2_DEFAULT_WEIGHT,
+           opt_runqueue_str[opt_runqueue]);
     for_each_cpu(i, &prv->active_queues)
     {
         s_time_t fraction;
+        char cpustr[100];
         
         fraction = prv->rqd[i].avgload * 100 / (1ULL<<prv->load_window_shift);
 
+        cpumask_scnprintf(cpustr, sizeof(cpustr), &prv->rqd[i].active);
         printk("Runqueue %d:\n"
                "\tncpus              = %u\n"
+               "\tcpus               = %s\n"
                "\tmax_weight         = %d\n"
                "\tinstload           = %d\n"
                "\taveload            = %3"PRI_stime"\n",
                i,
                cpumask_weight(&prv->rqd[i].active),
+               cpustr,
                prv->rqd[i].max_weight,
                prv->rqd[i].load,
                fraction);
@@ -1898,6 +2041,7 @@ static void activate_runqueue(struct csched2_private *prv, int rqi)
 
     rqd->max_weight = 1;
     rqd->id = rqi;
+    rqd->last_balance = 0;
     INIT_LIST_HEAD(&rqd->svc);
     INIT_LIST_HEAD(&rqd->runq);
     spin_lock_init(&rqd->lock);
@@ -1918,6 +2062,79 @@ static void deactivate_runqueue(struct csched2_private *prv, int rqi)
     cpumask_clear_cpu(rqi, &prv->active_queues);
 }
 
+static inline bool_t same_node(unsigned int cpua, unsigned int cpub)
+{
+    return cpu_to_node(cpua) == cpu_to_node(cpub);
+}
+
+static inline bool_t same_socket(unsigned int cpua, unsigned int cpub)
+{
+    return cpu_to_socket(cpua) == cpu_to_socket(cpub);
+}
+
+static inline bool_t same_llc(unsigned int cpua, unsigned int cpub)
+{
+    return same_socket(cpua, cpub) &&
+           cpu_to_llc(cpua) == cpu_to_llc(cpub);
+}
+
+static inline bool_t same_core(unsigned int cpua, unsigned int cpub)
+{
+    return same_socket(cpua, cpub) &&
+           cpu_to_core(cpua) == cpu_to_core(cpub);
+}
+
+/*
+ * Find the runqueue cpu should go in: the one of an already active cpu
+ * which is, topologically, close enough according to credit2_runqueue=,
+ * or a new one if there is no such cpu.  Must be called with prv->lock
+ * held.
+ */
+static int
+cpu_to_runqueue(struct csched2_private *prv, unsigned int cpu)
+{
+    struct csched2_runqueue_data *rqd;
+    unsigned int rqi;
+
+    for ( rqi = 0; rqi < nr_cpu_ids; rqi++ )
+    {
+        unsigned int peer_cpu;
+
+        /*
+         * As soon as we come across an uninitialized runqueue, use it.
+         * In fact, either:
+         *  - we are initializing the first cpu, and we assign it to
+         *    runqueue 0. This is handy, especially if we are dealing
+         *    with the boot cpu (if credit2 is the default scheduler),
+         *    as we would not be able to use cpu_to_socket() and similar
+         *    helpers anyway (the result of which is not reliable yet);
+         *  - we have gone through all the active runqueues, and have not
+         *    found anyone whose cpus' topology matches the one we are
+         *    dealing with, so activating a new runqueue is what we want.
+         */
+        if ( prv->rqd[rqi].id == -1 )
+            break;
+
+        rqd = prv->rqd + rqi;
+        BUG_ON(cpumask_empty(&rqd->active));
+
+        peer_cpu = cpumask_first(&rqd->active);
+        BUG_ON(cpu_to_socket(cpu) < 0 || cpu_to_socket(peer_cpu) < 0);
+
+        if ( opt_runqueue == OPT_RUNQUEUE_ALL ||
+             (opt_runqueue == OPT_RUNQUEUE_CORE && same_core(peer_cpu, cpu)) ||
+             (opt_runqueue == OPT_RUNQUEUE_LLC && same_llc(peer_cpu, cpu)) ||
+             (opt_runqueue == OPT_RUNQUEUE_SOCKET && same_socket(peer_cpu, cpu)) ||
+             (opt_runqueue == OPT_RUNQUEUE_NODE && same_node(peer_cpu, cpu)) )
+            break;
+    }
+
+    /* We really expect to be able to assign each cpu to a runqueue. */
+    BUG_ON(rqi >= nr_cpu_ids);
+
+    return rqi;
+}
+
 static void init_pcpu(const struct scheduler *ops, int cpu)
 {
     int rqi;
@@ -1936,21 +2153,7 @@ static void init_pcpu(const struct scheduler *ops, int cpu)
     }
 
     /* Figure out which runqueue to put it in */
-    rqi = 0;
-
-    /* Figure out which runqueue to put it in */
-    /* NB: cpu 0 doesn't get a STARTING callback, so we hard-code it to runqueue 0. */
-    if ( cpu == 0 )
-        rqi = 0;
-    else
-        rqi = cpu_to_socket(cpu);
-
-    if ( rqi < 0 )
-    {
-        printk("%s: cpu_to_socket(%d) returned %d!\n",
-               __func__, cpu, rqi);
-        BUG();
-    }
+    rqi = cpu_to_runqueue(prv, cpu);
 
     rqd=prv->rqd + rqi;
 
@@ -2099,6 +2302,7 @@ csched2_init(struct scheduler *ops)
            " Use at your own risk.\n");
 
     printk(" load_window_shift: %d\n", opt_load_window_shift);
+    printk(" runqueues arrangement: %s\n", opt_runqueue_str[opt_runqueue]);
     printk(" underload_balance_tolerance: %d\n", opt_underload_balance_tolerance);
     printk(" overload_balance_tolerance: %d\n", opt_overload_balance_tolerance);
 
@@ -26,6 +26,7 @@
 #include <xen/keyhandler.h>
 #include <xen/trace.h>
 #include <xen/guest_access.h>
+#include <xen/rbtree.h>
 
 /*
  * TODO:
@@ -58,24 +59,43 @@
  * When a VCPU has no task but with budget left, its budget is preserved.
  *
  * Queue scheme:
- * A global runqueue and a global depletedqueue for each CPU pool.
- * The runqueue holds all runnable VCPUs with budget, sorted by deadline;
- * The depletedqueue holds all VCPUs without budget, unsorted;
+ * The PCPUs of each CPU pool are split in partitions, one per socket by
+ * default (see the rtds_runqueue= boot parameter), and EDF is applied
+ * within each partition. Each partition has:
+ * A runqueue, holding all runnable VCPUs with budget, in an rbtree sorted
+ * by deadline;
+ * A depletedqueue, holding all VCPUs without budget, unsorted;
+ * A replenishment queue, holding all the VCPUs that are in one of the
+ * above two, in an rbtree sorted by replenishment time (i.e., by their
+ * current deadline), plus a timer set to fire at the earliest of them.
+ * Budgets of queued VCPUs are replenished by that timer, rather than by
+ * scanning the queues at every scheduling decision.
+ *
+ * A VCPU only changes partition when it is migrated to a PCPU of another
+ * partition via pick_cpu, which prefers PCPUs of the current partition.
+ * There is no load balancing between partitions: a VCPU stays in the
+ * partition it was first placed in unless its affinity, or its cpupool,
+ * leaves it no PCPU there. Partitions can thus end up unevenly loaded,
+ * and a set of VCPUs schedulable under global EDF may miss deadlines;
+ * use affinity to place VCPUs, or rtds_runqueue=all.
  *
  * Note: cpumask and cpupool is supported.
  */
 
 /*
  * Locking:
- * A global system lock is used to protect the RunQ and DepletedQ.
- * The global lock is referenced by schedule_data.schedule_lock
- * from all physical cpus.
+ * A per-partition lock is used to protect the queues of the partition.
+ * It is referenced by schedule_data.schedule_lock from all the physical
+ * cpus of the partition.
  *
  * The lock is already grabbed when calling wake/sleep/schedule/ functions
  * in schedule.c
  *
- * The functions involes RunQ and needs to grab locks are:
- *    vcpu_insert, vcpu_remove, context_saved, __runq_insert
+ * The functions involes the queues and needs to grab locks are:
+ *    vcpu_insert, vcpu_remove, context_saved, repl_timer_handler
+ *
+ * The global system lock protects the domain list and the partition
+ * list. It must be taken before any partition lock, never after.
  */
 
 
@@ -125,23 +145,60 @@
 #define TRC_RTDS_SCHED_TASKLET    TRC_SCHED_CLASS_EVT(RTDS, 5)
 
 /*
- * Systme-wide private data, include global RunQueue/DepletedQ
- * Global lock is referenced by schedule_data.schedule_lock from all
- * physical cpus. It can be grabbed via vcpu_schedule_lock_irq()
+ * Partitioning of the physical cpus: one partition per socket, or a
+ * single one for all the cpus of the pool (i.e., global EDF).
  */
-struct rt_private {
-    spinlock_t lock;            /* the global coarse grand lock */
-    struct list_head sdom;      /* list of availalbe domains, used for dump */
-    struct list_head runq;      /* ordered list of runnable vcpus */
+#define OPT_RUNQUEUE_SOCKET 0
+#define OPT_RUNQUEUE_ALL    1
+static int __read_mostly opt_runqueue = OPT_RUNQUEUE_SOCKET;
+
+static void __init parse_rtds_runqueue(const char *s)
+{
+    if ( !strcmp(s, "socket") )
+        opt_runqueue = OPT_RUNQUEUE_SOCKET;
+    else if ( !strcmp(s, "all") )
+        opt_runqueue = OPT_RUNQUEUE_ALL;
+    else
+        printk("WARNING, unrecognized value of rtds_runqueue option!\n");
+}
+custom_param("rtds_runqueue", parse_rtds_runqueue);
+
+/*
+ * Partition, include its RunQueue/DepletedQ/ReplQ
+ * Partition lock is referenced by schedule_data.schedule_lock from all
+ * physical cpus of the partition. It can be grabbed via
+ * vcpu_schedule_lock_irq()
+ */
+struct rt_runqueue {
+    spinlock_t lock;            /* the partition lock */
+    struct list_head elem;      /* on the list of partitions */
+    struct rb_root runq;        /* runnable vcpus, sorted by deadline */
     struct list_head depletedq; /* unordered list of depleted vcpus */
+    struct rb_root replq;       /* queued vcpus, sorted by replenishment */
+    struct timer repl_timer;    /* fires at the earliest replenishment */
+    cpumask_t cpus;             /* cpus of this partition */
     cpumask_t tickled;          /* cpus been tickled */
+    bool_t active;              /* on the list of partitions */
+};
+
+/*
+ * Systme-wide private data, include the list of partitions
+ */
+struct rt_private {
+    spinlock_t lock;            /* protects domain and partition lists */
+    struct list_head sdom;      /* list of availalbe domains, used for dump */
+    struct list_head runqs;     /* list of active partitions */
+    cpumask_t initialized;      /* cpus assigned to a partition */
+    struct rt_runqueue *rqd[NR_CPUS]; /* partition of each cpu */
 };
 
 /*
  * Virtual CPU
  */
 struct rt_vcpu {
-    struct list_head q_elem;    /* on the runq/depletedq list */
+    struct rb_node runq_elem;   /* on the runq tree */
+    struct list_head q_elem;    /* on the depletedq list */
+    struct rb_node replq_elem;  /* on the replq tree */
     struct list_head sdom_elem; /* on the domain VCPU list */
 
     /* Up-pointers */
@@ -187,23 +244,25 @@ static inline struct rt_dom *rt_dom(const struct domain *dom)
     return dom->sched_priv;
 }
 
-static inline struct list_head *rt_runq(const struct scheduler *ops)
+static inline struct rt_runqueue *rt_rqd(const struct scheduler *ops,
+                                         unsigned int cpu)
 {
-    return &rt_priv(ops)->runq;
+    return rt_priv(ops)->rqd[cpu];
 }
 
-static inline struct list_head *rt_depletedq(const struct scheduler *ops)
+/*
+ * Queue helper functions for runq, depletedq and replq
+ */
+static int
+__vcpu_on_runq(const struct rt_vcpu *svc)
 {
-    return &rt_priv(ops)->depletedq;
+    return !RB_EMPTY_NODE(&svc->runq_elem);
 }
 
-/*
- * Queue helper functions for runq and depletedq
- */
 static int
 __vcpu_on_q(const struct rt_vcpu *svc)
 {
-   return !list_empty(&svc->q_elem);
+   return __vcpu_on_runq(svc) || !list_empty(&svc->q_elem);
 }
 
 static struct rt_vcpu *
@@ -212,6 +271,18 @@ __q_elem(struct list_head *elem)
     return list_entry(elem, struct rt_vcpu, q_elem);
 }
 
+static struct rt_vcpu *
+__runq_elem(struct rb_node *elem)
+{
+    return rb_entry(elem, struct rt_vcpu, runq_elem);
+}
+
+static struct rt_vcpu *
+__replq_elem(struct rb_node *elem)
+{
+    return rb_entry(elem, struct rt_vcpu, replq_elem);
+}
+
 /*
  * Debug related code, dump vcpu/cpu information
  */
@@ -261,33 +332,42 @@ rt_dump_pcpu(const struct scheduler *ops, int cpu)
 static void
 rt_dump(const struct scheduler *ops)
 {
-    struct list_head *iter_sdom, *iter_svc, *runq, *depletedq, *iter;
+    struct list_head *iter_sdom, *iter_svc, *iter;
     struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *rqd;
     struct rt_vcpu *svc;
-    cpumask_t *online;
     struct rt_dom *sdom;
+    struct rb_node *node;
     unsigned long flags;
-
-    ASSERT(!list_empty(&prv->sdom));
-
-    sdom = list_entry(prv->sdom.next, struct rt_dom, sdom_elem);
-    online = cpupool_scheduler_cpumask(sdom->dom->cpupool);
-    runq = rt_runq(ops);
-    depletedq = rt_depletedq(ops);
+    char cpustr[100];
 
     spin_lock_irqsave(&prv->lock, flags);
-    printk("Global RunQueue info:\n");
-    list_for_each( iter, runq )
+    list_for_each_entry( rqd, &prv->runqs, elem )
     {
-        svc = __q_elem(iter);
-        rt_dump_vcpu(ops, svc);
-    }
+        spin_lock(&rqd->lock);
 
-    printk("Global DepletedQueue info:\n");
-    list_for_each( iter, depletedq )
-    {
-        svc = __q_elem(iter);
-        rt_dump_vcpu(ops, svc);
+        cpumask_scnprintf(cpustr, sizeof(cpustr), &rqd->cpus);
+        printk("Partition cpus=%s\n", cpustr);
+        printk("RunQueue info:\n");
+        for ( node = rb_first(&rqd->runq); node; node = rb_next(node) )
+        {
+            svc = __runq_elem(node);
+            rt_dump_vcpu(ops, svc);
+        }
+
+        printk("DepletedQueue info:\n");
+        list_for_each( iter, &rqd->depletedq )
+        {
+            svc = __q_elem(iter);
+            rt_dump_vcpu(ops, svc);
+        }
+
+        node = rb_first(&rqd->replq);
+        if ( node != NULL )
+            printk("Next replenishment: %"PRI_stime"\n",
+                   __replq_elem(node)->cur_deadline);
+
+        spin_unlock(&rqd->lock);
     }
 
     printk("Domain info:\n");
@@ -351,44 +431,118 @@ rt_update_deadline(s_time_t now, struct rt_vcpu *svc)
     return;
 }
 
+/*
+ * Remove svc from the RunQ or DepletedQ it is on, and from the ReplQ
+ */
 static inline void
-__q_remove(struct rt_vcpu *svc)
+__q_remove(struct rt_runqueue *rqd, struct rt_vcpu *svc)
 {
-    if ( __vcpu_on_q(svc) )
+    if ( __vcpu_on_runq(svc) )
+    {
+        rb_erase(&svc->runq_elem, &rqd->runq);
+        RB_CLEAR_NODE(&svc->runq_elem);
+    }
+    else if ( !list_empty(&svc->q_elem) )
         list_del_init(&svc->q_elem);
+    else
+        return;
+
+    rb_erase(&svc->replq_elem, &rqd->replq);
+    RB_CLEAR_NODE(&svc->replq_elem);
+}
+
+/*
+ * Insert elem, belonging to svc, in a tree sorted by cur_deadline.
+ * Among vcpus with the same deadline, the last inserted goes first.
+ * Returns 1 if svc is now the first in the tree.
+ */
+static int
+__deadline_insert(struct rt_vcpu *(*qelem)(struct rb_node *),
+                  struct rt_vcpu *svc, struct rb_node *elem,
+                  struct rb_root *queue)
+{
+    struct rb_node **link = &queue->rb_node, *parent = NULL;
+    int leftmost = 1;
+
+    while ( *link != NULL )
+    {
+        parent = *link;
+        if ( svc->cur_deadline <= qelem(parent)->cur_deadline )
+            link = &parent->rb_left;
+        else
+        {
+            link = &parent->rb_right;
+            leftmost = 0;
+        }
+    }
+
+    rb_link_node(elem, parent, link);
+    rb_insert_color(elem, queue);
+
+    return leftmost;
 }
 
 /*
  * Insert svc with budget in RunQ according to EDF:
  * vcpus with smaller deadlines go first.
  * Insert svc without budget in DepletedQ unsorted;
+ * Either way, insert svc in ReplQ, and rearm the replenishment timer
+ * if svc is the one to be replenished first.
  */
 static void
-__runq_insert(const struct scheduler *ops, struct rt_vcpu *svc)
+__runq_insert(struct rt_runqueue *rqd, struct rt_vcpu *svc)
 {
-    struct rt_private *prv = rt_priv(ops);
-    struct list_head *runq = rt_runq(ops);
-    struct list_head *iter;
-
-    ASSERT( spin_is_locked(&prv->lock) );
+    ASSERT( spin_is_locked(&rqd->lock) );
 
     ASSERT( !__vcpu_on_q(svc) );
 
     /* add svc to runq if svc still has budget */
     if ( svc->cur_budget > 0 )
-    {
-        list_for_each(iter, runq)
-        {
-            struct rt_vcpu * iter_svc = __q_elem(iter);
-            if ( svc->cur_deadline <= iter_svc->cur_deadline )
-                    break;
-         }
-        list_add_tail(&svc->q_elem, iter);
-    }
+        __deadline_insert(__runq_elem, svc, &svc->runq_elem, &rqd->runq);
     else
+        list_add(&svc->q_elem, &rqd->depletedq);
+
+    if ( __deadline_insert(__replq_elem, svc, &svc->replq_elem, &rqd->replq) )
+        set_timer(&rqd->repl_timer, svc->cur_deadline);
+}
+
+static struct rt_vcpu *__runq_pick(struct rt_runqueue *rqd, cpumask_t *mask);
+static void runq_tickle(struct rt_runqueue *rqd, struct rt_vcpu *new);
+
+/*
+ * Replenishment timer handler: replenish the budget of all the queued
+ * vcpus whose period is over, put them back in the RunQ, and tickle a
+ * cpu for each of them that could now preempt someone.
+ */
+static void
+repl_timer_handler(void *data)
+{
+    struct rt_runqueue *rqd = data;
+    struct rb_node *node;
+    struct rt_vcpu *svc;
+    s_time_t now = NOW();
+    unsigned long flags;
+
+    spin_lock_irqsave(&rqd->lock, flags);
+
+    while ( (node = rb_first(&rqd->replq)) != NULL )
     {
-        list_add(&svc->q_elem, &prv->depletedq);
+        svc = __replq_elem(node);
+        if ( now < svc->cur_deadline )
+            break;
+
+        __q_remove(rqd, svc);
+        rt_update_deadline(now, svc);
+        __runq_insert(rqd, svc);
+        runq_tickle(rqd, svc);
     }
+
+    /* __runq_insert() rearmed the timer if needed, but maybe not for
+     * the first vcpu, if it was already first in the queue */
+    if ( node != NULL )
+        set_timer(&rqd->repl_timer, __replq_elem(node)->cur_deadline);
+
+    spin_unlock_irqrestore(&rqd->lock, flags);
 }
 
 /*
@@ -408,10 +562,7 @@ rt_init(struct scheduler *ops)
 
     spin_lock_init(&prv->lock);
     INIT_LIST_HEAD(&prv->sdom);
-    INIT_LIST_HEAD(&prv->runq);
-    INIT_LIST_HEAD(&prv->depletedq);
-
-    cpumask_clear(&prv->tickled);
+    INIT_LIST_HEAD(&prv->runqs);
 
     ops->sched_data = prv;
 
@@ -423,25 +574,170 @@ rt_deinit(const struct scheduler *ops)
 {
     struct rt_private *prv = rt_priv(ops);
 
+    ASSERT(list_empty(&prv->runqs));
     xfree(prv);
 }
 
 /*
- * Point per_cpu spinlock to the global system lock;
- * All cpu have same global system lock
+ * Put cpu in the partition of an already initialized cpu on the same
+ * socket, or in a new partition (the one pre-allocated for cpu in
+ * alloc_pdata) if there is none, and point its per_cpu spinlock to the
+ * partition lock.
+ */
+static void
+rt_init_pcpu(const struct scheduler *ops, int cpu, struct rt_runqueue *spare)
+{
+    struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *rqd = NULL, *iter;
+    spinlock_t *old_lock;
+    unsigned long flags;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    if ( cpumask_test_cpu(cpu, &prv->initialized) )
+    {
+        spin_unlock_irqrestore(&prv->lock, flags);
+        return;
+    }
+
+    list_for_each_entry( iter, &prv->runqs, elem )
+    {
+        if ( opt_runqueue == OPT_RUNQUEUE_ALL ||
+             cpu_to_socket(cpumask_first(&iter->cpus)) == cpu_to_socket(cpu) )
+        {
+            rqd = iter;
+            break;
+        }
+    }
+
+    if ( rqd == NULL )
+    {
+        rqd = spare;
+        rqd->active = 1;
+        list_add_tail(&rqd->elem, &prv->runqs);
+    }
+
+    /* IRQs already disabled */
+    old_lock = pcpu_schedule_lock(cpu);
+
+    per_cpu(schedule_data, cpu).schedule_lock = &rqd->lock;
+    prv->rqd[cpu] = rqd;
+    cpumask_set_cpu(cpu, &rqd->cpus);
+
+    /* _Not_ pcpu_schedule_unlock(): per_cpu().schedule_lock changed! */
+    spin_unlock(old_lock);
+
+    cpumask_set_cpu(cpu, &prv->initialized);
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+}
+
+/*
+ * Allocate a partition for cpu, in case it turns out to be the first of
+ * its socket. Topology information is not available for cpus that are
+ * being brought up, so those are assigned to their partition later, at
+ * CPU_STARTING time.
  */
 static void *
 rt_alloc_pdata(const struct scheduler *ops, int cpu)
+{
+    struct rt_runqueue *spare;
+
+    spare = xzalloc(struct rt_runqueue);
+    if ( spare == NULL )
+        return NULL;
+
+    spin_lock_init(&spare->lock);
+    INIT_LIST_HEAD(&spare->elem);
+    spare->runq = RB_ROOT;
+    INIT_LIST_HEAD(&spare->depletedq);
+    spare->replq = RB_ROOT;
+    init_timer(&spare->repl_timer, repl_timer_handler, spare, cpu);
+
+    /* Note: cpu 0 doesn't get a STARTING callback */
+    if ( cpu == 0 || cpu_to_socket(cpu) >= 0 )
+        rt_init_pcpu(ops, cpu, spare);
+
+    return spare;
+}
+
+static void
+rt_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
 {
     struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *spare = pcpu, *rqd = NULL, *dead = NULL;
+    struct schedule_data *sd = &per_cpu(schedule_data, cpu);
     unsigned long flags;
 
     spin_lock_irqsave(&prv->lock, flags);
-    per_cpu(schedule_data, cpu).schedule_lock = &prv->lock;
+
+    if ( cpumask_test_cpu(cpu, &prv->initialized) )
+    {
+        rqd = prv->rqd[cpu];
+
+        spin_lock(&rqd->lock);
+        cpumask_clear_cpu(cpu, &rqd->cpus);
+        cpumask_clear_cpu(cpu, &rqd->tickled);
+        /* Move spinlock to the original lock, unless someone else did. */
+        if ( sd->schedule_lock == &rqd->lock )
+            sd->schedule_lock = &sd->_lock;
+        spin_unlock(&rqd->lock);
+
+        prv->rqd[cpu] = NULL;
+        cpumask_clear_cpu(cpu, &prv->initialized);
+
+        if ( cpumask_empty(&rqd->cpus) )
+        {
+            ASSERT(RB_EMPTY_ROOT(&rqd->replq));
+            list_del_init(&rqd->elem);
+            dead = rqd;
+        }
+    }
+
     spin_unlock_irqrestore(&prv->lock, flags);
 
-    /* 1 indicates alloc. succeed in schedule.c */
-    return (void *)1;
+    /* Timers can't be killed with the lock held (the handler takes it). */
+    if ( dead != NULL )
+    {
+        kill_timer(&dead->repl_timer);
+        xfree(dead);
+    }
+    else if ( rqd != NULL )
+        migrate_timer(&rqd->repl_timer, cpumask_first(&rqd->cpus));
+
+    /* The partition pre-allocated for cpu stays around if others use it. */
+    if ( spare != dead && !spare->active )
+    {
+        kill_timer(&spare->repl_timer);
+        xfree(spare);
+    }
+}
+
+static int
+cpu_rt_callback(struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct scheduler *ops;
+
+    if ( action == CPU_STARTING )
+    {
+        ops = per_cpu(scheduler, cpu);
+        if ( ops->alloc_pdata == rt_alloc_pdata )
+            rt_init_pcpu(ops, cpu, per_cpu(schedule_data, cpu).sched_priv);
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_rt_nfb = {
+    .notifier_call = cpu_rt_callback
+};
+
+static int
+rt_global_init(void)
+{
+    register_cpu_notifier(&cpu_rt_nfb);
+    return 0;
 }
 
 static void *
@@ -514,7 +810,9 @@ rt_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
     if ( svc == NULL )
         return NULL;
 
+    RB_CLEAR_NODE(&svc->runq_elem);
     INIT_LIST_HEAD(&svc->q_elem);
+    RB_CLEAR_NODE(&svc->replq_elem);
     INIT_LIST_HEAD(&svc->sdom_elem);
     svc->flags = 0U;
     svc->sdom = dd;
@@ -548,16 +846,21 @@ rt_vcpu_insert(const struct scheduler *ops, struct vcpu *vc)
 {
     struct rt_vcpu *svc = rt_vcpu(vc);
     s_time_t now = NOW();
+    spinlock_t *lock;
 
     /* not addlocate idle vcpu to dom vcpu list */
     if ( is_idle_vcpu(vc) )
         return;
 
+    lock = vcpu_schedule_lock_irq(vc);
+
     if ( now >= svc->cur_deadline )
         rt_update_deadline(now, svc);
 
     if ( !__vcpu_on_q(svc) && vcpu_runnable(vc) && !vc->is_running )
-        __runq_insert(ops, svc);
+        __runq_insert(rt_rqd(ops, vc->processor), svc);
+
+    vcpu_schedule_unlock_irq(lock, vc);
 
     /* add rt_vcpu svc to scheduler-specific vcpu list of the dom */
     list_add_tail(&svc->sdom_elem, &svc->sdom->vcpu);
@@ -578,7 +881,7 @@ rt_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
 
     lock = vcpu_schedule_lock_irq(vc);
     if ( __vcpu_on_q(svc) )
-        __q_remove(svc);
+        __q_remove(rt_rqd(ops, vc->processor), svc);
     vcpu_schedule_unlock_irq(lock, vc);
 
     if ( !is_idle_vcpu(vc) )
@@ -589,20 +892,31 @@ rt_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
  * Pick a valid CPU for the vcpu vc
  * Valid CPU of a vcpu is intesection of vcpu's affinity
  * and available cpus
+ * Stay in the current partition if possible, to keep the cache warm and
+ * not to change the set of vcpus we compete with.
  */
 static int
 rt_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
 {
-    cpumask_t cpus;
+    struct rt_runqueue *rqd = rt_rqd(ops, vc->processor);
+    cpumask_t cpus, local;
     cpumask_t *online;
     int cpu;
 
     online = cpupool_scheduler_cpumask(vc->domain->cpupool);
     cpumask_and(&cpus, online, vc->cpu_hard_affinity);
 
-    cpu = cpumask_test_cpu(vc->processor, &cpus)
-            ? vc->processor
-            : cpumask_cycle(vc->processor, &cpus);
+    if ( rqd != NULL )
+        cpumask_and(&local, &cpus, &rqd->cpus);
+    else
+        cpumask_clear(&local);
+
+    if ( cpumask_test_cpu(vc->processor, &cpus) )
+        cpu = vc->processor;
+    else if ( !cpumask_empty(&local) )
+        cpu = cpumask_cycle(vc->processor, &local);
+    else
+        cpu = cpumask_cycle(vc->processor, &cpus);
     ASSERT( !cpumask_empty(&cpus) && cpumask_test_cpu(cpu, &cpus) );
 
     return cpu;
@@ -663,18 +977,17 @@ burn_budget(const struct scheduler *ops, struct rt_vcpu *svc, s_time_t now)
  * lock is grabbed before calling this function
  */
 static struct rt_vcpu *
-__runq_pick(const struct scheduler *ops, cpumask_t *mask)
+__runq_pick(struct rt_runqueue *rqd, cpumask_t *mask)
 {
-    struct list_head *runq = rt_runq(ops);
-    struct list_head *iter;
+    struct rb_node *iter;
     struct rt_vcpu *svc = NULL;
     struct rt_vcpu *iter_svc = NULL;
     cpumask_t cpu_common;
     cpumask_t *online;
 
-    list_for_each(iter, runq)
+    for ( iter = rb_first(&rqd->runq); iter; iter = rb_next(iter) )
     {
-        iter_svc = __q_elem(iter);
+        iter_svc = __runq_elem(iter);
 
         /* mask cpu_hard_affinity & cpupool & mask */
         online = cpupool_scheduler_cpumask(iter_svc->vcpu->domain->cpupool);
@@ -715,44 +1028,6 @@ __runq_pick(const struct scheduler *ops, cpumask_t *mask)
     return svc;
 }
 
-/*
- * Update vcpu's budget and
- * sort runq by insert the modifed vcpu back to runq
- * lock is grabbed before calling this function
- */
-static void
-__repl_update(const struct scheduler *ops, s_time_t now)
-{
-    struct list_head *runq = rt_runq(ops);
-    struct list_head *depletedq = rt_depletedq(ops);
-    struct list_head *iter;
-    struct list_head *tmp;
-    struct rt_vcpu *svc = NULL;
-
-    list_for_each_safe(iter, tmp, runq)
-    {
-        svc = __q_elem(iter);
-        if ( now < svc->cur_deadline )
-            break;
-
-        rt_update_deadline(now, svc);
-        /* reinsert the vcpu if its deadline is updated */
-        __q_remove(svc);
-        __runq_insert(ops, svc);
-    }
-
-    list_for_each_safe(iter, tmp, depletedq)
-    {
-        svc = __q_elem(iter);
-        if ( now >= svc->cur_deadline )
-        {
-            rt_update_deadline(now, svc);
-            __q_remove(svc); /* remove from depleted queue */
-            __runq_insert(ops, svc); /* add to runq */
-        }
-    }
-}
-
 /*
  * schedule function for rt scheduler.
  * The lock is already grabbed in schedule.c, no need to lock here
@@ -761,18 +1036,23 @@ static struct task_slice
 rt_schedule(const struct scheduler *ops, s_time_t now, bool_t tasklet_work_scheduled)
 {
     const int cpu = smp_processor_id();
-    struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *rqd = rt_rqd(ops, cpu);
     struct rt_vcpu *const scurr = rt_vcpu(current);
     struct rt_vcpu *snext = NULL;
     struct task_slice ret = { .migrated = 0 };
 
     /* clear ticked bit now that we've been scheduled */
-    cpumask_clear_cpu(cpu, &prv->tickled);
+    cpumask_clear_cpu(cpu, &rqd->tickled);
 
     /* burn_budget would return for IDLE VCPU */
     burn_budget(ops, scurr, now);
 
-    __repl_update(ops, now);
+    /*
+     * Queued vcpus are replenished by the replenishment timer, the running
+     * one is not on any queue, so take care of it here.
+     */
+    if ( !is_idle_vcpu(current) && now >= scurr->cur_deadline )
+        rt_update_deadline(now, scurr);
 
     if ( tasklet_work_scheduled )
     {
@@ -783,7 +1063,7 @@ rt_schedule(const struct scheduler *ops, s_time_t now, bool_t tasklet_work_sched
         cpumask_t cur_cpu;
         cpumask_clear(&cur_cpu);
         cpumask_set_cpu(cpu, &cur_cpu);
-        snext = __runq_pick(ops, &cur_cpu);
+        snext = __runq_pick(rqd, &cur_cpu);
         if ( snext == NULL )
             snext = rt_vcpu(idle_vcpu[cpu]);
 
@@ -806,7 +1086,7 @@ rt_schedule(const struct scheduler *ops, s_time_t now, bool_t tasklet_work_sched
     {
         if ( snext != scurr )
         {
-            __q_remove(snext);
+            __q_remove(rqd, snext);
             set_bit(__RTDS_scheduled, &snext->flags);
         }
         if ( snext->vcpu->processor != cpu )
@@ -854,7 +1134,7 @@ rt_vcpu_sleep(const struct scheduler *ops, struct vcpu *vc)
     if ( curr_on_cpu(vc->processor) == vc )
         cpu_raise_softirq(vc->processor, SCHEDULE_SOFTIRQ);
     else if ( __vcpu_on_q(svc) )
-        __q_remove(svc);
+        __q_remove(rt_rqd(ops, vc->processor), svc);
     else if ( test_bit(__RTDS_delayed_runq_add, &svc->flags) )
         clear_bit(__RTDS_delayed_runq_add, &svc->flags);
 }
@@ -864,7 +1144,7 @@ rt_vcpu_sleep(const struct scheduler *ops, struct vcpu *vc)
  * possibly kicking out the vcpu running there
  * Called by wake() and context_saved()
  * We have a running candidate here, the kick logic is:
- * Among all the cpus that are within the cpu affinity
+ * Among all the cpus of the partition that are within the cpu affinity
  * 1) if the new->cpu is idle, kick it. This could benefit cache hit
  * 2) if there are any idle vcpu, kick it.
  * 3) now all pcpus are busy;
@@ -878,9 +1158,8 @@ rt_vcpu_sleep(const struct scheduler *ops, struct vcpu *vc)
  * lock is grabbed before calling this function
  */
 static void
-runq_tickle(const struct scheduler *ops, struct rt_vcpu *new)
+runq_tickle(struct rt_runqueue *rqd, struct rt_vcpu *new)
 {
-    struct rt_private *prv = rt_priv(ops);
     struct rt_vcpu *latest_deadline_vcpu = NULL; /* lowest priority */
     struct rt_vcpu *iter_svc;
     struct vcpu *iter_vc;
@@ -893,7 +1172,8 @@ runq_tickle(const struct scheduler *ops, struct rt_vcpu *new)
 
     online = cpupool_scheduler_cpumask(new->vcpu->domain->cpupool);
     cpumask_and(&not_tickled, online, new->vcpu->cpu_hard_affinity);
-    cpumask_andnot(&not_tickled, &not_tickled, &prv->tickled);
+    cpumask_and(&not_tickled, &not_tickled, &rqd->cpus);
+    cpumask_andnot(&not_tickled, &not_tickled, &rqd->tickled);
 
     /* 1) if new's previous cpu is idle, kick it for cache benefit */
     if ( is_idle_vcpu(curr_on_cpu(new->vcpu->processor)) )
@@ -941,7 +1221,7 @@ out:
                   (unsigned char *)&d);
     }
 
-    cpumask_set_cpu(cpu_to_tickle, &prv->tickled);
+    cpumask_set_cpu(cpu_to_tickle, &rqd->tickled);
     cpu_raise_softirq(cpu_to_tickle, SCHEDULE_SOFTIRQ);
     return;
 }
@@ -957,10 +1237,8 @@ rt_vcpu_wake(const struct scheduler *ops, struct vcpu *vc)
 {
     struct rt_vcpu * const svc = rt_vcpu(vc);
     s_time_t now = NOW();
-    struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *rqd = rt_rqd(ops, vc->processor);
     struct rt_vcpu *snext = NULL; /* highest priority on RunQ */
-    struct rt_dom *sdom = NULL;
-    cpumask_t *online;
 
     BUG_ON( is_idle_vcpu(vc) );
 
@@ -985,16 +1263,12 @@ rt_vcpu_wake(const struct scheduler *ops, struct vcpu *vc)
         rt_update_deadline(now, svc);
 
     /* insert svc to runq/depletedq because svc is not in queue now */
-    __runq_insert(ops, svc);
-
-    __repl_update(ops, now);
+    __runq_insert(rqd, svc);
 
-    ASSERT(!list_empty(&prv->sdom));
-    sdom = list_entry(prv->sdom.next, struct rt_dom, sdom_elem);
-    online = cpupool_scheduler_cpumask(sdom->dom->cpupool);
-    snext = __runq_pick(ops, online); /* pick snext from ALL valid cpus */
+    /* pick snext from ALL the cpus of the partition */
+    snext = __runq_pick(rqd, &rqd->cpus);
 
-    runq_tickle(ops, snext);
+    runq_tickle(rqd, snext);
 
     return;
 }
@@ -1008,9 +1282,8 @@ rt_context_saved(const struct scheduler *ops, struct vcpu *vc)
 {
     struct rt_vcpu *svc = rt_vcpu(vc);
     struct rt_vcpu *snext = NULL;
-    struct rt_dom *sdom = NULL;
-    struct rt_private *prv = rt_priv(ops);
-    cpumask_t *online;
+    struct rt_runqueue *rqd;
+    s_time_t now = NOW();
     spinlock_t *lock = vcpu_schedule_lock_irq(vc);
 
     clear_bit(__RTDS_scheduled, &svc->flags);
@@ -1021,15 +1294,17 @@ rt_context_saved(const struct scheduler *ops, struct vcpu *vc)
     if ( test_and_clear_bit(__RTDS_delayed_runq_add, &svc->flags) &&
          likely(vcpu_runnable(vc)) )
     {
-        __runq_insert(ops, svc);
-        __repl_update(ops, NOW());
+        rqd = rt_rqd(ops, vc->processor);
 
-        ASSERT(!list_empty(&prv->sdom));
-        sdom = list_entry(prv->sdom.next, struct rt_dom, sdom_elem);
-        online = cpupool_scheduler_cpumask(sdom->dom->cpupool);
-        snext = __runq_pick(ops, online); /* pick snext from ALL cpus */
+        if ( now >= svc->cur_deadline )
+            rt_update_deadline(now, svc);
+
+        __runq_insert(rqd, svc);
 
-        runq_tickle(ops, snext);
+        /* pick snext from ALL the cpus of the partition */
+        snext = __runq_pick(rqd, &rqd->cpus);
+
+        runq_tickle(rqd, snext);
     }
 out:
     vcpu_schedule_unlock_irq(lock, vc);
@@ -1048,6 +1323,7 @@ rt_dom_cntl(
     struct rt_dom * const sdom = rt_dom(d);
     struct rt_vcpu *svc;
     struct list_head *iter;
+    spinlock_t *lock;
     unsigned long flags;
     int rc = 0;
 
@@ -1056,8 +1332,10 @@ rt_dom_cntl(
     case XEN_DOMCTL_SCHEDOP_getinfo:
         spin_lock_irqsave(&prv->lock, flags);
         svc = list_entry(sdom->vcpu.next, struct rt_vcpu, sdom_elem);
+        lock = vcpu_schedule_lock(svc->vcpu);
         op->u.rtds.period = svc->period / MICROSECS(1); /* transfer to us */
         op->u.rtds.budget = svc->budget / MICROSECS(1);
+        vcpu_schedule_unlock(lock, svc->vcpu);
         spin_unlock_irqrestore(&prv->lock, flags);
         break;
     case XEN_DOMCTL_SCHEDOP_putinfo:
@@ -1070,8 +1348,12 @@ rt_dom_cntl(
         list_for_each( iter, &sdom->vcpu )
         {
             struct rt_vcpu * svc = list_entry(iter, struct rt_vcpu, sdom_elem);
+
+            /* IRQs are already disabled, and prv->lock comes first */
+            lock = vcpu_schedule_lock(svc->vcpu);
             svc->period = MICROSECS(op->u.rtds.period); /* transfer to nanosec */
             svc->budget = MICROSECS(op->u.rtds.budget);
+            vcpu_schedule_unlock(lock, svc->vcpu);
         }
         spin_unlock_irqrestore(&prv->lock, flags);
         break;
@@ -1090,9 +1372,11 @@ const struct scheduler sched_rtds_def = {
 
     .dump_cpu_state = rt_dump_pcpu,
     .dump_settings  = rt_dump,
+    .global_init    = rt_global_init,
     .init           = rt_init,
     .deinit         = rt_deinit,
     .alloc_pdata    = rt_alloc_pdata,
+    .free_pdata     = rt_free_pdata,
     .alloc_domdata  = rt_alloc_domdata,
     .free_domdata   = rt_free_domdata,
     .init_domain    = rt_dom_init,
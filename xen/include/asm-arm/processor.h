@@ -606,6 +606,7 @@ void show_registers(struct cpu_user_regs *regs);
 /* All a bit UP for the moment */
 #define cpu_to_core(_cpu)   (0)
 #define cpu_to_socket(_cpu) (0)
+#define cpu_to_llc(_cpu)    (0)
 
 void noreturn do_unexpected_trap(const char *msg, struct cpu_user_regs *regs);
 
@@ -64,6 +64,13 @@ struct hvm_irq {
         uint32_t vector;
     } callback_via;
 
+    /*
+     * Event channel upcalls raised through per-vCPU upcall vectors, and how
+     * many of them were posted to a running vCPU without a VM exit.
+     */
+    atomic_t evtchn_upcalls;
+    atomic_t evtchn_upcalls_posted;
+
     /* Number of INTx wires asserting each PCI-ISA link. */
     u8 pci_link_assert_count[4];
 
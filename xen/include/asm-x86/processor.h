@@ -183,6 +183,7 @@ struct cpuinfo_x86 {
     int   phys_proc_id; /* package ID of each logical CPU */
     int   cpu_core_id; /* core ID of each logical CPU*/
     int   compute_unit_id; /* AMD compute unit ID of each logical CPU */
+    int   cpu_llc_id; /* last level cache ID of each logical CPU */
     unsigned short x86_clflush_size;
 } __cacheline_aligned;
 
@@ -216,6 +217,7 @@ extern void detect_ht(struct cpuinfo_x86 *c);
 
 #define cpu_to_core(_cpu)   (cpu_data[_cpu].cpu_core_id)
 #define cpu_to_socket(_cpu) (cpu_data[_cpu].phys_proc_id)
+#define cpu_to_llc(_cpu)    (cpu_data[_cpu].cpu_llc_id)
 
 unsigned int apicid_to_socket(unsigned int);
 
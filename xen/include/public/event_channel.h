@@ -74,6 +74,7 @@
 #define EVTCHNOP_init_control    11
 #define EVTCHNOP_expand_array    12
 #define EVTCHNOP_set_priority    13
+#define EVTCHNOP_send_batch      14
 /* ` } */
 
 typedef uint32_t evtchn_port_t;
@@ -312,6 +313,30 @@ struct evtchn_set_priority {
 };
 typedef struct evtchn_set_priority evtchn_set_priority_t;
 
+/*
+ * EVTCHNOP_send_batch: Send an event to the remote end of each of the
+ * <nr_ports> channels whose local endpoints are listed in <port>.
+ * NOTES:
+ *  1. This is equivalent to an EVTCHNOP_send for each port in turn, except
+ *     that the notifications of remote vCPUs are coalesced: any IPIs needed
+ *     are sent together once every port has been processed.
+ *  2. Processing stops at the first port which cannot be signalled, and its
+ *     error is returned. <nr_sent> is the number of ports signalled.
+ */
+struct evtchn_send_batch {
+    /* IN parameters. */
+    uint32_t nr_ports;
+    /* OUT parameters. */
+    uint32_t nr_sent;
+    /* IN parameters. */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+    evtchn_port_t port[];
+#elif defined(__GNUC__)
+    evtchn_port_t port[0];
+#endif
+};
+typedef struct evtchn_send_batch evtchn_send_batch_t;
+
 /*
  * ` enum neg_errnoval
  * ` HYPERVISOR_event_channel_op_compat(struct evtchn_op *op)
@@ -50,6 +50,8 @@ enum xsd_sockmsg_type
     XS_SET_TARGET,
     XS_RESTRICT,
     XS_RESET_WATCHES,
+    XS_MULTI,
+    XS_LOCAL_RING,
 
     XS_INVALID = 0xffff /* Guaranteed to remain an invalid type */
 };
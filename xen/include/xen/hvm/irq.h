@@ -127,6 +127,7 @@ int hvm_inject_msi(struct domain *d, uint64_t addr, uint32_t data);
 
 void hvm_maybe_deassert_evtchn_irq(void);
 void hvm_assert_evtchn_irq(struct vcpu *v);
+void hvm_migrate_evtchn_upcall(struct vcpu *v);
 void hvm_set_callback_via(struct domain *d, uint64_t via);
 
 #endif /* __XEN_HVM_IRQ_H__ */
@@ -51,6 +51,17 @@ PERFCOUNTER(migrate_running,        "csched: migrate_running")
 PERFCOUNTER(migrate_kicked_away,    "csched: migrate_kicked_away")
 PERFCOUNTER(vcpu_hot,               "csched: vcpu_hot")
 
+/* credit2 specific counters */
+PERFCOUNTER(balance_load,           "csched2: balance_load")
+PERFCOUNTER(balance_load_idle,      "csched2: balance_load_idle")
+PERFCOUNTER(balance_load_ratelimit, "csched2: balance_load_ratelimit")
+PERFCOUNTER(balance_trylock_failed, "csched2: balance_trylock_failed")
+PERFCOUNTER(balance_push,           "csched2: balance_push")
+PERFCOUNTER(balance_pull,           "csched2: balance_pull")
+PERFCOUNTER(pick_trylock_failed,    "csched2: pick_trylock_failed")
+PERFCOUNTER(migrate_requested,      "csched2: migrate_requested")
+PERFCOUNTER(migrate_on_runq,        "csched2: migrate_on_runq")
+
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */